@@ -1,13 +1,226 @@
 (ns user
   (:require [clojure.java.io :as io])
-  (:import [java.io FileInputStream StringWriter]
-           java.net.Socket))
+  (:import [java.io ByteArrayOutputStream FileInputStream StringWriter]
+           java.net.Socket
+           net.jpountz.lz4.LZ4Factory))
+
+;; firmware download, see picow/kbd/util/fw_download.h
+(def cmd-query 5)
+(def cmd-begin 6)
+(def cmd-chunk 7)
+(def cmd-end 8)
+(def cmd-begin-packed 9)
+(def cmd-begin-delta 10)
+(def status-bad-base 6) ;; the board not running the build the delta is of
+(def chunk-size 1024) ;; a sector (4096) is 4 of them
+(def window 8192) ;; bytes in flight, beyond acknowledged
+(def sector-size 4096) ;; packed a block per sector of the image
+(def block-stored 0x8000)
+
+;; relayed by AP to left/right over BLE, see picow/kbd/util/fw_relay.h
+(def cmd-target {:ap 0x0B :left 0x0C :right 0x0D}) ;; of the download that follows, AP by default
+(def cmd-relay-status 0x0E)
+(def relay-states [:idle :relaying :verified :committed :failed])
+
+(defn- pack
+  "the image as blocks, each a sector packed on its own (lz4 block), or stored if not smaller"
+  ^bytes [^bytes image]
+  (let [compressor (.fastCompressor (LZ4Factory/fastestInstance))
+        block (byte-array (.maxCompressedLength compressor sector-size))
+        out (ByteArrayOutputStream.)]
+    (doseq [offset (range 0 (alength image) sector-size)]
+      (let [size (min sector-size (- (alength image) offset))
+            n (.compress compressor image offset size block 0 (alength block))
+            stored? (>= n size)
+            head (if stored? (bit-or size block-stored) n)]
+        (.write out (bit-and head 0xFF))
+        (.write out (bit-shift-right head 8))
+        (if stored?
+          (.write out image offset size)
+          (.write out block 0 n))))
+    (.toByteArray out)))
+
+(defn- u32-bytes [v]
+  (mapv #(unchecked-byte (bit-and (bit-shift-right v (* 8 %)) 0xFF)) (range 4)))
+
+(defn- read-u32 [ba pos]
+  (reduce (fn [v i] (bit-or v (bit-shift-left (bit-and (aget ba (+ pos i)) 0xFF) (* 8 i)))) 0 (range 4)))
+
+(defn- crc32 [ba offset n]
+  (let [crc (java.util.zip.CRC32.)]
+    (.update crc ba offset n)
+    (.getValue crc)))
+
+(defn- read-reply
+  "reply as {:cmd :status :offset}, and for the query :size :crc"
+  [sis]
+  (let [head (.readNBytes sis 6)
+        _ (when (< (count head) 6) (throw (java.io.IOException. "connection closed")))
+        reply {:cmd (aget head 0) :status (aget head 1) :offset (read-u32 head 2)}]
+    (if (= (:cmd reply) cmd-query)
+      (let [tail (.readNBytes sis 8)]
+        (assoc reply :size (read-u32 tail 0) :crc (read-u32 tail 4)))
+      reply)))
+
+(defn- write-command [sos cmd & u32s]
+  (.write sos (byte-array (into [(unchecked-byte cmd)] (mapcat u32-bytes u32s))))
+  (.flush sos))
+
+(defn- write-chunk [sos ^bytes image offset]
+  (let [n (min chunk-size (- (alength image) offset))
+        head (byte-array (concat [(unchecked-byte cmd-chunk)] (u32-bytes offset)
+                                 [(unchecked-byte (bit-and n 0xFF)) (unchecked-byte (bit-shift-right n 8))]
+                                 (u32-bytes (crc32 image offset n))))]
+    (.write sos head)
+    (.write sos image offset n)
+    (+ offset n)))
+
+(defn- await-reply [sis cmd]
+  ;; skipping the chunk replies still on the way
+  (let [reply (read-reply sis)]
+    (if (= (:cmd reply) cmd) reply (recur sis cmd))))
+
+(defn- download
+  "one connection: resume if the board has the same stream in progress, else begin,
+   then the chunks, a window of them in flight. The stream is the image, packed of it,
+   or a delta, begun as per [begin-cmd & u32s after the size and crc of the stream].
+   A target (cmd-target) other than AP is staged on AP, to be relayed."
+  [server-ip server-port ^bytes stream [begin-cmd & begin-args] & {:keys [target]}]
+  (with-open [sock (Socket. server-ip server-port)
+              sos (.getOutputStream sock)
+              sis (.getInputStream sock)]
+    (let [size (alength stream)
+          crc (crc32 stream 0 size)
+          _ (when target (write-command sos target)) ;; on each connection
+          _ (write-command sos cmd-query)
+          q (await-reply sis cmd-query)
+          start (if (and (zero? (:status q)) (= size (:size q)) (= crc (:crc q)))
+                  (:offset q)
+                  (do (apply write-command sos begin-cmd size crc begin-args)
+                      (let [r (await-reply sis begin-cmd)]
+                        (when-not (zero? (:status r))
+                          (throw (ex-info (if (= (:status r) status-bad-base)
+                                            "begin failed, not running the base of the delta"
+                                            "begin failed")
+                                          r)))
+                        0)))]
+      (println "sending from" start "of" size)
+      (flush)
+      (loop [sent start, acked start]
+        (cond
+          (and (< sent size) (< (- sent acked) window))
+          (recur (write-chunk sos stream sent) acked)
+
+          (< acked size)
+          (let [_ (.flush sos)
+                r (read-reply sis)]
+            (cond
+              (not= (:cmd r) cmd-chunk) (recur sent acked)
+              (zero? (:status r)) (recur sent (max acked (:offset r)))
+              :else (do (println "going back to" (:offset r) "status" (:status r))
+                        (recur (:offset r) (:offset r)))))))
+      (write-command sos cmd-end)
+      (let [r (await-reply sis cmd-end)]
+        (when-not (zero? (:status r))
+          (throw (ex-info "end failed, image not valid" r)))))))
+
+(defn- download-retrying [server-ip server-port ^bytes stream begin & {:keys [target]}]
+  (let [t0 (System/currentTimeMillis)]
+    (loop [attempt 1]
+      (let [done (try
+                   (download server-ip server-port stream begin :target target)
+                   true
+                   (catch java.io.IOException e
+                     (println "connection lost:" (.getMessage e))
+                     (when (>= attempt 5) (throw e))
+                     false))]
+        (when-not done
+          (Thread/sleep 1000)
+          (recur (inc attempt)))))
+    (println "Finished deploy in" (- (System/currentTimeMillis) t0) "ms")
+    (flush)))
+
+(defn- read-file ^bytes [file]
+  (let [f (io/file file)]
+    (when-not (.exists f)
+      (throw (ex-info "File not found!" {:file file})))
+    (java.nio.file.Files/readAllBytes (.toPath f))))
+
+(defn deploy
+  "packed, unless :raw true (a board before the packed download)"
+  [server-ip server-port bin-file & {:keys [raw]}]
+  (let [image (read-file bin-file)
+        stream (if raw image (pack image))]
+    (println "Deploying file length:" (alength image) "sending:" (alength stream))
+    (flush)
+    (download-retrying server-ip server-port stream
+                       (if raw [cmd-begin] [cmd-begin-packed (alength image) (crc32 image 0 (alength image))]))))
+
+(defn deploy-delta
+  "a delta against the image running on the board, as made by picow/kbd/tests/test_fw_delta
+   (-w): image size(4), image crc(4), base size(4), base crc(4), then the stream"
+  [server-ip server-port delta-file]
+  (let [ba (read-file delta-file)
+        stream (java.util.Arrays/copyOfRange ba 16 (alength ba))]
+    (println "Deploying delta of image length:" (read-u32 ba 0) "sending:" (alength stream))
+    (flush)
+    (download-retrying server-ip server-port stream
+                       (into [cmd-begin-delta] (map #(read-u32 ba (* 4 %)) (range 4))))))
+
+(defn- node-stream
+  "the download of a node as the commands it reads, relayed as is by AP: begin, the chunks, end"
+  ^bytes [^bytes stream [begin-cmd & begin-args]]
+  (let [out (ByteArrayOutputStream.)]
+    (apply write-command out begin-cmd (alength stream) (crc32 stream 0 (alength stream)) begin-args)
+    (loop [offset 0]
+      (when (< offset (alength stream))
+        (recur (write-chunk out stream offset))))
+    (write-command out cmd-end)
+    (.toByteArray out)))
+
+(defn relay-status
+  "of the firmware relayed by AP, per node (left, right): :state, :status of the node download,
+   :size and :read of what is relayed"
+  [server-ip server-port]
+  (with-open [sock (Socket. server-ip server-port)
+              sos (.getOutputStream sock)
+              sis (.getInputStream sock)]
+    (write-command sos cmd-relay-status)
+    (let [header (.readNBytes sis 2)
+          n (aget header 1)
+          ba (.readNBytes sis (* n 10))]
+      (mapv (fn [i]
+              (let [pos (* i 10)]
+                {:state (relay-states (long (aget ba pos))) :status (aget ba (inc pos))
+                 :size (read-u32 ba (+ pos 2)) :read (read-u32 ba (+ pos 6))}))
+            (range n)))))
+
+(defn deploy-relay
+  "to left/right through AP over BLE, the nodes typing on meanwhile: staged on AP, packed, then
+   relayed to each node, which reboots into it once verified, and the other one relayed is too"
+  [server-ip server-port & {:as bin-files}]
+  (doseq [[node bin-file] bin-files]
+    (let [image (read-file bin-file)
+          stream (node-stream (pack image) [cmd-begin-packed (alength image) (crc32 image 0 (alength image))])]
+      (println "Staging" (name node) "file length:" (alength image) "relayed:" (alength stream))
+      (flush)
+      (download-retrying server-ip server-port stream [cmd-begin] :target (cmd-target node))))
+  (loop []
+    (Thread/sleep 1000)
+    (let [relayed (select-keys (zipmap [:left :right] (relay-status server-ip server-port)) (keys bin-files))]
+      (doseq [[node s] relayed]
+        (println (name node) (name (:state s)) (:read s) "of" (:size s) "status" (:status s)))
+      (flush)
+      (when (some #(#{:relaying :verified} (:state %)) (vals relayed))
+        (recur)))))
 
 (def hsize 4) ;; header size
 (def dsize 1024) ;; data size, 4*256
 (def psize (+ hsize dsize)) ;; packet size
 
-(defn deploy [server-ip server-port bin-file]
+(defn deploy-v1
+  "to a board still running the firmware from before the windowed download (deploy)"
+  [server-ip server-port bin-file]
   (let [f (io/file bin-file)
         ba (byte-array psize)]
     (when-not (.exists f)
@@ -53,6 +266,33 @@
       (println "Finished deploy")
       (flush))))
 
+(def telemetry-fields ;; kbd_link_telemetry_t, little endian
+  [[:tx-fps 2] [:rx-fps 2] [:rtt-ms 2] [:rtt-max-ms 2] [:key-latency-us 2]
+   [:retransmits 2] [:rssi -1] [:interval 1] [:duplicates 1] [:out-of-sync 1]])
+
+(defn- read-telemetry [ba offset]
+  (loop [fields telemetry-fields, pos offset, m {}]
+    (if-let [[k n] (first fields)]
+      (let [v (case n
+                2 (bit-or (bit-and (aget ba pos) 0xFF) (bit-shift-left (bit-and (aget ba (inc pos)) 0xFF) 8))
+                1 (bit-and (aget ba pos) 0xFF)
+                -1 (long (aget ba pos)))]
+        (recur (rest fields) (+ pos (Math/abs (long n))) (assoc m k v)))
+      m)))
+
+(defn link-telemetry
+  "link telemetry of the node, per link: AP has left and right, left/right the one to AP"
+  [server-ip server-port]
+  (with-open [sock (Socket. server-ip server-port)
+              sos (.getOutputStream sock)
+              sis (.getInputStream sock)]
+    (.write sos (byte-array [4]) 0 1)
+    (.flush sos)
+    (let [header (.readNBytes sis 2)
+          n (aget header 1)
+          ba (.readNBytes sis (* n 16))]
+      (mapv #(read-telemetry ba (* % 16)) (range n)))))
+
 (comment ;; deploy
 
   "NOTE:
@@ -60,10 +300,30 @@ Initial deployment:
    1. copy the pico-fota-bootloader.uf2 to picow usb drive
    2. copy the kbd_(ap|left|right).uf2 to picow usb drive
 
-Thereafter, this wifi download method can be used to update the picow."
+Thereafter, this wifi download method can be used to update the picow.
+A dropped connection is resumed from where it stopped, upto 5 times; deploy again
+to resume later on, as long as the picow has not restarted.
+The image is sent packed (lz4, a block per 4 KB sector), and unpacked on the picow;
+a picow still on the firmware before the packed download takes (deploy ... :raw true).
+A picow still on the firmware before the windowed download is updated by deploy-v1, once.
+An update of a few functions is sent as a delta against the build running on the picow:
+   gcc -O2 -o /tmp/test_fw_delta picow/kbd/tests/test_fw_delta.c picow/kbd/util/fw_download.c \\
+       picow/kbd/util/crc32.c picow/kbd/util/lz4_block.c
+   /tmp/test_fw_delta -w kbd_ap.delta kbd_ap.running.bin kbd_ap.bin
+the picow refuses it if not running that build, then deploy the whole of it.
+Left/right are updated through AP, over BLE, with no wifi on them (deploy-relay); each is
+staged on AP, relayed, and rebooted into once it and the other relayed are verified."
 
   (deploy "192.168.4.1" 82 "/home/dipu/my/pico/kbd/picow/build/kbd/kbd_ap.bin")
 
+  (deploy-delta "192.168.4.1" 82 "/home/dipu/my/pico/kbd/picow/build/kbd/kbd_ap.delta")
+
+  (deploy-relay "192.168.4.1" 82
+                :left "/home/dipu/my/pico/kbd/picow/build/kbd/kbd_left.bin"
+                :right "/home/dipu/my/pico/kbd/picow/build/kbd/kbd_right.bin")
+
+  (relay-status "192.168.4.1" 82)
+
   (do
 
     (deploy "192.168.4.2" 82 "/home/dipu/my/pico/kbd/picow/build/kbd/kbd_left.bin")
@@ -75,6 +335,12 @@ Thereafter, this wifi download method can be used to update the picow."
 
   )
 
+(comment ;; link telemetry, while wifi is on
+
+  (link-telemetry "192.168.4.1" 82)
+
+  )
+
 (comment
 
   (deploy "192.168.4.1" 80 "/home/dipu/my/pico/kbd/picow/build/hello_wifi/picow_ap.bin")
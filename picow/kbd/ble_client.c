@@ -22,10 +22,17 @@ typedef struct {
   gatt_client_characteristic_t tx;
   btstack_context_callback_registration_t write;
   ble_comm_t comm;
+  ble_peer_t *peer; // as cached
+  bool cached;      // connecting, or connected as cached
 } ble_client_t;
 
 static ble_client_t ble_clients[MAX_CLIENTS];
 
+static ble_peer_cache_t *peer_cache = NULL;
+static void (*peer_cache_changed)(void) = NULL;
+
+static bool scanning = false;
+
 static char *const ble_server_name = "kekdanode";
 
 // addr and type of device with correct name
@@ -46,12 +53,112 @@ static btstack_packet_callback_registration_t hci_event_callback_registration;
 
 static void handle_write(void *context);
 
+static void gatt_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
 static void init_client(ble_client_t *client) {
   client->con_handle = HCI_CON_HANDLE_INVALID;
   client->write.callback = handle_write;
   client->write.context = client;
+  client->cached = false;
   ble_comm_t *comm = &client->comm;
   comm->state = ble_state_IDLE;
+  comm->connect_start_ms = btstack_run_loop_get_time_ms();
+  ble_init_link(&comm->link);
+}
+
+void ble_set_peer_cache(ble_peer_cache_t *cache, void (*changed)(void)) {
+  peer_cache = cache;
+  peer_cache_changed = changed;
+  if (cache->version != BLE_PEER_CACHE_VERSION) {
+    memset(cache, 0, sizeof(ble_peer_cache_t));
+    cache->version = BLE_PEER_CACHE_VERSION;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    ble_clients[i].peer = cache->peers + i;
+}
+
+static ble_peer_t *cached_peer(ble_client_t *client) {
+  return client->peer && client->peer->valid ? client->peer : NULL;
+}
+
+static void save_peer(ble_client_t *client, bool valid) {
+  ble_peer_t *peer = client->peer;
+  if (!peer)
+    return;
+  if (valid) {
+    memcpy(peer->addr, client->addr, BD_ADDR_LEN);
+    peer->addr_type = client->addr_type;
+    peer->rx_value_handle = client->rx.value_handle;
+    peer->tx_value_handle = client->tx.value_handle;
+    peer->tx_end_handle = client->tx.end_handle;
+  }
+  peer->valid = valid;
+  if (peer_cache_changed)
+    peer_cache_changed();
+}
+
+static void connect_client(ble_client_t *client) {
+  // via the filter accept list, along with any other being connected
+  client->comm.state = ble_state_CONNECT;
+  gap_auto_connection_start(client->addr_type, client->addr);
+}
+
+static void update_scanning() {
+  // scan by name, for those not known, or not connected for long as cached
+  bool scan = false;
+  uint32_t ms = btstack_run_loop_get_time_ms();
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ble_client_t *client = ble_clients + i;
+    if (client->comm.state == ble_state_IDLE ||
+        (client->comm.state == ble_state_CONNECT && ms - client->comm.connect_start_ms >= BLE_RECONNECT_SCAN_MS))
+      scan = true;
+  }
+  if (scan && !scanning) {
+    gap_set_scan_parameters(0, BLE_SCAN_INTERVAL, BLE_SCAN_WINDOW);
+    gap_start_scan();
+  } else if (!scan && scanning) {
+    gap_stop_scan();
+  }
+  scanning = scan;
+}
+
+static void start_connecting() {
+  // cached peers right away, the others once found by name
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ble_client_t *client = ble_clients + i;
+    ble_peer_t *peer = cached_peer(client);
+    if (client->comm.state != ble_state_IDLE || !peer)
+      continue;
+    memcpy(client->addr, peer->addr, BD_ADDR_LEN);
+    client->addr_type = (bd_addr_type_t)peer->addr_type;
+    client->cached = true;
+    connect_client(client);
+  }
+  update_scanning();
+}
+
+static void listen_for_notifications(ble_client_t *client) {
+  gatt_client_listen_for_characteristic_value_updates(&client->listener, gatt_event_handler, client->con_handle,
+                                                      &client->tx);
+  gatt_client_write_client_characteristic_configuration(gatt_event_handler, client->con_handle, &client->tx,
+                                                        GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION);
+  client->comm.state = ble_state_NOTIFY;
+}
+
+static void use_cached_handles(ble_client_t *client) {
+  // skip the discovery, the peer is as discovered before
+  ble_peer_t *peer = client->peer;
+  memset(&client->rx, 0, sizeof(gatt_client_characteristic_t));
+  memset(&client->tx, 0, sizeof(gatt_client_characteristic_t));
+  client->rx.value_handle = peer->rx_value_handle;
+  client->rx.start_handle = peer->rx_value_handle - 1;
+  client->rx.end_handle = peer->rx_value_handle;
+  client->rx.properties = ATT_PROPERTY_WRITE_WITHOUT_RESPONSE | ATT_PROPERTY_NOTIFY;
+  client->tx.value_handle = peer->tx_value_handle;
+  client->tx.start_handle = peer->tx_value_handle - 1;
+  client->tx.end_handle = peer->tx_end_handle;
+  client->tx.properties = ATT_PROPERTY_WRITE_WITHOUT_RESPONSE | ATT_PROPERTY_NOTIFY;
+  listen_for_notifications(client);
 }
 
 static ble_client_t *find_client_by_addr(bd_addr_t addr) {
@@ -121,16 +228,54 @@ void ble_initiate_send(uint8_t comm_id) {
   gatt_client_request_to_write_without_response(&client->write, client->con_handle);
 }
 
+void ble_update_link(uint8_t comm_id) {
+  ble_client_t *client = find_client_by_id(comm_id);
+  if (!client)
+    return;
+  // look for it by name as well, if not connected for long as cached
+  if (client->comm.state == ble_state_CONNECT && !scanning)
+    update_scanning();
+  if (client->con_handle == HCI_CON_HANDLE_INVALID || client->comm.state != ble_state_DATA)
+    return;
+  ble_comm_t *comm = &client->comm;
+  ble_link_t *link = &comm->link;
+
+  // 2M PHY, and data length extension, once per connection
+  if (!link->phy_requested)
+    link->phy_requested = gap_le_set_phy(client->con_handle, 0, BLE_PHY_2M, BLE_PHY_2M, 0) == ERROR_CODE_SUCCESS;
+  if (!link->dle_requested && hci_can_send_command_packet_now())
+    link->dle_requested = hci_send_cmd(&hci_le_set_data_length, client->con_handle, BLE_DLE_TX_OCTETS,
+                                       BLE_DLE_TX_TIME) == ERROR_CODE_SUCCESS;
+
+  // RSSI, as reported by GAP_EVENT_RSSI_MEASUREMENT
+  uint32_t ms = btstack_run_loop_get_time_ms();
+  if (ms - link->rssi_ms >= BLE_TELEMETRY_MS && gap_read_rssi(client->con_handle) == ERROR_CODE_SUCCESS)
+    link->rssi_ms = ms;
+
+  // fast while active, else slow to save the battery of the node
+  bool fast = ms - comm->active_ms < BLE_ACTIVE_MS;
+  if (link->params_requested && fast == link->fast)
+    return;
+  uint16_t interval = fast ? BLE_FAST_INTERVAL : BLE_IDLE_INTERVAL;
+  uint16_t latency = fast ? BLE_FAST_LATENCY : BLE_IDLE_LATENCY;
+  if (gap_update_connection_parameters(client->con_handle, interval, interval, latency, BLE_SUPERVISION_TIMEOUT) ==
+      ERROR_CODE_SUCCESS) {
+    link->fast = fast;
+    link->params_requested = true;
+  }
+}
+
 static void send_data(ble_client_t *client) {
   ble_comm_t *comm = &client->comm;
   if (client->con_handle == HCI_CON_HANDLE_INVALID || comm->state != ble_state_DATA)
     return;
 
   // send
-  if (comm->send_len > 0) {
-    gatt_client_write_value_of_characteristic_without_response(client->con_handle, client->rx.value_handle,
-                                                               comm->send_len, comm->send_buff);
-    comm->send_len = 0;
+  uint8_t len;
+  uint8_t *buff = ble_next_send(comm, &len);
+  if (buff) {
+    gatt_client_write_value_of_characteristic_without_response(client->con_handle, client->rx.value_handle, len,
+                                                               buff);
     gatt_client_request_to_write_without_response(&client->write, client->con_handle);
   } else {
     comm->auto_send = false;
@@ -176,6 +321,8 @@ static void gatt_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
       att_status = gatt_event_query_complete_get_att_status(packet);
       if (att_status != ATT_ERROR_SUCCESS) {
         // printf("Query failed 0x%04x, ATT Error 0x%02x\n", client->con_handle, att_status);
+        if (client->cached)
+          save_peer(client, false); // the handles are not valid anymore, discover the next time
         client->comm.state = ble_state_IDLE;
         gap_disconnect(client->con_handle);
         break;
@@ -198,16 +345,16 @@ static void gatt_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
       case ble_state_TX:
         // TX query complete, listen for notification
         // printf("Listen for notifictaion, 0x%04x\n", client->con_handle);
-        gatt_client_listen_for_characteristic_value_updates(&client->listener, gatt_event_handler, client->con_handle,
-                                                            &client->tx);
-        gatt_client_write_client_characteristic_configuration(gatt_event_handler, client->con_handle, &client->tx,
-                                                              GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION);
-        client->comm.state = ble_state_NOTIFY;
+        listen_for_notifications(client);
         break;
       case ble_state_NOTIFY:
         // printf("Notifications enabled, 0x%04x\n", client->con_handle);
         ble_init_comm_data(&client->comm);
         client->comm.state = ble_state_DATA;
+        client->comm.connect_ms = btstack_run_loop_get_time_ms() - client->comm.connect_start_ms;
+        client->comm.connect_cached = client->cached;
+        if (!client->cached)
+          save_peer(client, true); // to skip the discovery the next time
         gatt_client_request_to_write_without_response(&client->write, client->con_handle);
       case ble_state_DATA:
         break;
@@ -228,14 +375,6 @@ static void gatt_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
   }
 }
 
-static bool all_connected() {
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (ble_clients[i].con_handle == HCI_CON_HANDLE_INVALID)
-      return false;
-  }
-  return true;
-}
-
 static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
   UNUSED(channel);
   UNUSED(size);
@@ -243,8 +382,6 @@ static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
   if (packet_type != HCI_EVENT_PACKET)
     return;
 
-  static bool scanning = false;
-
   const uint8_t *adv_data;
   uint8_t adv_len;
   uint8_t id;
@@ -256,10 +393,8 @@ static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
   case BTSTACK_EVENT_STATE:
     // BTStack activated, get started
     if (btstack_event_state_get_state(packet) == HCI_STATE_WORKING) {
-      // printf("Start scanning\n");
-      gap_set_scan_parameters(0, 0x0030, 0x0030);
-      gap_start_scan();
-      scanning = true;
+      // printf("Start connecting\n");
+      start_connecting();
     }
     break;
   case GAP_EVENT_ADVERTISING_REPORT:
@@ -268,17 +403,22 @@ static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
     adv_len = gap_event_advertising_report_get_data_length(packet);
     if (!(id = identify_node(ble_server_name, adv_len, adv_data)))
       return;
-    client = find_client_by_id(id);
-    if (client->con_handle != HCI_CON_HANDLE_INVALID)
+    if (!(client = find_client_by_id(id)) || client->con_handle != HCI_CON_HANDLE_INVALID)
       return;
-    // match connecting phy
-    gap_set_connection_phys(1);
+    gap_event_advertising_report_get_address(packet, addr);
+    if (client->comm.state == ble_state_CONNECT) {
+      if (memcmp(addr, client->addr, BD_ADDR_LEN) == 0)
+        return; // being connected already
+      // not the one cached, connect to this one and discover
+      gap_auto_connection_stop(client->addr_type, client->addr);
+      client->cached = false;
+    }
     // connect
-    gap_event_advertising_report_get_address(packet, client->addr);
+    memcpy(client->addr, addr, BD_ADDR_LEN);
     client->addr_type = gap_event_advertising_report_get_address_type(packet);
-    client->comm.state = ble_state_CONNECT;
     // printf("Connecting to node %u %s\n", client->id, bd_addr_to_str(client->addr));
-    gap_connect(client->addr, client->addr_type);
+    connect_client(client);
+    update_scanning();
     break;
   case HCI_EVENT_LE_META:
     // wait for connection complete
@@ -289,19 +429,45 @@ static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
         return;
       if (client->comm.state != ble_state_CONNECT)
         return;
-      if (all_connected()) {
-        gap_stop_scan();
-        scanning = false;
-      }
-      client->comm.state = ble_state_SERVICE;
+      gap_auto_connection_stop(client->addr_type, client->addr);
       client->con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
-      // printf("Connected to node %s, 0x%04x searching service\n", bd_addr_to_str(client->addr), client->con_handle);
-      gatt_client_discover_primary_services_by_uuid128(gatt_event_handler, client->con_handle, client->service_uuid);
+      client->comm.link.interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+      client->comm.link.latency = hci_subevent_le_connection_complete_get_conn_latency(packet);
+      if (client->cached) {
+        // printf("Connected to node %s, 0x%04x as cached\n", bd_addr_to_str(client->addr), client->con_handle);
+        use_cached_handles(client);
+      } else {
+        client->comm.state = ble_state_SERVICE;
+        // printf("Connected to node %s, 0x%04x searching service\n", bd_addr_to_str(client->addr),
+        // client->con_handle);
+        gatt_client_discover_primary_services_by_uuid128(gatt_event_handler, client->con_handle, client->service_uuid);
+      }
+      update_scanning();
+      break;
+    case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+      if (!(client = find_client_by_con_handle(hci_subevent_le_connection_update_complete_get_connection_handle(packet))))
+        return;
+      client->comm.link.interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+      client->comm.link.latency = hci_subevent_le_connection_update_complete_get_conn_latency(packet);
+      break;
+    case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+      if (!(client = find_client_by_con_handle(hci_subevent_le_phy_update_complete_get_connection_handle(packet))))
+        return;
+      client->comm.link.phy = hci_subevent_le_phy_update_complete_get_tx_phy(packet);
+      break;
+    case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
+      if (!(client = find_client_by_con_handle(hci_subevent_le_data_length_change_get_connection_handle(packet))))
+        return;
+      client->comm.link.tx_octets = hci_subevent_le_data_length_change_get_max_tx_octets(packet);
       break;
     default:
       break;
     }
     break;
+  case GAP_EVENT_RSSI_MEASUREMENT:
+    if ((client = find_client_by_con_handle(gap_event_rssi_measurement_get_con_handle(packet))))
+      client->comm.link.rssi = (int8_t)gap_event_rssi_measurement_get_rssi(packet);
+    break;
   case HCI_EVENT_DISCONNECTION_COMPLETE:
     // unregister listener
     con_handle = hci_event_disconnection_complete_get_connection_handle(packet);
@@ -312,10 +478,7 @@ static void hci_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
     }
     init_client(client);
     // printf("Disconnected %s, 0x%04x\n", bd_addr_to_str(client->addr), client->con_handle);
-    if (!scanning) {
-      gap_start_scan();
-      scanning = true;
-    }
+    start_connecting();
     break;
   default:
     break;
@@ -340,6 +503,10 @@ int ble_init() {
   // sm_init needed before gatt_client_init
   gatt_client_init();
 
+  // connect at full scan duty, with the fast interval right away
+  gap_set_connection_parameters(BLE_SCAN_INTERVAL, BLE_SCAN_WINDOW, BLE_FAST_INTERVAL, BLE_FAST_INTERVAL,
+                                BLE_FAST_LATENCY, BLE_SUPERVISION_TIMEOUT, 0, 0);
+
   hci_event_callback_registration.callback = &hci_event_handler;
   hci_add_event_handler(&hci_event_callback_registration);
 
@@ -1,51 +1,237 @@
 #include "ble_comm.h"
 #include <string.h>
 
+#include "pico/stdlib.h"
+
+static inline uint32_t ble_millis() { return to_ms_since_boot(get_absolute_time()); }
+
+static void (*ble_wake)(void) = NULL;
+
+void ble_set_wake(void (*wake)(void)) { ble_wake = wake; }
+
 void ble_init_comm_data(ble_comm_t *comm) {
-  comm->recv_count = 0;
+  comm->recv_head = 0;
+  comm->recv_tail = 0;
   memset(comm->recv_len, 0, BLE_QUEUE_SIZE);
-  comm->send_len = 0;
+  memset(comm->send_len, 0, BLE_WINDOW_SIZE);
   comm->auto_send = true;
-  comm->x = 0;
-  comm->y = 0;
+  comm->seq_next = 0;
+  comm->seq_sent = 0;
+  comm->seq_acked = 0;
+  comm->recv_next = 0;
+  comm->seq_fresh = 0;
+  memset(comm->send_ms, 0, sizeof(comm->send_ms));
+  comm->ack_pending = false;
+  comm->ack_ms = ble_millis();
+  comm->sent_ms = comm->ack_ms;
+  comm->retransmits = 0;
+  comm->recv_overflows = 0;
+  comm->recv_duplicates = 0;
+  comm->recv_out_of_sync = 0;
+  comm->recv_malformed = 0;
+  comm->recv_burst_max = 0;
+  comm->sent_frames = 0;
+  comm->recv_frames = 0;
+  comm->telemetry_ms = comm->ack_ms;
+  comm->sent_frames_last = 0;
+  comm->recv_frames_last = 0;
+  comm->tx_fps = 0;
+  comm->rx_fps = 0;
+  comm->rtt_ms = 0;
+  comm->rttvar_ms = 0;
+  comm->retransmit_backoff = 0;
+  comm->rtt_max_ms = 0;
+  comm->rtt_max_ms_next = 0;
 }
 
-void ble_process(uint8_t comm_id, ble_consume_t consume, ble_produce_t produce) {
+void ble_init_link(ble_link_t *link) {
+  memset(link, 0, sizeof(ble_link_t));
+  link->phy = 1;
+  link->tx_octets = 27;
+  link->rssi = BLE_RSSI_UNKNOWN;
+}
+
+void ble_note_activity(uint8_t comm_id) {
   ble_comm_t *comm = ble_find_comm_by_id(comm_id);
-  if (!comm || comm->state != ble_state_DATA)
+  if (comm)
+    comm->active_ms = ble_millis();
+}
+
+static void ble_time_ack(ble_comm_t *comm, uint8_t seq, uint32_t ms) {
+  // round trip of the frame just acked, if sent once
+  uint32_t sent = comm->send_ms[seq & (BLE_WINDOW_SIZE - 1)];
+  if (!sent)
     return;
+  uint32_t rtt = ms - sent;
+  if (rtt > 0xFFFF)
+    rtt = 0xFFFF;
+  if (comm->rtt_ms) {
+    uint32_t dev = rtt > comm->rtt_ms ? rtt - comm->rtt_ms : comm->rtt_ms - rtt;
+    comm->rttvar_ms = (3 * comm->rttvar_ms + dev) / 4;
+    comm->rtt_ms = (7 * comm->rtt_ms + rtt) / 8;
+  } else {
+    comm->rttvar_ms = rtt / 2;
+    comm->rtt_ms = rtt;
+  }
+  if (rtt > comm->rtt_max_ms_next)
+    comm->rtt_max_ms_next = rtt;
+  comm->retransmit_backoff = 0;
+}
+
+static uint32_t ble_retransmit_ms(ble_comm_t *comm) {
+  // a round trip as per the connection, in 1.25 ms units, else as timed
+  uint32_t ms = comm->link.interval * (2 + comm->link.latency) * 5 / 4 + BLE_RETRANSMIT_MARGIN_MS;
+  uint32_t timed = comm->rtt_ms + 4 * (uint32_t)comm->rttvar_ms;
+  if (timed > ms)
+    ms = timed;
+  if (ms < BLE_RETRANSMIT_MIN_MS)
+    ms = BLE_RETRANSMIT_MIN_MS;
+  ms <<= comm->retransmit_backoff;
+  return ms < BLE_RETRANSMIT_MAX_MS ? ms : BLE_RETRANSMIT_MAX_MS;
+}
+
+static void ble_update_telemetry(ble_comm_t *comm, uint32_t ms) {
+  uint32_t dt = ms - comm->telemetry_ms;
+  if (dt < BLE_TELEMETRY_MS)
+    return;
+  comm->tx_fps = (comm->sent_frames - comm->sent_frames_last) * 1000 / dt;
+  comm->rx_fps = (comm->recv_frames - comm->recv_frames_last) * 1000 / dt;
+  comm->sent_frames_last = comm->sent_frames;
+  comm->recv_frames_last = comm->recv_frames;
+  comm->rtt_max_ms = comm->rtt_max_ms_next;
+  comm->rtt_max_ms_next = 0;
+  comm->telemetry_ms = ms;
+}
+
+static void ble_receive_ack(ble_comm_t *comm, uint8_t ack) {
+  // ack is of the last frame received, so acked upto ack+1
+  uint8_t acked = ack + 1;
+  uint8_t advance = acked - comm->seq_acked;
+  uint8_t in_flight = comm->seq_next - comm->seq_acked;
+  if (advance == 0 || advance > in_flight)
+    return; // nothing new, or stale
+  comm->seq_acked = acked;
+  comm->ack_ms = ble_millis();
+  ble_time_ack(comm, ack, comm->ack_ms);
+  // gone back for resending, but acked meanwhile
+  if ((uint8_t)(comm->seq_sent - comm->seq_acked) > (uint8_t)(comm->seq_next - comm->seq_acked))
+    comm->seq_sent = comm->seq_acked;
+}
+
+bool ble_process(uint8_t comm_id, ble_consume_t consume, ble_produce_t produce) {
+  ble_comm_t *comm = ble_find_comm_by_id(comm_id);
+  if (!comm || comm->state != ble_state_DATA)
+    return false;
 
   uint8_t *buff;
   uint8_t len;
+  bool busy = comm->recv_head != comm->recv_tail;
 
-  // consume received data
-  while (comm->recv_count > 0) {
-    buff = comm->recv_buff[comm->recv_count - 1];
-    len = comm->recv_len[comm->recv_count - 1];
-    comm->recv_count--;
-    comm->y = buff[0];
-    if (len > 1)
-      consume(comm_id, buff + 1, len - 1);
+  // consume received data, in the order of arrival
+  uint8_t burst = comm->recv_tail - comm->recv_head;
+  if (burst > comm->recv_burst_max)
+    comm->recv_burst_max = burst;
+  while (comm->recv_head != comm->recv_tail) {
+    uint8_t pos = comm->recv_head++ & (BLE_QUEUE_SIZE - 1);
+    buff = comm->recv_buff[pos];
+    len = comm->recv_len[pos];
+    ble_receive_ack(comm, buff[2]);
+    if (buff[0] != BLE_FRAME_DATA)
+      continue;
+    // a duplicate, or past a lost one, ack again what is received so far
+    comm->ack_pending = true;
+    if (buff[1] != comm->recv_next) {
+      if ((uint8_t)(comm->recv_next - buff[1]) <= BLE_WINDOW_SIZE)
+        comm->recv_duplicates++;
+      else
+        comm->recv_out_of_sync++;
+      continue;
+    }
+    comm->recv_next++;
+    comm->recv_frames++;
+    if (len > BLE_HEADER_SIZE)
+      consume(comm_id, buff + BLE_HEADER_SIZE, len - BLE_HEADER_SIZE);
   }
 
-  uint8_t x = comm->x == 255 ? 0 : comm->x + 1;
-  bool in_sync = comm->x == comm->y || x == comm->y;
-
-  // produce data to send
-  if (comm->send_len == 0 && in_sync) {
-    buff = comm->send_buff;
-    len = produce(comm_id, buff + 1);
-    buff[0] = comm->x = x;
-    comm->send_len = len + 1;
-    if (!comm->auto_send)
-      ble_initiate_send(comm_id);
+  // resend the unacknowledged frames, if no ack for long
+  uint32_t ms = ble_millis();
+  if (comm->seq_sent != comm->seq_acked && ms - comm->ack_ms >= ble_retransmit_ms(comm)) {
+    comm->retransmits += (uint8_t)(comm->seq_sent - comm->seq_acked);
+    comm->seq_sent = comm->seq_acked;
+    comm->ack_ms = ms;
+    if (comm->retransmit_backoff < 5)
+      comm->retransmit_backoff++;
   }
+  ble_update_telemetry(comm, ms);
+
+  // produce data to send, once the previous frame is sent, if the window has room
+  uint8_t in_flight = comm->seq_next - comm->seq_acked;
+  if (comm->seq_sent == comm->seq_next && in_flight < BLE_WINDOW_SIZE) {
+    uint8_t slot = comm->seq_next & (BLE_WINDOW_SIZE - 1);
+    buff = comm->send_buff[slot];
+    len = produce(comm_id, buff + BLE_HEADER_SIZE);
+    if (len > 0) { // else nothing new
+      busy = true;
+      buff[0] = BLE_FRAME_DATA;
+      buff[1] = comm->seq_next++;
+      comm->send_len[slot] = len + BLE_HEADER_SIZE;
+      if (in_flight == 0)
+        comm->ack_ms = ms; // time the ack from now
+    }
+  }
+
+  // keep alive, if nothing sent for long
+  if (comm->seq_sent == comm->seq_next && ms - comm->sent_ms >= BLE_KEEP_ALIVE_MS)
+    comm->ack_pending = true;
+
+  if (!comm->auto_send && (comm->seq_sent != comm->seq_next || comm->ack_pending))
+    ble_initiate_send(comm_id);
+
+  ble_update_link(comm_id);
+
+  return busy || comm->seq_next != comm->seq_acked;
 }
 
 void ble_receive_data(ble_comm_t *comm, const uint8_t *buff, uint16_t len) {
-  if (comm->recv_count < BLE_QUEUE_SIZE) {
-    uint8_t pos = comm->recv_count++;
-    memcpy(comm->recv_buff[pos], buff, len);
-    comm->recv_len[pos] = len;
+  if (len < BLE_HEADER_SIZE || len > BLE_DATA_SIZE || (buff[0] != BLE_FRAME_DATA && buff[0] != BLE_FRAME_EMPTY)) {
+    comm->recv_malformed++;
+    return;
+  }
+  if ((uint8_t)(comm->recv_tail - comm->recv_head) >= BLE_QUEUE_SIZE) {
+    comm->recv_overflows++; // lost, resent by the peer if a data frame
+    return;
+  }
+  uint8_t pos = comm->recv_tail++ & (BLE_QUEUE_SIZE - 1);
+  memcpy(comm->recv_buff[pos], buff, len);
+  comm->recv_len[pos] = len;
+  if (ble_wake)
+    ble_wake();
+}
+
+uint8_t *ble_next_send(ble_comm_t *comm, uint8_t *len) {
+  uint8_t *buff;
+  uint32_t ms = ble_millis();
+  if (comm->seq_sent != comm->seq_next) {
+    // time the ack of a frame sent once only
+    bool fresh = comm->seq_sent == comm->seq_fresh;
+    if (fresh)
+      comm->seq_fresh++;
+    uint8_t slot = comm->seq_sent++ & (BLE_WINDOW_SIZE - 1);
+    buff = comm->send_buff[slot];
+    *len = comm->send_len[slot];
+    comm->send_ms[slot] = fresh ? (ms ? ms : 1) : 0;
+    comm->sent_frames++;
+  } else if (comm->ack_pending) {
+    buff = comm->ack_buff;
+    buff[0] = BLE_FRAME_EMPTY;
+    buff[1] = 0;
+    *len = BLE_HEADER_SIZE;
+  } else {
+    return NULL;
   }
+  // every frame carries the latest ack
+  buff[2] = comm->recv_next - 1;
+  comm->ack_pending = false;
+  comm->sent_ms = ms;
+  return buff;
 }
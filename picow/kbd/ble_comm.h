@@ -10,17 +10,131 @@
 #define BLE_COMM_RIGHT_ID 'R'
 
 // using 64 bytes - large enough to pack max loads
-// ap   -> 45 = 1 sync + 1+4 state           + 1+36 req + 2 ack
-// left -> 47 = 1 sync + 1+6 keys            + 1+36 res + 2 ack
-// right-> 54 = 1 sync + 1+6 keys + 1+6  tb  + 1+36 res + 2 ack
-// whereas the req/res are not always present
-// also tb is present only when the ball is moved
+// ap   -> 50 = 3 header + 2 comm + 1+4 state                 + 1+36 req + 2 ack
+// left -> 53 = 3 header + 2 comm + 2+6 keys                  + 1+36 res + 2 ack
+// right-> 60 = 3 header + 2 comm + 2+6 keys + 1+1+2x3 tb     + 1+36 res + 2 ack
+// whereas the records are sent only when changed, and all of them every 250 ms to resync
+// keys are sent as key events (2 + 4 per event) filling up the rest of the frame,
+// and the key_press as the changed rows (2 + 1 per row) every 100 ms
+// tb deltas are varints, mostly 1 byte each
 // so the typical load is
-// ap    -> 8
-// left  -> 10
-// right -> 10    (17 when ball moved)
+// idle  -> 3     (an empty frame, as a keep alive)
+// left  -> 9     (with a key event)
+// right -> 7     (when ball moved)
 #define BLE_DATA_SIZE 64
-#define BLE_QUEUE_SIZE 2
+#define BLE_HEADER_SIZE 3
+#define BLE_PAYLOAD_SIZE (BLE_DATA_SIZE - BLE_HEADER_SIZE)
+
+/*
+ * Sliding window link protocol
+ *
+ * Frame: type, seq, ack, payload (the comm_data_type_* records)
+ *   type : BLE_FRAME_DATA, or BLE_FRAME_EMPTY which has no payload and no seq of its own
+ *   seq  : sequence number of the data frame, wraps at 256
+ *   ack  : cumulative, the last data frame received (and consumed) in order
+ *
+ * Upto BLE_WINDOW_SIZE data frames are in flight, kept until acknowledged.
+ * The receiver consumes only the frame next in order, the others are dropped,
+ * and if no ack arrives in the retransmit timeout the unacknowledged frames are sent again (go back n).
+ * The timeout is srtt + 4 * rttvar of the round trips timed (as in TCP), but no less than a round
+ * trip as per the connection, interval * (2 + latency) + BLE_RETRANSMIT_MARGIN_MS, as the peer may
+ * skip upto latency events before it listens. It doubles on each timeout, upto BLE_RETRANSMIT_MAX_MS,
+ * till a round trip is timed again.
+ * A new frame is produced once the previous one is handed over to the stack, so the frames
+ * go at the rate of the link, rather than one per round trip.
+ * An empty frame is sent when the window is full, so that both sides keep going,
+ * and when there is nothing to send for BLE_KEEP_ALIVE_MS, as a keep alive.
+ * Nothing produced (0 length) is not sent as a data frame, so idle links cost only the keep alives.
+ */
+#define BLE_WINDOW_SIZE 4 // power of 2, < 128
+#define BLE_RETRANSMIT_MIN_MS 50
+#define BLE_RETRANSMIT_MARGIN_MS 20 // for the processing at both ends
+#define BLE_RETRANSMIT_MAX_MS 1000
+#define BLE_KEEP_ALIVE_MS 100
+
+/*
+ * Receive queue, a FIFO ring consumed in arrival order by ble_process.
+ * A burst is the frames queued between two ble_process calls, upto the window of data frames
+ * plus the empty frames, the largest is kept as recv_burst_max (see scan screen) to size it.
+ */
+#ifndef BLE_QUEUE_SIZE
+#define BLE_QUEUE_SIZE 8 // power of 2, no less than the window, to not drop in flight frames
+#endif
+#if BLE_QUEUE_SIZE < BLE_WINDOW_SIZE || (BLE_QUEUE_SIZE & (BLE_QUEUE_SIZE - 1))
+#error "BLE_QUEUE_SIZE must be a power of 2, and no less than BLE_WINDOW_SIZE"
+#endif
+
+#define BLE_FRAME_DATA 0xD0
+#define BLE_FRAME_EMPTY 0xE0
+
+/*
+ * Connection parameters, set by the central (AP) as per the activity
+ * while keys are active: the shortest interval, no latency
+ * when idle for BLE_ACTIVE_MS: a longer interval, with peripheral latency
+ * 2M PHY and data length extension are requested once connected, so that a frame fits a link layer packet
+ */
+#define BLE_ACTIVE_MS 3000
+#define BLE_FAST_INTERVAL 6 // 7.5 ms, in 1.25 ms units
+#define BLE_FAST_LATENCY 0
+#define BLE_IDLE_INTERVAL 24 // 30 ms
+#define BLE_IDLE_LATENCY 4
+#define BLE_SUPERVISION_TIMEOUT 0x0048 // 720 ms, in 10 ms units
+#define BLE_PHY_2M 2
+#define BLE_DLE_TX_OCTETS 251
+#define BLE_DLE_TX_TIME 2120 // us, for 251 octets on 1M, as per the spec
+
+/*
+ * Link telemetry, by each end of the link
+ * frames per second each way, counted over BLE_TELEMETRY_MS
+ * round trip time, from a data frame sent to its ack, not timed if resent (as it is ambiguous),
+ * smoothed as (7 * rtt + sample) / 8, and the max over BLE_TELEMETRY_MS
+ * RSSI, read from the controller every BLE_TELEMETRY_MS
+ */
+#define BLE_TELEMETRY_MS 1000
+#define BLE_RSSI_UNKNOWN 127
+
+typedef struct {
+  // as reported by the controller
+  uint16_t interval;  // 1.25 ms units
+  uint16_t latency;   // connection events the peripheral may skip
+  uint8_t phy;        // tx, 1: 1M, 2: 2M, 3: coded
+  uint16_t tx_octets; // link layer payload, 27 without data length extension
+  int8_t rssi;        // dBm, BLE_RSSI_UNKNOWN until read
+  // as requested
+  bool fast;
+  bool params_requested;
+  bool phy_requested;
+  bool dle_requested;
+  uint32_t rssi_ms; // when read last
+} ble_link_t;
+
+/*
+ * Peers cached by the central (AP) in flash, so that a reconnect goes directly to the address
+ * via the filter accept list, at full scan duty, and skips the discovery, with the attribute handles
+ * as discovered before. A cached peer not connected for BLE_RECONNECT_SCAN_MS is also looked for
+ * by the name, in case it is not the same any more.
+ */
+#define BLE_PEER_CACHE_VERSION 0x01
+#define BLE_PEER_COUNT 2 // left, right
+#define BLE_RECONNECT_SCAN_MS 2000
+#define BLE_SCAN_INTERVAL 0x0030 // 30 ms, in 0.625 ms units
+#define BLE_SCAN_WINDOW 0x0030   // full duty
+
+typedef struct {
+  // be careful about the size, it has to fit a flash dataset with the header
+  uint16_t rx_value_handle;
+  uint16_t tx_value_handle;
+  uint16_t tx_end_handle;
+  uint8_t addr[6];
+  uint8_t addr_type;
+  uint8_t valid;
+} ble_peer_t;
+
+typedef struct {
+  uint8_t version;
+  uint8_t reserved;
+  ble_peer_t peers[BLE_PEER_COUNT];
+} ble_peer_cache_t;
 
 typedef enum {
   ble_state_IDLE,
@@ -35,30 +149,85 @@ typedef enum {
 typedef struct {
   uint8_t id; // 1 to 255
   ble_state_t state;
-  uint8_t send_buff[BLE_DATA_SIZE];
-  uint8_t send_len;
+  uint8_t send_buff[BLE_WINDOW_SIZE][BLE_DATA_SIZE]; // by seq, in flight frames
+  uint8_t send_len[BLE_WINDOW_SIZE];
+  uint8_t ack_buff[BLE_HEADER_SIZE];
   uint8_t recv_buff[BLE_QUEUE_SIZE][BLE_DATA_SIZE];
   uint8_t recv_len[BLE_QUEUE_SIZE];
-  uint8_t recv_count;
+  uint8_t recv_head; // next to consume, runs free
+  uint8_t recv_tail; // next to receive into, runs free
   bool auto_send;
-  // for sync
-  uint8_t x;
-  uint8_t y;
+  // window
+  uint8_t seq_next;  // seq of the next frame to produce
+  uint8_t seq_sent;  // seq of the next frame to send
+  uint8_t seq_acked; // seq of the oldest frame not acknowledged
+  uint8_t recv_next; // seq of the next frame expected
+  uint8_t seq_fresh; // seq of the next frame never sent yet, the ones before it are resent
+  bool ack_pending;  // received frames not acknowledged yet
+  uint32_t ack_ms;   // when acknowledgement last advanced
+  uint32_t sent_ms;  // when a frame was last sent
+  uint32_t send_ms[BLE_WINDOW_SIZE]; // by seq, when first sent, 0 if resent, to time the ack
+  uint8_t retransmit_backoff; // timeouts since a round trip was timed, the timeout doubles on each
+  // connection
+  ble_link_t link;
+  uint32_t active_ms; // when keys were active last
+  uint32_t connect_start_ms; // when disconnected, or started
+  uint32_t connect_ms;       // time taken to connect last, upto data
+  bool connect_cached;       // connected last as cached
+  // stats
+  uint32_t retransmits;
+  uint32_t recv_overflows; // dropped, the queue being full
+  uint32_t recv_duplicates;  // data frames received already
+  uint32_t recv_out_of_sync; // data frames past a lost one
+  uint32_t recv_malformed;   // too short or too long, or of unknown type
+  uint8_t recv_burst_max;    // most frames queued at a time
+  // telemetry
+  uint32_t sent_frames; // data frames, resent included
+  uint32_t recv_frames; // data frames consumed
+  uint32_t telemetry_ms; // start of the current count
+  uint32_t sent_frames_last; // at the start
+  uint32_t recv_frames_last;
+  uint16_t tx_fps; // over the last count
+  uint16_t rx_fps;
+  uint16_t rtt_ms; // smoothed
+  uint16_t rttvar_ms; // smoothed mean deviation, for the retransmit timeout
+  uint16_t rtt_max_ms; // over the last count
+  uint16_t rtt_max_ms_next; // over the current count
 } ble_comm_t;
 
 void ble_init_comm_data(ble_comm_t *comm);
 
 ble_comm_t *ble_find_comm_by_id(uint8_t id);
 
+static inline uint8_t ble_frames_in_flight(ble_comm_t *comm) { return comm->seq_next - comm->seq_acked; }
+
 int ble_init(void);
 
 typedef void (*ble_consume_t)(uint8_t id, uint8_t *buff, uint8_t len);
 typedef uint8_t (*ble_produce_t)(uint8_t id, uint8_t *buff);
 
-void ble_process(uint8_t comm_id, ble_consume_t consume, ble_produce_t produce);
+// returns true if busy: any frame consumed or produced, or in flight
+bool ble_process(uint8_t comm_id, ble_consume_t consume, ble_produce_t produce);
+
+// called on a frame received, to process it right away
+void ble_set_wake(void (*wake)(void));
 
 void ble_initiate_send(uint8_t comm_id);
 
+// note the user activity on the link, to keep it fast
+void ble_note_activity(uint8_t comm_id);
+
+// adapt the connection parameters to the activity, on the central, and read the RSSI, called by ble_process
+void ble_update_link(uint8_t comm_id);
+
+void ble_init_link(ble_link_t *link);
+
+// on the central, the cache is used as is, and updated, with a call to changed
+void ble_set_peer_cache(ble_peer_cache_t *cache, void (*changed)(void));
+
 void ble_receive_data(ble_comm_t *comm, const uint8_t *buff, uint16_t len);
 
+// frame to send next, with the latest ack, NULL if nothing to send
+uint8_t *ble_next_send(ble_comm_t *comm, uint8_t *len);
+
 #endif
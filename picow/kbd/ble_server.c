@@ -69,6 +69,7 @@ static void init_server(ble_server_t *server) {
   server->con_handle = HCI_CON_HANDLE_INVALID;
   ble_comm_t *comm = &ble_server.comm;
   comm->state = ble_state_IDLE;
+  ble_init_link(&comm->link);
 }
 
 ble_comm_t *ble_find_comm_by_id(uint8_t comm_id) {
@@ -76,6 +77,18 @@ ble_comm_t *ble_find_comm_by_id(uint8_t comm_id) {
   return &ble_server.comm;
 }
 
+void ble_update_link(uint8_t comm_id) {
+  (void)comm_id; // the connection parameters are set by the central
+  ble_server_t *server = &ble_server;
+  ble_link_t *link = &server->comm.link;
+  if (server->con_handle == HCI_CON_HANDLE_INVALID)
+    return;
+  // RSSI, as reported by GAP_EVENT_RSSI_MEASUREMENT
+  uint32_t ms = btstack_run_loop_get_time_ms();
+  if (ms - link->rssi_ms >= BLE_TELEMETRY_MS && gap_read_rssi(server->con_handle) == ERROR_CODE_SUCCESS)
+    link->rssi_ms = ms;
+}
+
 void ble_initiate_send(uint8_t comm_id) {
   ble_server_t *server = &ble_server;
   ble_comm_t *comm = &ble_server.comm;
@@ -89,9 +102,10 @@ static void send_data(ble_server_t *server) {
     return;
 
   // send
-  if (comm->send_len > 0) {
-    att_server_notify(server->con_handle, server->value_handle, comm->send_buff, comm->send_len);
-    comm->send_len = 0;
+  uint8_t len;
+  uint8_t *buff = ble_next_send(comm, &len);
+  if (buff) {
+    att_server_notify(server->con_handle, server->value_handle, buff, len);
     att_server_request_can_send_now_event(server->con_handle);
   } else {
     comm->auto_send = false;
@@ -187,9 +201,10 @@ static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
       // printf("- LE Connection 0x%04x: connected - interval %u.%02u ms, latency %u\n", con_handle,
       //        con_interval * 125 / 100, 25 * (con_interval & 3),
       //        hci_subevent_le_connection_complete_get_conn_interval(packet));
-      // printf("- LE Connection 0x%04x: request for interval change\n");
-      // gap_request_connection_parameter_update(con_handle, 12, 12, 4, 0x0048); // 15 ms
-      gap_request_connection_parameter_update(con_handle, 8, 8, 4, 0x0048); // 10 ms
+      // the connection parameters are set by the central, as per the activity
+      (void)con_handle;
+      ble_server.comm.link.interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+      ble_server.comm.link.latency = hci_subevent_le_connection_complete_get_conn_latency(packet);
       break;
     case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
       con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
@@ -197,10 +212,18 @@ static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
       // printf("- LE Connection 0x%04x: connected - interval %u.%02u ms, latency %u\n", con_handle,
       //        con_interval * 125 / 100, 25 * (con_interval & 3),
       //        hci_subevent_le_connection_update_complete_get_conn_interval(packet));
+      (void)con_handle;
+      ble_server.comm.link.interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+      ble_server.comm.link.latency = hci_subevent_le_connection_update_complete_get_conn_latency(packet);
       break;
     default:
       break;
     }
+    break;
+  case GAP_EVENT_RSSI_MEASUREMENT:
+    if (gap_event_rssi_measurement_get_con_handle(packet) == ble_server.con_handle)
+      ble_server.comm.link.rssi = (int8_t)gap_event_rssi_measurement_get_rssi(packet);
+    break;
   default:
     break;
   }
@@ -10,6 +10,7 @@
 #define ENABLE_LOG_INFO
 #define ENABLE_LOG_ERROR
 #define ENABLE_PRINTF_HEXDUMP
+#define ENABLE_LE_DATA_LENGTH_EXTENSION
 
 // for the client
 #if RUNNING_AS_CLIENT
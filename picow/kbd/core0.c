@@ -5,15 +5,19 @@
 
 #include "btstack.h"
 #include "pico/cyw43_arch.h"
+#include "pico/multicore.h"
 #include "pico/stdlib.h"
 
 #include "data_model.h"
 #include "hw_model.h"
 
 #include "ble_comm.h"
+#include "fw_flash.h"
+#include "util/key_event.h"
 #include "util/shared_buffer.h"
 
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+#include "util/key_debounce.h"
 #include "util/key_scan.h"
 #endif
 
@@ -103,34 +107,218 @@ typedef enum {
   comm_data_type_task_request,
   comm_data_type_task_response,
   comm_data_type_task_id,
+  comm_data_type_key_events, // count + sent time + key events, in order
+  comm_data_type_comm_state,
+  comm_data_type_bulk_begin, // see util/bulk_transfer.h
+  comm_data_type_bulk_chunk,
+  comm_data_type_bulk_ack,
+  comm_data_type_clock_ping, // see util/clock_sync.h
+  comm_data_type_clock_pong,
+  comm_data_type_fw_relay_status, // see util/fw_relay.h
+  comm_data_type_fw_relay_commit, // no body
 } comm_data_type_t;
 
+// key_press record: mask of the rows present, then those rows
+// in full, the rows not present are 0, else they are unchanged since the previous one
+#define COMM_KEY_PRESS_FULL 0x80
+#define COMM_KEY_PRESS_SIZE_MAX (2 + hw_row_count)
+
+// tb_motion record: flags, then dx and dy as zigzag varints
+#define COMM_TB_HAS_MOTION 0x01
+#define COMM_TB_ON_SURFACE 0x02
+#define COMM_VARINT_SIZE_MAX 3 // for 16 bits
+
+// key_events record: count, time sent (low 32 bits of the node time), then the events aged as of then
+#define COMM_KEY_EVENTS_HEAD_SIZE 5
+
+// clock ping record: t1 (low 32 bits of the AP time)
+// clock pong record: t1 echoed, t3 - t2 (held by the node), t3 (node time)
+// the ping goes only right after a frame is received, as the pong does, so that both wait alike for
+// the next connection event, else the way there is shorter than the way back and the offset is off
+#define COMM_CLOCK_PING_SIZE 4
+#define COMM_CLOCK_PONG_SIZE 16
+#define COMM_CLOCK_PING_AFTER_US 1000
+
+// what was sent last, so that a record is sent only when changed, or on refresh
+typedef struct {
+  uint32_t refresh_ms; // when all the records were sent last
+  bool refresh;        // send all the records in this frame
+  uint8_t comm_state;
+  uint8_t task_id;  // acknowledged
+  uint64_t state_ts; // of the system state
+  uint64_t task_ts;  // of the task request/response
+} comm_sent_t;
+
+static bool begin_comm_frame(comm_sent_t *sent, kbd_comm_state_t comm_state) {
+  // refresh all, periodically and when the comm state changes
+  uint32_t ms = board_millis();
+  sent->refresh = comm_state != sent->comm_state || ms - sent->refresh_ms >= KBD_COMM_REFRESH_MS;
+  if (sent->refresh) {
+    sent->refresh_ms = ms;
+    sent->comm_state = comm_state;
+  }
+  return sent->refresh;
+}
+
+#ifdef KBD_NODE_RIGHT
+
+static uint8_t write_varint16(uint8_t *buff, int16_t v) {
+  // zigzag, so that small deltas either way take a byte
+  uint16_t z = ((uint16_t)v << 1) ^ (uint16_t)(v >> 15);
+  uint8_t n = 0;
+  while (z >= 0x80) {
+    buff[n++] = (z & 0x7F) | 0x80;
+    z >>= 7;
+  }
+  buff[n++] = (uint8_t)z;
+  return n;
+}
+
+#endif
+
 #ifdef KBD_NODE_AP
 
+static uint8_t read_varint16(const uint8_t *buff, uint8_t len, int16_t *v) {
+  // returns the bytes read, 0 if invalid
+  uint16_t z = 0;
+  uint8_t n = 0;
+  do {
+    if (n >= len || n >= COMM_VARINT_SIZE_MAX)
+      return 0;
+    z |= (uint16_t)(buff[n] & 0x7F) << (7 * n);
+  } while (buff[n++] & 0x80);
+  *v = (int16_t)((z >> 1) ^ -(z & 1));
+  return n;
+}
+
 static uint8_t comm_ack_req_id[2] = {0, 0}; // last request acknowledged
 static uint8_t comm_rcv_res_id[2] = {0, 0}; // last response received
 
+static uint8_t comm_key_press[2][hw_row_count]; // key_press as per events and snapshots
+
+static void wake_core1_inputs() {
+  // skip if fifo is full, core1 has wake up calls pending anyway
+  if (multicore_fifo_wready())
+    multicore_fifo_push_blocking(KBD_CORE1_WAKE_INPUTS);
+}
+
+static uint32_t comm_key_latency_us[2]; // scan to receive, smoothed
+
+static uint64_t key_events_sent_ts(uint8_t index, const uint8_t *buff, uint64_t now) {
+  // when the node sent them, in AP time, so that the events are aged from there rather than from now,
+  // leaving out the transport delay; as received, till the clock is synced
+  clock_sync_t *cs = kbd_system.clock_sync + index;
+  if (!cs->synced)
+    return now;
+  uint32_t sent_low;
+  memcpy(&sent_low, buff, 4);
+  uint64_t node_now = clock_sync_to_remote(cs, now);
+  uint64_t ts = clock_sync_to_local(cs, node_now - (uint32_t)((uint32_t)node_now - sent_low));
+  return ts < now ? ts : now;
+}
+
+static uint8_t consume_key_events(uint8_t index, uint8_t *buff, uint8_t len) {
+  // buff: count, sent, events
+  uint8_t n = buff[0];
+  key_event_t events[BLE_DATA_SIZE / KEY_EVENT_WIRE_SIZE];
+  if (len < COMM_KEY_EVENTS_HEAD_SIZE + n * KEY_EVENT_WIRE_SIZE || n > BLE_DATA_SIZE / KEY_EVENT_WIRE_SIZE)
+    return len; // invalid, consume all
+  uint64_t now = time_us_64();
+  uint64_t sent_ts = key_events_sent_ts(index, buff + 1, now);
+  uint8_t *kp = comm_key_press[index];
+  for (uint8_t i = 0; i < n; i++) {
+    key_event_t *e = events + i;
+    read_key_event_wire(buff + COMM_KEY_EVENTS_HEAD_SIZE + i * KEY_EVENT_WIRE_SIZE, e, sent_ts);
+    comm_key_latency_us[index] = (7 * comm_key_latency_us[index] + (uint32_t)(now - e->ts)) / 8;
+    e->key = (e->key & ~KEY_EVENT_RIGHT) | (index ? KEY_EVENT_RIGHT : 0);
+    uint8_t row = KEY_EVENT_ROW(e->key);
+    uint8_t mask = 1 << (hw_col_count - 1 - KEY_EVENT_COL(e->key));
+    if (row >= hw_row_count)
+      continue;
+    if (e->key & KEY_EVENT_PRESS)
+      kp[row] |= mask;
+    else
+      kp[row] &= ~mask;
+  }
+  // the events before the key_press, so that core1 never sees the key_press ahead of its events,
+  // which it would resync with as of now, losing the scan times
+  for (uint8_t i = 0; i < n; i++)
+    push_key_event(kbd_system.key_events, events[i].ts, events[i].key);
+  write_shared_buffer(index == 0 ? kbd_system.sb_left_key_press : kbd_system.sb_right_key_press, now, kp);
+  return COMM_KEY_EVENTS_HEAD_SIZE + n * KEY_EVENT_WIRE_SIZE;
+}
+
+static uint8_t consume_clock_pong(uint8_t index, const uint8_t *buff, uint8_t len) {
+  // buff: t1 (low 32 bits), t3 - t2, t3
+  if (len < COMM_CLOCK_PONG_SIZE)
+    return len; // invalid, consume all
+  uint64_t t4 = time_us_64();
+  uint32_t t1_low, hold;
+  uint64_t t3;
+  memcpy(&t1_low, buff, 4);
+  memcpy(&hold, buff + 4, 4);
+  memcpy(&t3, buff + 8, 8);
+  uint64_t t1 = t4 - (uint32_t)((uint32_t)t4 - t1_low);
+  clock_sync_add(kbd_system.clock_sync + index, t1, t3 - hold, t3, t4);
+  return COMM_CLOCK_PONG_SIZE;
+}
+
+static uint8_t consume_key_press(uint8_t index, uint8_t *buff, uint8_t len) {
+  // buff: mask, rows
+  uint8_t mask = buff[0];
+  uint8_t n = 0;
+  for (uint8_t row = 0; row < hw_row_count; row++)
+    if (mask & (1 << row))
+      n++;
+  if (len < 1 + n)
+    return len; // invalid, consume all
+  uint8_t *kp = comm_key_press[index];
+  const uint8_t *rows = buff + 1;
+  for (uint8_t row = 0; row < hw_row_count; row++)
+    if (mask & (1 << row))
+      kp[row] = *rows++;
+    else if (mask & COMM_KEY_PRESS_FULL)
+      kp[row] = 0;
+  write_shared_buffer(index == 0 ? kbd_system.sb_left_key_press : kbd_system.sb_right_key_press, time_us_64(), kp);
+  return 1 + n;
+}
+
+static uint8_t consume_tb_motion(uint8_t *buff, uint8_t len) {
+  // buff: flags, dx, dy
+  kbd_tb_motion_t tbm;
+  uint8_t n = 1, k;
+  tbm.has_motion = (buff[0] & COMM_TB_HAS_MOTION) ? 1 : 0;
+  tbm.on_surface = (buff[0] & COMM_TB_ON_SURFACE) ? 1 : 0;
+  if (!(k = read_varint16(buff + n, len - n, &tbm.dx)))
+    return len; // invalid, consume all
+  n += k;
+  if (!(k = read_varint16(buff + n, len - n, &tbm.dy)))
+    return len;
+  n += k;
+  push_spsc_queue(kbd_system.tb_motion_queue, &tbm); // counted as overflow if full
+  return n;
+}
+
+static uint64_t comm_received_us[2]; // last frame
+
 static void comm_consume(uint8_t comm_id, uint8_t *buff, uint8_t len) {
   uint8_t index = comm_id == BLE_COMM_LEFT_ID ? 0 : 1;
   volatile kbd_comm_state_t *comm_state = kbd_system.comm_state + index;
-  if (len < 1)
-    return;
-  update_comm_state(comm_state, (kbd_comm_state_t)buff[0]);
-  len--;
-  buff++;
-  // check if ready for data
-  if (*comm_state != kbd_comm_state_data)
-    return;
-  // read: key_press, tb_motion, task_response
+  comm_received_us[index] = time_us_64();
+  // read: comm_state, then if ready for data: key_events, key_press, tb_motion, task_response
+  bool has_inputs = false;
   while (len > 0) {
+    if (buff[0] == comm_data_type_comm_state && len > 1) {
+      update_comm_state(comm_state, (kbd_comm_state_t)buff[1]);
+      len -= 2;
+      buff += 2;
+      continue;
+    }
+    // check if ready for data
+    if (*comm_state != kbd_comm_state_data)
+      break;
     shared_buffer_t *sb = NULL;
     switch (buff[0]) {
-    case comm_data_type_key_press:
-      sb = index == 0 ? kbd_system.sb_left_key_press : kbd_system.sb_right_key_press;
-      break;
-    case comm_data_type_tb_motion:
-      sb = kbd_system.sb_tb_motion;
-      break;
     case comm_data_type_task_response:
       sb = index == 0 ? kbd_system.sb_left_task_response : kbd_system.sb_right_task_response;
       comm_rcv_res_id[index] = buff[1];
@@ -147,45 +335,148 @@ static void comm_consume(uint8_t comm_id, uint8_t *buff, uint8_t len) {
     } else if (buff[0] == comm_data_type_task_id) {
       len -= 2;
       buff += 2;
+    } else if (buff[0] == comm_data_type_key_press && len > 1) {
+      uint8_t n = 1 + consume_key_press(index, buff + 1, len - 1);
+      len -= n;
+      buff += n;
+    } else if (buff[0] == comm_data_type_tb_motion && len > 1) {
+      uint8_t n = 1 + consume_tb_motion(buff + 1, len - 1);
+      len -= n;
+      buff += n;
+      has_inputs = true;
+    } else if (buff[0] == comm_data_type_key_events && len > 1) {
+      uint8_t n = 1 + consume_key_events(index, buff + 1, len - 1);
+      len -= n;
+      buff += n;
+      has_inputs = true;
+    } else if (buff[0] == comm_data_type_bulk_ack && len > 1) {
+      uint8_t n = bulk_sender_read_ack(kbd_system.bulk_tx + index, buff + 1, len - 1, board_millis());
+      len = n ? len - 1 - n : 0;
+      buff += 1 + n;
+    } else if (buff[0] == comm_data_type_clock_pong && len > 1) {
+      uint8_t n = 1 + consume_clock_pong(index, buff + 1, len - 1);
+      len -= n;
+      buff += n;
+    } else if (buff[0] == comm_data_type_fw_relay_status && len > 1) {
+      uint8_t n = fw_relay_sender_read_status(kbd_system.fw_relay + index, buff + 1, len - 1, board_millis());
+      len = n ? len - 1 - n : 0;
+      buff += 1 + n;
     } else {
       len = 0; // stop if encountered invalid
     }
   }
+  // process right away, rather than wait for the next process cycle
+  if (has_inputs) {
+    ble_note_activity(comm_id); // keep the link fast
+    wake_core1_inputs();
+  }
+}
+
+static comm_sent_t comm_sent[2];
+static uint32_t clock_ping_ms[2]; // sent last
+
+static void ble_peer_cache_changed() {
+  kbd_system.ble_peer_cache_changed = true; // saved by core1
+}
+
+static uint8_t bulk_probe[KBD_BULK_PROBE_SIZE];
+
+static void start_bulk_probe(bulk_sender_t *tx) {
+  // to left, back to back while on the scan screen, to measure the throughput, unless relaying a firmware
+  if (kbd_system.screen != kbd_info_screen_scan || bulk_sender_busy(tx) || fw_relay_sender_active(kbd_system.fw_relay))
+    return;
+  if (bulk_probe[1] == 0) // not yet filled
+    for (uint16_t i = 0; i < KBD_BULK_PROBE_SIZE; i++)
+      bulk_probe[i] = i * 31 + 7;
+  bulk_sender_start(tx, bulk_probe, KBD_BULK_PROBE_SIZE, board_millis());
 }
 
 static uint8_t comm_produce(uint8_t comm_id, uint8_t *buff) {
   uint8_t index = comm_id == BLE_COMM_LEFT_ID ? 0 : 1;
   kbd_comm_state_t comm_state = kbd_system.comm_state[index];
+  comm_sent_t *sent = comm_sent + index;
   uint8_t len = 0;
   // while in reset mode, nothing to send
   if (comm_state == kbd_comm_state_reset)
     return 0;
-  // pack the state as the first byte
-  buff[0] = comm_state;
-  len++;
-  buff++;
+  // the node may have restarted, sync its clock afresh
+  clock_sync_t *cs = kbd_system.clock_sync + index;
+  if (comm_state != kbd_comm_state_data && cs->count > 0) {
+    clock_sync_init(cs);
+    comm_key_latency_us[index] = 0;
+  }
+  // records only when changed, else all on refresh
+  bool refresh = begin_comm_frame(sent, comm_state);
+  if (refresh) {
+    buff[0] = comm_data_type_comm_state;
+    buff[1] = comm_state;
+    len += 2;
+    buff += 2;
+  }
   // append data if in data mode
   if (comm_state == kbd_comm_state_data) {
     // add system state
-    static uint64_t state_ts = 0;
-    buff[0] = comm_data_type_system_state;
+    uint64_t state_ts;
     read_shared_buffer(kbd_system.sb_state, &state_ts, buff + 1);
-    len += (1 + kbd_system.sb_state->size);
-    buff += (1 + kbd_system.sb_state->size);
+    if (refresh || state_ts > sent->state_ts) {
+      sent->state_ts = state_ts;
+      buff[0] = comm_data_type_system_state;
+      len += (1 + kbd_system.sb_state->size);
+      buff += (1 + kbd_system.sb_state->size);
+    }
     // add request unless acknowledged
-    static uint64_t req_ts[2] = {0, 0};
+    uint64_t req_ts;
     shared_buffer_t *sb = index == 0 ? kbd_system.sb_left_task_request : kbd_system.sb_right_task_request;
-    read_shared_buffer(sb, req_ts + index, buff + 1);
-    if (buff[1] != comm_ack_req_id[index]) {
+    read_shared_buffer(sb, &req_ts, buff + 1);
+    if (buff[1] != comm_ack_req_id[index] && (refresh || req_ts > sent->task_ts)) {
+      sent->task_ts = req_ts;
       buff[0] = comm_data_type_task_request;
       len += (1 + sb->size);
       buff += (1 + sb->size);
     }
     // acknowledge resposne received
-    buff[0] = comm_data_type_task_id;
-    buff[1] = comm_rcv_res_id[index];
-    len += 2;
-    buff += 2;
+    if (refresh || comm_rcv_res_id[index] != sent->task_id) {
+      sent->task_id = comm_rcv_res_id[index];
+      buff[0] = comm_data_type_task_id;
+      buff[1] = comm_rcv_res_id[index];
+      len += 2;
+      buff += 2;
+    }
+    // ping for clock sync, stamped as late as possible, just before the bulk data
+    uint32_t ping_ms = cs->count < CLOCK_SYNC_SAMPLES ? KBD_CLOCK_SYNC_FAST_MS : KBD_CLOCK_SYNC_MS;
+    uint64_t now = time_us_64();
+    if (board_millis() - clock_ping_ms[index] >= ping_ms && now - comm_received_us[index] < COMM_CLOCK_PING_AFTER_US &&
+        len + 1 + COMM_CLOCK_PING_SIZE <= BLE_PAYLOAD_SIZE) {
+      clock_ping_ms[index] = board_millis();
+      uint32_t t1 = now;
+      buff[0] = comm_data_type_clock_ping;
+      memcpy(buff + 1, &t1, 4);
+      len += (1 + COMM_CLOCK_PING_SIZE);
+      buff += (1 + COMM_CLOCK_PING_SIZE);
+    }
+    // commit the firmware relayed, once verified by the node, and by the other if relayed too
+    fw_relay_sender_t *rs = kbd_system.fw_relay + index;
+    if (fw_relay_sender_commit_due(rs, kbd_system.fw_relay, 2) && len + 1 <= BLE_PAYLOAD_SIZE) {
+      rs->state = fw_relay_state_COMMITTED;
+      buff[0] = comm_data_type_fw_relay_commit;
+      len += 1;
+      buff += 1;
+    }
+    // add bulk data in the room left, but never in the last free frame of the window,
+    // that is kept for the records above, so that they are not delayed behind the bulk
+    bulk_sender_t *tx = kbd_system.bulk_tx + index;
+    fw_relay_sender_task(rs, tx, board_millis());
+    if (index == 0)
+      start_bulk_probe(tx);
+    if (ble_frames_in_flight(ble_find_comm_by_id(comm_id)) < BLE_WINDOW_SIZE - 1) {
+      bool is_begin;
+      uint8_t n = bulk_sender_write(tx, buff + 1, BLE_PAYLOAD_SIZE - len - 1, &is_begin, board_millis());
+      if (n > 0) {
+        buff[0] = is_begin ? comm_data_type_bulk_begin : comm_data_type_bulk_chunk;
+        len += (1 + n);
+        buff += (1 + n);
+      }
+    }
   }
 
   return len;
@@ -193,28 +484,70 @@ static uint8_t comm_produce(uint8_t comm_id, uint8_t *buff) {
 
 #else
 
-static void key_scan_task() {
-  // scan key presses with kbd_hw.ks and save to core0.key_press
-  key_scan_update(kbd_hw.ks);
-  memcpy(kbd_system.core0.key_press, kbd_hw.ks->keys, hw_row_count);
+static bool key_scan_task() {
+  key_debounce_t *kd = kbd_system.core0.kd;
+  // config is updated by core1 via config screen
+  if (kbd_system.debounce_config_changed) {
+    kbd_system.debounce_config_changed = false;
+    key_debounce_set_config(kd, &kbd_system.core1.debounce_config);
+  }
+  // events are of use only while connected, else AP gets resynced by the snapshot,
+  // queued from ready on, so that a tap during the handshake is sent once in data,
+  // else dropped, as of a connection before (core0 is both ends of the queue on left/right)
+  kbd_comm_state_t comm_state = *kbd_system.comm_state;
+  bool connected = comm_state == kbd_comm_state_data || comm_state == kbd_comm_state_ready;
+  if (!connected)
+    clear_key_event_queue(kbd_system.key_events);
+  // each matrix frame scanned by pio into kbd_hw.ks since the last poll, at the scan rate,
+  // debounce it and save to core0.key_press, queue the changes as key events
+  bool changed = false;
+  while (key_scan_next(kbd_hw.ks)) {
+    if (!key_debounce_update(kd, kbd_hw.ks->keys, kbd_hw.ks->ts))
+      continue;
+    if (connected)
+      push_key_events_diff(kbd_system.key_events, kbd_hw.ks->ts, kbd_system.core0.key_press, kd->keys, hw_row_count,
+                           hw_col_count);
+    memcpy(kbd_system.core0.key_press, kd->keys, hw_row_count);
+    changed = true;
+  }
+  if (changed)
+    return true;
+  // active while any key is pressed or bouncing, to catch its release in time
+  for (uint8_t row = 0; row < hw_row_count; row++)
+    if (kbd_hw.ks->keys[row] | kd->keys[row])
+      return true;
+  return false;
 }
 
 static uint8_t comm_rcv_req_id = 0; // last request received
 static uint8_t comm_ack_res_id = 0; // last response acknowledged
 
+// clock sync ping received, to pong back
+static bool clock_pong_due = false;
+static uint32_t clock_ping_t1; // AP time, low 32 bits
+static uint64_t clock_ping_t2; // when received
+
 static void comm_consume(uint8_t comm_id, uint8_t *buff, uint8_t len) {
   (void)comm_id;
   volatile kbd_comm_state_t *comm_state = kbd_system.comm_state;
-  if (len < 1)
-    return;
-  update_comm_state(comm_state, (kbd_comm_state_t)buff[0]);
-  len--;
-  buff++;
-  // check if ready for data
-  if (*comm_state != kbd_comm_state_data)
-    return;
-  // read: system_state, task_request
+  // read: comm_state, then if ready for data: system_state, task_request
   while (len > 0) {
+    if (buff[0] == comm_data_type_comm_state && len > 1) {
+      kbd_comm_state_t was = *comm_state;
+      update_comm_state(comm_state, (kbd_comm_state_t)buff[1]);
+      if (was == kbd_comm_state_init && *comm_state != was) {
+        // a new session, the AP may have restarted, its bulk ids from the first again
+        bulk_receiver_t *rx = &kbd_system.bulk_rx;
+        bulk_receiver_init(rx, rx->data, rx->capacity);
+        kbd_system.fw_relay.piece_seen = false;
+      }
+      len -= 2;
+      buff += 2;
+      continue;
+    }
+    // check if ready for data
+    if (*comm_state != kbd_comm_state_data)
+      break;
     shared_buffer_t *sb = NULL;
     switch (buff[0]) {
     case comm_data_type_system_state:
@@ -236,12 +569,48 @@ static void comm_consume(uint8_t comm_id, uint8_t *buff, uint8_t len) {
     } else if (buff[0] == comm_data_type_task_id) {
       len -= 2;
       buff += 2;
+    } else if ((buff[0] == comm_data_type_bulk_begin || buff[0] == comm_data_type_bulk_chunk) && len > 1) {
+      bulk_receiver_t *rx = &kbd_system.bulk_rx;
+      uint8_t n = buff[0] == comm_data_type_bulk_begin
+                      ? bulk_receiver_read_begin(rx, buff + 1, len - 1, board_millis())
+                      : bulk_receiver_read_chunk(rx, buff + 1, len - 1, board_millis());
+      len = n ? len - 1 - n : 0;
+      buff += 1 + n;
+    } else if (buff[0] == comm_data_type_clock_ping && len > COMM_CLOCK_PING_SIZE) {
+      clock_ping_t2 = time_us_64();
+      memcpy(&clock_ping_t1, buff + 1, 4);
+      clock_pong_due = true;
+      len -= (1 + COMM_CLOCK_PING_SIZE);
+      buff += (1 + COMM_CLOCK_PING_SIZE);
+    } else if (buff[0] == comm_data_type_fw_relay_commit) {
+      fw_relay_receiver_commit(&kbd_system.fw_relay); // rebooted into, on the next poll
+      len -= 1;
+      buff += 1;
     } else {
       len = 0; // stop if encountered invalid
     }
   }
 }
 
+static uint8_t write_key_press(uint8_t *buff, const uint8_t *key_press, uint8_t *key_press_sent, bool full) {
+  // buff: mask, rows; in full the rows with any key pressed, else the rows changed
+  // returns the bytes written, 0 if nothing to send
+  uint8_t mask = full ? COMM_KEY_PRESS_FULL : 0;
+  uint8_t n = 1;
+  for (uint8_t row = 0; row < hw_row_count; row++)
+    if (full ? key_press[row] != 0 : key_press[row] != key_press_sent[row]) {
+      mask |= 1 << row;
+      buff[n++] = key_press[row];
+    }
+  if (mask == 0)
+    return 0;
+  buff[0] = mask;
+  memcpy(key_press_sent, key_press, hw_row_count);
+  return n;
+}
+
+static comm_sent_t comm_sent;
+
 static uint8_t comm_produce(uint8_t comm_id, uint8_t *buff) {
   (void)comm_id;
   kbd_comm_state_t comm_state = *kbd_system.comm_state;
@@ -249,40 +618,113 @@ static uint8_t comm_produce(uint8_t comm_id, uint8_t *buff) {
   // while in reset mode, nothing to send
   if (comm_state == kbd_comm_state_reset)
     return 0;
-  // pack the state as the first byte
-  buff[0] = comm_state;
-  len++;
-  buff++;
+  // records only when changed, else all on refresh
+  bool refresh = begin_comm_frame(&comm_sent, comm_state);
+  if (refresh) {
+    buff[0] = comm_data_type_comm_state;
+    buff[1] = comm_state;
+    len += 2;
+    buff += 2;
+  }
   // append data if in data mode
   if (comm_state == kbd_comm_state_data) {
-    // add key_press
-    buff[0] = comm_data_type_key_press;
-    memcpy(buff + 1, kbd_system.core0.key_press, hw_row_count);
-    len += (1 + hw_row_count);
-    buff += (1 + hw_row_count);
 #ifdef KBD_NODE_RIGHT
-    // add tb_motion
-    static uint64_t tbm_ts = 0;
-    if (kbd_system.sb_tb_motion->ts > tbm_ts) {
+    // add tb_motion, all that is queued summed up
+    kbd_tb_motion_t tbm, m;
+    if (pop_spsc_queue(kbd_system.tb_motion_queue, &tbm)) {
+      while (pop_spsc_queue(kbd_system.tb_motion_queue, &m)) {
+        add_tb_motion(&tbm, &m);
+        tbm.on_surface = m.on_surface; // as per the latest
+      }
+      uint8_t n = 2;
       buff[0] = comm_data_type_tb_motion;
-      read_shared_buffer(kbd_system.sb_tb_motion, &tbm_ts, buff + 1);
-      len += (1 + kbd_system.sb_tb_motion->size);
-      buff += (1 + kbd_system.sb_tb_motion->size);
+      buff[1] = (tbm.has_motion ? COMM_TB_HAS_MOTION : 0) | (tbm.on_surface ? COMM_TB_ON_SURFACE : 0);
+      n += write_varint16(buff + n, tbm.dx);
+      n += write_varint16(buff + n, tbm.dy);
+      len += n;
+      buff += n;
     }
 #endif
     // add response unless acknowledged
-    static uint64_t res_ts = 0;
+    uint64_t res_ts;
     read_shared_buffer(kbd_system.sb_task_response, &res_ts, buff + 1);
-    if (buff[1] != comm_ack_res_id) {
+    if (buff[1] != comm_ack_res_id && (refresh || res_ts > comm_sent.task_ts)) {
+      comm_sent.task_ts = res_ts;
       buff[0] = comm_data_type_task_response;
       len += (1 + kbd_system.sb_task_response->size);
       buff += (1 + kbd_system.sb_task_response->size);
     }
     // acknowledge request received
-    buff[0] = comm_data_type_task_id;
-    buff[1] = comm_rcv_req_id;
-    len += 2;
-    buff += 2;
+    if (refresh || comm_rcv_req_id != comm_sent.task_id) {
+      comm_sent.task_id = comm_rcv_req_id;
+      buff[0] = comm_data_type_task_id;
+      buff[1] = comm_rcv_req_id;
+      len += 2;
+      buff += 2;
+    }
+    // acknowledge bulk data received, if there is room left for the key_press, else in the next frame
+    bulk_receiver_t *rx = &kbd_system.bulk_rx;
+    if ((rx->ack_due || (refresh && rx->state != bulk_state_IDLE)) &&
+        len + 1 + BULK_ACK_SIZE + COMM_KEY_PRESS_SIZE_MAX <= BLE_PAYLOAD_SIZE) {
+      buff[0] = comm_data_type_bulk_ack;
+      len += 1 + bulk_receiver_write_ack(rx, buff + 1);
+      buff += 1 + BULK_ACK_SIZE;
+    }
+    // tell how far the firmware relayed is read, as is the ack, so that AP sends on, or goes back
+    fw_relay_receiver_t *rr = &kbd_system.fw_relay;
+    if ((rr->status_due || (refresh && rx->state != bulk_state_IDLE)) &&
+        len + 1 + FW_RELAY_STATUS_SIZE + COMM_KEY_PRESS_SIZE_MAX <= BLE_PAYLOAD_SIZE) {
+      buff[0] = comm_data_type_fw_relay_status;
+      len += 1 + fw_relay_receiver_write_status(rr, buff + 1);
+      buff += 1 + FW_RELAY_STATUS_SIZE;
+    }
+    // add key events, as many as would fit, keeping room for the key_press
+    uint8_t room = BLE_PAYLOAD_SIZE - len - COMM_KEY_PRESS_SIZE_MAX;
+    uint8_t head = 1 + COMM_KEY_EVENTS_HEAD_SIZE;
+    uint8_t n = 0;
+    key_event_t e;
+    uint64_t now = time_us_64();
+    while (head + (n + 1) * KEY_EVENT_WIRE_SIZE <= room && pop_key_event(kbd_system.key_events, &e)) {
+      write_key_event_wire(buff + head + n * KEY_EVENT_WIRE_SIZE, &e, now);
+      n++;
+    }
+    if (n > 0) {
+      uint32_t sent = now;
+      buff[0] = comm_data_type_key_events;
+      buff[1] = n;
+      memcpy(buff + 2, &sent, 4);
+      len += (head + n * KEY_EVENT_WIRE_SIZE);
+      buff += (head + n * KEY_EVENT_WIRE_SIZE);
+    }
+    // pong the clock sync ping, after the key events, if there is room left for the key_press
+    if (clock_pong_due && len + 1 + COMM_CLOCK_PONG_SIZE + COMM_KEY_PRESS_SIZE_MAX <= BLE_PAYLOAD_SIZE) {
+      uint64_t t3 = time_us_64();
+      uint32_t hold = t3 - clock_ping_t2;
+      buff[0] = comm_data_type_clock_pong;
+      memcpy(buff + 1, &clock_ping_t1, 4);
+      memcpy(buff + 5, &hold, 4);
+      memcpy(buff + 9, &t3, 8);
+      clock_pong_due = false;
+      len += (1 + COMM_CLOCK_PONG_SIZE);
+      buff += (1 + COMM_CLOCK_PONG_SIZE);
+    }
+    // add key_press snapshot periodically, only once all the events are sent
+    // the rows changed since the last one, in full on refresh
+    static uint32_t snapshot_ms = 0;
+    static bool full_due = true;
+    static uint8_t key_press_sent[hw_row_count];
+    full_due = full_due || refresh;
+    if (key_event_count(kbd_system.key_events) == 0 &&
+        (full_due || board_millis() - snapshot_ms >= KBD_KEY_SNAPSHOT_MS)) {
+      snapshot_ms = board_millis();
+      n = write_key_press(buff + 1, kbd_system.core0.key_press, key_press_sent, full_due);
+      full_due = false;
+      if (n > 0) {
+        buff[0] = comm_data_type_key_press;
+        len += (1 + n);
+        buff += (1 + n);
+      }
+    }
   }
 
   return len;
@@ -321,6 +763,7 @@ static void stop_system() {
 
 static void wifi_task() {
   cyw43_arch_poll(); // do wifi tasks
+  tcp_server_task(&kbd_system.core0.tcp_server);
 
   // disable wifi after 10 minutes, which should enough for downloading firmware
   if (board_millis() > 600000) {
@@ -332,28 +775,114 @@ static void wifi_task() {
   }
 }
 
+static inline uint16_t cap16(uint32_t v) { return v > 0xFFFF ? 0xFFFF : v; }
+static inline uint8_t cap8(uint32_t v) { return v > 0xFF ? 0xFF : v; }
+
+static void publish_link_telemetry(void *param) {
+  (void)param;
+  kbd_link_telemetry_t telemetry[KBD_LINK_COUNT];
+  memset(telemetry, 0, sizeof(telemetry));
+  for (uint8_t i = 0; i < KBD_LINK_COUNT; i++) {
+#ifdef KBD_NODE_AP
+    ble_comm_t *comm = ble_find_comm_by_id(i == 0 ? BLE_COMM_LEFT_ID : BLE_COMM_RIGHT_ID);
+#else
+    ble_comm_t *comm = ble_find_comm_by_id(0); // comm_id ignored
+#endif
+    kbd_link_telemetry_t *t = telemetry + i;
+    t->rssi = BLE_RSSI_UNKNOWN;
+    if (comm->state != ble_state_DATA)
+      continue;
+    t->tx_fps = comm->tx_fps;
+    t->rx_fps = comm->rx_fps;
+    t->rtt_ms = comm->rtt_ms;
+    t->rtt_max_ms = comm->rtt_max_ms;
+#ifdef KBD_NODE_AP
+    t->key_latency_us = cap16(comm_key_latency_us[i]);
+#endif
+    t->retransmits = cap16(comm->retransmits);
+    t->duplicates = cap8(comm->recv_duplicates);
+    t->out_of_sync = cap8(comm->recv_out_of_sync);
+    t->rssi = comm->link.rssi;
+    t->interval = comm->link.interval > 0xFF ? 0xFF : comm->link.interval;
+  }
+  write_shared_buffer(kbd_system.sb_link_telemetry, time_us_64(), telemetry);
+}
+
+static btstack_timer_source_t bt_poll;
+static uint32_t bt_poll_ms = KBD_POLL_ACTIVE_MS;
+
+static void bt_poll_schedule(bool active) {
+  // fast while active, backing off exponentially while idle
+  bt_poll_ms = active ? KBD_POLL_ACTIVE_MS : MIN(2 * bt_poll_ms, KBD_POLL_IDLE_MAX_MS);
+  uint32_t ms = bt_poll_ms;
+  if (kbd_system.firmware_downloading)
+    ms = 1; // wifi is primary
+  else if (kbd_system.wifi && ms > KBD_POLL_WIFI_MS)
+    ms = KBD_POLL_WIFI_MS;
+  btstack_run_loop_set_timer(&bt_poll, ms);
+  btstack_run_loop_add_timer(&bt_poll);
+}
+
+static void bt_poll_now() {
+  // on a frame received or a key pressed, not to wait for the idle poll
+  bt_poll_ms = KBD_POLL_ACTIVE_MS;
+  btstack_run_loop_remove_timer(&bt_poll);
+  btstack_run_loop_set_timer(&bt_poll, 0);
+  btstack_run_loop_add_timer(&bt_poll);
+}
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+
+// wake up from an irq (key press) or the other core (tb motion), via the run loop
+static btstack_data_source_t bt_wake;
+static volatile bool bt_wake_pending = false;
+
+static void bt_wake_handler(btstack_data_source_t *ds, btstack_data_source_callback_type_t type) {
+  (void)ds;
+  (void)type;
+  if (bt_wake_pending) {
+    bt_wake_pending = false;
+    bt_poll_now();
+  }
+}
+
+static void bt_wake_from_irq() {
+  bt_wake_pending = true;
+  btstack_run_loop_poll_data_sources_from_irq();
+}
+
+#endif
+
 static void bt_poll_handler(struct btstack_timer_source *timer) {
+  (void)timer;
   if (kbd_system.firmware_downloading) {
-    btstack_run_loop_set_timer(timer, 1); // wifi is primary
-    btstack_run_loop_add_timer(timer);
+    bt_poll_schedule(true);
   } else {
     led_task();
 
+    static uint32_t telemetry_last_ms = 0;
+    do_if_elapsed(&telemetry_last_ms, BLE_TELEMETRY_MS, NULL, publish_link_telemetry);
+
 #ifdef KBD_NODE_AP
-    ble_process(BLE_COMM_LEFT_ID, comm_consume, comm_produce);
-    ble_process(BLE_COMM_RIGHT_ID, comm_consume, comm_produce);
+    bool active = ble_process(BLE_COMM_LEFT_ID, comm_consume, comm_produce);
+    active = ble_process(BLE_COMM_RIGHT_ID, comm_consume, comm_produce) || active;
 
-    btstack_run_loop_set_timer(timer, 5); // repeat after 5 ms
-    btstack_run_loop_add_timer(timer);
+    bt_poll_schedule(active);
 #else
-    key_scan_task();
-    ble_process(0, comm_consume, comm_produce); // comm_id ignored
+    bool active = key_scan_task();
+    active = ble_process(0, comm_consume, comm_produce) || active; // comm_id ignored
+
+    // the firmware relayed by AP, read on, a sector flashed at a time, BLE going on
+    active = fw_relay_receiver_task(&kbd_system.fw_relay, &kbd_system.bulk_rx) || active;
+    if (kbd_system.fw_relay.commit_due)
+      fw_flash_reboot();
 
     if (is_ap_long_lost()) {
       btstack_run_loop_trigger_exit();
     } else {
-      btstack_run_loop_set_timer(timer, 5); // repeat after 5 ms
-      btstack_run_loop_add_timer(timer);
+      if (!active)
+        key_scan_arm_wake(kbd_hw.ks, bt_wake_from_irq); // disarmed by the first key press
+      bt_poll_schedule(active);
     }
 #endif
   }
@@ -362,15 +891,20 @@ static void bt_poll_handler(struct btstack_timer_source *timer) {
     wifi_task();
 }
 
-static btstack_timer_source_t bt_poll;
-
 void core0_main() {
 #ifdef KBD_NODE_AP
   kbd_system.wifi = true;
   cyw43_arch_enable_ap_mode(hw_ap_name, hw_ap_password, CYW43_AUTH_WPA2_AES_PSK);
 
   tcp_server_open(&kbd_system.core0.tcp_server, KBD_NODE_NAME);
+
+  // reconnect the peers as cached, once loaded from flash by core1
+  while (!kbd_system.ble_peer_cache_loaded)
+    sleep_ms(1);
+  ble_set_peer_cache(&kbd_system.ble_peer_cache, ble_peer_cache_changed);
 #else
+  kbd_system.core0.kd = key_debounce_create(hw_row_count, hw_col_count, &kbd_system.core1.debounce_config);
+
   check_if_wifi_requested();
 
   if (kbd_system.wifi) {
@@ -385,6 +919,16 @@ void core0_main() {
   }
 #endif
 
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+  btstack_run_loop_set_data_source_handler(&bt_wake, &bt_wake_handler);
+  btstack_run_loop_enable_data_source_callbacks(&bt_wake, DATA_SOURCE_CALLBACK_POLL);
+  btstack_run_loop_add_data_source(&bt_wake);
+#endif
+#ifdef KBD_NODE_RIGHT
+  kbd_system.core0_wake = bt_wake_from_irq;
+#endif
+
+  ble_set_wake(bt_poll_now);
   ble_init();
 
   bt_poll.process = &bt_poll_handler;
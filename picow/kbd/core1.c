@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "pico/multicore.h"
 #include "pico/stdlib.h"
 
 #include "data_model.h"
@@ -98,40 +99,37 @@ void lcd_display_head_task(void *param) {
 
 #ifdef KBD_NODE_RIGHT
 
-static inline int16_t add_cap16_value(int16_t v1, int16_t v2) {
-  int32_t v = v1;
-  v += v2;
-  // cap the value to 16 bits
-  return (v > 0x7fff) ? 0x7fff : (-v > 0x7fff) ? -0x7fff : v;
+void tb_scan_task_publish(kbd_tb_motion_t *ds) {
+  // push out the accumulated motion deltas to comm and clear out
+  // if the queue is full, keep on accumulating, to not lose any
+  static uint8_t on_surface = false; // as published
+  if (!ds->has_motion && ds->on_surface == on_surface)
+    return; // nothing new
+  if (!push_spsc_queue(kbd_system.tb_motion_queue, ds))
+    return;
+  on_surface = ds->on_surface;
+  if (kbd_system.core0_wake)
+    kbd_system.core0_wake(); // comm may be idle polling
+
+  ds->has_motion = false;
+  ds->on_surface = false;
+  ds->dx = 0;
+  ds->dy = 0;
 }
 
-void tb_scan_task_capture(void *param) {
-  // sacn the track ball motion and accumulate
+void tb_scan_task(void *param) {
+  // sacn the track ball motion and accumulate, publish at the same rate
   kbd_tb_motion_t *ds = (kbd_tb_motion_t *)param;
 
-  bool has_motion = false;
   bool on_surface = false;
   int16_t dx = 0;
   int16_t dy = 0;
+  bool has_motion = tb_check_motion(kbd_hw.tb, &on_surface, &dx, &dy);
 
-  has_motion = tb_check_motion(kbd_hw.tb, &on_surface, &dx, &dy);
+  kbd_tb_motion_t m = {.dx = dx, .dy = dy, .has_motion = has_motion, .on_surface = on_surface};
+  add_tb_motion(ds, &m);
 
-  ds->has_motion = ds->has_motion || has_motion;
-  ds->on_surface = ds->on_surface || on_surface;
-  ds->dx = add_cap16_value(ds->dx, dx);
-  ds->dy = add_cap16_value(ds->dy, dy);
-}
-
-void tb_scan_task_publish(void *param) {
-  // push out the accumulated motion deltas to shared buffer and clear out
-  kbd_tb_motion_t *ds = (kbd_tb_motion_t *)param;
-
-  write_shared_buffer(kbd_system.sb_tb_motion, time_us_64(), ds);
-
-  ds->has_motion = false;
-  ds->on_surface = false;
-  ds->dx = 0;
-  ds->dy = 0;
+  tb_scan_task_publish(ds);
 }
 
 #endif
@@ -172,11 +170,70 @@ kbd_event_t process_basic_event(kbd_event_t event) {
   }
 }
 
+static key_event_t pending_key_events[KBD_KEY_EVENT_QUEUE_SIZE]; // ordered by ts
+static uint8_t pending_key_event_count = 0;
+
+static void read_key_press() {
+  kbd_system_core1_t *c = &kbd_system.core1;
+
+  // collect the new key events, ordered by scan time across left/right
+  key_event_t *pe = pending_key_events;
+  key_event_t e;
+  while (pending_key_event_count < KBD_KEY_EVENT_QUEUE_SIZE && pop_key_event(kbd_system.key_events, &e)) {
+    uint8_t i = pending_key_event_count++;
+    for (; i > 0 && pe[i - 1].ts > e.ts; i--)
+      pe[i] = pe[i - 1];
+    pe[i] = e;
+  }
+
+  // apply the events in order, the layer engine holds back the release of a key pressed in
+  // the same pass, so that even the shortest tap gets processed
+  bool active[2] = {false, false}; // side had events in this cycle
+  uint8_t i;
+  for (i = 0; i < pending_key_event_count; i++) {
+    uint8_t key = pe[i].key;
+    uint8_t side = (key & KEY_EVENT_RIGHT) ? 1 : 0;
+    uint8_t row = KEY_EVENT_ROW(key);
+    uint8_t mask = 1 << (hw_col_count - 1 - KEY_EVENT_COL(key));
+    uint8_t *kp = side ? c->right_key_press : c->left_key_press;
+    if (row >= hw_row_count)
+      continue; // invalid
+    // to the layer engine, with the event time for tap-hold and combos, the rest once it has room
+    if (!push_input_key_event(key, pe[i].ts))
+      break;
+    active[side] = true;
+    if (key & KEY_EVENT_PRESS)
+      kp[row] |= mask;
+    else
+      kp[row] &= ~mask;
+  }
+  pending_key_event_count -= i;
+  memmove(pe, pe + i, pending_key_event_count * sizeof(key_event_t));
+
+  // resync with the key_press as per comm (in case of lost events), only on a quiet side
+  for (i = 0; i < pending_key_event_count; i++)
+    active[(pe[i].key & KEY_EVENT_RIGHT) ? 1 : 0] = true;
+  // core0 pushes the events before the key_press, if any are queued since, they come first
+  uint64_t ts;
+  uint8_t kp[2][hw_row_count];
+  if (!active[0])
+    read_shared_buffer(kbd_system.sb_left_key_press, &ts, kp[0]);
+  if (!active[1])
+    read_shared_buffer(kbd_system.sb_right_key_press, &ts, kp[1]);
+  if (spsc_queue_count(kbd_system.key_events) > 0)
+    return;
+  if (!active[0])
+    memcpy(c->left_key_press, kp[0], hw_row_count);
+  if (!active[1])
+    memcpy(c->right_key_press, kp[1], hw_row_count);
+}
+
 /*
  * Processing:
- * sb_left_key_press      -->  sb_state
+ * key_events             -->  sb_state
+ * sb_left_key_press
  * sb_right_key_press          sb_left_task_request
- * sb_tb_motion                sb_right_task_request
+ * tb_motion_queue             sb_right_task_request
  * sb_left_task_response       task_request
  * sb_right_task_response      hid_report_out
  * task_response
@@ -207,15 +264,22 @@ void process_inputs(void *param) {
     read_shared_buffer(sb, &c->right_task_response_ts, c->right_task_response);
 
   // read the key_press
-  uint64_t ts;
-  read_shared_buffer(kbd_system.sb_left_key_press, &ts, c->left_key_press);
-  read_shared_buffer(kbd_system.sb_right_key_press, &ts, c->right_key_press);
-
-  // read tb_motion
-  sb = kbd_system.sb_tb_motion;
-  if (sb->ts > c->tb_motion_ts) {
-    read_shared_buffer(sb, &c->tb_motion_ts, &c->tb_motion);
-  } else {
+  read_key_press();
+
+  // read tb_motion, all that arrived since last time, summed up
+  kbd_tb_motion_t tbm;
+  bool has_tb_motion = false;
+  while (pop_spsc_queue(kbd_system.tb_motion_queue, &tbm)) {
+    if (!has_tb_motion) {
+      // on_surface as per the latest, deltas of all
+      c->tb_motion = (kbd_tb_motion_t){0};
+      has_tb_motion = true;
+    }
+    add_tb_motion(&c->tb_motion, &tbm);
+    c->tb_motion.on_surface = tbm.on_surface;
+    c->tb_motion_ts = time_us_64();
+  }
+  if (!has_tb_motion) {
     // discard the delta if already used
     c->tb_motion.dx = 0;
     c->tb_motion.dy = 0;
@@ -359,8 +423,39 @@ void validate_comm_state(uint8_t index) {
   }
 }
 
+#ifdef KBD_NODE_AP
+
+static void load_ble_peer_cache() {
+  // comm (core0) waits for it, and checks the version
+  flash_dataset_t *fd = kbd_system.core1.ble_peer_dataset;
+  flash_store_load(fd);
+  memcpy(&kbd_system.ble_peer_cache, fd->data, sizeof(ble_peer_cache_t));
+  kbd_system.ble_peer_cache_loaded = true;
+}
+
+static void save_ble_peer_cache() {
+  // as updated by comm (core0), on discovering a peer
+  if (!kbd_system.ble_peer_cache_changed)
+    return;
+  kbd_system.ble_peer_cache_changed = false;
+  flash_dataset_t *fd = kbd_system.core1.ble_peer_dataset;
+  memcpy(fd->data, &kbd_system.ble_peer_cache, sizeof(ble_peer_cache_t));
+  flash_store_save(fd);
+}
+
+#endif
+
 ////// MAIN
 
+static void __not_in_flash_func(hold_for_flash)() {
+  // core0 writes the flash (fw_flash.c), the XIP is off meanwhile, so wait in RAM, interrupts off
+  uint32_t irq = save_and_disable_interrupts();
+  kbd_system.core1_flash_hold = kbd_flash_hold_HELD;
+  while (kbd_system.core1_flash_hold == kbd_flash_hold_HELD)
+    tight_loop_contents();
+  restore_interrupts(irq);
+}
+
 static void set_led(volatile kbd_led_state_t *led, kbd_led_state_t value) {
   if (*led != value)
     *led = value;
@@ -369,9 +464,10 @@ static void set_led(volatile kbd_led_state_t *led, kbd_led_state_t value) {
 void core1_main() {
 #ifdef KBD_NODE_AP
   // load FLASH DATASETS
-  init_flash_datasets(kbd_system.core1.flash_datasets);
+  init_flash_datasets(kbd_system.core1.flash_datasets, &kbd_system.core1.ble_peer_dataset);
   init_config_screen_data();
   load_flash_datasets(kbd_system.core1.flash_datasets);
+  load_ble_peer_cache();
 
   usb_hid_init();
 #endif
@@ -392,8 +488,7 @@ void core1_main() {
   uint32_t rtc_last_ms = ts;
 #endif
 #ifdef KBD_NODE_RIGHT
-  uint32_t tb_capture_last_ms = ts;
-  uint32_t tb_publish_last_ms = ts + 2;
+  uint32_t tb_scan_last_ms = ts;
 #endif
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
   uint32_t pixel_last_ms = ts;
@@ -414,6 +509,9 @@ void core1_main() {
     if (kbd_system.firmware_downloading)
       return; // shutdown core1 on upgrade
 
+    if (kbd_system.core1_flash_hold == kbd_flash_hold_REQUESTED)
+      hold_for_flash(); // a firmware relayed, BLE going on
+
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
     if (kbd_system.no_ap) {
       // typically the nodes are being just charged but not in operation
@@ -457,13 +555,10 @@ void core1_main() {
     // reset comm if needed
     validate_comm_state(1);
 
-    // scan track ball scroll (capture), @ 5 ms
+    // scan track ball scroll and publish, @ 5 ms
     // scan at a high rate to eliminate trackball register overflow
-    do_if_elapsed(&tb_capture_last_ms, 5, &tbm, tb_scan_task_capture);
-
-    // publish track ball scroll (publish), @ 25 ms
-    // publish at a lower rate than master process, to eliminate loss
-    do_if_elapsed(&tb_publish_last_ms, 25, &tbm, tb_scan_task_publish);
+    // published through a queue, comm sends all that is queued, AP processes it on arrival
+    do_if_elapsed(&tb_scan_last_ms, 5, &tbm, tb_scan_task);
 
     // set the caps lock led
     set_led(&kbd_system.led, kbd_system.ap_connected
@@ -478,6 +573,15 @@ void core1_main() {
     validate_comm_state(0); // left comm
     validate_comm_state(1); // right comm
 
+    // persist the BLE peers, if changed
+    save_ble_peer_cache();
+
+    // queue the firmware staged/relayed by core0 (hw_model.h)
+    fw_stage_task();
+
+    // program/erase the flash as saved, polled once per loop, so that typing goes on meanwhile
+    flash_store_task();
+
     // keep the tiny usb ready
     usb_hid_idle_task();
 
@@ -494,8 +598,17 @@ void core1_main() {
       break;
     }
 
-    // process input to output/usb, @ 20 ms
-    do_if_elapsed(&proc_last_ms, 20, NULL, process_inputs);
+    // process input to output/usb, as soon as core0 receives new inputs
+    // else @ 1 ms while a tap-hold or combo waits on time, else @ 20 ms, for screens and idle housekeeping
+    bool has_inputs = false;
+    while (multicore_fifo_rvalid())
+      has_inputs = multicore_fifo_pop_blocking() == KBD_CORE1_WAKE_INPUTS || has_inputs;
+    if (has_inputs) {
+      proc_last_ms = board_millis();
+      process_inputs(NULL);
+    } else {
+      do_if_elapsed(&proc_last_ms, has_pending_input() ? 1 : 20, NULL, process_inputs);
+    }
 
     // handle idelness
     process_idle();
@@ -524,6 +637,13 @@ void core1_main() {
 
 #endif
 
+#ifdef KBD_NODE_AP
+    // sleep for 1 ms, unless woken up by core0 pushing to fifo (sev)
+    absolute_time_t wake_at = make_timeout_time_ms(1);
+    while (!multicore_fifo_rvalid() && !best_effort_wfe_or_timeout(wake_at))
+      ;
+#else
     sleep_ms(1);
+#endif
   }
 }
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "data_model.h"
+#include "fw_flash.h"
 
 kbd_system_t kbd_system = {.core1 =
                                {/// CORE 1 ///
@@ -60,6 +61,13 @@ kbd_system_t kbd_system = {.core1 =
                                         .anim_style = pixel_anim_style_FIXED, // fade
                                         .anim_cycles = 30                     // not applicable when fixed
                                     },
+                                .debounce_config =
+                                    {
+                                        .algorithm = key_debounce_EAGER,
+                                        .press_ms = 5,
+                                        .release_ms = 5,
+                                        .counter_max = 4,
+                                    },
 
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
                                 .pixel_colors = {0}, // default to 0
@@ -67,6 +75,7 @@ kbd_system_t kbd_system = {.core1 =
 
 #ifdef KBD_NODE_AP
                                 .flash_datasets = {0},      // default to NULL
+                                .ble_peer_dataset = NULL,
                                 .left_flash_data_pos = {},  // default to 0
                                 .right_flash_data_pos = {}, // default to 0
 #else
@@ -86,17 +95,21 @@ kbd_system_t kbd_system = {.core1 =
                                    .tcp_server =
                                        {
                                            .gw = {.addr = KBD_NODE_IP},
+                                           .client = NULL,
                                        },
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+                                   .kd = NULL,
                                    .key_press = {0}, // default to 0
 #endif
                                },
 
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
                            .no_ap = false,
+                           .debounce_config_changed = false,
 #endif
 
                            .firmware_downloading = false,
+                           .core1_flash_hold = kbd_flash_hold_NONE,
 
                            .pixels_on = false,
                            .screen = kbd_info_screen_welcome,
@@ -124,6 +137,8 @@ kbd_system_t kbd_system = {.core1 =
 
                            .sb_state = NULL,
 
+                           .key_events = NULL,
+
 #ifdef KBD_NODE_AP
                            .sb_left_key_press = NULL,
                            .sb_right_key_press = NULL,
@@ -139,8 +154,28 @@ kbd_system_t kbd_system = {.core1 =
                            .sb_task_response = NULL,
 #endif
 
+#ifdef KBD_NODE_AP
+                           .ble_peer_cache = {0}, // default to 0
+                           .ble_peer_cache_loaded = false,
+                           .ble_peer_cache_changed = false,
+#endif
+
+                           .sb_link_telemetry = NULL,
+
 #if defined(KBD_NODE_AP) || defined(KBD_NODE_RIGHT)
-                           .sb_tb_motion = NULL,
+                           .tb_motion_queue = NULL,
+#endif
+
+#ifdef KBD_NODE_AP
+                           .bulk_tx = {{0}, {0}}, // idle
+                           .fw_relay = {{0}, {0}}, // idle
+#else
+                           .bulk_rx = {0},
+                           .fw_relay = {0},
+#endif
+
+#ifdef KBD_NODE_RIGHT
+                           .core0_wake = NULL,
 #endif
 
                            .spin_lock = NULL};
@@ -154,6 +189,8 @@ void init_data_model() {
   kbd_system.sb_state = new_shared_buffer(sizeof(kbd_state_t), spin_lock);
   write_shared_buffer(kbd_system.sb_state, kbd_system.core1.state_ts, &kbd_system.core1.state);
 
+  kbd_system.key_events = new_key_event_queue(KBD_KEY_EVENT_QUEUE_SIZE);
+
 #ifdef KBD_NODE_AP
   kbd_system.sb_left_key_press = new_shared_buffer(hw_row_count, spin_lock);  // 1 byte per row
   kbd_system.sb_right_key_press = new_shared_buffer(hw_row_count, spin_lock); // 1 byte per row
@@ -169,7 +206,39 @@ void init_data_model() {
   kbd_system.sb_task_response = new_shared_buffer(KBD_TASK_SIZE, spin_lock);
 #endif
 
+  kbd_system.sb_link_telemetry = new_shared_buffer(KBD_LINK_COUNT * sizeof(kbd_link_telemetry_t), spin_lock);
+
 #if defined(KBD_NODE_AP) || defined(KBD_NODE_RIGHT)
-  kbd_system.sb_tb_motion = new_shared_buffer(sizeof(kbd_tb_motion_t), spin_lock);
+  kbd_system.tb_motion_queue = new_spsc_queue(sizeof(kbd_tb_motion_t), KBD_TB_MOTION_QUEUE_SIZE);
+#endif
+
+#ifdef KBD_NODE_AP
+  bulk_sender_init(kbd_system.bulk_tx);
+  bulk_sender_init(kbd_system.bulk_tx + 1);
+  clock_sync_init(kbd_system.clock_sync);
+  clock_sync_init(kbd_system.clock_sync + 1);
+  fw_relay_sender_init(kbd_system.fw_relay, (uint8_t *)malloc(KBD_BULK_SIZE_MAX), KBD_BULK_SIZE_MAX);
+  fw_relay_sender_init(kbd_system.fw_relay + 1, (uint8_t *)malloc(KBD_BULK_SIZE_MAX), KBD_BULK_SIZE_MAX);
+#else
+  bulk_receiver_init(&kbd_system.bulk_rx, (uint8_t *)malloc(KBD_BULK_SIZE_MAX), KBD_BULK_SIZE_MAX);
+  fw_relay_receiver_init(&kbd_system.fw_relay, &fw_flash_relayed);
 #endif
 }
+
+#if defined(KBD_NODE_AP) || defined(KBD_NODE_RIGHT)
+
+static inline int16_t add_cap16_value(int16_t v1, int16_t v2) {
+  int32_t v = v1;
+  v += v2;
+  // cap the value to 16 bits
+  return (v > 0x7fff) ? 0x7fff : (-v > 0x7fff) ? -0x7fff : v;
+}
+
+void add_tb_motion(kbd_tb_motion_t *acc, const kbd_tb_motion_t *m) {
+  acc->has_motion = acc->has_motion || m->has_motion;
+  acc->on_surface = acc->on_surface || m->on_surface;
+  acc->dx = add_cap16_value(acc->dx, m->dx);
+  acc->dy = add_cap16_value(acc->dy, m->dy);
+}
+
+#endif
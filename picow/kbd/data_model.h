@@ -1,12 +1,19 @@
 #ifndef _DATA_MODEL_H
 #define _DATA_MODEL_H
 
+#include "ble_comm.h"
 #include "hw_config.h"
 
 #include "screen_model.h"
 #include "tcp_server.h"
+#include "util/bulk_transfer.h"
+#include "util/clock_sync.h"
+#include "util/fw_relay.h"
+#include "util/key_debounce.h"
+#include "util/key_event.h"
 #include "util/pixel_anim.h"
 #include "util/shared_buffer.h"
+#include "util/spsc_queue.h"
 
 #ifdef KBD_NODE_AP
 #include "key_layout.h"
@@ -20,13 +27,13 @@
 /*
  * Tasks (20 ms process cycle)
  *
- * core-0: scan key_press (left/right)            @ 5 ms
+ * pio   : scan key matrix (left/right)           @ 1 ms, no cpu (pio + dma)
+ * core-0: read & debounce key_press (left/right) @ 4 ms, each 1 ms frame scanned since
  *         BT send/recv (all)                     @ 10 ms
  *         led blinking (left/right)              @ no-delay
  *
- * core-1: scan tb_motion (right)                 @ 5 ms
- *         publish tb_motion (right)              @ 25 ms
- *         primary process                        @ 20 ms
+ * core-1: scan & publish tb_motion (right)        @ 5 ms
+ *         primary process                        @ on new input (ap), else 20 ms
  *         - update state using inputs (ap)
  *         - set task requests (ap)
  *         - make usb hid report and send (ap)
@@ -39,16 +46,20 @@
  *
  * It is critical to time the scan and processing for track ball
  * since it is an accumulator of dx and dy. We scan it quickly to avoid overflow of hardware registers.
- * And accumulate in memroy. Then use it at a lower frequency, i.e. 25 ms intervals. It should be
- * slower than our processing cycle which is 20 ms. So that, we can consume the readings without loss.
+ * And accumulate in memroy. The accumulated motion is published at each scan, through a queue, and
+ * comm sends all that is queued, summed up, so that none is lost. The AP queues it on arrival and
+ * processes it right away, and sends it on the mouse interface at the next 1 ms USB poll, independent
+ * of the keyboard reports.
  *
  * Flow
  *
  * core-0
- * scan : left:key_scan  ==> left:key_press
- *        right:key_scan ==> right:key_press
- * BT   : left:key_press  ==> ap:left_key_press
- *        right:key_press ==> ap:right_key_press
+ * scan : left:key_scan  ==> left:key_debounce  ==> left:key_press  + left:key_events
+ *        right:key_scan ==> right:key_debounce ==> right:key_press + right:key_events
+ * BT   : left:key_events  ==> ap:key_events
+ *        right:key_events ==> ap:key_events
+ *        left:key_press   ==> ap:left_key_press  (snapshot @ 100 ms)
+ *        right:key_press  ==> ap:right_key_press (snapshot @ 100 ms)
  *        right:tb_motion ==> ap:tb_motion
  *        ap:system_state ==> left:system_state
  *        ap:system_state ==> right:system_state
@@ -56,11 +67,18 @@
  *        ap:right_task_request ==> right:task_request
  *        left:task_response    ==> ap:left_task_response
  *        right:task_response   ==> ap:right_task_response
+ *        ap:bulk_tx[0]  ==> left:bulk_rx  (chunks in the room left in frames)
+ *        ap:bulk_tx[1]  ==> right:bulk_rx
+ *        ap:clock ping ==> left/right ==> ap:clock_sync[0/1] (the round trip, @ 1 second)
+ *        ap:fw_relay[0/1] ==> bulk ==> left/right:fw_relay ==> download slot, a sector at a time
+ *        left/right:fw_relay status ==> ap:fw_relay[0/1] ==> commit, once all verified
+ *        ble_comm ==> link_telemetry (@ 1 second, each node of its links)
  *
  * core-1
  * scan   : right:tb_scan ==> right:tb_motion
- * Process: ap:left_key_press   ==>  ap:system_state
- *          ap:right_key_press       ap:hid_report_out
+ * Process: ap:key_events       ==>  ap:system_state
+ *          ap:left_key_press        ap:hid_report_out
+ *          ap:right_key_press
  *          ap:tb_motion
  *          ap:hid_report_in
  *          ap:left_task_response
@@ -69,6 +87,8 @@
  *          ap:hid_report_out ==> ap:usb
  *          ap:usb ==> ap:hid_report_in
  *
+ *          ap:link_telemetry ==> ap:left_task_request (link screen)
+ *
  *          left:task_request  ==> left:task_response
  *          right:task_request ==> right:task_response
  *
@@ -79,12 +99,49 @@
 
 #define KBD_SB_COUNT 8
 
+// key events in flight, between key scan and BLE on left/right, between BLE and process on AP
+#define KBD_KEY_EVENT_QUEUE_SIZE 64
+// key_press snapshot sent by left/right, the changed rows, to resync AP in case of lost events
+#define KBD_KEY_SNAPSHOT_MS 100
+// comm records are sent only when changed, and all of them (key_press in full) this often, to resync and keep alive
+#define KBD_COMM_REFRESH_MS 250
+// tb motions in flight, between tb scan and BLE on right, between BLE and process on AP
+#define KBD_TB_MOTION_QUEUE_SIZE 16
+// clock sync ping by AP to left/right this often, faster till the samples are filled (see util/clock_sync.h)
+#define KBD_CLOCK_SYNC_MS 1000
+#define KBD_CLOCK_SYNC_FAST_MS 200
+
+// core0 poll (key scan, BLE comm), this often while active, doubled on each idle poll upto the max
+// woken up right away on a frame received, a key pressed (left/right), or a tb motion (right)
+#define KBD_POLL_ACTIVE_MS 4
+#define KBD_POLL_IDLE_MAX_MS 64
+#define KBD_POLL_WIFI_MS 5 // at most, while wifi is on
+
+// multicore fifo message, core0 (comm) wakes up core1 (process) on new key/tb input (ap)
+#define KBD_CORE1_WAKE_INPUTS 0x01
+
+// flash dataset id of the BLE peers cached on AP, after the config screens
+#define KBD_FLASH_DATASET_BLE_PEERS 0xF0
+
 // The request/response should be large enough to fit 4 bytes header and 32 bytes data
 // The data is 32 bytes so as to fit flash dataset which is also 32 bytes
 // The header 4 bytes are 0:flag, 1:screen, 2:command, 3:(data size or config version)
 #define KBD_TASK_SIZE 36
 #define KBD_TASK_DATA_SIZE 32
 
+// larger payloads go by bulk transfer, from AP to left/right, one at a time per node
+#define KBD_BULK_SIZE_MAX 4096
+// sent to left back to back while on the scan screen, to measure the throughput, not while a firmware is relayed
+#define KBD_BULK_PROBE_SIZE 2048
+
+// link telemetry, by comm (core0) every BLE_TELEMETRY_MS, for the link screen (core1) and the tcp server
+// AP: 0-left, 1-right, left/right: the link to AP
+#ifdef KBD_NODE_AP
+#define KBD_LINK_COUNT 2
+#else
+#define KBD_LINK_COUNT 1
+#endif
+
 typedef enum {
   kbd_comm_state_init = 0, // initial state waiting to handshake
   kbd_comm_state_ready,    // handshake done, ready to transfer data
@@ -92,6 +149,12 @@ typedef enum {
   kbd_comm_state_reset     // wait till system is initialized back to init
 } kbd_comm_state_t;
 
+typedef enum {
+  kbd_flash_hold_NONE = 0,
+  kbd_flash_hold_REQUESTED, // by core0, to write the flash (fw_flash.c)
+  kbd_flash_hold_HELD       // core1 waits in RAM, interrupts off, till released
+} kbd_flash_hold_t;
+
 typedef enum {
   kbd_usb_hid_state_UNMOUNTED = 0,
   kbd_usb_hid_state_MOUNTED = 1,
@@ -107,6 +170,21 @@ typedef struct {
   uint8_t on_surface; // as bool may be larger
 } kbd_tb_motion_t;
 
+typedef struct {
+  // be careful about the size, both links have to fit a task (KBD_TASK_DATA_SIZE)
+  // order members larger to smaller, see ble_comm.h for what they are
+  uint16_t tx_fps;
+  uint16_t rx_fps;
+  uint16_t rtt_ms;
+  uint16_t rtt_max_ms;
+  uint16_t key_latency_us; // AP: scan to receive, smoothed, in AP time once the clock is synced
+  uint16_t retransmits;    // since connected, capped
+  int8_t rssi;             // dBm, BLE_RSSI_UNKNOWN if not known
+  uint8_t interval;        // 1.25 ms units, 0 if not connected
+  uint8_t duplicates;      // since connected, capped
+  uint8_t out_of_sync;
+} kbd_link_telemetry_t;
+
 typedef struct {
   uint16_t cpi;
   uint8_t scroll_scale;
@@ -186,7 +264,7 @@ typedef struct {
   bool rightShift;
   bool rightAlt;
   bool rightGui;
-  uint8_t key_codes[KEY_CODE_MAX];
+  uint8_t key_bits[KEY_BITS_SIZE]; // bit per key code, LSB first
 } hid_report_out_keyboard_t;
 
 typedef struct {
@@ -245,6 +323,7 @@ typedef struct {
   // ap - for processing, left - for display, right - for scanning
   kbd_tb_config_t tb_config;
   kbd_pixel_config_t pixel_config;
+  key_debounce_config_t debounce_config; // left/right - for scanning
 
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
   uint32_t pixel_colors[hw_led_pixel_count];
@@ -254,6 +333,7 @@ typedef struct {
   // flash loaded and saved on AP
   // the update is done via config screens (core1)
   flash_dataset_t *flash_datasets[KBD_CONFIG_SCREEN_COUNT];
+  flash_dataset_t *ble_peer_dataset;
   uint8_t left_flash_data_pos[KBD_CONFIG_SCREEN_COUNT];
   uint8_t right_flash_data_pos[KBD_CONFIG_SCREEN_COUNT];
 #else
@@ -274,6 +354,7 @@ typedef struct {
   tcp_server_t tcp_server;
 
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+  key_debounce_t *kd;
   uint8_t key_press[hw_row_count];
 #endif
 } kbd_system_core0_t;
@@ -285,9 +366,11 @@ typedef struct {
 typedef struct {
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
   volatile bool no_ap;
+  volatile bool debounce_config_changed; // set by core1, applied by core0
 #endif
 
   volatile bool firmware_downloading;
+  volatile kbd_flash_hold_t core1_flash_hold; // while the firmware is relayed, BLE and core1 going on
 
   kbd_system_core0_t core0;
   kbd_system_core1_t core1;
@@ -319,6 +402,10 @@ typedef struct {
 
   shared_buffer_t *sb_state;
 
+  // ap - from left/right comm (core0) to process (core1), ordered by scan time when processed
+  // left/right - from key scan to comm (both core0)
+  key_event_queue_t *key_events;
+
 #ifdef KBD_NODE_AP
   shared_buffer_t *sb_left_key_press;
   shared_buffer_t *sb_right_key_press;
@@ -334,8 +421,32 @@ typedef struct {
   shared_buffer_t *sb_task_response;
 #endif
 
+#ifdef KBD_NODE_AP
+  // BLE peers cached in flash, loaded and saved by core1, used and updated by comm (core0)
+  ble_peer_cache_t ble_peer_cache;
+  volatile bool ble_peer_cache_loaded;  // set by core1, then comm starts
+  volatile bool ble_peer_cache_changed; // set by core0, saved by core1
+#endif
+
+  shared_buffer_t *sb_link_telemetry; // kbd_link_telemetry_t per link, from comm (core0)
+
 #if defined(KBD_NODE_AP) || defined(KBD_NODE_RIGHT)
-  shared_buffer_t *sb_tb_motion;
+  // right - from tb scan (core1) to comm (core0)
+  // ap - from comm (core0) to process (core1)
+  spsc_queue_t *tb_motion_queue;
+#endif
+
+#ifdef KBD_NODE_AP
+  bulk_sender_t bulk_tx[2]; // 0-left, 1-right, by comm (core0)
+  clock_sync_t clock_sync[2]; // of left/right to AP, by comm (core0)
+  fw_relay_sender_t fw_relay[2]; // staged by the tcp server, relayed over bulk_tx by comm (both core0)
+#else
+  bulk_receiver_t bulk_rx; // by comm (core0), the data is for core1 once done
+  fw_relay_receiver_t fw_relay; // of bulk_rx, by comm (core0)
+#endif
+
+#ifdef KBD_NODE_RIGHT
+  void (*core0_wake)(void); // set by core0, wakes up its poll, called by tb scan (core1)
 #endif
 
   volatile spin_lock_t *spin_lock; // for multicore data access
@@ -353,4 +464,9 @@ extern kbd_system_t kbd_system;
 
 void init_data_model();
 
+#if defined(KBD_NODE_AP) || defined(KBD_NODE_RIGHT)
+// accumulate the motion m into acc, deltas capped to 16 bits
+void add_tb_motion(kbd_tb_motion_t *acc, const kbd_tb_motion_t *m);
+#endif
+
 #endif
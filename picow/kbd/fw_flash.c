@@ -0,0 +1,93 @@
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#include "pico_fota_bootloader.h"
+
+#include "data_model.h"
+#include "fw_flash.h"
+
+// the slots, as per the linker script of pico_fota_bootloader
+extern uint32_t __FLASH_APP_START[];
+extern uint32_t __FLASH_DOWNLOAD_SLOT_START[];
+extern uint32_t __FLASH_SWAP_SPACE_LENGTH[];
+
+#define SLOT_SIZE ((uint32_t) (uintptr_t) __FLASH_SWAP_SPACE_LENGTH)
+#define SLOT_FLASH_OFFSET ((uint32_t) (uintptr_t) __FLASH_DOWNLOAD_SLOT_START - XIP_BASE)
+
+const uint8_t* fw_flash_running(uint32_t* size) {
+    // the application slot, as copied from the download slot
+    *size = SLOT_SIZE;
+    return (const uint8_t*) __FLASH_APP_START;
+}
+
+static bool hold_core1(void) {
+    // off the flash, unless stopped already
+    if(kbd_system.firmware_downloading) return false;
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+    if(kbd_system.no_ap) return false;
+#endif
+    kbd_system.core1_flash_hold = kbd_flash_hold_REQUESTED;
+    __sev(); // out of its wait
+    while(kbd_system.core1_flash_hold != kbd_flash_hold_HELD) tight_loop_contents();
+    return true;
+}
+
+static void release_core1(bool held) {
+    if(held) kbd_system.core1_flash_hold = kbd_flash_hold_NONE;
+}
+
+bool fw_flash_write_slot(uint32_t offset, const uint8_t* data, uint32_t size) {
+    if(offset > SLOT_SIZE || size > SLOT_SIZE - offset) return false;
+    if(offset % FW_DOWNLOAD_PAGE_SIZE || size % FW_DOWNLOAD_PAGE_SIZE) return false;
+    // the sectors started within, those before are as written already
+    uint32_t from = (offset + FW_DOWNLOAD_SECTOR_SIZE - 1) / FW_DOWNLOAD_SECTOR_SIZE * FW_DOWNLOAD_SECTOR_SIZE;
+    uint32_t to = (offset + size + FW_DOWNLOAD_SECTOR_SIZE - 1) / FW_DOWNLOAD_SECTOR_SIZE * FW_DOWNLOAD_SECTOR_SIZE;
+
+    bool held = hold_core1();
+    uint32_t irq = save_and_disable_interrupts();
+    if(from < to) flash_range_erase(SLOT_FLASH_OFFSET + from, to - from);
+    flash_range_program(SLOT_FLASH_OFFSET + offset, data, size);
+    restore_interrupts(irq);
+    release_core1(held);
+    return true;
+}
+
+void fw_flash_mark_slot(bool valid) {
+    bool held = hold_core1();
+    uint32_t irq = save_and_disable_interrupts();
+    if(valid)
+        pfb_mark_download_slot_as_valid();
+    else
+        pfb_mark_download_slot_as_invalid();
+    restore_interrupts(irq);
+    release_core1(held);
+}
+
+void fw_flash_reboot(void) {
+    pfb_perform_update();
+}
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+
+static void relayed_init_slot(void) {
+    // the slot is erased as written, till verified it is not to be booted into
+    fw_flash_mark_slot(false);
+}
+
+static bool relayed_write(const uint8_t* data, uint32_t offset, uint32_t size) {
+    return fw_flash_write_slot(offset, data, size);
+}
+
+static void relayed_mark_valid(void) {
+    fw_flash_mark_slot(true);
+}
+
+const fw_download_flash_t fw_flash_relayed = {
+    .init_slot = relayed_init_slot,
+    .write = relayed_write,
+    .mark_valid = relayed_mark_valid,
+    .running = fw_flash_running,
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _FW_FLASH_H
+#define _FW_FLASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/fw_download.h"
+
+/*
+ * The download slot of pico_fota_bootloader, written while BLE and core1 go on, unlike the tcp
+ * download which stops them and erases the slot at once (see tcp_server.c). Each sector is
+ * erased as it is written, with core1 held in RAM (core1.c) as the XIP is off meanwhile, so
+ * both cores stall for the erase and the programs, ~45 ms and 16 x 0.7 ms a sector as per
+ * the data sheet of the W25Q16JV (the erase upto 400 ms). The key scan ring of the nodes holds
+ * 128 ms of frames meanwhile (KEY_SCAN_FRAME_COUNT), beyond it they are lost (frames_lost).
+ *
+ * AP   : the relay to left/right is staged in the W25Q32 instead, not to stall the typing
+ *        (see hw_model.h)
+ * Nodes: fw_flash_relayed, the callbacks of the relay received
+ */
+
+// the image running, the application slot, read through XIP
+const uint8_t* fw_flash_running(uint32_t* size);
+
+// pages at offset into the download slot, a sector started is erased first, returns false if outside
+bool fw_flash_write_slot(uint32_t offset, const uint8_t* data, uint32_t size);
+
+// the info of pico_fota_bootloader, as to the download slot
+void fw_flash_mark_slot(bool valid);
+
+// into the download slot, once marked valid
+void fw_flash_reboot(void);
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+extern const fw_download_flash_t fw_flash_relayed;
+#endif
+
+#endif
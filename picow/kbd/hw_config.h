@@ -60,10 +60,11 @@
 #define hw_col_count 7
 #define hw_gpio_rows  {10, 11, 12, 13, 14, 15} // 6 rows
 #define hw_gpio_cols {16, 17, 18, 19, 20, 21, 22} // 7 cols
+#define hw_inst_PIO_key_scan 0 // state machine claimed, as is the one of cyw43 spi
+#define hw_key_scan_rate_hz 1000 // full matrix scans per second
 
 // key pixels
-#define hw_inst_PIO 0
-#define hw_inst_PIO_SM 0
+#define hw_inst_PIO 0 // state machine claimed, as is the one of key scan
 #define hw_gpio_led_DI 6
 #define hw_key_led_mapping {                    \
         { 0,  1,  2,  3,  4,  5,  6},           \
@@ -97,10 +98,11 @@
 #define hw_col_count 7
 #define hw_gpio_rows  {21, 20, 19, 18, 17, 16} // 6 rows
 #define hw_gpio_cols {9, 10, 11, 12, 13, 14, 15} // 7 cols
+#define hw_inst_PIO_key_scan 0 // state machine claimed, as is the one of cyw43 spi
+#define hw_key_scan_rate_hz 1000 // full matrix scans per second
 
 // key pixels
-#define hw_inst_PIO 0
-#define hw_inst_PIO_SM 0
+#define hw_inst_PIO 0 // state machine claimed, as is the one of key scan
 #define hw_gpio_led_DI 6
 #define hw_key_led_mapping {                    \
         { 6,  5,  4,  3,  2,  1,  0},           \
@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hardware/sync.h"
 #include "pico/cyw43_arch.h"
 
+#include "data_model.h"
 #include "hw_model.h"
 
 #include "screen_model.h"
@@ -30,18 +32,27 @@ void do_if_elapsed(uint32_t *t_ms, uint32_t dt_ms, void *param, void (*task)(voi
 
 static void flash_store_read(uint32_t addr, uint8_t *buf, size_t len) { flash_read(kbd_hw.flash, addr, buf, len); }
 
+// issued only, polled by flash_store_task (core1), not to hold up the process loop
 static void flash_store_page_program(uint32_t addr, const uint8_t *buf, size_t len) {
-  flash_page_program(kbd_hw.flash, addr, buf, len);
+  flash_page_program_start(kbd_hw.flash, addr, buf, len);
 }
 
-static void flash_store_sector_erase(uint32_t addr) { flash_sector_erase(kbd_hw.flash, addr); }
+static void flash_store_sector_erase(uint32_t addr) { flash_sector_erase_start(kbd_hw.flash, addr); }
 
-void init_flash_datasets(flash_dataset_t **flash_datasets) {
-  uint8_t i, ids[KBD_CONFIG_SCREEN_COUNT];
+static bool flash_store_busy(void) { return flash_is_busy(kbd_hw.flash); }
+
+void init_flash_datasets(flash_dataset_t **flash_datasets, flash_dataset_t **ble_peer_dataset) {
+  // config screens, then the BLE peers
+  uint8_t i, ids[KBD_CONFIG_SCREEN_COUNT + 1];
+  flash_dataset_t *fds[KBD_CONFIG_SCREEN_COUNT + 1];
   for (i = 0; i < KBD_CONFIG_SCREEN_COUNT; i++)
     ids[i] = kbd_config_screens[i];
-  flash_create_store(KBD_CONFIG_SCREEN_COUNT, ids, flash_datasets, flash_store_read, flash_store_page_program,
-                     flash_store_sector_erase);
+  ids[KBD_CONFIG_SCREEN_COUNT] = KBD_FLASH_DATASET_BLE_PEERS;
+  flash_create_store(KBD_CONFIG_SCREEN_COUNT + 1, ids, fds, flash_store_read, flash_store_page_program,
+                     flash_store_sector_erase, flash_store_busy);
+  for (i = 0; i < KBD_CONFIG_SCREEN_COUNT; i++)
+    flash_datasets[i] = fds[i];
+  *ble_peer_dataset = fds[KBD_CONFIG_SCREEN_COUNT];
 }
 
 void load_flash_datasets(flash_dataset_t **flash_datasets) {
@@ -50,6 +61,86 @@ void load_flash_datasets(flash_dataset_t **flash_datasets) {
     flash_store_load(flash_datasets[i]);
 }
 
+// the firmware staged, asked by core0, queued on the flash_store by core1, done once it is flashed
+typedef enum {
+  fw_stage_IDLE = 0,
+  fw_stage_DUE,    // asked by core0
+  fw_stage_QUEUED, // on the flash_store, by core1
+  fw_stage_READ    // for core0 to take
+} fw_stage_state_t;
+
+typedef struct {
+  volatile fw_stage_state_t state;
+  bool done; // by flash_store_task (core1)
+  uint32_t addr;
+  uint8_t *buf;
+  uint16_t len;
+} fw_stage_job_t;
+
+static fw_stage_job_t fw_stage_writing;
+static fw_stage_job_t fw_stage_reading[2];
+static uint8_t fw_stage_sector[FLASH_SECTOR_SIZE];
+
+bool fw_stage_write(uint32_t addr, const uint8_t *data, uint32_t size) {
+  if (fw_stage_writing.state != fw_stage_IDLE || size > FLASH_SECTOR_SIZE)
+    return false;
+  memcpy(fw_stage_sector, data, size);
+  fw_stage_writing.addr = addr;
+  fw_stage_writing.buf = fw_stage_sector;
+  fw_stage_writing.len = size;
+  __dmb(); // the sector copied before it is asked
+  fw_stage_writing.state = fw_stage_DUE;
+  return true;
+}
+
+bool fw_stage_busy() { return fw_stage_writing.state != fw_stage_IDLE; }
+
+bool fw_stage_read(uint8_t i, uint32_t addr, uint8_t *buf, uint32_t len) {
+  fw_stage_job_t *job = fw_stage_reading + i;
+  if (job->state == fw_stage_READ && job->addr == addr && job->buf == buf && job->len == len) {
+    __dmb(); // told before the data is taken
+    job->state = fw_stage_IDLE;
+    return true;
+  }
+  // not while at one, a read of another is dropped
+  if ((job->state == fw_stage_IDLE || job->state == fw_stage_READ) && len <= FLASH_SECTOR_SIZE) {
+    job->addr = addr;
+    job->buf = buf;
+    job->len = len;
+    __dmb();
+    job->state = fw_stage_DUE;
+  }
+  return false;
+}
+
+void fw_stage_read_reset(uint8_t i) {
+  if (fw_stage_reading[i].state == fw_stage_READ)
+    fw_stage_reading[i].state = fw_stage_IDLE;
+}
+
+static bool fw_stage_job_task(fw_stage_job_t *job, bool write) {
+  // returns false if due, but no room on the flash_store yet
+  if (job->state == fw_stage_DUE) {
+    __dmb(); // asked before the job is read
+    job->done = false;
+    if (write ? !flash_store_queue_write(job->addr, job->buf, job->len, &job->done)
+              : !flash_store_queue_read(job->addr, job->buf, job->len, &job->done))
+      return false;
+    job->state = fw_stage_QUEUED;
+  }
+  if (job->state == fw_stage_QUEUED && job->done) {
+    __dmb(); // flashed, or read, before it is told
+    job->state = write ? fw_stage_IDLE : fw_stage_READ;
+  }
+  return true;
+}
+
+void fw_stage_task() {
+  // the reads first, so that one asked before a write is done before it, in order on the flash
+  if (fw_stage_job_task(fw_stage_reading, false) && fw_stage_job_task(fw_stage_reading + 1, false))
+    fw_stage_job_task(&fw_stage_writing, true);
+}
+
 #endif
 
 #ifdef KBD_NODE_LEFT
@@ -109,7 +200,7 @@ void init_hw_core1() {
 #if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
   // setup key pixels
   pio_hw_t *pio = hw_inst_PIO == 0 ? pio0 : pio1;
-  kbd_hw.led_pixel = led_pixel_create(pio, hw_inst_PIO_SM, hw_gpio_led_DI, hw_led_pixel_count);
+  kbd_hw.led_pixel = led_pixel_create(pio, hw_gpio_led_DI, hw_led_pixel_count);
 #endif
 }
 
@@ -149,6 +240,7 @@ void init_hw_core0() {
   // init key scanner
   uint8_t gpio_rows[hw_row_count] = hw_gpio_rows;
   uint8_t gpio_cols[hw_col_count] = hw_gpio_cols;
-  kbd_hw.ks = key_scan_create(hw_row_count, hw_col_count, gpio_rows, gpio_cols);
+  pio_hw_t *ks_pio = hw_inst_PIO_key_scan == 0 ? pio0 : pio1;
+  kbd_hw.ks = key_scan_create(ks_pio, hw_row_count, hw_col_count, gpio_rows, gpio_cols, hw_key_scan_rate_hz);
 #endif
 }
@@ -73,10 +73,33 @@ void do_if_elapsed(uint32_t* t_ms, uint32_t dt_ms, void* param, void(*task)(void
 
 #ifdef KBD_NODE_AP
 
-void init_flash_datasets(flash_dataset_t** flash_datasets);
+void init_flash_datasets(flash_dataset_t** flash_datasets, flash_dataset_t** ble_peer_dataset);
 
 void load_flash_datasets(flash_dataset_t** flash_datasets);
 
+/*
+ * The firmware relayed to left/right (see tcp_server.c, util/fw_relay.h) is staged in the upper
+ * half of the W25Q32, a region each, off the config datasets. The flash is core1's, so core0 asks
+ * and core1 queues the jobs on the flash_store (fw_stage_task), neither waits on the flash.
+ */
+#define KBD_FW_STAGE_ADDR 0x200000
+#define KBD_FW_STAGE_SIZE 0x100000 // per node
+
+// core0: a sector at most, copied, the sectors started erased first, false while one is written
+bool fw_stage_write(uint32_t addr, const uint8_t* data, uint32_t size);
+
+// while a write is not yet flashed
+bool fw_stage_busy();
+
+// core0, per node (0-left, 1-right): asked on a call, true on a call after with the same, once read
+bool fw_stage_read(uint8_t i, uint32_t addr, uint8_t* buf, uint32_t len);
+
+// a read done and not taken is dropped, as staged again
+void fw_stage_read_reset(uint8_t i);
+
+// core1, polled by the process loop, before flash_store_task
+void fw_stage_task();
+
 #endif
 
 #ifdef KBD_NODE_LEFT
@@ -1,34 +1,11 @@
 #include <string.h>
 
 #include "class/hid/hid.h"
+#include "pico/stdlib.h"
 
 #include "data_model.h"
 #include "input_processor.h"
 
-#define KEY_PRESS_MAX 16
-
-static uint8_t key_layout_read(const uint8_t* key_press[KEY_PRESS_MAX]) {
-    int row,col,k=0;
-    uint8_t v;
-
-    for(row=0;
-        k<KEY_PRESS_MAX && row<hw_row_count;
-        row++) {
-        for(col=hw_col_count-1, v=kbd_system.core1.left_key_press[row];
-            v>0 && k<KEY_PRESS_MAX && col>=0;
-            col--, v>>=1) {
-            if(v & 1) key_press[k++] = key_layout[row][col];
-        }
-
-        for(col=hw_col_count-1, v=kbd_system.core1.right_key_press[row];
-            v>0 && k<KEY_PRESS_MAX && col>=0;
-            col--, v>>=1) {
-            if(v & 1) key_press[k++] = key_layout[row][hw_col_count+col];
-        }
-    }
-    return k;
-}
-
 #define TRACK_KEY_COUNT 10
 
 // keycodes tracked with new_key_press, old_key_press, cur_key_press
@@ -77,84 +54,53 @@ static void update_track_key_press() {
     }
 }
 
-static void parse_modifier(uint8_t modifier, hid_report_out_keyboard_t* outk) {
-    switch(modifier) {
-    case KEYBOARD_MODIFIER_LEFTCTRL:
-        outk->leftCtrl=true;
-        break;
-    case KEYBOARD_MODIFIER_LEFTSHIFT:
-        outk->leftShift=true;
-        break;
-    case KEYBOARD_MODIFIER_LEFTALT:
-        outk->leftAlt=true;
-        break;
-    case KEYBOARD_MODIFIER_LEFTGUI:
-        outk->leftGui=true;
-        break;
-    case KEYBOARD_MODIFIER_RIGHTCTRL:
-        outk->rightCtrl=true;
-        break;
-    case KEYBOARD_MODIFIER_RIGHTSHIFT:
-        outk->rightShift=true;
-        break;
-    case KEYBOARD_MODIFIER_RIGHTALT:
-        outk->rightAlt=true;
-        break;
-    case KEYBOARD_MODIFIER_RIGHTGUI:
-        outk->rightGui=true;
-        break;
-    default: // skip
-        break;
-    }
+#define SPECIAL_BIT(code) (1u << ((code) - KEYMAP_SPECIAL_BASE))
+
+// layout compiled to lookup tables, the moon keys switch to the layer 1
+static keymap_t* keymap = NULL;
+
+static void init_keymap() {
+    if(keymap) return;
+    keymap = keymap_create(&key_layout[0][0][0], hw_row_count, hw_col_count,
+                           track_keys, TRACK_KEY_COUNT,
+                           SPECIAL_BIT(KBD_KEY_LEFT_MOON) | SPECIAL_BIT(KBD_KEY_RIGHT_MOON));
+    keymap_add_actions(keymap, key_layout_actions, KEY_LAYOUT_ACTION_COUNT);
+    keymap_add_combos(keymap, key_layout_combos, KEY_LAYOUT_COMBO_COUNT);
 }
 
-static void parse_code(uint8_t code, uint8_t base_code,
-                       uint8_t* n_key_codes, hid_report_out_keyboard_t* outk,
-                       hid_report_out_mouse_t* outm) {
-    switch (base_code) {
-    case KBD_KEY_SUN:
-        cur_key_press.sun = 1;
-        break;
-    case KBD_KEY_LEFT_MOON:
-    case KBD_KEY_RIGHT_MOON:
-        // no action
-        break;
-    default:
-        switch(code) {
-        case KBD_KEY_BACKLIGHT:
-            cur_key_press.backlight = 1;
-            break;
-        case KBD_KEY_PIXELS:
-            cur_key_press.pixels = 1;
-            break;
-        case KBD_KEY_MOUSE_LEFT:
-            outm->left=true;
-            break;
-        case KBD_KEY_MOUSE_RIGHT:
-            outm->right=true;
-            break;
-        case KBD_KEY_MOUSE_MIDDLE:
-            outm->middle=true;
-            break;
-        case KBD_KEY_MOUSE_BACKWARD:
-            outm->backward=true;
-            break;
-        case KBD_KEY_MOUSE_FORWARD:
-            outm->forward=true;
-            break;
-        default: // normal keys
-            outk->key_codes[*n_key_codes]=code;
-            *n_key_codes = *n_key_codes + 1;
-            // note keys for screen event
-            for(int j=0; j<TRACK_KEY_COUNT; j++) {
-                if(track_keys[j]==code) {
-                    ((uint8_t*)&cur_key_press)[j] = 1;
-                    break;
-                }
-            }
-        }
-        break;
-    }
+bool push_input_key_event(uint8_t key, uint64_t ts) {
+    init_keymap();
+    return keymap_push_event(keymap, KEY_EVENT_ROW(key), (key & KEY_EVENT_RIGHT) ? 1 : 0, KEY_EVENT_COL(key),
+                      key & KEY_EVENT_PRESS, ts);
+}
+
+bool has_pending_input() {
+    return keymap && keymap->queue_count > 0;
+}
+
+static void parse_modifiers(uint8_t modifiers, hid_report_out_keyboard_t* outk) {
+    outk->leftCtrl = modifiers & KEYBOARD_MODIFIER_LEFTCTRL;
+    outk->leftShift = modifiers & KEYBOARD_MODIFIER_LEFTSHIFT;
+    outk->leftAlt = modifiers & KEYBOARD_MODIFIER_LEFTALT;
+    outk->leftGui = modifiers & KEYBOARD_MODIFIER_LEFTGUI;
+    outk->rightCtrl = modifiers & KEYBOARD_MODIFIER_RIGHTCTRL;
+    outk->rightShift = modifiers & KEYBOARD_MODIFIER_RIGHTSHIFT;
+    outk->rightAlt = modifiers & KEYBOARD_MODIFIER_RIGHTALT;
+    outk->rightGui = modifiers & KEYBOARD_MODIFIER_RIGHTGUI;
+}
+
+static void parse_specials(uint16_t specials, hid_report_out_mouse_t* outm) {
+    outm->left = specials & SPECIAL_BIT(KBD_KEY_MOUSE_LEFT);
+    outm->right = specials & SPECIAL_BIT(KBD_KEY_MOUSE_RIGHT);
+    outm->middle = specials & SPECIAL_BIT(KBD_KEY_MOUSE_MIDDLE);
+    outm->backward = specials & SPECIAL_BIT(KBD_KEY_MOUSE_BACKWARD);
+    outm->forward = specials & SPECIAL_BIT(KBD_KEY_MOUSE_FORWARD);
+}
+
+static void parse_track_keys(uint16_t track_bits) {
+    uint8_t* ckp = (uint8_t*) &cur_key_press;
+    for(uint8_t i=0; i<TRACK_KEY_COUNT; i++)
+        ckp[i] = (track_bits >> i) & 1;
 }
 
 static inline int16_t cap16_value(int32_t v) {
@@ -224,49 +170,27 @@ static kbd_event_t parse_config_screen_event(bool moon) {
 
 // update the hid_report_out and return the screen event if any
 kbd_event_t execute_input_processor() {
-    // identify the raw left/right scan matrix
-    const uint8_t* key_press[KEY_PRESS_MAX];
-    uint8_t n = key_layout_read(key_press);
-
-    // check for sun or moon
-    bool sun=false, moon=false, lmoon=false, rmoon=false;
-    int i;
-    for(i=0; i<n; i++) {
-        switch(key_press[i][1]) {
-        case KBD_KEY_SUN:
-            sun=true;
-            break;
-        case KBD_KEY_LEFT_MOON:
-            lmoon=true;
-            break;
-        case KBD_KEY_RIGHT_MOON:
-            rmoon=true;
-            break;
-        }
-        if(sun && lmoon && rmoon) break; // no need to look further
-    }
-    moon = lmoon || rmoon;
+    init_keymap();
 
-    // initialize cleared
+    // resolve the key events, and any keys changed without events (resync)
+    keymap_update(keymap, kbd_system.core1.left_key_press, kbd_system.core1.right_key_press, time_us_64());
+
+    // check for moon
+    bool lmoon = keymap->special_bits & SPECIAL_BIT(KBD_KEY_LEFT_MOON);
+    bool rmoon = keymap->special_bits & SPECIAL_BIT(KBD_KEY_RIGHT_MOON);
+    bool moon = lmoon || rmoon;
+
+    // no limit on the number of keys pressed, the report is a bitmap
     hid_report_out_keyboard_t outk;
-    memset(&outk, 0, sizeof(hid_report_out_keyboard_t));
+    parse_modifiers(keymap->modifiers, &outk);
+    memcpy(outk.key_bits, keymap->key_bits, KEY_BITS_SIZE);
+    uint8_t n_key_codes = keymap->key_count;
 
     hid_report_out_mouse_t outm;
     memset(&outm, 0, sizeof(hid_report_out_mouse_t));
+    parse_specials(keymap->special_bits, &outm);
 
-    memset(&cur_key_press, 0, sizeof(track_key_press_t));
-
-    // parse keypress
-    uint8_t n_key_codes=0;
-    for(i=0; i<n; i++) {
-        // read modifiers
-        parse_modifier(key_press[i][0], &outk);
-        // read key_codes
-        uint8_t base_code = key_press[i][1];
-        uint8_t moon_code = key_press[i][2];
-        uint8_t code = (moon && moon_code) ? moon_code : base_code;
-        parse_code(code, base_code, &n_key_codes, &outk, &outm);
-    }
+    parse_track_keys(keymap->track_bits);
 
     // parse tb motion
     bool has_motion = parse_tb_motion(moon, outk.leftShift || outk.rightShift, &outm);
@@ -1,8 +1,18 @@
 #ifndef _INPUT_PROCESSOR_H
 #define _INPUT_PROCESSOR_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "kbd_events.h"
 
 kbd_event_t execute_input_processor();
 
+// key event (as in key_event.h) with ts in the AP clock, to be resolved by the next execute,
+// false if the queue is full, to be pushed again after
+bool push_input_key_event(uint8_t key, uint64_t ts);
+
+// key events waiting to be resolved, on the time for a tap-hold or a combo
+bool has_pending_input();
+
 #endif
@@ -276,3 +276,17 @@ const uint8_t key_layout[KEY_LAYOUT_ROW_COUNT][KEY_LAYOUT_COL_COUNT][3] = {
         {0, HID_KEY_BRACKET_RIGHT, 0},
     },
 };
+
+// Each entry is {row, col, layer, action, key_code, modifier_mask, layer_arg, hold_modifier_mask}
+// the layer 1 is the moon layer, set KEY_LAYOUT_ACTION_COUNT as per the entries
+const keymap_action_def_t key_layout_actions[KEY_LAYOUT_ACTION_COUNT] = {
+    // e.g. caps lock on tap, control on hold
+    // {1, 7, 0, keymap_action_TAP_HOLD, HID_KEY_CAPS_LOCK, 0, 0, KEYBOARD_MODIFIER_LEFTCTRL},
+};
+
+// Each entry is {key_count, {{row, col}, ...}, action, key_code, modifier_mask, layer_arg}
+// set KEY_LAYOUT_COMBO_COUNT as per the entries
+const keymap_combo_def_t key_layout_combos[KEY_LAYOUT_COMBO_COUNT] = {
+    // e.g. both moons together lock the moon layer, again to unlock
+    // {2, {{5, 4}, {5, 9}}, keymap_action_TOGGLE, 0, 0, 1},
+};
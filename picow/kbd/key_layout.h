@@ -4,8 +4,10 @@
 #include <stdint.h>
 
 #include "hw_config.h"
+#include "util/keymap.h"
 
-#define KEY_CODE_MAX 6 // same as in TinyUSB
+#define KEY_CODE_MAX 6 // boot protocol report, same as in TinyUSB
+#define KEY_BITS_SIZE 28 // NKRO report, a bit per key code 0x00 - 0xDF (modifiers are separate)
 
 // special keys
 #define KBD_KEY_SUN            0xF1
@@ -24,4 +26,11 @@
 
 extern const uint8_t key_layout[KEY_LAYOUT_ROW_COUNT][KEY_LAYOUT_COL_COUNT][3];
 
+// layers, tap-holds, one-shots over the key_layout, and combos, none by default (see key_layout.c)
+#define KEY_LAYOUT_ACTION_COUNT 0
+#define KEY_LAYOUT_COMBO_COUNT 0
+
+extern const keymap_action_def_t key_layout_actions[KEY_LAYOUT_ACTION_COUNT];
+extern const keymap_combo_def_t key_layout_combos[KEY_LAYOUT_COMBO_COUNT];
+
 #endif /* _KBD_LAYOUT_H_ */
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../hw_model.h"
+#include "../data_model.h"
+
+#define THIS_SCREEN kbd_config_screen_debounce
+#define CONFIG_VERSION 0x01
+
+/*
+ *   0123456789012  font
+ * 1 .............  11x16 y:10
+ * 2 Algo  Counter  17x24 y:60
+ * 3 Press      05        y:100
+ * 4 Release    05        y:130
+ * 5 Count      04        y:160
+ */
+
+#define DEBOUNCE_MS_MAX 30
+#define COUNTER_MAX 20
+
+typedef struct {
+    uint8_t version;
+    uint8_t algorithm; // key_debounce_algorithm_t
+    uint8_t press_ms; // 0-DEBOUNCE_MS_MAX
+    uint8_t release_ms; // 0-DEBOUNCE_MS_MAX
+    uint8_t counter_max; // 1-COUNTER_MAX, samples
+} debounce_config_t;
+
+static debounce_config_t debounce_config;
+
+#ifdef KBD_NODE_AP
+
+static flash_dataset_t* fd;
+
+void handle_screen_event_debounce(kbd_event_t event) {
+    kbd_system_core1_t* c = &kbd_system.core1;
+    uint8_t* lreq = c->left_task_request;
+    uint8_t* rreq = c->right_task_request;
+    uint8_t* lres = c->left_task_response;
+
+    if(is_nav_event(event)) return;
+
+    switch(event) {
+    case kbd_screen_event_INIT:
+        init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+        init_task_request(rreq, &c->right_task_request_ts, THIS_SCREEN);
+        lreq[2] = rreq[2] = 1;
+        lreq[3] = fd->pos;
+        memcpy(lreq+4, &debounce_config, sizeof(debounce_config_t));
+        break;
+    case kbd_screen_event_SAVE:
+        init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+        lreq[2] = 2;
+        break;
+    case kbd_screen_event_LEFT:
+    case kbd_screen_event_RIGHT:
+    case kbd_screen_event_UP:
+    case kbd_screen_event_DOWN:
+        init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+        lreq[2] = 3;
+        lreq[3] = 1;
+        lreq[4] = event;
+        break;
+    case kbd_screen_event_SEL_PREV:
+    case kbd_screen_event_SEL_NEXT:
+        init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+        lreq[2] = 4;
+        lreq[3] = 1;
+        lreq[4] = event;
+        break;
+    case kbd_screen_event_RESPONSE:
+        if(lres[0] && lres[1]==THIS_SCREEN && lres[2]==1) {
+            // save to flash
+            memcpy(&debounce_config, lres+4, sizeof(debounce_config_t));
+            memcpy(fd->data, &debounce_config, sizeof(debounce_config_t));
+            uint16_t pos = flash_store_save(fd); // fd->pos once flashed
+            // show on lcd
+            init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+            lreq[2] = 1;
+            lreq[3] = pos;
+            memcpy(lreq+4, fd->data, sizeof(debounce_config_t));
+        }
+        break;
+    default: break;
+    }
+}
+
+#endif
+
+#ifdef KBD_NODE_LEFT
+
+#define FIELD_COUNT 4
+
+static uint8_t fd_pos;
+static uint8_t field;
+static bool dirty;
+
+static uint8_t select_next_value(uint8_t field) {
+    switch(field) {
+    case 0: // algorithm
+        return debounce_config.algorithm = debounce_config.algorithm>=(key_debounce_COUNT-1) ?
+            0 : debounce_config.algorithm+1;
+    case 1: // press_ms
+        return debounce_config.press_ms = debounce_config.press_ms>=DEBOUNCE_MS_MAX ?
+            DEBOUNCE_MS_MAX : debounce_config.press_ms+1;
+    case 2: // release_ms
+        return debounce_config.release_ms = debounce_config.release_ms>=DEBOUNCE_MS_MAX ?
+            DEBOUNCE_MS_MAX : debounce_config.release_ms+1;
+    case 3: // counter_max
+        return debounce_config.counter_max = debounce_config.counter_max>=COUNTER_MAX ?
+            COUNTER_MAX : debounce_config.counter_max+1;
+    default: return 0; // invalid
+    }
+}
+
+static uint8_t select_prev_value(uint8_t field) {
+    switch(field) {
+    case 0: // algorithm
+        return debounce_config.algorithm = debounce_config.algorithm==0 ?
+            (key_debounce_COUNT-1) : debounce_config.algorithm-1;
+    case 1: // press_ms
+        return debounce_config.press_ms = debounce_config.press_ms==0 ?
+            0 : debounce_config.press_ms-1;
+    case 2: // release_ms
+        return debounce_config.release_ms = debounce_config.release_ms==0 ?
+            0 : debounce_config.release_ms-1;
+    case 3: // counter_max
+        return debounce_config.counter_max = debounce_config.counter_max<=1 ?
+            1 : debounce_config.counter_max-1;
+    default: return 0; // invalid
+    }
+}
+
+static void draw_algorithm(lcd_canvas_t* cv, uint16_t x, uint16_t y, bool selected) {
+    char* algo;
+    switch(debounce_config.algorithm) {
+    case key_debounce_NONE:
+        algo = "None   ";
+        break;
+    case key_debounce_EAGER:
+        algo = "Eager  ";
+        break;
+    case key_debounce_DEFER:
+        algo = "Defer  ";
+        break;
+    case key_debounce_COUNTER:
+        algo = "Counter";
+        break;
+    default:
+        algo = "Error  ";
+        break;
+    }
+    lcd_canvas_text(cv, x, y, algo, &lcd_font24, selected?RED:WHITE, LCD_BODY_BG);
+}
+
+static void draw_number(lcd_canvas_t* cv, uint16_t x, uint16_t y, uint8_t value, bool selected) {
+    char txt[8];
+    sprintf(txt, "%02d", value);
+    lcd_canvas_text(cv, x, y, txt, &lcd_font24, selected?RED:WHITE, LCD_BODY_BG);
+}
+
+static void init_screen() {
+    lcd_canvas_t* cv = kbd_hw.lcd_body;
+    lcd_canvas_clear(cv);
+
+    char txt[16];
+    sprintf(txt, "Debounce-%04d", fd_pos);
+    lcd_canvas_text(cv, 43, 10, txt, &lcd_font16, BLUE, LCD_BODY_BG);
+
+    lcd_canvas_text(cv, 10, 60, "Algo", &lcd_font24, DARK_GRAY, LCD_BODY_BG);
+    draw_algorithm(cv, 112, 60, field==0);
+
+    lcd_canvas_text(cv, 10, 100, "Press", &lcd_font24, DARK_GRAY, LCD_BODY_BG);
+    draw_number(cv, 197, 100, debounce_config.press_ms, field==1);
+
+    lcd_canvas_text(cv, 10, 130, "Release", &lcd_font24, DARK_GRAY, LCD_BODY_BG);
+    draw_number(cv, 197, 130, debounce_config.release_ms, field==2);
+
+    lcd_canvas_text(cv, 10, 160, "Count", &lcd_font24, DARK_GRAY, LCD_BODY_BG);
+    draw_number(cv, 197, 160, debounce_config.counter_max, field==3);
+
+    lcd_display_body();
+}
+
+static void draw_field(lcd_canvas_t* cv1, lcd_canvas_t* cv2, uint8_t field, bool selected) {
+    switch(field) {
+    case 0: // algorithm
+        draw_algorithm(cv2, 0, 0, selected);
+        lcd_display_body_canvas(112, 60, cv2);
+        break;
+    case 1: // press_ms
+        draw_number(cv1, 0, 0, debounce_config.press_ms, selected);
+        lcd_display_body_canvas(197, 100, cv1);
+        break;
+    case 2: // release_ms
+        draw_number(cv1, 0, 0, debounce_config.release_ms, selected);
+        lcd_display_body_canvas(197, 130, cv1);
+        break;
+    case 3: // counter_max
+        draw_number(cv1, 0, 0, debounce_config.counter_max, selected);
+        lcd_display_body_canvas(197, 160, cv1);
+        break;
+    default: break; // invalid
+    }
+}
+
+static void update_screen(uint8_t field, uint8_t sel_field) {
+    lcd_canvas_t* cv1 = lcd_new_shared_canvas(kbd_hw.lcd_body->buf, 34, 24, LCD_BODY_BG);
+    lcd_canvas_t* cv2 = lcd_new_shared_canvas(kbd_hw.lcd_body->buf, 119, 24, LCD_BODY_BG);
+
+    if(field!=sel_field) {
+        draw_field(cv1, cv2, field, false);
+        lcd_canvas_clear(cv2); // clear the bigger one of the shared canvases
+    }
+
+    draw_field(cv1, cv2, sel_field, true);
+    lcd_free_canvas(cv1);
+    lcd_free_canvas(cv2);
+
+    if(dirty) {
+        lcd_canvas_t* cv = lcd_new_shared_canvas(kbd_hw.lcd_body->buf, 10, 10, LCD_BODY_BG);
+        lcd_canvas_circle(cv, 5, 5, 5, RED, 1, true);
+        lcd_display_body_canvas(220, 10, cv);
+        lcd_free_canvas(cv);
+    }
+}
+
+void work_screen_task_debounce() {
+    kbd_system_core1_t* c = &kbd_system.core1;
+    uint8_t* req = c->task_request;
+    uint8_t* res = c->task_response;
+
+    uint8_t old_field;
+    switch(req[2]) {
+    case 1: // init
+        fd_pos = req[3];
+        memcpy(&debounce_config, req+4, sizeof(debounce_config_t));
+        field = 0; dirty = false;
+        init_screen();
+        break;
+    case 2: // save
+        res[2] = 1;
+        res[3] = fd_pos;
+        memcpy(res+4, &debounce_config, sizeof(debounce_config_t));
+        break;
+    case 3: // select field
+        old_field = field;
+        switch(req[4]) {
+        case kbd_screen_event_LEFT:
+        case kbd_screen_event_UP:
+            field = field==0 ? FIELD_COUNT-1 : field-1;
+            break;
+        case kbd_screen_event_RIGHT:
+        case kbd_screen_event_DOWN:
+            field = field==FIELD_COUNT-1 ? 0 : field+1;
+            break;
+        default: break;
+        }
+        update_screen(old_field, field);
+        break;
+    case 4: // select value
+        if(req[4]==kbd_screen_event_SEL_PREV) select_prev_value(field);
+        else select_next_value(field);
+        dirty = true;
+        update_screen(field, field);
+        break;
+    default: break;
+    }
+}
+
+#endif
+
+#ifdef KBD_NODE_RIGHT
+
+void work_screen_task_debounce() {} // no action
+
+#endif
+
+void init_config_screen_data_debounce() {
+    uint8_t si = get_screen_index(THIS_SCREEN);
+#ifdef KBD_NODE_AP
+    fd = kbd_system.core1.flash_datasets[si];
+    uint8_t* data = fd->data;
+#else
+    uint8_t* data = kbd_system.core1.flash_data[si];
+#endif
+
+    memset(data, 0xFF, KBD_TASK_DATA_SIZE); // use 0xFF = erased state in flash
+
+    key_debounce_config_t* kdc = &kbd_system.core1.debounce_config;
+    debounce_config.version = CONFIG_VERSION;
+    debounce_config.algorithm = kdc->algorithm;
+    debounce_config.press_ms = kdc->press_ms;
+    debounce_config.release_ms = kdc->release_ms;
+    debounce_config.counter_max = kdc->counter_max;
+    memcpy(data, &debounce_config, sizeof(debounce_config_t));
+}
+
+void apply_config_screen_data_debounce() {
+#ifdef KBD_NODE_AP
+    uint8_t* data = fd->data;
+#else
+    uint8_t si = get_screen_index(THIS_SCREEN);
+    uint8_t* data = kbd_system.core1.flash_data[si];
+#endif
+    if(data[0]!=CONFIG_VERSION) return;
+
+    memcpy(&debounce_config, data, sizeof(debounce_config_t));
+
+    key_debounce_config_t* kdc = &kbd_system.core1.debounce_config;
+    kdc->algorithm = debounce_config.algorithm;
+    kdc->press_ms = debounce_config.press_ms;
+    kdc->release_ms = debounce_config.release_ms;
+    kdc->counter_max = debounce_config.counter_max;
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+    // the debouncer runs on core0 along with the key scan, let it pick up the change
+    kbd_system.debounce_config_changed = true;
+#endif
+}
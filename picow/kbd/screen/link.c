@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../ble_comm.h"
+#include "../data_model.h"
+#include "../hw_model.h"
+
+#define THIS_SCREEN kbd_info_screen_link
+
+/*
+ * Link telemetry, as seen by AP, of the link to each node (see kbd_link_telemetry_t)
+ *
+ *   0123456789012345678  font 11x16
+ *         Link           y:10
+ *           L     R      y:30
+ * tx/s     133   133     y:48, then every 16
+ * rx/s     133   133
+ * rtt       12    14     smoothed, ms
+ * max       40    38     over the last second, ms
+ * lat      4.2   5.1     key scan to AP, smoothed, ms
+ * rssi     -60   -58     dBm
+ * retx       3     0     since connected
+ * d/o      0/0   0/0     duplicates/out of sync, since connected
+ * intv    7.50 30.00     connection interval, ms
+ */
+
+#define ROW_COUNT 9
+#define ROW_Y 48
+#define ROW_HEIGHT 16
+#define VALUE_X 90 // the value columns, L then R
+#define VALUE_WIDTH 66
+
+#ifdef KBD_NODE_AP
+
+static uint64_t telemetry_ts = 0; // as sent last
+
+void handle_screen_event_link(kbd_event_t event) {
+  kbd_system_core1_t *c = &kbd_system.core1;
+  uint8_t *lreq = c->left_task_request;
+  uint8_t *rreq = c->right_task_request;
+
+  if (is_nav_event(event))
+    return;
+
+  // on init, then as published by comm (every BLE_TELEMETRY_MS)
+  shared_buffer_t *sb = kbd_system.sb_link_telemetry;
+  if (event != kbd_screen_event_INIT && sb->ts <= telemetry_ts)
+    return;
+
+  init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
+  lreq[2] = (event == kbd_screen_event_INIT) ? 1 : 2;
+  lreq[3] = sb->size;
+  read_shared_buffer(sb, &telemetry_ts, lreq + 4);
+
+  // init right
+  if (event == kbd_screen_event_INIT) {
+    init_task_request(rreq, &c->right_task_request_ts, THIS_SCREEN);
+    rreq[2] = 1;
+  }
+}
+
+#endif
+
+#ifdef KBD_NODE_LEFT
+
+static void format_value(char *txt, const kbd_link_telemetry_t *t, uint8_t row) {
+  if (!t->interval) {
+    sprintf(txt, "%5s", "-"); // not connected
+    return;
+  }
+  switch (row) {
+  case 0:
+    sprintf(txt, "%5u", t->tx_fps);
+    break;
+  case 1:
+    sprintf(txt, "%5u", t->rx_fps);
+    break;
+  case 2:
+    sprintf(txt, "%5u", t->rtt_ms);
+    break;
+  case 3:
+    sprintf(txt, "%5u", t->rtt_max_ms);
+    break;
+  case 4:
+    sprintf(txt, "%3u.%u", t->key_latency_us / 1000, t->key_latency_us % 1000 / 100);
+    break;
+  case 5:
+    if (t->rssi == BLE_RSSI_UNKNOWN)
+      sprintf(txt, "%5s", "?");
+    else
+      sprintf(txt, "%5d", t->rssi);
+    break;
+  case 6:
+    sprintf(txt, "%5u", t->retransmits);
+    break;
+  case 7:
+    sprintf(txt, "%2u/%-2u", t->duplicates > 99 ? 99 : t->duplicates, t->out_of_sync > 99 ? 99 : t->out_of_sync);
+    break;
+  default:
+    sprintf(txt, "%2u.%02u", t->interval * 125 / 100, 25 * (t->interval & 3));
+    break;
+  }
+}
+
+static void draw_values(lcd_canvas_t *cv, uint16_t x, uint16_t y, const kbd_link_telemetry_t *telemetry) {
+  char txt[16];
+  for (uint8_t row = 0; row < ROW_COUNT; row++)
+    for (uint8_t i = 0; i < 2; i++) {
+      format_value(txt, telemetry + i, row);
+      lcd_canvas_text(cv, x + i * VALUE_WIDTH, y + row * ROW_HEIGHT, txt, &lcd_font16, WHITE, LCD_BODY_BG);
+    }
+}
+
+static void init_screen(const kbd_link_telemetry_t *telemetry) {
+  static const char *labels[ROW_COUNT] = {"tx/s", "rx/s", "rtt", "max", "lat", "rssi", "retx", "d/o", "intv"};
+
+  lcd_canvas_t *cv = kbd_hw.lcd_body;
+  lcd_canvas_clear(cv);
+
+  lcd_canvas_text(cv, 98, 10, "Link", &lcd_font16, BLUE, LCD_BODY_BG);
+  lcd_canvas_text(cv, VALUE_X + 44, 30, "L", &lcd_font16, DARK_GRAY, LCD_BODY_BG);
+  lcd_canvas_text(cv, VALUE_X + VALUE_WIDTH + 44, 30, "R", &lcd_font16, DARK_GRAY, LCD_BODY_BG);
+  for (uint8_t row = 0; row < ROW_COUNT; row++)
+    lcd_canvas_text(cv, 10, ROW_Y + row * ROW_HEIGHT, labels[row], &lcd_font16, DARK_GRAY, LCD_BODY_BG);
+  draw_values(cv, VALUE_X, ROW_Y, telemetry);
+
+  lcd_display_body();
+}
+
+static void update_screen(const kbd_link_telemetry_t *telemetry) {
+  // only the values
+  lcd_canvas_t *cv = lcd_new_canvas(2 * VALUE_WIDTH, ROW_COUNT * ROW_HEIGHT, LCD_BODY_BG);
+  draw_values(cv, 0, 0, telemetry);
+  lcd_display_body_canvas(VALUE_X, ROW_Y, cv);
+  lcd_free_canvas(cv);
+}
+
+void work_screen_task_link() {
+  kbd_system_core1_t *c = &kbd_system.core1;
+  uint8_t *req = c->task_request;
+
+  kbd_link_telemetry_t telemetry[2];
+  if (req[3] != sizeof(telemetry))
+    return;
+  memcpy(telemetry, req + 4, sizeof(telemetry));
+
+  switch (req[2]) {
+  case 1:
+    init_screen(telemetry);
+    break;
+  case 2:
+    update_screen(telemetry);
+    break;
+  default:
+    break;
+  }
+}
+
+#endif
+
+#ifdef KBD_NODE_RIGHT
+
+void work_screen_task_link() {} // no action
+
+#endif
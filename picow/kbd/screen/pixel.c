@@ -63,11 +63,11 @@ void handle_screen_event_pixel(kbd_event_t event) {
             // save to flash
             memcpy(&pixel_config, lres+4, sizeof(pixel_config_t));
             memcpy(fd->data, &pixel_config, sizeof(pixel_config_t));
-            flash_store_save(fd);
+            uint16_t pos = flash_store_save(fd); // fd->pos once flashed
             // show on lcd
             init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
             lreq[2] = 1;
-            lreq[3] = fd->pos;
+            lreq[3] = pos;
             memcpy(lreq+4, fd->data, sizeof(pixel_config_t));
         }
         break;
@@ -57,11 +57,11 @@ void handle_screen_event_power(kbd_event_t event) {
             data[0] = CONFIG_VERSION;
             data[1] = lres[4]; // backlight
             data[2] = lres[5]; // idle_minutes
-            flash_store_save(fd);
+            uint16_t pos = flash_store_save(fd); // fd->pos once flashed
             // show on lcd
             init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
             lreq[2] = 1;
-            lreq[3] = fd->pos;
+            lreq[3] = pos;
             lreq[4] = data[1];
             lreq[5] = data[2];
         }
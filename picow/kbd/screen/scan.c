@@ -1,12 +1,33 @@
+#include <stdio.h>
 #include <string.h>
 
+#include "../ble_comm.h"
 #include "../data_model.h"
 #include "../hw_model.h"
 
 #define THIS_SCREEN kbd_info_screen_scan
 
+// stats of a link: overflows, reorders, malformed, burst max, each capped to a byte
+// then connection interval, latency<<4 | phy<<1 | dle, and the time taken to connect in 10 ms
+#define LINK_STATS_SIZE 7
+
 #ifdef KBD_NODE_AP
 
+static inline uint8_t cap8(uint32_t v) { return v > 0xFF ? 0xFF : v; }
+
+static void read_link_stats(uint8_t comm_id, uint8_t *buff) {
+  ble_comm_t *comm = ble_find_comm_by_id(comm_id);
+  buff[0] = cap8(comm->recv_overflows);
+  buff[1] = cap8(comm->recv_duplicates + comm->recv_out_of_sync);
+  buff[2] = cap8(comm->recv_malformed);
+  buff[3] = comm->recv_burst_max;
+  ble_link_t *link = &comm->link;
+  buff[4] = cap8(link->interval);
+  buff[5] = (link->latency > 0x0F ? 0x0F : link->latency) << 4 | (link->phy & 0x07) << 1 |
+            (link->tx_octets > 27 ? 1 : 0);
+  buff[6] = cap8(comm->connect_ms / 10);
+}
+
 void handle_screen_event_scan(kbd_event_t event) {
   kbd_system_core1_t *c = &kbd_system.core1;
   uint8_t *lreq = c->left_task_request;
@@ -18,7 +39,7 @@ void handle_screen_event_scan(kbd_event_t event) {
   init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
 
   lreq[2] = (event == kbd_screen_event_INIT) ? 1 : 2;
-  lreq[3] = hw_row_count * 2 + sizeof(kbd_tb_motion_t);
+  lreq[3] = hw_row_count * 2 + sizeof(kbd_tb_motion_t) + 2 * LINK_STATS_SIZE;
 
   // add scan data
   uint8_t pos = 4;
@@ -27,6 +48,10 @@ void handle_screen_event_scan(kbd_event_t event) {
   memcpy(lreq + pos, c->right_key_press, hw_row_count);
   pos += hw_row_count;
   memcpy(lreq + pos, &c->tb_motion, sizeof(kbd_tb_motion_t));
+  pos += sizeof(kbd_tb_motion_t);
+  read_link_stats(BLE_COMM_LEFT_ID, lreq + pos);
+  pos += LINK_STATS_SIZE;
+  read_link_stats(BLE_COMM_RIGHT_ID, lreq + pos);
 
   // init right
   if (event == kbd_screen_event_INIT) {
@@ -77,6 +102,49 @@ static int16_t scale_tb_motion(int32_t x, uint16_t max) {
   return (int16_t)(x > max ? max : x < -max ? -max : x);
 }
 
+static void draw_link_stats(lcd_canvas_t *cv, uint16_t x, uint16_t y, char id, const uint8_t *stats, uint8_t line) {
+  char txt[32];
+  if (line == 0) {
+    // o: overflows, r: reorders, m: malformed, b: burst max
+    sprintf(txt, "%c o%u r%u m%u b%u", id, stats[0], stats[1], stats[2], stats[3]);
+  } else {
+    // interval ms, l: latency, phy, dle if data length extended, c: ms to connect
+    uint8_t interval = stats[4];
+    sprintf(txt, "%u.%02u l%u %uM%s c%u", interval * 125 / 100, 25 * (interval & 3), stats[5] >> 4,
+            (stats[5] >> 1) & 0x07, stats[5] & 1 ? " dle" : "", stats[6] * 10);
+  }
+  lcd_canvas_text(cv, x, y, txt, &lcd_font8, DARK_GRAY, LCD_BODY_BG);
+}
+
+static void draw_bulk_rate(lcd_canvas_t *cv, uint16_t x, uint16_t y) {
+  // the bulk transfer received by this node (probed by AP while on this screen), in KB/s
+  bulk_receiver_t *rx = &kbd_system.bulk_rx;
+  uint32_t rate = rx->rate;
+  char txt[32];
+  sprintf(txt, "bulk %lu.%lu KB/s%s", rate / 1024, (rate % 1024) * 10 / 1024,
+          rx->state == bulk_state_FAILED ? " crc!" : "");
+  lcd_canvas_text(cv, x, y, txt, &lcd_font8, DARK_GRAY, LCD_BODY_BG);
+}
+
+static void display_link_stats(const uint8_t *req) {
+  // above and below the horizontal tb bar
+  const uint8_t *stats = req + 4 + hw_row_count * 2 + sizeof(kbd_tb_motion_t);
+  lcd_canvas_t *cv = lcd_new_canvas(100, 8, LCD_BODY_BG);
+  uint16_t ys[2] = {83, 108};
+  for (uint8_t line = 0; line < 2; line++) {
+    lcd_canvas_clear(cv);
+    draw_link_stats(cv, 0, 0, 'L', stats, line);
+    lcd_display_body_canvas(5, ys[line], cv);
+    lcd_canvas_clear(cv);
+    draw_link_stats(cv, 0, 0, 'R', stats + LINK_STATS_SIZE, line);
+    lcd_display_body_canvas(135, ys[line], cv);
+  }
+  lcd_canvas_clear(cv);
+  draw_bulk_rate(cv, 0, 0);
+  lcd_display_body_canvas(5, 116, cv);
+  lcd_free_canvas(cv);
+}
+
 static void init_screen() {
   lcd_canvas_t *cv = kbd_hw.lcd_body;
   lcd_canvas_clear(cv);
@@ -124,6 +192,13 @@ static void init_screen() {
       lcd_canvas_rect(cv, 115, 90 + dy, 10, -dy, YELLOW, 1, true);
   }
 
+  const uint8_t *stats = req + 4 + hw_row_count * 2 + sizeof(kbd_tb_motion_t);
+  for (uint8_t line = 0; line < 2; line++) {
+    draw_link_stats(cv, 5, line ? 108 : 83, 'L', stats, line);
+    draw_link_stats(cv, 135, line ? 108 : 83, 'R', stats + LINK_STATS_SIZE, line);
+  }
+  draw_bulk_rate(cv, 5, 116);
+
   lcd_display_body();
 }
 
@@ -184,6 +259,8 @@ static void update_screen() {
   lcd_free_canvas(canvas);
   lcd_free_canvas(cv0);
   lcd_free_canvas(cv1);
+
+  display_link_stats(req);
 }
 
 void work_screen_task_scan() {
@@ -77,11 +77,11 @@ void handle_screen_event_tb(kbd_event_t event) {
             // save to flash
             memcpy(&tb_motion_config, lres+4, sizeof(tb_motion_config_t));
             memcpy(fd->data, &tb_motion_config, sizeof(tb_motion_config_t));
-            flash_store_save(fd);
+            uint16_t pos = flash_store_save(fd); // fd->pos once flashed
             // show on lcd
             init_task_request(lreq, &c->left_task_request_ts, THIS_SCREEN);
             lreq[2] = 1;
-            lreq[3] = fd->pos;
+            lreq[3] = pos;
             memcpy(lreq+4, fd->data, sizeof(tb_motion_config_t));
         }
         break;
@@ -7,6 +7,7 @@
 kbd_screen_t kbd_info_screens[KBD_INFO_SCREEN_COUNT] = {
     kbd_info_screen_welcome,
     kbd_info_screen_scan,
+    kbd_info_screen_link,
 };
 
 kbd_screen_t kbd_config_screens[KBD_CONFIG_SCREEN_COUNT] = {
@@ -14,50 +15,59 @@ kbd_screen_t kbd_config_screens[KBD_CONFIG_SCREEN_COUNT] = {
     kbd_config_screen_power,
     kbd_config_screen_tb,
     kbd_config_screen_pixel,
+    kbd_config_screen_debounce,
 };
 
 #ifdef KBD_NODE_AP
 
 extern screen_event_handler_t handle_screen_event_welcome;
 extern screen_event_handler_t handle_screen_event_scan;
+extern screen_event_handler_t handle_screen_event_link;
 
 static screen_event_handler_t* info_screen_event_handlers[KBD_INFO_SCREEN_COUNT] = {
     handle_screen_event_welcome,
     handle_screen_event_scan,
+    handle_screen_event_link,
 };
 
 extern screen_event_handler_t handle_screen_event_date;
 extern screen_event_handler_t handle_screen_event_power;
 extern screen_event_handler_t handle_screen_event_tb;
 extern screen_event_handler_t handle_screen_event_pixel;
+extern screen_event_handler_t handle_screen_event_debounce;
 
 static screen_event_handler_t* config_screen_event_handlers[KBD_CONFIG_SCREEN_COUNT] = {
     handle_screen_event_date,
     handle_screen_event_power,
     handle_screen_event_tb,
     handle_screen_event_pixel,
+    handle_screen_event_debounce,
 };
 
 #else
 
 extern screen_task_worker_t work_screen_task_welcome;
 extern screen_task_worker_t work_screen_task_scan;
+extern screen_task_worker_t work_screen_task_link;
 
 static screen_task_worker_t* info_screen_task_workers[KBD_INFO_SCREEN_COUNT] = {
     work_screen_task_welcome,
     work_screen_task_scan,
+    work_screen_task_link,
 };
 
 extern screen_task_worker_t work_screen_task_date;
 extern screen_task_worker_t work_screen_task_power;
 extern screen_task_worker_t work_screen_task_tb;
 extern screen_task_worker_t work_screen_task_pixel;
+extern screen_task_worker_t work_screen_task_debounce;
 
 static screen_task_worker_t* config_screen_task_workers[KBD_CONFIG_SCREEN_COUNT] = {
     work_screen_task_date,
     work_screen_task_power,
     work_screen_task_tb,
     work_screen_task_pixel,
+    work_screen_task_debounce,
 };
 
 #endif
@@ -66,24 +76,28 @@ extern config_screen_data_initiator_t init_config_screen_data_date;
 extern config_screen_data_initiator_t init_config_screen_data_power;
 extern config_screen_data_initiator_t init_config_screen_data_tb;
 extern config_screen_data_initiator_t init_config_screen_data_pixel;
+extern config_screen_data_initiator_t init_config_screen_data_debounce;
 
 static config_screen_data_initiator_t* config_screen_data_initiators[KBD_CONFIG_SCREEN_COUNT] = {
     init_config_screen_data_date,
     init_config_screen_data_power,
     init_config_screen_data_tb,
     init_config_screen_data_pixel,
+    init_config_screen_data_debounce,
 };
 
 extern config_screen_data_applier_t apply_config_screen_data_date;
 extern config_screen_data_applier_t apply_config_screen_data_power;
 extern config_screen_data_applier_t apply_config_screen_data_tb;
 extern config_screen_data_applier_t apply_config_screen_data_pixel;
+extern config_screen_data_applier_t apply_config_screen_data_debounce;
 
 static config_screen_data_applier_t* config_screen_data_appliers[KBD_CONFIG_SCREEN_COUNT] = {
     apply_config_screen_data_date,
     apply_config_screen_data_power,
     apply_config_screen_data_tb,
     apply_config_screen_data_pixel,
+    apply_config_screen_data_debounce,
 };
 
 ////////////////////////////////////////////////////////////
@@ -20,18 +20,20 @@
  * Each config screen gets a flash storage of 32 bytes (kbd_system.core1.flash_datasets)
  */
 
-#define KBD_INFO_SCREEN_COUNT 2
-#define KBD_CONFIG_SCREEN_COUNT 4
+#define KBD_INFO_SCREEN_COUNT 3
+#define KBD_CONFIG_SCREEN_COUNT 5
 
 typedef enum {
     // info screens
     kbd_info_screen_welcome = 0x00,
     kbd_info_screen_scan,
+    kbd_info_screen_link,
     // config screens
     kbd_config_screen_date = 0x80,
     kbd_config_screen_power,
     kbd_config_screen_tb,
     kbd_config_screen_pixel,
+    kbd_config_screen_debounce,
 } kbd_screen_t;
 
 extern kbd_screen_t kbd_info_screens[KBD_INFO_SCREEN_COUNT];
@@ -50,6 +52,7 @@ uint8_t get_screen_index(kbd_screen_t screen);
 
 // there is only one task possible at a time for any node.
 // no more tasks until the current one is completed.
+// anything larger than a task (KBD_TASK_DATA_SIZE) goes by bulk transfer (kbd_system.bulk_tx/bulk_rx)
 
 // each screen creates its own request and responds to it
 // and it must clear the request upon completion
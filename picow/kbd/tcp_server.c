@@ -8,9 +8,82 @@
 #include "pico_fota_bootloader.h"
 
 #include "data_model.h"
+#include "fw_flash.h"
+#include "hw_model.h"
+#include "util/fw_download.h"
+
+#define TCP_CMD_LINK_TELEMETRY 0x04
+
+#ifdef KBD_NODE_AP
+// the download that follows is of AP (as on a new connection), or staged and relayed to left/right
+#define TCP_CMD_TARGET_AP 0x0B
+#define TCP_CMD_TARGET_LEFT 0x0C
+#define TCP_CMD_TARGET_RIGHT 0x0D
+#define TCP_CMD_RELAY_STATUS 0x0E
+#endif
 
 static bool reboot = false;
 
+static void flash_init_slot(void) {
+    kbd_system.firmware_downloading = true; // core1 and ble stop, off the flash
+    pfb_initialize_download_slot();
+}
+
+static bool flash_write(const uint8_t* data, uint32_t offset, uint32_t size) {
+    return pfb_write_to_flash_aligned_256_bytes((uint8_t*) data, offset, size) == 0;
+}
+
+static const fw_download_flash_t fw_flash = {
+    .init_slot = flash_init_slot,
+    .write = flash_write,
+    .mark_valid = pfb_mark_download_slot_as_valid,
+    .running = fw_flash_running,
+};
+
+static fw_download_t fw_download; // kept across the connections, to resume
+
+#ifdef KBD_NODE_AP
+
+// the image of a node, as a stream of fw_download commands, staged in a region of the W25Q32,
+// a sector at a time, flashed by core1 while BLE goes on, then relayed to the node (see util/fw_relay.h)
+static fw_download_t fw_staged[2]; // 0-left, 1-right
+
+static void staged_init_slot(uint8_t i) {
+    fw_relay_sender_stop(kbd_system.fw_relay + i);
+}
+
+static bool staged_write(uint8_t i, const uint8_t* data, uint32_t offset, uint32_t size) {
+    if (offset > KBD_FW_STAGE_SIZE || size > KBD_FW_STAGE_SIZE - offset) return false;
+    return fw_stage_write(KBD_FW_STAGE_ADDR + i * KBD_FW_STAGE_SIZE + offset, data, size);
+}
+
+static void staged_mark_valid(uint8_t i, bool (*read)(uint32_t offset, uint8_t* buf, uint32_t len)) {
+    fw_stage_read_reset(i);
+    fw_relay_sender_start(kbd_system.fw_relay + i, read, fw_staged[i].image_size);
+}
+
+static bool staged_read(uint8_t i, uint32_t offset, uint8_t* buf, uint32_t len) {
+    return fw_stage_read(i, KBD_FW_STAGE_ADDR + i * KBD_FW_STAGE_SIZE + offset, buf, len);
+}
+
+static void staged_init_left(void) { staged_init_slot(0); }
+static void staged_init_right(void) { staged_init_slot(1); }
+static bool staged_write_left(const uint8_t* data, uint32_t offset, uint32_t size) { return staged_write(0, data, offset, size); }
+static bool staged_write_right(const uint8_t* data, uint32_t offset, uint32_t size) { return staged_write(1, data, offset, size); }
+static bool staged_read_left(uint32_t offset, uint8_t* buf, uint32_t len) { return staged_read(0, offset, buf, len); }
+static bool staged_read_right(uint32_t offset, uint8_t* buf, uint32_t len) { return staged_read(1, offset, buf, len); }
+static void staged_mark_valid_left(void) { staged_mark_valid(0, staged_read_left); }
+static void staged_mark_valid_right(void) { staged_mark_valid(1, staged_read_right); }
+
+static const fw_download_flash_t fw_staged_flash[2] = {
+    {.init_slot = staged_init_left, .write = staged_write_left, .mark_valid = staged_mark_valid_left, .busy = fw_stage_busy},
+    {.init_slot = staged_init_right, .write = staged_write_right, .mark_valid = staged_mark_valid_right, .busy = fw_stage_busy},
+};
+
+#endif
+
+static fw_download_t* fw_target = &fw_download; // of the download commands read
+
 static err_t tcp_close_client_connection(tcp_client_t* client, struct tcp_pcb* client_pcb, err_t close_err) {
     if (client_pcb) {
         assert(client && client->pcb == client_pcb);
@@ -25,6 +98,8 @@ static err_t tcp_close_client_connection(tcp_client_t* client, struct tcp_pcb* c
             close_err = ERR_ABRT;
         }
         if (client) {
+            if (client->server->client == client) client->server->client = NULL;
+            if (client->pending) pbuf_free(client->pending);
             free(client);
         }
     }
@@ -39,6 +114,65 @@ static err_t tcp_server_sent(void* arg, struct tcp_pcb* pcb, u16_t len) {
     return ERR_OK;
 }
 
+static u16_t tcp_server_command(struct tcp_pcb* pcb, u8_t cmd) {
+    // the single byte commands, returns the bytes read
+    if(cmd==TCP_CMD_LINK_TELEMETRY) { // 0x00, count, then kbd_link_telemetry_t per link (little endian)
+        u8_t res[2 + KBD_LINK_COUNT * sizeof(kbd_link_telemetry_t)] = {0x00, KBD_LINK_COUNT};
+        uint64_t ts;
+        read_shared_buffer(kbd_system.sb_link_telemetry, &ts, res + 2);
+        tcp_write(pcb,res,sizeof(res),TCP_WRITE_FLAG_COPY);
+    }
+#ifdef KBD_NODE_AP
+    else if(cmd>=TCP_CMD_TARGET_AP && cmd<=TCP_CMD_TARGET_RIGHT) { // no reply
+        fw_target = cmd==TCP_CMD_TARGET_AP ? &fw_download : fw_staged + (cmd - TCP_CMD_TARGET_LEFT);
+    }
+    else if(cmd==TCP_CMD_RELAY_STATUS) { // 0x00, count, then state, status, size(4), read(4) per node
+        u8_t res[2 + 2 * 10] = {0x00, 2};
+        for(u8_t i=0; i<2; i++) {
+            fw_relay_sender_t* rs = kbd_system.fw_relay + i;
+            u8_t* b = res + 2 + i * 10;
+            b[0] = rs->state;
+            b[1] = rs->status;
+            memcpy(b + 2, &rs->size, 4);
+            memcpy(b + 6, &rs->read, 4);
+        }
+        tcp_write(pcb,res,sizeof(res),TCP_WRITE_FLAG_COPY);
+    }
+#endif
+    return 1; // else unknown, skipped
+}
+
+static void tcp_server_read(tcp_client_t* client) {
+    // read the data received so far, as a stream of commands across the pbufs,
+    // the download may hold it back till its sector buffers are flashed (tcp_server_task),
+    // and the tcp window closes meanwhile, as the data is acknowledged only once read
+    struct pbuf* p = client->pending;
+    u32_t read = 0;
+    while (p) {
+        u8_t* b = (u8_t*) p->payload;
+        u16_t n;
+        fw_download_t* dl = fw_target;
+        if (!fw_download_in_command(dl) && !fw_download_is_command(b[0])) {
+            n = tcp_server_command(client->pcb, b[0]);
+        } else {
+            n = fw_download_read(dl, b, p->len);
+        }
+        bool replied = dl->reply_len > 0;
+        if (replied) {
+            tcp_write(client->pcb, dl->reply, dl->reply_len, TCP_WRITE_FLAG_COPY);
+            dl->reply_len = 0;
+            // once the reply is sent, unless staged for a node
+            if (dl == &fw_download && dl->state == fw_download_state_DONE) reboot = true;
+        }
+        if (n == 0 && !replied) break;
+        read += n;
+        p = pbuf_free_header(p, n);
+    }
+    client->pending = p;
+    if (read > 0) tcp_recved(client->pcb, read);
+    tcp_output(client->pcb);
+}
+
 static err_t tcp_server_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err) {
     (void) err;
     tcp_client_t* client = (tcp_client_t*) arg;
@@ -46,25 +180,12 @@ static err_t tcp_server_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err
         return tcp_close_client_connection(client, pcb, ERR_OK);
     }
     assert(client && client->pcb == pcb);
-    if (p->tot_len > 0) {
-        u8_t* b = (u8_t*)p->payload;
-        if(b[0]==0x01) { // initialize flash
-            kbd_system.firmware_downloading = true;
-            pfb_initialize_download_slot();
-        } else if(b[0]==0x02) { // flash
-            u32_t offset = 1024 * (b[1]*0x100 + b[2]);
-            u8_t buf[1024];
-            pbuf_copy_partial(p, buf, 1024, 4);
-            pfb_write_to_flash_aligned_256_bytes(buf, offset, 1024);
-        } else if(b[0]==0x03) { // finalize flash
-            pfb_mark_download_slot_as_valid();
-            reboot = true;
-        }
-        tcp_recved(pcb, p->tot_len);
-        u8_t res[1] = {0x00};
-        tcp_write(pcb,res,1,TCP_WRITE_FLAG_COPY);
+    if (client->pending) {
+        pbuf_cat(client->pending, p);
+    } else {
+        client->pending = p;
     }
-    pbuf_free(p);
+    tcp_server_read(client);
     return ERR_OK;
 }
 
@@ -88,6 +209,15 @@ static err_t tcp_server_accept(void* arg, struct tcp_pcb* client_pcb, err_t err)
     tcp_client_t* client = (tcp_client_t*) malloc(sizeof(tcp_client_t));
     client->pcb = client_pcb;
     client->gw = &server->gw;
+    client->server = server;
+    client->pending = NULL;
+    server->client = client; // the latest, for the download
+    fw_download_restart_stream(&fw_download);
+#ifdef KBD_NODE_AP
+    fw_download_restart_stream(fw_staged);
+    fw_download_restart_stream(fw_staged + 1);
+#endif
+    fw_target = &fw_download;
 
     // setup connection to client
     tcp_arg(client_pcb, client);
@@ -100,6 +230,12 @@ static err_t tcp_server_accept(void* arg, struct tcp_pcb* client_pcb, err_t err)
 }
 
 bool tcp_server_open(tcp_server_t* server, const char *server_name) {
+    fw_download_init(&fw_download, &fw_flash);
+#ifdef KBD_NODE_AP
+    fw_download_init(fw_staged, fw_staged_flash);
+    fw_download_init(fw_staged + 1, fw_staged_flash + 1);
+#endif
+    server->client = NULL;
     struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     err_t err = tcp_bind(pcb, IP_ANY_TYPE, hw_tcp_port);
     if(err==ERR_OK) {
@@ -111,6 +247,18 @@ bool tcp_server_open(tcp_server_t* server, const char *server_name) {
     return false;
 }
 
+void tcp_server_task(tcp_server_t* server) {
+    // flash a sector of the download, off the tcp callbacks, then read on what was held back
+    bool flushed = fw_download_flush(&fw_download);
+#ifdef KBD_NODE_AP
+    flushed = fw_download_flush(fw_staged) || flushed;
+    flushed = fw_download_flush(fw_staged + 1) || flushed;
+#endif
+    if (flushed && server->client) {
+        tcp_server_read(server->client);
+    }
+}
+
 void tcp_server_close(tcp_server_t* server) {
     if (server->pcb) {
         tcp_arg(server->pcb, NULL);
@@ -3,19 +3,27 @@
 
 #include "lwip/tcp.h"
 
+typedef struct tcp_client tcp_client_t;
+
 typedef struct {
     struct tcp_pcb* pcb;
     ip_addr_t gw;
+    tcp_client_t* client; // connected latest
 } tcp_server_t;
 
-typedef struct {
+struct tcp_client {
     struct tcp_pcb* pcb;
     ip_addr_t* gw;
-} tcp_client_t;
+    tcp_server_t* server;
+    struct pbuf* pending; // received, not yet read
+};
 
 
 bool tcp_server_open(tcp_server_t* server, const char *server_name);
 
+// flash the download as received, from the main loop while wifi is on
+void tcp_server_task(tcp_server_t* server);
+
 void tcp_server_close(tcp_server_t* server);
 
 #endif
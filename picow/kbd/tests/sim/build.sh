@@ -0,0 +1,40 @@
+#!/bin/sh
+# Builds the link simulation (tests/sim_link.c) with the firmware of the three nodes,
+# see sim.h. Run from anywhere, the binary goes to $1 (default /tmp/sim_link).
+#
+# Each node is compiled for itself and linked into one relocatable object, then its
+# globals are renamed with a prefix (ap_, left_, right_), so the three link together.
+
+set -e
+
+KBD=$(cd "$(dirname "$0")/../.." && pwd)
+OUT=${1:-/tmp/sim_link}
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+CC=${CC:-gcc}
+CFLAGS="-O2 -g -Wall -Wno-unused-function -I$KBD/tests/sim/include -I$KBD/tests/sim -I$KBD -I$KBD/usb"
+
+COMMON="core0.c data_model.c ble_comm.c util/key_event.c util/spsc_queue.c util/shared_buffer.c util/bulk_transfer.c util/crc32.c util/clock_sync.c util/fw_relay.c util/fw_download.c util/lz4_block.c"
+AP_SRCS="$COMMON core1.c input_processor.c key_layout.c util/keymap.c"
+NODE_SRCS="$COMMON util/key_debounce.c"
+
+build_node() { # prefix, node, sources
+    objs=""
+    for src in $3; do
+        obj="$BUILD/$1_$(echo "$src" | tr / _).o"
+        $CC $CFLAGS -DKBD_NODE_$2 -c "$KBD/$src" -o "$obj"
+        objs="$objs $obj"
+    done
+    $CC $CFLAGS -DKBD_NODE_$2 -c "$KBD/tests/sim/sim_node.c" -o "$BUILD/$1_sim_node.o"
+    ld -r -o "$BUILD/$1.o" $objs "$BUILD/$1_sim_node.o"
+    nm -g --defined-only "$BUILD/$1.o" | awk -v p="$1_" '{print $3, p $3}' > "$BUILD/$1.syms"
+    objcopy --redefine-syms="$BUILD/$1.syms" "$BUILD/$1.o"
+}
+
+build_node ap AP "$AP_SRCS"
+build_node left LEFT "$NODE_SRCS"
+build_node right RIGHT "$NODE_SRCS"
+
+$CC $CFLAGS -o "$OUT" "$KBD/tests/sim_link.c" "$BUILD/ap.o" "$BUILD/left.o" "$BUILD/right.o"
+echo "built $OUT"
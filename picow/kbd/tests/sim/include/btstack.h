@@ -0,0 +1,36 @@
+#ifndef _SIM_BTSTACK_H
+#define _SIM_BTSTACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the run loop of a node, driven by the virtual clock, see tests/sim/sim_node.c
+
+typedef struct btstack_timer_source {
+    void (*process)(struct btstack_timer_source *ts);
+    uint32_t timeout; // ms
+} btstack_timer_source_t;
+
+typedef enum { DATA_SOURCE_CALLBACK_POLL = 1 } btstack_data_source_callback_type_t;
+
+typedef struct btstack_data_source {
+    void (*process)(struct btstack_data_source *ds, btstack_data_source_callback_type_t type);
+    uint16_t flags;
+} btstack_data_source_t;
+
+#define HCI_POWER_OFF 0
+
+void btstack_run_loop_set_timer(btstack_timer_source_t *ts, uint32_t ms);
+void btstack_run_loop_add_timer(btstack_timer_source_t *ts);
+int btstack_run_loop_remove_timer(btstack_timer_source_t *ts);
+void btstack_run_loop_set_data_source_handler(btstack_data_source_t *ds,
+                                                void (*process)(btstack_data_source_t *ds,
+                                                                btstack_data_source_callback_type_t type));
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t *ds, uint16_t flags);
+void btstack_run_loop_add_data_source(btstack_data_source_t *ds);
+void btstack_run_loop_poll_data_sources_from_irq(void);
+void btstack_run_loop_execute(void);
+void btstack_run_loop_trigger_exit(void);
+int hci_power_control(int mode);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _SIM_HARDWARE_DMA_H
+#define _SIM_HARDWARE_DMA_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+
+#endif
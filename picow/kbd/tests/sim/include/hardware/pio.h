@@ -0,0 +1,10 @@
+#ifndef _SIM_HARDWARE_PIO_H
+#define _SIM_HARDWARE_PIO_H
+
+#include <stdint.h>
+
+typedef unsigned int uint;
+typedef struct pio_hw pio_hw_t;
+typedef pio_hw_t *PIO;
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _SIM_HARDWARE_SPI_H
+#define _SIM_HARDWARE_SPI_H
+
+typedef struct spi_inst spi_inst_t;
+
+#endif
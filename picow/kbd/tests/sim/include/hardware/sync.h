@@ -0,0 +1,23 @@
+#ifndef _SIM_HARDWARE_SYNC_H
+#define _SIM_HARDWARE_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// all the nodes run on one thread, no locking needed
+
+typedef volatile uint32_t spin_lock_t;
+
+static inline void __dmb(void) { __sync_synchronize(); }
+static inline void __sev(void) {}
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+static inline uint32_t spin_lock_blocking(spin_lock_t *l) { (void)l; return 0; }
+static inline void spin_unlock(spin_lock_t *l, uint32_t s) { (void)l; (void)s; }
+static inline int spin_lock_claim_unused(bool required) { (void)required; return 0; }
+static inline spin_lock_t *spin_lock_init(int num) {
+    static spin_lock_t locks[32];
+    return locks + num;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _SIM_LWIP_TCP_H
+#define _SIM_LWIP_TCP_H
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+struct tcp_pcb;
+struct pbuf;
+typedef struct {
+    uint32_t addr;
+} ip_addr_t;
+
+#define LWIP_MAKEU32(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _SIM_PICO_CYW43_ARCH_H
+#define _SIM_PICO_CYW43_ARCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CYW43_AUTH_WPA2_AES_PSK 0x00400004
+
+// no wifi in the simulation
+static inline void cyw43_arch_gpio_put(uint32_t gpio, bool value) { (void)gpio; (void)value; }
+static inline void cyw43_arch_enable_ap_mode(const char *ssid, const char *pw, uint32_t auth) {
+    (void)ssid; (void)pw; (void)auth;
+}
+static inline void cyw43_arch_disable_ap_mode(void) {}
+static inline void cyw43_arch_enable_sta_mode(void) {}
+static inline void cyw43_arch_disable_sta_mode(void) {}
+static inline void cyw43_arch_poll(void) {}
+static inline void cyw43_arch_deinit(void) {}
+static inline int cyw43_arch_wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, uint32_t ms) {
+    (void)ssid; (void)pw; (void)auth; (void)ms;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _SIM_PICO_MULTICORE_H
+#define _SIM_PICO_MULTICORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// core0 -> core1 wake ups of a node, see tests/sim/sim_node.c
+bool multicore_fifo_wready(void);
+bool multicore_fifo_rvalid(void);
+void multicore_fifo_push_blocking(uint32_t data);
+uint32_t multicore_fifo_pop_blocking(void);
+
+#endif
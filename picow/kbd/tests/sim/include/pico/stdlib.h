@@ -0,0 +1,33 @@
+#ifndef _SIM_PICO_STDLIB_H
+#define _SIM_PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the clock of the node, the virtual clock of the simulation skewed per node (tests/sim/sim.h)
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+uint64_t sim_node_now_us(void);
+
+static inline uint64_t time_us_64(void) { return sim_node_now_us(); }
+static inline absolute_time_t get_absolute_time(void) { return sim_node_now_us(); }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+static inline uint32_t us_to_ms(uint64_t us) { return (uint32_t)(us / 1000); }
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return sim_node_now_us() + 1000ull * ms; }
+static inline bool best_effort_wfe_or_timeout(absolute_time_t t) { (void)t; return true; }
+static inline void sleep_ms(uint32_t ms) { (void)ms; }
+static inline void tight_loop_contents(void) {}
+static inline void gpio_put(uint gpio, bool value) { (void)gpio; (void)value; }
+
+#define __not_in_flash_func(f) f
+
+#ifndef MIN
+#define MIN(a, b) ((b) > (a) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#endif
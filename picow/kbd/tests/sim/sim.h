@@ -0,0 +1,63 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Three node link simulation (tests/sim_link.c)
+ *
+ * Each node is the firmware (core0.c, data_model.c, ble_comm.c, ..., core1.c on AP)
+ * built for the node, with sim_node.c in place of the hardware, BTstack, USB and core1 loop,
+ * linked into one relocatable object with its globals renamed by a node prefix
+ * (ap_, left_, right_), see tests/sim/build.sh. So the three run in one process,
+ * each with its own kbd_system, and the harness sees them only through their sim_node.
+ *
+ * The harness provides the virtual clock and the key matrix, not renamed. Each node runs
+ * on its own clock, the virtual one with an offset and a rate error, as set by the harness.
+ */
+
+#define SIM_SIDE_LEFT 0
+#define SIM_SIDE_RIGHT 1
+
+// by the harness
+uint64_t sim_now_us(void);
+// raw level of a key at the latest scan frame (1 ms), as the pio would sample it
+bool sim_raw_key(uint8_t side, uint8_t row, uint8_t col);
+
+typedef struct {
+    // as main/core0_main/core1_main would do, upto the run loop
+    void (*init)(void);
+    // the earliest timer or wake up of the run loop, UINT64_MAX if none
+    uint64_t (*next_due_us)(void);
+    // run loop, the due timers and data sources
+    void (*run)(void);
+    // every ms: the core1 loop (AP), a key scan frame, an edge irq if armed (left/right)
+    void (*tick_ms)(void);
+    // core1 woken up by core0 (AP), run right away
+    bool (*core1_woken)(void);
+
+    // link, comm_id is the peer (BLE_COMM_LEFT_ID/RIGHT_ID) on AP, ignored on left/right
+    void (*connect)(uint8_t comm_id);
+    uint8_t (*next_send)(uint8_t comm_id, uint8_t* buff); // frame to send, 0 if none
+    void (*receive)(uint8_t comm_id, const uint8_t* buff, uint8_t len);
+    // connection interval as requested by the central (AP), in 1.25 ms units
+    uint16_t (*link_interval)(uint8_t comm_id);
+    void (*link_updated)(uint8_t comm_id, uint16_t interval);
+
+    // AP: the keyboard report as last handed to USB, a bit per key code
+    const uint8_t* (*usb_key_bits)(void);
+    // AP: key code as per the base layer, 0 if not a plain key (modifier, special, tap-hold, combo)
+    uint8_t (*key_code)(uint8_t side, uint8_t row, uint8_t col);
+
+    // link stats, of the comm
+    uint32_t (*retransmits)(uint8_t comm_id);
+
+    // the node clock: node = virtual + offset + virtual * ppm / 10^6
+    void (*set_clock)(int64_t offset_us, int32_t ppm);
+    uint64_t (*now_us)(void);
+    // AP: clock of the node (comm_id) - AP clock, as estimated by the clock sync, false till synced
+    bool (*clock_offset)(uint8_t comm_id, int64_t* offset_us);
+} sim_node_t;
+
+#endif
@@ -0,0 +1,543 @@
+/*
+ * A node of the link simulation, in place of the hardware, BTstack, USB and the
+ * core1 loop, built once per node (-DKBD_NODE_AP/LEFT/RIGHT) with the firmware.
+ * See sim.h.
+ *
+ * core0 runs as is: core0_main upto the run loop, then the bt_poll timer and the
+ * wake ups, as driven by the harness. The BLE stack is replaced by the harness
+ * pulling the frames at each connection event (ble_next_send) and pushing the ones
+ * received (ble_receive_data). On AP, core1 is the part of its loop which handles
+ * the inputs (process_inputs as woken up by core0, else on time), and USB takes the
+ * keyboard report as is. On left/right, core1 is only what comm depends on.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btstack.h"
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+
+#include "data_model.h"
+#include "fw_flash.h"
+#include "hw_model.h"
+
+#ifdef KBD_NODE_AP
+#include "input_processor.h"
+#include "key_layout.h"
+#include "usb_hid.h"
+#endif
+
+#include "sim.h"
+
+void core0_main();
+
+#ifdef KBD_NODE_AP
+void process_inputs(void* param);
+#endif
+void validate_comm_state(uint8_t index);
+
+////// clock of the node
+
+static int64_t clock_offset_us = 0;
+static int32_t clock_ppm = 0;
+
+uint64_t sim_node_now_us(void) {
+    uint64_t t = sim_now_us();
+    return t + clock_offset_us + (int64_t) t * clock_ppm / 1000000;
+}
+
+// the virtual time by which the node clock reaches node_t, rounded up
+static uint64_t sim_us(uint64_t node_t) {
+    int64_t t = (int64_t) node_t - clock_offset_us;
+    if(t <= 0) return 0;
+    return ((uint64_t) t * 1000000 + 1000000 + clock_ppm - 1) / (1000000 + clock_ppm) + 1;
+}
+
+static void set_clock(int64_t offset_us, int32_t ppm) {
+    clock_offset_us = offset_us;
+    clock_ppm = ppm;
+}
+
+static bool clock_offset(uint8_t comm_id, int64_t* offset_us) {
+#ifdef KBD_NODE_AP
+    clock_sync_t* cs = kbd_system.clock_sync + (comm_id == BLE_COMM_LEFT_ID ? 0 : 1);
+    *offset_us = clock_sync_offset(cs, time_us_64());
+    return cs->synced;
+#else
+    (void) comm_id;
+    (void) offset_us;
+    return false;
+#endif
+}
+
+////// hw_model
+
+kbd_hw_t kbd_hw;
+
+uint32_t board_millis() { return us_to_ms(time_us_64()); }
+
+void do_if_elapsed(uint32_t* t_ms, uint32_t dt_ms, void* param, void (*task)(void* param)) {
+    uint32_t ms = board_millis();
+    if(ms >= *t_ms + dt_ms) {
+        task(param);
+        if(dt_ms == 0 || *t_ms == 0) {
+            *t_ms = ms;
+            return;
+        }
+        while(*t_ms <= (ms - dt_ms)) {
+            *t_ms += dt_ms;
+        }
+    }
+}
+
+bool tcp_server_open(tcp_server_t* server, const char* server_name) {
+    (void) server;
+    (void) server_name;
+    return true;
+}
+
+void tcp_server_task(tcp_server_t* server) { (void) server; }
+
+////// fw_flash, not relayed in the simulation
+
+void fw_flash_reboot(void) {}
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+const fw_download_flash_t fw_flash_relayed = {0};
+#endif
+
+////// run loop
+
+#define SIM_TIMER_MAX 8
+#define SIM_DATA_SOURCE_MAX 4
+#define SIM_RUN_STEP_MAX 64 // timers run in a go, a timer may add itself back as due
+
+static btstack_timer_source_t* timers[SIM_TIMER_MAX];
+static btstack_data_source_t* data_sources[SIM_DATA_SOURCE_MAX];
+static bool poll_pending = false;
+static bool exited = false;
+static jmp_buf run_loop_entry;
+
+void btstack_run_loop_set_timer(btstack_timer_source_t* ts, uint32_t ms) {
+    ts->timeout = board_millis() + ms;
+}
+
+void btstack_run_loop_add_timer(btstack_timer_source_t* ts) {
+    for(int i=0; i<SIM_TIMER_MAX; i++)
+        if(timers[i] == ts) return;
+    for(int i=0; i<SIM_TIMER_MAX; i++)
+        if(!timers[i]) {
+            timers[i] = ts;
+            return;
+        }
+    fprintf(stderr, "sim: too many timers\n");
+    abort();
+}
+
+int btstack_run_loop_remove_timer(btstack_timer_source_t* ts) {
+    for(int i=0; i<SIM_TIMER_MAX; i++)
+        if(timers[i] == ts) {
+            timers[i] = NULL;
+            return 1;
+        }
+    return 0;
+}
+
+void btstack_run_loop_set_data_source_handler(btstack_data_source_t* ds,
+        void (*process)(btstack_data_source_t* ds, btstack_data_source_callback_type_t type)) {
+    ds->process = process;
+}
+
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t* ds, uint16_t flags) {
+    ds->flags |= flags;
+}
+
+void btstack_run_loop_add_data_source(btstack_data_source_t* ds) {
+    for(int i=0; i<SIM_DATA_SOURCE_MAX; i++)
+        if(!data_sources[i]) {
+            data_sources[i] = ds;
+            return;
+        }
+}
+
+void btstack_run_loop_poll_data_sources_from_irq(void) { poll_pending = true; }
+
+void btstack_run_loop_execute(void) { longjmp(run_loop_entry, 1); } // driven by the harness from here on
+
+void btstack_run_loop_trigger_exit(void) { exited = true; }
+
+int hci_power_control(int mode) {
+    (void) mode;
+    return 0;
+}
+
+static btstack_timer_source_t* due_timer() {
+    btstack_timer_source_t* due = NULL;
+    uint64_t now = time_us_64();
+    for(int i=0; i<SIM_TIMER_MAX; i++)
+        if(timers[i] && timers[i]->timeout * 1000ull <= now && (!due || timers[i]->timeout < due->timeout))
+            due = timers[i];
+    return due;
+}
+
+static uint64_t next_due_us(void) {
+    if(exited) return UINT64_MAX;
+    if(poll_pending) return sim_now_us();
+    uint64_t due = UINT64_MAX;
+    for(int i=0; i<SIM_TIMER_MAX; i++)
+        if(timers[i] && timers[i]->timeout * 1000ull < due)
+            due = timers[i]->timeout * 1000ull;
+    return due == UINT64_MAX ? due : sim_us(due);
+}
+
+static void run(void) {
+    for(int step=0; step<SIM_RUN_STEP_MAX && !exited; step++) {
+        if(poll_pending) {
+            poll_pending = false;
+            for(int i=0; i<SIM_DATA_SOURCE_MAX; i++)
+                if(data_sources[i] && (data_sources[i]->flags & DATA_SOURCE_CALLBACK_POLL))
+                    data_sources[i]->process(data_sources[i], DATA_SOURCE_CALLBACK_POLL);
+            continue;
+        }
+        btstack_timer_source_t* ts = due_timer();
+        if(!ts) return;
+        btstack_run_loop_remove_timer(ts);
+        ts->process(ts);
+    }
+}
+
+////// multicore fifo, core0 waking up core1
+
+static bool fifo_pending = false;
+
+bool multicore_fifo_wready(void) { return !fifo_pending; }
+
+bool multicore_fifo_rvalid(void) { return fifo_pending; }
+
+void multicore_fifo_push_blocking(uint32_t data) {
+    (void) data;
+    fifo_pending = true;
+}
+
+uint32_t multicore_fifo_pop_blocking(void) {
+    fifo_pending = false;
+    return KBD_CORE1_WAKE_INPUTS;
+}
+
+static bool core1_woken(void) { return fifo_pending; }
+
+////// BLE, in place of ble_client.c/ble_server.c
+
+#ifdef KBD_NODE_AP
+#define SIM_COMM_COUNT 2
+#else
+#define SIM_COMM_COUNT 1
+#endif
+
+static ble_comm_t comms[SIM_COMM_COUNT];
+
+ble_comm_t* ble_find_comm_by_id(uint8_t comm_id) {
+#ifdef KBD_NODE_AP
+    return comm_id == BLE_COMM_LEFT_ID ? comms : comm_id == BLE_COMM_RIGHT_ID ? comms + 1 : NULL;
+#else
+    (void) comm_id;
+    return comms;
+#endif
+}
+
+int ble_init(void) {
+    for(int i=0; i<SIM_COMM_COUNT; i++) {
+        ble_comm_t* comm = comms + i;
+        memset(comm, 0, sizeof(ble_comm_t));
+#ifdef KBD_NODE_AP
+        comm->id = i == 0 ? BLE_COMM_LEFT_ID : BLE_COMM_RIGHT_ID;
+#else
+        comm->id = 1;
+#endif
+        comm->state = ble_state_IDLE;
+        ble_init_link(&comm->link);
+        ble_init_comm_data(comm);
+    }
+    return 0;
+}
+
+void ble_initiate_send(uint8_t comm_id) {
+    ble_find_comm_by_id(comm_id)->auto_send = true; // pulled at the next connection event
+}
+
+void ble_update_link(uint8_t comm_id) {
+#ifdef KBD_NODE_AP
+    // as ble_client.c, fast while active, the harness applies it
+    ble_comm_t* comm = ble_find_comm_by_id(comm_id);
+    comm->link.fast = board_millis() - comm->active_ms < BLE_ACTIVE_MS;
+    comm->link.params_requested = true;
+#else
+    (void) comm_id; // set by the central
+#endif
+}
+
+void ble_set_peer_cache(ble_peer_cache_t* cache, void (*changed)(void)) {
+    (void) cache;
+    (void) changed;
+}
+
+static void connect(uint8_t comm_id) {
+    ble_comm_t* comm = ble_find_comm_by_id(comm_id);
+    ble_init_comm_data(comm);
+    ble_init_link(&comm->link);
+    comm->link.interval = BLE_FAST_INTERVAL;
+    comm->active_ms = board_millis();
+    comm->state = ble_state_DATA;
+}
+
+static uint8_t next_send(uint8_t comm_id, uint8_t* buff) {
+    ble_comm_t* comm = ble_find_comm_by_id(comm_id);
+    if(comm->state != ble_state_DATA || !comm->auto_send) return 0;
+    uint8_t len;
+    uint8_t* frame = ble_next_send(comm, &len);
+    if(!frame) {
+        comm->auto_send = false;
+        return 0;
+    }
+    memcpy(buff, frame, len);
+    return len;
+}
+
+static void receive(uint8_t comm_id, const uint8_t* buff, uint8_t len) {
+    ble_comm_t* comm = ble_find_comm_by_id(comm_id);
+    if(comm->state == ble_state_DATA) ble_receive_data(comm, buff, len);
+}
+
+static uint16_t link_interval(uint8_t comm_id) {
+#ifdef KBD_NODE_AP
+    ble_link_t* link = &ble_find_comm_by_id(comm_id)->link;
+    if(link->params_requested) return link->fast ? BLE_FAST_INTERVAL : BLE_IDLE_INTERVAL;
+    return link->interval;
+#else
+    return ble_find_comm_by_id(comm_id)->link.interval;
+#endif
+}
+
+static void link_updated(uint8_t comm_id, uint16_t interval) {
+    ble_link_t* link = &ble_find_comm_by_id(comm_id)->link;
+    link->interval = interval;
+    link->latency = interval == BLE_FAST_INTERVAL ? BLE_FAST_LATENCY : BLE_IDLE_LATENCY;
+}
+
+static uint32_t retransmits(uint8_t comm_id) { return ble_find_comm_by_id(comm_id)->retransmits; }
+
+////// key scan, the matrix as per the harness
+
+#if defined(KBD_NODE_LEFT) || defined(KBD_NODE_RIGHT)
+
+#ifdef KBD_NODE_LEFT
+#define SIM_SIDE SIM_SIDE_LEFT
+#else
+#define SIM_SIDE SIM_SIDE_RIGHT
+#endif
+
+static key_scan_t key_scan;
+static uint8_t key_scan_keys[hw_row_count];
+static void (*key_scan_wake)(void) = NULL; // armed
+static uint8_t key_scan_ring[KEY_SCAN_FRAME_COUNT][hw_row_count]; // frames, as the dma ring
+static uint32_t key_scan_frames = 0; // completed
+
+static void read_raw_keys(uint8_t* keys) {
+    for(uint8_t row=0; row<hw_row_count; row++) {
+        uint8_t v = 0;
+        for(uint8_t col=0; col<hw_col_count; col++)
+            if(sim_raw_key(SIM_SIDE, row, col)) v |= 1 << (hw_col_count - 1 - col);
+        keys[row] = v;
+    }
+}
+
+void key_scan_update(key_scan_t* ks) {
+    // the latest frame, scanned at a ms
+    ks->ts = (time_us_64() / 1000) * 1000;
+    read_raw_keys(ks->keys);
+    ks->frame_read = key_scan_frames;
+}
+
+bool key_scan_next(key_scan_t* ks) {
+    // as key_scan.c, the frames completed each ms by key_scan_frame
+    if(ks->frame_read >= key_scan_frames) return false;
+    if(key_scan_frames - ks->frame_read > KEY_SCAN_FRAME_COUNT - 1) {
+        ks->frames_lost += key_scan_frames - ks->frame_read - (KEY_SCAN_FRAME_COUNT - 1);
+        ks->frame_read = key_scan_frames - (KEY_SCAN_FRAME_COUNT - 1);
+    }
+    memcpy(ks->keys, key_scan_ring[ks->frame_read % KEY_SCAN_FRAME_COUNT], hw_row_count);
+    ks->ts = (time_us_64() / 1000 - (key_scan_frames - 1 - ks->frame_read)) * 1000;
+    ks->frame_read++;
+    return true;
+}
+
+void key_scan_arm_wake(key_scan_t* ks, void (*wake)(void)) {
+    (void) ks;
+    key_scan_wake = wake;
+}
+
+void key_scan_disarm_wake(key_scan_t* ks) {
+    (void) ks;
+    key_scan_wake = NULL;
+}
+
+static void key_scan_frame() {
+    read_raw_keys(key_scan_ring[key_scan_frames % KEY_SCAN_FRAME_COUNT]);
+    key_scan_frames++;
+    // a pressed key rises on its column each frame, the edge irq wakes core0 if armed
+    if(!key_scan_wake) return;
+    for(uint8_t row=0; row<hw_row_count; row++)
+        for(uint8_t col=0; col<hw_col_count; col++)
+            if(sim_raw_key(SIM_SIDE, row, col)) {
+                void (*wake)(void) = key_scan_wake;
+                key_scan_wake = NULL;
+                wake();
+                return;
+            }
+}
+
+#endif
+
+////// core1
+
+#ifdef KBD_NODE_AP
+
+static uint8_t usb_key_bits_reported[KEY_BITS_SIZE];
+
+void usb_hid_init(void) { kbd_system.usb_hid_state = kbd_usb_hid_state_MOUNTED; }
+
+void usb_hid_idle_task(void) {}
+
+void usb_hid_task(void) {
+    // the keyboard report, sent at the next USB frame
+    memcpy(usb_key_bits_reported, kbd_system.core1.hid_report_out.keyboard.key_bits, KEY_BITS_SIZE);
+}
+
+void set_core0_debug(uint8_t index, uint32_t value) {
+    (void) index;
+    (void) value;
+}
+
+bool is_config_screen(kbd_screen_t screen) { return screen & KBD_CONFIG_SCREEN; }
+
+void handle_screen_event(kbd_event_t event) { (void) event; } // no screens
+
+// referenced by core1_main, which is not run
+void init_config_screen_data() {}
+void apply_config_screen_data() {}
+void init_flash_datasets(flash_dataset_t** flash_datasets, flash_dataset_t** ble_peer_dataset) {
+    (void) flash_datasets;
+    (void) ble_peer_dataset;
+}
+void load_flash_datasets(flash_dataset_t** flash_datasets) { (void) flash_datasets; }
+void flash_store_load(flash_dataset_t* fd) { (void) fd; }
+uint16_t flash_store_save(flash_dataset_t* fd) { return fd->pos; }
+bool flash_store_task(void) { return false; }
+void fw_stage_task() {}
+
+static uint32_t proc_last_ms = 0;
+
+static void tick_ms(void) {
+    // as the loop of core1_main
+    validate_comm_state(0);
+    validate_comm_state(1);
+    bool has_inputs = false;
+    while(multicore_fifo_rvalid())
+        has_inputs = multicore_fifo_pop_blocking() == KBD_CORE1_WAKE_INPUTS || has_inputs;
+    if(has_inputs) {
+        proc_last_ms = board_millis();
+        process_inputs(NULL);
+    } else {
+        do_if_elapsed(&proc_last_ms, has_pending_input() ? 1 : 20, NULL, process_inputs);
+    }
+}
+
+static const uint8_t* usb_key_bits(void) { return usb_key_bits_reported; }
+
+static uint8_t key_code(uint8_t side, uint8_t row, uint8_t col) {
+    uint8_t layout_col = side * hw_col_count + col;
+    const uint8_t* k = key_layout[row][layout_col];
+    if(k[0] != 0 || k[1] < 0x04 || k[1] >= 0xE0) return 0; // modifier or special
+    for(int i=0; i<KEY_LAYOUT_ACTION_COUNT; i++)
+        if(key_layout_actions[i].row == row && key_layout_actions[i].col == layout_col) return 0;
+    for(int i=0; i<KEY_LAYOUT_COMBO_COUNT; i++)
+        for(int j=0; j<key_layout_combos[i].key_count; j++)
+            if(key_layout_combos[i].keys[j][0] == row && key_layout_combos[i].keys[j][1] == layout_col) return 0;
+    return k[1];
+}
+
+#else
+
+static void tick_ms(void) {
+    key_scan_frame();
+
+    // as the loop of core1_main, the state and the comm reset
+    kbd_system_core1_t* c = &kbd_system.core1;
+#ifdef KBD_NODE_LEFT
+    validate_comm_state(0);
+#else
+    validate_comm_state(1);
+#endif
+    if(kbd_system.sb_state->ts > c->state_ts)
+        read_shared_buffer(kbd_system.sb_state, &c->state_ts, &c->state);
+    kbd_system.ap_connected = board_millis() < (c->state_ts / 1000) + 1000;
+}
+
+void validate_comm_state(uint8_t index) {
+    // as core1.c, no tasks in flight
+    if(kbd_system.comm_state[index] == kbd_comm_state_reset)
+        kbd_system.comm_state[index] = kbd_comm_state_init;
+}
+
+static const uint8_t* usb_key_bits(void) { return NULL; }
+
+static uint8_t key_code(uint8_t side, uint8_t row, uint8_t col) {
+    (void) side;
+    (void) row;
+    (void) col;
+    return 0;
+}
+
+#endif
+
+////// node
+
+static void init(void) {
+    init_data_model();
+
+#ifdef KBD_NODE_AP
+    usb_hid_init();
+    kbd_system.ble_peer_cache_loaded = true;
+#else
+    key_scan.keys = key_scan_keys;
+    kbd_hw.ks = &key_scan;
+#endif
+
+    if(!setjmp(run_loop_entry))
+        core0_main();
+
+    // past the wifi window, for the steady poll rate
+    kbd_system.wifi = false;
+}
+
+sim_node_t sim_node = {
+    .init = init,
+    .next_due_us = next_due_us,
+    .run = run,
+    .tick_ms = tick_ms,
+    .core1_woken = core1_woken,
+    .connect = connect,
+    .next_send = next_send,
+    .receive = receive,
+    .link_interval = link_interval,
+    .link_updated = link_updated,
+    .usb_key_bits = usb_key_bits,
+    .key_code = key_code,
+    .retransmits = retransmits,
+    .set_clock = set_clock,
+    .now_us = sim_node_now_us,
+    .clock_offset = clock_offset,
+};
@@ -0,0 +1,519 @@
+/*
+ * Run left, right and AP in one process with a virtual clock, linked by a simulated
+ * BLE channel, replay a typing trace and report the key to USB report latency, as a
+ * histogram, with the transitions lost or spurious on the way. See sim/sim.h.
+ *
+ * Build & run (host):
+ *   sim/build.sh /tmp/sim_link
+ *   /tmp/sim_link [-i interval] [-l loss%] [-d drop%] [-j jitter-us] [-n packets] [-k keystrokes] [-c ppm] [-s seed]
+ *                 [trace-file]
+ *
+ *   -i connection interval in 1.25 ms units, default as requested by AP (fast when active, idle else)
+ *   -l link layer loss, a lost packet ends the connection event and is sent again at the next one
+ *   -d frames dropped past the link layer (e.g. host buffer full), left to the comm to retransmit
+ *   -j jitter of the connection events, +/- us
+ *   -n packets per connection event each way, default 4
+ *   -c clock rate error of left (+ppm) and right (-ppm) to AP, on top of a fixed offset each
+ *
+ * Trace file: one raw level change per line "t_us side row col level", side 0 left, 1 right,
+ * '#' for comments. Without a trace file a synthetic trace of bouncy keystrokes is used, in
+ * bursts with pauses, so the link goes idle in between.
+ *
+ * A transition is measured from its first raw edge to the first USB report with it, on the
+ * keys which map to a plain key code (no modifier, tap-hold or combo) on the base layer.
+ * The clock offset of left/right as estimated by AP is checked against the actual every ms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ble_comm.h"
+#include "sim/sim.h"
+
+#define ROWS 6
+#define COLS 7
+#define SIDES 2
+#define KEYS (SIDES*ROWS*COLS)
+#define MAX_EVENTS 200000
+#define MAX_EDGES 8192
+#define SETTLE_US 10000 // a level which holds this long is intended
+#define START_US 200000 // connected at
+#define CODE_COUNT 224
+#define HIST_BINS 40 // 1 ms bins, the last one for the rest
+#define INSTANT_EVENTS 6 // connection events to a new interval
+#define FRAME_MAX BLE_DATA_SIZE
+#define CLOCK_OFFSET_US 1500000 // of left to AP, twice that for right
+
+extern sim_node_t ap_sim_node;
+extern sim_node_t left_sim_node;
+extern sim_node_t right_sim_node;
+
+#define AP (&ap_sim_node)
+
+typedef struct {
+    uint64_t t;
+    uint8_t side;
+    uint8_t row;
+    uint8_t col;
+    uint8_t level;
+} trace_event_t;
+
+typedef struct {
+    uint64_t t;
+    uint8_t level;
+    uint8_t code;
+    bool matched;
+} edge_t;
+
+typedef struct {
+    uint8_t len;
+    uint8_t data[FRAME_MAX];
+} frame_t;
+
+typedef struct {
+    sim_node_t* node;
+    uint8_t id; // of the peer on AP
+    uint16_t interval;
+    uint16_t pending_interval;
+    uint8_t instant; // events to the pending interval
+    uint8_t skipped; // by the peripheral, as per its latency
+    uint64_t anchor; // of the next event, without jitter
+    // taken from the node, not yet through the air
+    frame_t tx[2]; // [0] central, [1] peripheral
+    uint32_t lost;
+    uint32_t dropped;
+    uint32_t events;
+    // clock offset estimate by AP - actual
+    int64_t clock_error;
+    int64_t clock_error_max; // abs, once synced
+    bool clock_synced;
+} link_t;
+
+// options
+static uint16_t opt_interval = 0;
+static uint32_t opt_loss = 0;   // per 1000
+static uint32_t opt_drop = 0;   // per 1000
+static uint32_t opt_jitter = 0; // us
+static uint32_t opt_packets = 4;
+static uint32_t opt_keystrokes = 600;
+static int32_t opt_ppm = 0;
+
+static uint64_t now_us = 0;
+
+static trace_event_t trace[MAX_EVENTS];
+static int trace_count = 0;
+static int trace_next = 0;
+static uint8_t raw[SIDES][ROWS][COLS];
+
+static edge_t intended[KEYS][MAX_EDGES];
+static int intended_count[KEYS];
+static uint8_t key_codes[KEYS];
+
+static uint8_t usb_prev[CODE_COUNT / 8];
+static uint32_t hist[HIST_BINS];
+static uint32_t latencies[MAX_EVENTS];
+static uint32_t latency_count = 0;
+static uint64_t latency_sum[2] = {0, 0};
+static uint32_t latency_n[2] = {0, 0};
+static uint32_t spurious = 0;
+
+static link_t links[SIDES];
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+uint64_t sim_now_us(void) { return now_us; }
+
+bool sim_raw_key(uint8_t side, uint8_t row, uint8_t col) { return raw[side][row][col]; }
+
+static inline int key_index(uint8_t side, uint8_t row, uint8_t col) { return (side*ROWS + row)*COLS + col; }
+
+////// trace
+
+static void add_event(uint64_t t, uint8_t side, uint8_t row, uint8_t col, uint8_t level) {
+    if(trace_count >= MAX_EVENTS) return;
+    trace[trace_count++] = (trace_event_t) {t, side, row, col, level};
+}
+
+static uint64_t add_bounce(uint64_t t, uint8_t side, uint8_t row, uint8_t col, uint8_t level) {
+    // contact chatter for upto 4 ms, then settle on level
+    uint32_t bounces = next_rand(6);
+    for(uint32_t i=0; i<bounces; i++) {
+        add_event(t, side, row, col, (i%2) ? !level : level);
+        t += 100 + next_rand(600);
+    }
+    add_event(t, side, row, col, level);
+    return t;
+}
+
+static void make_synthetic_trace() {
+    static uint64_t busy[KEYS]; // key is in use until
+    static uint64_t code_busy[CODE_COUNT]; // so that a code is down for a key at a time
+    uint64_t t = START_US + 300000;
+    for(uint32_t i=0; i<opt_keystrokes; i++) {
+        uint8_t side, row, col;
+        int k;
+        do { // rolls overlap, but not on the same key, only plain keys
+            side = next_rand(SIDES);
+            row = next_rand(ROWS);
+            col = next_rand(COLS);
+            k = key_index(side, row, col);
+        } while(!key_codes[k] || busy[k] + SETTLE_US > t || code_busy[key_codes[k]] + SETTLE_US > t);
+        // mostly normal keystrokes, some quick taps
+        uint32_t hold = (i%10==0) ? 15000 + next_rand(5000) : 30000 + next_rand(90000);
+        uint64_t tr = add_bounce(t, side, row, col, 1);
+        busy[k] = code_busy[key_codes[k]] = add_bounce(tr + hold, side, row, col, 0);
+        // bursts of typing, then a pause long enough for the link to go idle
+        t += (i%50 == 49) ? 4000000 + next_rand(2000000) : 20000 + next_rand(150000);
+    }
+    // order by time, rolls can overlap
+    for(int i=1; i<trace_count; i++) {
+        trace_event_t e = trace[i];
+        int j = i-1;
+        while(j>=0 && trace[j].t > e.t) { trace[j+1] = trace[j]; j--; }
+        trace[j+1] = e;
+    }
+}
+
+static int read_trace(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(!f) return -1;
+    char line[128];
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long long t;
+        unsigned side, row, col, level;
+        if(line[0]=='#') continue;
+        if(sscanf(line, "%llu %u %u %u %u", &t, &side, &row, &col, &level) != 5) continue;
+        if(side>=SIDES || row>=ROWS || col>=COLS) continue;
+        add_event(START_US + t, side, row, col, level ? 1 : 0);
+    }
+    fclose(f);
+    return 0;
+}
+
+// intended transition: 1st edge of a burst of raw edges, which settles to a new level
+static void find_intended() {
+    static uint64_t burst_t[KEYS];
+    static uint8_t burst_level[KEYS];
+    static uint8_t level[KEYS];
+    static uint64_t last_t[KEYS];
+
+    for(int i=0; i<=trace_count; i++) {
+        for(int k=0; k<KEYS; k++) {
+            // close the bursts which settled
+            uint64_t t = i<trace_count ? trace[i].t : (uint64_t)-1;
+            if(burst_t[k] && t - last_t[k] >= SETTLE_US) {
+                if(level[k] != burst_level[k] && key_codes[k] && intended_count[k] < MAX_EDGES)
+                    intended[k][intended_count[k]++] = (edge_t) {burst_t[k], level[k], key_codes[k], false};
+                burst_level[k] = level[k];
+                burst_t[k] = 0;
+            }
+        }
+        if(i==trace_count) break;
+        trace_event_t* e = trace + i;
+        int k = key_index(e->side, e->row, e->col);
+        if(e->level == level[k]) continue;
+        if(!burst_t[k]) burst_t[k] = e->t;
+        level[k] = e->level;
+        last_t[k] = e->t;
+    }
+}
+
+////// USB reports, matched to the intended transitions
+
+static void match_report(uint8_t code, uint8_t level) {
+    // the earliest intended transition of the code, not yet reported
+    edge_t* first = NULL;
+    for(int k=0; k<KEYS; k++) {
+        if(key_codes[k] != code) continue;
+        for(int i=0; i<intended_count[k]; i++) {
+            edge_t* e = &intended[k][i];
+            if(e->t > now_us) break;
+            if(e->matched || e->level != level) continue;
+            if(!first || e->t < first->t) first = e;
+            break;
+        }
+    }
+    if(!first) {
+        spurious++;
+        return;
+    }
+    first->matched = true;
+    uint32_t dt = (uint32_t) (now_us - first->t);
+    uint32_t bin = dt / 1000;
+    hist[bin < HIST_BINS ? bin : HIST_BINS-1]++;
+    latencies[latency_count++] = dt;
+    latency_sum[level] += dt;
+    latency_n[level]++;
+}
+
+static void check_usb() {
+    const uint8_t* bits = AP->usb_key_bits();
+    for(int i=0; i<CODE_COUNT/8; i++) {
+        uint8_t dv = bits[i] ^ usb_prev[i];
+        for(int b=0; b<8 && dv; b++)
+            if(dv & (1 << b)) match_report(i*8 + b, (bits[i] >> b) & 1);
+        usb_prev[i] = bits[i];
+    }
+}
+
+////// BLE link
+
+static void link_init(link_t* l, sim_node_t* node, uint8_t id) {
+    memset(l, 0, sizeof(link_t));
+    l->node = node;
+    l->id = id;
+    AP->connect(id);
+    node->connect(0);
+    l->interval = opt_interval ? opt_interval : AP->link_interval(id);
+    AP->link_updated(id, l->interval);
+    node->link_updated(0, l->interval);
+    l->anchor = now_us + l->interval * 1250;
+}
+
+static uint64_t link_next_event(link_t* l) {
+    uint64_t t = l->anchor;
+    if(opt_jitter) t = t + next_rand(2*opt_jitter + 1) - opt_jitter;
+    return t;
+}
+
+static bool air(link_t* l) {
+    // a packet through, else the event ends, the link layer sends it again at the next
+    if(next_rand(1000) < opt_loss) {
+        l->lost++;
+        return false;
+    }
+    return true;
+}
+
+static void deliver(link_t* l, sim_node_t* to, uint8_t id, frame_t* f) {
+    if(next_rand(1000) < opt_drop) l->dropped++;
+    else to->receive(id, f->data, f->len);
+    f->len = 0;
+}
+
+static void link_event(link_t* l) {
+    l->events++;
+
+    // the peripheral listens on every event if it has data, else once per latency+1
+    frame_t* ctx = &l->tx[0];
+    frame_t* ptx = &l->tx[1];
+    uint16_t latency = l->interval == BLE_FAST_INTERVAL ? BLE_FAST_LATENCY : BLE_IDLE_LATENCY;
+    if(!ptx->len) ptx->len = l->node->next_send(0, ptx->data);
+    bool listen = ptx->len || l->skipped >= latency;
+
+    if(listen) {
+        l->skipped = 0;
+        // central first, then the peripheral, a packet each way at a time
+        for(uint32_t i=0; i<opt_packets; i++) {
+            if(!ctx->len) ctx->len = AP->next_send(l->id, ctx->data);
+            if(!ptx->len) ptx->len = l->node->next_send(0, ptx->data);
+            if(!ctx->len && !ptx->len) break;
+            if(ctx->len) {
+                if(!air(l)) break;
+                deliver(l, l->node, 0, ctx);
+            }
+            if(ptx->len) {
+                if(!air(l)) break;
+                deliver(l, AP, l->id, ptx);
+            }
+        }
+    } else {
+        l->skipped++;
+    }
+
+    // the interval as requested, a few events later
+    uint16_t interval = opt_interval ? opt_interval : AP->link_interval(l->id);
+    if(interval != l->interval && interval != l->pending_interval) {
+        l->pending_interval = interval;
+        l->instant = INSTANT_EVENTS;
+    }
+    if(l->pending_interval && --l->instant == 0) {
+        l->interval = l->pending_interval;
+        l->pending_interval = 0;
+        AP->link_updated(l->id, l->interval);
+        l->node->link_updated(0, l->interval);
+    }
+    l->anchor += l->interval * 1250;
+}
+
+////// run
+
+static void run_nodes() {
+    sim_node_t* nodes[3] = {&left_sim_node, &right_sim_node, AP};
+    for(int i=0; i<3; i++) {
+        // bounded, a node may keep on polling at once
+        for(int n=0; n<16 && nodes[i]->next_due_us() <= now_us; n++)
+            nodes[i]->run();
+    }
+    if(AP->core1_woken()) {
+        AP->tick_ms();
+        check_usb();
+    }
+}
+
+static void check_clock(link_t* l) {
+    int64_t estimate;
+    if(!l->node || !AP->clock_offset(l->id, &estimate)) return;
+    int64_t actual = (int64_t) (l->node->now_us() - AP->now_us());
+    l->clock_error = estimate - actual;
+    int64_t e = l->clock_error < 0 ? -l->clock_error : l->clock_error;
+    if(l->clock_synced && e > l->clock_error_max) l->clock_error_max = e;
+    l->clock_synced = true; // the first estimate is in a burst of pings, settled from the next on
+}
+
+static void tick() {
+    for(; trace_next<trace_count && trace[trace_next].t <= now_us; trace_next++) {
+        trace_event_t* e = trace + trace_next;
+        raw[e->side][e->row][e->col] = e->level;
+    }
+    left_sim_node.tick_ms();
+    right_sim_node.tick_ms();
+    AP->tick_ms();
+    check_usb();
+    for(int s=0; s<SIDES; s++)
+        check_clock(links + s);
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report() {
+    int total = 0, lost = 0;
+    for(int k=0; k<KEYS; k++) {
+        total += intended_count[k];
+        for(int i=0; i<intended_count[k]; i++)
+            if(!intended[k][i].matched) lost++;
+    }
+    qsort(latencies, latency_count, sizeof(uint32_t), cmp_u32);
+    uint32_t max_count = 1;
+    for(int i=0; i<HIST_BINS; i++)
+        if(hist[i] > max_count) max_count = hist[i];
+
+    printf("\nKey to USB report latency, %u transitions\n", latency_count);
+    for(int i=0; i<HIST_BINS; i++) {
+        if(!hist[i]) continue;
+        printf("%s%2d ms %6u ", i<HIST_BINS-1 ? " " : ">", i, hist[i]);
+        for(uint32_t n=0; n<hist[i]*50/max_count; n++) putchar('#');
+        putchar('\n');
+    }
+    if(latency_count) {
+        printf("\np50 %u us, p90 %u us, p99 %u us, max %u us\n",
+               latencies[latency_count/2], latencies[latency_count*9/10],
+               latencies[latency_count*99/100], latencies[latency_count-1]);
+        printf("press: avg %llu us | release: avg %llu us\n",
+               (unsigned long long) (latency_n[1] ? latency_sum[1]/latency_n[1] : 0),
+               (unsigned long long) (latency_n[0] ? latency_sum[0]/latency_n[0] : 0));
+    }
+    printf("\nintended: %d, lost: %d, spurious: %u\n", total, lost, spurious);
+    for(int s=0; s<SIDES; s++) {
+        link_t* l = links + s;
+        printf("%s: events %u, lost packets %u, dropped frames %u, retransmits ap %u / node %u\n",
+               s == SIM_SIDE_LEFT ? "left " : "right", l->events, l->lost, l->dropped,
+               AP->retransmits(l->id), l->node->retransmits(0));
+    }
+    for(int s=0; s<SIDES; s++) {
+        link_t* l = links + s;
+        printf("%s: clock offset error %lld us at the end, %lld us at most\n", s == SIM_SIDE_LEFT ? "left " : "right",
+               (long long) l->clock_error, (long long) l->clock_error_max);
+    }
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "i:l:d:j:n:k:c:s:")) != -1) {
+        switch(opt) {
+            case 'i': opt_interval = atoi(optarg); break;
+            case 'l': opt_loss = (uint32_t) (atof(optarg) * 10); break;
+            case 'd': opt_drop = (uint32_t) (atof(optarg) * 10); break;
+            case 'j': opt_jitter = atoi(optarg); break;
+            case 'n': opt_packets = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'k': opt_keystrokes = atoi(optarg); break;
+            case 'c': opt_ppm = atoi(optarg); break;
+            case 's': rand_state = atoi(optarg); break;
+            default:
+                printf("usage: %s [-i interval] [-l loss%%] [-d drop%%] [-j jitter-us] [-n packets]"
+                       " [-k keystrokes] [-c ppm] [-s seed] [trace-file]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("\nTest link\n");
+
+    left_sim_node.set_clock(CLOCK_OFFSET_US, opt_ppm);
+    right_sim_node.set_clock(2 * CLOCK_OFFSET_US, -opt_ppm);
+
+    AP->init();
+    left_sim_node.init();
+    right_sim_node.init();
+
+    for(uint8_t side=0; side<SIDES; side++)
+        for(uint8_t row=0; row<ROWS; row++)
+            for(uint8_t col=0; col<COLS; col++)
+                key_codes[key_index(side, row, col)] = AP->key_code(side, row, col);
+
+    if(optind < argc) {
+        if(read_trace(argv[optind])) {
+            printf("\nCan not read trace %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        make_synthetic_trace();
+    }
+    if(trace_count == 0) {
+        printf("\nEmpty trace\n");
+        return 1;
+    }
+    find_intended();
+    printf("\nTrace: %d raw edges, interval %s, loss %.1f%%, drop %.1f%%, jitter %u us, %u packets per event,"
+           " clock +/-%d ppm\n", trace_count, opt_interval ? "fixed" : "as requested", opt_loss / 10.0,
+           opt_drop / 10.0, opt_jitter, opt_packets, opt_ppm);
+
+    // discrete events: the ms ticks, the node run loops, the connection events
+    uint64_t end = trace[trace_count-1].t + 500000;
+    uint64_t next_tick = 1000;
+    uint64_t next_link[SIDES] = {UINT64_MAX, UINT64_MAX};
+    bool connected = false;
+    while(now_us < end) {
+        uint64_t t = next_tick;
+        sim_node_t* nodes[3] = {&left_sim_node, &right_sim_node, AP};
+        for(int i=0; i<3; i++) {
+            uint64_t due = nodes[i]->next_due_us();
+            if(due < t) t = due;
+        }
+        for(int s=0; s<SIDES; s++)
+            if(next_link[s] < t) t = next_link[s];
+        if(t > now_us) now_us = t;
+
+        if(!connected && now_us >= START_US) {
+            link_init(links + SIM_SIDE_LEFT, &left_sim_node, 'L');
+            link_init(links + SIM_SIDE_RIGHT, &right_sim_node, 'R');
+            for(int s=0; s<SIDES; s++) next_link[s] = link_next_event(links + s);
+            connected = true;
+        }
+        if(now_us >= next_tick) {
+            tick();
+            next_tick += 1000;
+        }
+        run_nodes();
+        for(int s=0; s<SIDES; s++)
+            if(now_us >= next_link[s]) {
+                link_event(links + s);
+                next_link[s] = link_next_event(links + s);
+                run_nodes();
+            }
+    }
+
+    report();
+
+    printf("\nEnd of Test link\n");
+    return 0;
+}
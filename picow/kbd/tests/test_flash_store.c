@@ -0,0 +1,211 @@
+/*
+ * Test util/flash_store: save the datasets over and over, as the config screens do, against a
+ * simulated W25Q32 (program ANDs the bits, erase sets a sector to 0xFF, busy for as long as the
+ * data sheet says), from a 1 ms process loop which polls the store once per iteration (core1).
+ * Checks that nothing is issued or read while the flash is busy, that fd->pos moves only once a
+ * save is flashed, and that a load after a restart finds the latest of each dataset, across the
+ * wrap of the versions. Reports the longest the loop is held up, against waiting for each save.
+ * Queued, another user writes sectors and reads them back meanwhile, as the firmware staged on
+ * AP, and checks what it reads.
+ *
+ * Build & run (host):
+ *   gcc -O2 -o /tmp/test_flash_store test_flash_store.c ../util/flash_store.c
+ *   /tmp/test_flash_store [-n saves] [-e erase-us] [-p program-us] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/flash_store.h"
+
+#define DATASETS 3
+#define STAGE_ADDR (65536 * (DATASETS + 1))
+#define STAGE_SECTORS 16
+#define FLASH_SIZE (STAGE_ADDR + 4096 * STAGE_SECTORS)
+#define SECTOR 4096
+#define PAGE 256
+#define POLL_US 10 // a status read, at 31.25 MHz with the select/release
+#define READ_BYTES_PER_US 4 // at 31.25 MHz
+
+// options
+static uint32_t opt_saves = 10000;
+static uint32_t opt_erase_us = 90000;
+static uint32_t opt_program_us = 500;
+
+static uint64_t now_us = 0;
+
+static uint8_t flash[FLASH_SIZE];
+static uint64_t busy_till = 0;
+static uint32_t violations = 0; // issued or read while busy
+static uint32_t erases = 0;
+static uint32_t programs = 0;
+static uint32_t staged = 0; // sectors written and read back
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+////// W25Q32
+
+static void check_idle(const char* op, uint32_t addr) {
+    if(now_us < busy_till && violations++ < 5) fprintf(stderr, "%s at %u while busy\n", op, addr);
+}
+
+static void sim_read(uint32_t addr, uint8_t* buf, size_t len) {
+    check_idle("read", addr);
+    memcpy(buf, flash + addr, len);
+    now_us += len / READ_BYTES_PER_US;
+}
+
+static void sim_program(uint32_t addr, const uint8_t* buf, size_t len) {
+    check_idle("program", addr);
+    if(addr / PAGE != (addr + len - 1) / PAGE && violations++ < 5) fprintf(stderr, "program across a page at %u\n", addr);
+    for(size_t i=0; i<len; i++) flash[addr + i] &= buf[i];
+    busy_till = now_us + opt_program_us;
+    programs++;
+}
+
+static void sim_erase(uint32_t addr) {
+    check_idle("erase", addr);
+    memset(flash + addr / SECTOR * SECTOR, 0xFF, SECTOR);
+    busy_till = now_us + opt_erase_us;
+    erases++;
+}
+
+static bool sim_busy(void) {
+    now_us += POLL_US;
+    return now_us < busy_till;
+}
+
+////// run
+
+static uint8_t ids[DATASETS] = {0x01, 0x02, 0xF0};
+static flash_dataset_t* fds[DATASETS];
+static uint8_t latest[DATASETS][FLASH_DATASET_SIZE]; // as saved last
+
+static void create(void) {
+    for(int i=0; i<DATASETS; i++) if(fds[i]) flash_free_dataset(fds[i]);
+    flash_create_store(DATASETS, ids, fds, sim_read, sim_program, sim_erase, sim_busy);
+    for(int i=0; i<DATASETS; i++) flash_store_load(fds[i]);
+}
+
+static void save(int i) {
+    for(int k=0; k<FLASH_DATASET_SIZE; k++) fds[i]->data[k] = next_rand(256);
+    memcpy(latest[i], fds[i]->data, FLASH_DATASET_SIZE);
+    flash_store_save(fds[i]);
+}
+
+// the other user: a sector written, then read back, each queued once there is room
+static uint8_t stage_data[SECTOR];
+static uint8_t stage_read[SECTOR];
+static uint8_t stage_step = 0; // 0-to write, 1-writing, 2-reading
+static bool stage_done;
+
+static void stage_task(void) {
+    uint32_t addr = STAGE_ADDR + (staged % STAGE_SECTORS) * SECTOR;
+    if(stage_step == 0) {
+        for(int k=0; k<SECTOR; k++) stage_data[k] = next_rand(256);
+        stage_done = false;
+        if(flash_store_queue_write(addr, stage_data, SECTOR, &stage_done)) stage_step = 1;
+    } else if(stage_step == 1 && stage_done) {
+        stage_done = false;
+        if(flash_store_queue_read(addr, stage_read, SECTOR, &stage_done)) stage_step = 2;
+    } else if(stage_step == 2 && stage_done) {
+        if(memcmp(stage_read, stage_data, SECTOR) && violations++ < 5) fprintf(stderr, "staged sector at %u not as written\n", addr);
+        staged++;
+        stage_step = 0;
+    }
+}
+
+static uint32_t run(bool wait) {
+    // a few saves back to back, every 200 ms or so, returns the longest iteration, us
+    uint32_t held_max = 0;
+    uint32_t pos_early = 0;
+    for(uint32_t n=0; n<opt_saves;) {
+        uint64_t t0 = now_us;
+        if(next_rand(200) == 0) {
+            uint32_t k = 1 + next_rand(4);
+            for(; k>0 && n<opt_saves; k--, n++) {
+                int i = next_rand(DATASETS);
+                uint16_t pos = fds[i]->pos;
+                save(i);
+                if(wait) flash_store_flush();
+                else if(fds[i]->pos != pos) pos_early++;
+            }
+        }
+        if(!wait) stage_task();
+        flash_store_task();
+        uint32_t held = now_us - t0;
+        if(held > held_max) held_max = held;
+        now_us = t0 + 1000 > now_us ? t0 + 1000 : now_us; // the rest of the iteration
+    }
+    flash_store_flush();
+    if(pos_early) {
+        fprintf(stderr, "fd->pos moved before flashed, %u times\n", pos_early);
+        violations++;
+    }
+    return held_max;
+}
+
+static int verify(const char* name) {
+    // as after a restart
+    uint16_t pos[DATASETS];
+    for(int i=0; i<DATASETS; i++) pos[i] = fds[i]->pos;
+    create();
+    int failures = 0;
+    for(int i=0; i<DATASETS; i++) {
+        if(fds[i]->need_flash_init || fds[i]->pos != pos[i] || memcmp(fds[i]->data, latest[i], FLASH_DATASET_SIZE)) {
+            fprintf(stderr, "%s: dataset %02X not as saved last, pos %u, was %u\n", name, ids[i], fds[i]->pos, pos[i]);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "n:e:p:s:")) != -1) {
+        switch(opt) {
+        case 'n': opt_saves = atoi(optarg); break;
+        case 'e': opt_erase_us = atoi(optarg); break;
+        case 'p': opt_program_us = atoi(optarg); break;
+        case 's': rand_state = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n saves] [-e erase-us] [-p program-us] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    int failures = 0;
+    uint32_t seed = rand_state;
+
+    memset(flash, 0xFF, sizeof(flash));
+    create();
+    uint32_t held_wait = run(true);
+    failures += verify("waited");
+    printf("waited : %u saves, %u erases, %u programs, loop held up to %.1f ms\n",
+           opt_saves, erases, programs, held_wait / 1000.0);
+
+    rand_state = seed;
+    memset(flash, 0xFF, sizeof(flash));
+    memset(fds, 0, sizeof(fds));
+    erases = programs = 0;
+    create();
+    uint32_t held_queued = run(false);
+    failures += verify("queued");
+    printf("queued : %u saves, %u erases, %u programs, %u sectors staged, loop held up to %.3f ms\n",
+           opt_saves, erases, programs, staged, held_queued / 1000.0);
+
+    if(violations) {
+        fprintf(stderr, "%u violations\n", violations);
+        failures++;
+    }
+    if(held_queued > 1000) failures++; // not beyond the polls, and a read, of an iteration
+    if(staged == 0) failures++;
+    printf(failures ? "FAILED\n" : "OK\n");
+    return failures ? 1 : 0;
+}
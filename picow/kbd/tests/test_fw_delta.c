@@ -0,0 +1,493 @@
+/*
+ * Test util/fw_download deltas, and the tool making them: a delta of a new build against the
+ * one running (base), a block per sector, bsdiff alike, streamed through fw_download with the
+ * base as the image running. Checks the slot against the new build, that a delta against
+ * another base is refused, and that a delta tampered with is not marked valid. Reports the
+ * size of the delta against the new build, and against it packed (lz4) only.
+ *
+ * The builds are generated, functions with calls and literal pools of addresses, some of them
+ * changed in the new one (so that all after are moved), or read from files (.bin of 2 builds).
+ * With -w the delta is written as the deploy tool sends it (deploy-delta, deploy/src/user.clj):
+ *   image size(4), image crc(4), base size(4), base crc(4), the stream
+ *
+ * Build & run (host):
+ *   gcc -O2 -o /tmp/test_fw_delta test_fw_delta.c ../util/fw_download.c ../util/crc32.c ../util/lz4_block.c
+ *   /tmp/test_fw_delta [-k image-kb] [-m functions-changed] [-s seed] [-w out.delta] [base.bin new.bin]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/crc32.h"
+#include "../util/fw_download.h"
+
+#define SLOT_MAX (2048 * 1024)
+#define STREAM_MAX (SLOT_MAX + SLOT_MAX / FW_DOWNLOAD_SECTOR_SIZE * 2)
+#define CHUNK_HEAD 11
+#define FUNCS_MAX 4096
+#define REFS_MAX 8
+#define FLASH_ADDR 0x10000000
+
+// options
+static uint32_t opt_kb = 600;
+static uint32_t opt_changed = 5;
+
+static uint8_t base[SLOT_MAX];
+static uint32_t base_size;
+static uint8_t image[SLOT_MAX];
+static uint32_t image_size;
+static uint8_t stream[STREAM_MAX];
+static uint32_t stream_size;
+static uint32_t blocks[3]; // stored, packed, delta
+
+static uint8_t slot[SLOT_MAX];
+static bool slot_valid;
+static uint32_t slot_inits;
+static const uint8_t* running; // as the application slot
+static fw_download_t dl;
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+static inline void write_u16(uint8_t* buff, uint16_t v) {
+    buff[0] = v & 0xFF;
+    buff[1] = v >> 8;
+}
+
+static inline void write_u32(uint8_t* buff, uint32_t v) {
+    for(int i=0; i<4; i++) buff[i] = (v >> (8 * i)) & 0xFF;
+}
+
+////// builds
+
+typedef struct {
+    uint32_t seed; // of the code
+    uint16_t len;
+    uint16_t refs[REFS_MAX]; // the functions addressed, from the literal pool
+    uint8_t refs_n;
+} func_t;
+
+static func_t funcs[FUNCS_MAX];
+static uint32_t funcs_n;
+static uint16_t words[64]; // the instructions most used
+
+static uint32_t build(uint8_t* out) {
+    // code of halfwords, some of them common, calls relative to the function called, then
+    // the literal pool, absolute addresses
+    uint32_t addr[FUNCS_MAX];
+    uint32_t size = 0;
+    for(uint32_t f=0; f<funcs_n; f++) {
+        addr[f] = size;
+        size += (funcs[f].len + 4 * funcs[f].refs_n + 3) & ~3u;
+    }
+    if(size > SLOT_MAX) size = SLOT_MAX;
+    uint32_t saved = rand_state;
+    for(uint32_t f=0; f<funcs_n && addr[f] < size; f++) {
+        rand_state = funcs[f].seed;
+        uint32_t at = addr[f];
+        uint32_t end = addr[f] + funcs[f].len;
+        while(at + 4 <= end) {
+            uint32_t kind = next_rand(16);
+            uint32_t v;
+            if(kind == 0) { // bl, relative
+                v = addr[next_rand(funcs_n)] - at;
+                write_u32(out + at, v);
+                at += 4;
+                continue;
+            }
+            v = kind < 12 ? words[next_rand(64)] : next_rand(1 << 16);
+            write_u16(out + at, v);
+            at += 2;
+        }
+        for(; at < end; at++) out[at] = 0;
+        for(uint8_t r=0; r<funcs[f].refs_n; r++, at += 4)
+            write_u32(out + at, (FLASH_ADDR + addr[funcs[f].refs[r]]) | 1);
+        for(; at < size && at % 4; at++) out[at] = 0;
+    }
+    rand_state = saved;
+    return size;
+}
+
+static void make_builds() {
+    for(uint32_t i=0; i<64; i++) words[i] = next_rand(1 << 16);
+    funcs_n = 0;
+    for(uint32_t size=0; size < opt_kb * 1024 && funcs_n < FUNCS_MAX; funcs_n++) {
+        func_t* f = funcs + funcs_n;
+        f->seed = next_rand(1 << 30);
+        f->len = 32 + next_rand(1500);
+        f->refs_n = next_rand(REFS_MAX + 1);
+        size += f->len + 4 * f->refs_n;
+    }
+    for(uint32_t f=0; f<funcs_n; f++)
+        for(uint8_t r=0; r<funcs[f].refs_n; r++) funcs[f].refs[r] = next_rand(funcs_n);
+    base_size = build(base);
+    // a few functions changed, in place and in size
+    for(uint32_t i=0; i<opt_changed; i++) {
+        func_t* f = funcs + next_rand(funcs_n);
+        int32_t grown = (int32_t) next_rand(256) - 64;
+        f->seed = next_rand(1 << 30);
+        if(f->len + grown >= 32) f->len += grown;
+    }
+    image_size = build(image);
+}
+
+static uint32_t read_file(const char* path, uint8_t* buff) {
+    FILE* f = fopen(path, "rb");
+    if(!f) return 0;
+    uint32_t size = fread(buff, 1, SLOT_MAX, f);
+    fclose(f);
+    return size;
+}
+
+////// lz4, as LZ4_compress_default, greedy, a block on its own
+
+#define HASH_BITS 12
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v = p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t* write_length(uint8_t* out, uint32_t len) {
+    for(; len >= 255; len -= 255) *out++ = 255;
+    *out++ = len;
+    return out;
+}
+
+static uint8_t* write_sequence(uint8_t* out, const uint8_t* lit, uint32_t lit_len, uint16_t offset, uint32_t match_len) {
+    uint8_t* token = out++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if(lit_len >= 15) out = write_length(out, lit_len - 15);
+    memcpy(out, lit, lit_len);
+    out += lit_len;
+    if(match_len == 0) return out;
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    match_len -= 4;
+    *token |= match_len < 15 ? match_len : 15;
+    if(match_len >= 15) out = write_length(out, match_len - 15);
+    return out;
+}
+
+static uint32_t lz4_block_encode(const uint8_t* src, uint32_t len, uint8_t* dst) {
+    int32_t table[1 << HASH_BITS];
+    for(uint32_t i=0; i<(1 << HASH_BITS); i++) table[i] = -1;
+    uint8_t* out = dst;
+    uint32_t anchor = 0, i = 0;
+    while(len >= 13 && i + 12 < len) {
+        uint32_t h = hash4(src + i);
+        int32_t ref = table[h];
+        table[h] = i;
+        if(ref < 0 || memcmp(src + ref, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        uint32_t match_len = 4;
+        while(i + match_len < len - 5 && src[ref + match_len] == src[i + match_len]) match_len++;
+        out = write_sequence(out, src + anchor, i - anchor, i - ref, match_len);
+        i += match_len;
+        anchor = i;
+    }
+    out = write_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out - dst;
+}
+
+////// delta, bsdiff alike: copies of the base, extended while more bytes match than not,
+////// the difference to those and the bytes new, packed
+
+#define INDEX_BITS 20
+#define MATCH_MIN 8
+
+static int32_t base_index[1 << INDEX_BITS]; // of 8 bytes, the last position in the base
+static int64_t alignment;                   // base - image, of the last copy
+
+static uint32_t hash8(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (v * 0x9E3779B97F4A7C15ull) >> (64 - INDEX_BITS);
+}
+
+static void index_base() {
+    for(uint32_t i=0; i<(1 << INDEX_BITS); i++) base_index[i] = -1;
+    for(uint32_t i=0; i + MATCH_MIN <= base_size; i++) base_index[hash8(base + i)] = i;
+    alignment = 0;
+}
+
+static uint32_t extend(const uint8_t* a, uint32_t a_n, const uint8_t* b, uint32_t b_n, int step) {
+    // as bsdiff: the length with the most of (matched - not matched)
+    uint32_t best = 0;
+    int32_t score = 0, best_score = 0;
+    for(uint32_t i=0; i<a_n && i<b_n; i++) {
+        score += a[step * (int32_t) i] == b[step * (int32_t) i] ? 1 : -1;
+        if(score > best_score) {
+            best_score = score;
+            best = i + 1;
+        }
+    }
+    return best;
+}
+
+static uint32_t encode_delta(uint32_t offset, uint32_t size, uint8_t* out) {
+    // returns the length, 0 if not fitting a block
+    uint8_t diff[FW_DOWNLOAD_SECTOR_SIZE];
+    uint8_t copies[FW_DOWNLOAD_SECTOR_SIZE];
+    const uint8_t* new = image + offset;
+    memcpy(diff, new, size);
+    uint16_t count = 0;
+    uint32_t copies_len = 2;
+    uint32_t at = 0, i = 0;
+    while(i + MATCH_MIN <= size && copies_len + 8 <= sizeof(copies)) {
+        // the alignment of the copy before, else one indexed
+        int64_t p = offset + i + alignment;
+        uint32_t n = 0;
+        if(p >= 0 && p < base_size)
+            n = extend(new + i, size - i, base + p, base_size - p, 1);
+        if(n < MATCH_MIN) {
+            int32_t q = base_index[hash8(new + i)];
+            if(q < 0 || memcmp(base + q, new + i, MATCH_MIN) != 0) {
+                i++;
+                continue;
+            }
+            p = q;
+            n = extend(new + i, size - i, base + p, base_size - p, 1);
+        }
+        uint32_t back = i > at && p > 0 ? extend(new + i - 1, i - at, base + p - 1, p, -1) : 0;
+        i -= back;
+        p -= back;
+        n += back;
+        write_u16(copies + copies_len, i - at);
+        write_u16(copies + copies_len + 2, n);
+        write_u32(copies + copies_len + 4, p);
+        copies_len += 8;
+        count++;
+        for(uint32_t k=0; k<n; k++) diff[i + k] -= base[p + k];
+        alignment = p - (int64_t) (offset + i);
+        at = i = i + n;
+    }
+    write_u16(copies, count);
+    uint8_t packed[FW_DOWNLOAD_SECTOR_SIZE + FW_DOWNLOAD_SECTOR_SIZE / 255 + 16];
+    uint32_t n = lz4_block_encode(diff, size, packed);
+    if(copies_len + n > FW_DOWNLOAD_SECTOR_SIZE) return 0;
+    memcpy(out, copies, copies_len);
+    memcpy(out + copies_len, packed, n);
+    return copies_len + n;
+}
+
+static void make_stream(bool delta) {
+    // a block per sector, the least of stored, packed, delta
+    uint8_t packed[FW_DOWNLOAD_SECTOR_SIZE + FW_DOWNLOAD_SECTOR_SIZE / 255 + 16];
+    uint8_t diff[FW_DOWNLOAD_SECTOR_SIZE];
+    if(delta) index_base();
+    stream_size = 0;
+    memset(blocks, 0, sizeof(blocks));
+    for(uint32_t offset=0; offset<image_size; offset+=FW_DOWNLOAD_SECTOR_SIZE) {
+        uint32_t size = image_size - offset < FW_DOWNLOAD_SECTOR_SIZE ? image_size - offset : FW_DOWNLOAD_SECTOR_SIZE;
+        uint32_t n = size;
+        uint16_t head = size | FW_DOWNLOAD_BLOCK_STORED;
+        const uint8_t* data = image + offset;
+        uint8_t kind = 0;
+        uint32_t packed_n = lz4_block_encode(image + offset, size, packed);
+        if(packed_n < n) {
+            n = head = packed_n;
+            data = packed;
+            kind = 1;
+        }
+        uint32_t diff_n = delta ? encode_delta(offset, size, diff) : 0;
+        if(diff_n && diff_n < n) {
+            n = diff_n;
+            head = diff_n | FW_DOWNLOAD_BLOCK_DELTA;
+            data = diff;
+            kind = 2;
+        }
+        write_u16(stream + stream_size, head);
+        memcpy(stream + stream_size + 2, data, n);
+        stream_size += 2 + n;
+        blocks[kind]++;
+    }
+}
+
+////// receiver
+
+static void flash_init_slot(void) {
+    memset(slot, 0xFF, sizeof(slot));
+    slot_valid = false;
+    slot_inits++;
+}
+
+static bool flash_write(const uint8_t* data, uint32_t offset, uint32_t size) {
+    if(offset % FW_DOWNLOAD_PAGE_SIZE || size % FW_DOWNLOAD_PAGE_SIZE || offset + size > SLOT_MAX) return false;
+    memcpy(slot + offset, data, size);
+    return true;
+}
+
+static void flash_mark_valid(void) { slot_valid = true; }
+
+static const uint8_t* flash_running(uint32_t* size) {
+    *size = SLOT_MAX;
+    return running;
+}
+
+static const fw_download_flash_t flash = {
+    .init_slot = flash_init_slot,
+    .write = flash_write,
+    .mark_valid = flash_mark_valid,
+    .running = flash_running,
+};
+
+static uint8_t send(const uint8_t* data, uint32_t len) {
+    // through the receiver, flushed whenever it waits, returns the status of the last reply
+    uint8_t status = 0xFF;
+    while(len > 0) {
+        uint16_t n = fw_download_read(&dl, data, len);
+        bool replied = dl.reply_len > 0;
+        if(replied) status = dl.reply[1];
+        dl.reply_len = 0;
+        if(n == 0 && !replied && !fw_download_flush(&dl)) {
+            printf("\nStuck\n");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+    while(fw_download_flush(&dl))
+        ;
+    return status;
+}
+
+static uint8_t send_begin(uint32_t base_crc) {
+    uint8_t b[FW_DOWNLOAD_HEAD_MAX] = {FW_DOWNLOAD_CMD_BEGIN_DELTA};
+    write_u32(b + 1, stream_size);
+    write_u32(b + 5, crc32_update(0, stream, stream_size));
+    write_u32(b + 9, image_size);
+    write_u32(b + 13, crc32_update(0, image, image_size));
+    write_u32(b + 17, base_size);
+    write_u32(b + 21, base_crc);
+    return send(b, sizeof(b));
+}
+
+static bool send_chunks() {
+    uint8_t b[CHUNK_HEAD + FW_DOWNLOAD_CHUNK_MAX];
+    for(uint32_t sent=0; sent<stream_size;) {
+        uint32_t n = stream_size - sent < FW_DOWNLOAD_CHUNK_MAX ? stream_size - sent : FW_DOWNLOAD_CHUNK_MAX;
+        uint32_t in_sector = FW_DOWNLOAD_SECTOR_SIZE - sent % FW_DOWNLOAD_SECTOR_SIZE;
+        if(n > in_sector) n = in_sector;
+        b[0] = FW_DOWNLOAD_CMD_CHUNK;
+        write_u32(b + 1, sent);
+        write_u16(b + 5, n);
+        write_u32(b + 7, crc32_update(0, stream + sent, n));
+        memcpy(b + CHUNK_HEAD, stream + sent, n);
+        uint8_t status = send(b, CHUNK_HEAD + n);
+        if(status != 0xFF && status != fw_download_status_OK) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static uint8_t download(const uint8_t* running_base, uint32_t base_crc) {
+    // returns the status of the end, or of what failed before
+    running = running_base;
+    uint8_t status = send_begin(base_crc);
+    if(status != fw_download_status_OK) return status;
+    if(!send_chunks()) return fw_download_status_BAD_CHUNK;
+    uint8_t end = FW_DOWNLOAD_CMD_END;
+    return send(&end, 1);
+}
+
+////// run
+
+static bool write_delta(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if(!f) return false;
+    uint8_t head[16];
+    write_u32(head, image_size);
+    write_u32(head + 4, crc32_update(0, image, image_size));
+    write_u32(head + 8, base_size);
+    write_u32(head + 12, crc32_update(0, base, base_size));
+    bool ok = fwrite(head, 1, 16, f) == 16 && fwrite(stream, 1, stream_size, f) == stream_size;
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const char* out_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "k:m:s:w:")) != -1) {
+        switch(opt) {
+            case 'k': opt_kb = atoi(optarg); break;
+            case 'm': opt_changed = atoi(optarg); break;
+            case 's': rand_state = atoi(optarg); break;
+            case 'w': out_path = optarg; break;
+            default:
+                printf("usage: %s [-k image-kb] [-m functions-changed] [-s seed] [-w out.delta] [base.bin new.bin]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("\nTest fw_delta\n");
+
+    if(optind + 1 < argc) {
+        base_size = read_file(argv[optind], base);
+        image_size = read_file(argv[optind + 1], image);
+        if(!base_size || !image_size) {
+            printf("\nCan not read %s, %s\n", argv[optind], argv[optind + 1]);
+            return 1;
+        }
+    } else {
+        if(opt_kb * 1024 > SLOT_MAX) opt_kb = SLOT_MAX / 1024;
+        make_builds();
+    }
+    uint32_t base_crc = crc32_update(0, base, base_size);
+
+    make_stream(false);
+    uint32_t packed_size = stream_size;
+    make_stream(true);
+    printf("\nBase %u bytes, new %u bytes, %u functions changed\n", base_size, image_size,
+           optind + 1 < argc ? 0 : opt_changed);
+    printf("packed %u bytes (%u%%), delta %u bytes (%u.%u%%), blocks stored %u, packed %u, delta %u\n",
+           packed_size, packed_size * 100 / image_size, stream_size, stream_size * 100 / image_size,
+           stream_size * 1000 / image_size % 10, blocks[0], blocks[1], blocks[2]);
+
+    bool ok = true;
+    fw_download_init(&dl, &flash);
+
+    // as is
+    uint8_t status = download(base, base_crc);
+    bool applied = status == fw_download_status_OK && slot_valid && memcmp(slot, image, image_size) == 0;
+    printf("\napplied: %s\n", applied ? "OK" : "FAILED");
+    ok = ok && applied;
+
+    // against another base, refused before the slot is erased
+    static uint8_t other[SLOT_MAX];
+    memcpy(other, base, base_size);
+    other[base_size / 2] ^= 0x01;
+    uint32_t inits = slot_inits;
+    status = download(other, base_crc);
+    bool refused = status == fw_download_status_BAD_BASE && slot_inits == inits;
+    printf("another base refused: %s\n", refused ? "OK" : "FAILED");
+    ok = ok && refused;
+
+    // tampered with, the stream crc as per it, so only the image crc tells: the last byte, a
+    // literal of the last block, as the last sequence of lz4 is (a copy may be of the same bytes)
+    uint32_t at = stream_size - 1;
+    stream[at] ^= 0x10;
+    status = download(base, base_crc);
+    bool tampered = status != fw_download_status_OK && !slot_valid;
+    printf("tampered not valid: %s (status %u)\n", tampered ? "OK" : "FAILED", status);
+    ok = ok && tampered;
+    stream[at] ^= 0x10;
+
+    if(out_path) {
+        bool written = write_delta(out_path);
+        printf("\nwritten %s: %s\n", out_path, written ? "OK" : "FAILED");
+        ok = ok && written;
+    }
+
+    printf("\nEnd of Test fw_delta\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,502 @@
+/*
+ * Test util/fw_download: push an image through the command stream, as the deploy tool
+ * does, over a simulated tcp link (bandwidth, round trip, segments split at random),
+ * with chunks corrupted and connections dropped on the way, into a flash which blocks
+ * the receiver while a sector is programmed. Checks the slot against the image, and
+ * reports the time taken against the one 1 KB chunk at a time protocol before.
+ *
+ * With -z the image is packed, a block per sector, as the deploy tool does, and unpacked by
+ * the receiver. The image is generated, somewhat alike to code, or read from a file (a .bin).
+ * With -a the flash takes a sector and programs it in the background, as the staged on AP,
+ * the receiver goes on and the busy callback holds the next sector, and the end, meanwhile.
+ *
+ * Build & run (host):
+ *   gcc -O2 -o /tmp/test_fw_download test_fw_download.c ../util/fw_download.c ../util/crc32.c ../util/lz4_block.c
+ *   /tmp/test_fw_download [-k image-kb] [-b bytes-per-ms] [-r rtt-ms] [-f flash-ms-per-sector]
+ *                         [-c corrupt-per-1000-chunks] [-d drops-per-1000-s] [-s seed] [-z] [-a] [image.bin]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/crc32.h"
+#include "../util/fw_download.h"
+
+#define SLOT_MAX (2048 * 1024)
+#define SEGMENTS_MAX 4096
+#define SEGMENT_MAX 1460 // tcp mss
+#define TIME_MAX_MS 3600000
+
+typedef struct {
+    uint64_t t; // arrives at, ms
+    uint16_t len;
+    uint16_t read;
+    uint8_t data[SEGMENT_MAX];
+} segment_t;
+
+typedef struct {
+    segment_t segments[SEGMENTS_MAX];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t free_us; // the link is busy till, as per the bandwidth
+} pipe_t;
+
+typedef enum {
+    sender_CONNECT = 0,
+    sender_QUERY,
+    sender_BEGIN,
+    sender_CHUNKS,
+    sender_END,
+    sender_DONE
+} sender_state_t;
+
+// options
+static uint32_t opt_kb = 600;
+static uint32_t opt_bw = 500; // bytes per ms, ~4 Mbit/s
+static uint32_t opt_rtt = 4;
+static uint32_t opt_flash_ms = 10;
+static uint32_t opt_corrupt = 0; // per 1000 chunks
+static uint32_t opt_drops = 0;   // per 1000 s
+static bool opt_packed = false;
+static bool opt_async = false;
+
+static uint64_t now = 0;
+
+static uint8_t image[SLOT_MAX];
+static uint32_t image_size;
+static uint8_t packed[SLOT_MAX + SLOT_MAX / FW_DOWNLOAD_SECTOR_SIZE * 2];
+static uint32_t packed_size;
+static const uint8_t* stream; // as sent, the image or packed
+static uint32_t stream_size;
+static uint8_t slot[SLOT_MAX];
+static bool slot_valid = false;
+static bool marked_early = false; // valid before all is flashed
+static uint64_t flash_busy_t = 0;
+static uint32_t sectors_flashed = 0;
+
+static pipe_t to_receiver;
+static pipe_t to_sender;
+static fw_download_t dl;
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+static inline void write_u32(uint8_t* buff, uint32_t v) {
+    for(int i=0; i<4; i++) buff[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static inline uint32_t read_u32(const uint8_t* buff) {
+    return buff[0] | (uint32_t) buff[1] << 8 | (uint32_t) buff[2] << 16 | (uint32_t) buff[3] << 24;
+}
+
+////// flash
+
+static void flash_init_slot(void) {
+    memset(slot, 0xFF, sizeof(slot));
+    slot_valid = false;
+}
+
+static bool flash_write(const uint8_t* data, uint32_t offset, uint32_t size) {
+    if(offset % FW_DOWNLOAD_PAGE_SIZE || size % FW_DOWNLOAD_PAGE_SIZE || offset + size > SLOT_MAX) return false;
+    memcpy(slot + offset, data, size);
+    flash_busy_t = now + opt_flash_ms;
+    sectors_flashed++;
+    return true;
+}
+
+static void flash_mark_valid(void) {
+    if(now < flash_busy_t) marked_early = true;
+    slot_valid = true;
+}
+
+static bool flash_busy(void) { return now < flash_busy_t; }
+
+static const fw_download_flash_t flash = {
+    .init_slot = flash_init_slot,
+    .write = flash_write,
+    .mark_valid = flash_mark_valid,
+};
+
+static const fw_download_flash_t flash_async = {
+    .init_slot = flash_init_slot,
+    .write = flash_write,
+    .mark_valid = flash_mark_valid,
+    .busy = flash_busy,
+};
+
+////// pack, as lz4 LZ4_compress_default, greedy, a block on its own
+
+#define HASH_BITS 12
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v = p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t* write_length(uint8_t* out, uint32_t len) {
+    // beyond the 15 of the token
+    for(; len >= 255; len -= 255) *out++ = 255;
+    *out++ = len;
+    return out;
+}
+
+static uint8_t* write_sequence(uint8_t* out, const uint8_t* lit, uint32_t lit_len, uint16_t offset, uint32_t match_len) {
+    uint8_t* token = out++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if(lit_len >= 15) out = write_length(out, lit_len - 15);
+    memcpy(out, lit, lit_len);
+    out += lit_len;
+    if(match_len == 0) return out; // the last
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    match_len -= 4;
+    *token |= match_len < 15 ? match_len : 15;
+    if(match_len >= 15) out = write_length(out, match_len - 15);
+    return out;
+}
+
+static uint32_t lz4_block_encode(const uint8_t* src, uint32_t len, uint8_t* dst) {
+    // a match starts 12 before the end at the latest and ends 5 before, as per the format
+    int32_t table[1 << HASH_BITS];
+    for(uint32_t i=0; i<(1 << HASH_BITS); i++) table[i] = -1;
+    uint8_t* out = dst;
+    uint32_t anchor = 0, i = 0;
+    while(len >= 13 && i + 12 < len) {
+        uint32_t h = hash4(src + i);
+        int32_t ref = table[h];
+        table[h] = i;
+        if(ref < 0 || memcmp(src + ref, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        uint32_t match_len = 4;
+        while(i + match_len < len - 5 && src[ref + match_len] == src[i + match_len]) match_len++;
+        out = write_sequence(out, src + anchor, i - anchor, i - ref, match_len);
+        i += match_len;
+        anchor = i;
+    }
+    out = write_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out - dst;
+}
+
+static void pack_image() {
+    // a block per sector, stored if not any smaller
+    uint8_t block[FW_DOWNLOAD_SECTOR_SIZE + FW_DOWNLOAD_SECTOR_SIZE / 255 + 16];
+    packed_size = 0;
+    for(uint32_t offset=0; offset<image_size; offset+=FW_DOWNLOAD_SECTOR_SIZE) {
+        uint32_t size = image_size - offset < FW_DOWNLOAD_SECTOR_SIZE ? image_size - offset : FW_DOWNLOAD_SECTOR_SIZE;
+        uint32_t n = lz4_block_encode(image + offset, size, block);
+        uint16_t head = n;
+        const uint8_t* data = block;
+        if(n >= size) {
+            head = size | FW_DOWNLOAD_BLOCK_STORED;
+            data = image + offset;
+            n = size;
+        }
+        packed[packed_size++] = head & 0xFF;
+        packed[packed_size++] = head >> 8;
+        memcpy(packed + packed_size, data, n);
+        packed_size += n;
+    }
+}
+
+static void make_image() {
+    // alike to code: words from a few, runs of the same, and pieces of what is before
+    uint32_t words[64];
+    for(uint32_t i=0; i<64; i++) words[i] = next_rand(1 << 16) | next_rand(1 << 16) << 16;
+    uint32_t i = 0;
+    while(i < image_size) {
+        uint32_t kind = next_rand(10);
+        if(kind < 5) {
+            uint32_t w = kind < 3 ? words[next_rand(64)] : next_rand(1 << 16) | next_rand(1 << 16) << 16;
+            for(int k=0; k<4 && i<image_size; k++) image[i++] = (w >> (8 * k)) & 0xFF;
+        } else if(kind < 6) {
+            uint32_t n = 4 + next_rand(60);
+            uint8_t b = next_rand(2) ? 0x00 : 0xFF;
+            for(; n>0 && i<image_size; n--) image[i++] = b;
+        } else if(i > 64) {
+            uint32_t n = 8 + next_rand(56);
+            uint32_t from = i - 1 - next_rand(i < 8192 ? i - 1 : 8192);
+            for(; n>0 && i<image_size; n--) image[i++] = image[from++];
+        }
+    }
+}
+
+static bool read_image(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(!f) return false;
+    image_size = fread(image, 1, SLOT_MAX, f);
+    fclose(f);
+    return image_size > 0;
+}
+
+////// link
+
+static void pipe_clear(pipe_t* p) {
+    p->head = p->tail = 0;
+    p->free_us = now * 1000;
+}
+
+static uint32_t pipe_queued(pipe_t* p) {
+    uint32_t n = 0;
+    for(uint32_t i=p->head; i!=p->tail; i++)
+        n += p->segments[i % SEGMENTS_MAX].len - p->segments[i % SEGMENTS_MAX].read;
+    return n;
+}
+
+static void pipe_write(pipe_t* p, const uint8_t* data, uint32_t len) {
+    // split into segments at random, upto the mss
+    while(len > 0) {
+        if(p->tail - p->head >= SEGMENTS_MAX) {
+            printf("\nPipe overflow\n");
+            exit(1);
+        }
+        segment_t* s = p->segments + p->tail++ % SEGMENTS_MAX;
+        s->len = 1 + next_rand(len < SEGMENT_MAX ? len : SEGMENT_MAX);
+        s->read = 0;
+        memcpy(s->data, data, s->len);
+        if(p->free_us < now * 1000) p->free_us = now * 1000;
+        p->free_us += s->len * 1000 / opt_bw;
+        s->t = (p->free_us + 999) / 1000 + opt_rtt / 2;
+        data += s->len;
+        len -= s->len;
+    }
+}
+
+static segment_t* pipe_arrived(pipe_t* p) {
+    if(p->head == p->tail) return NULL;
+    segment_t* s = p->segments + p->head % SEGMENTS_MAX;
+    return s->t <= now ? s : NULL;
+}
+
+static void pipe_read(pipe_t* p, segment_t* s, uint16_t n) {
+    s->read += n;
+    if(s->read == s->len) p->head++;
+}
+
+////// receiver, as tcp_server
+
+static void receiver_read() {
+    segment_t* s;
+    while((s = pipe_arrived(&to_receiver))) {
+        const uint8_t* b = s->data + s->read;
+        uint16_t len = s->len - s->read;
+        uint16_t n = 1; // not of the download, skipped
+        if(fw_download_in_command(&dl) || fw_download_is_command(b[0]))
+            n = fw_download_read(&dl, b, len);
+        bool replied = dl.reply_len > 0;
+        if(replied) {
+            pipe_write(&to_sender, dl.reply, dl.reply_len);
+            dl.reply_len = 0;
+        }
+        if(n == 0 && !replied) break;
+        pipe_read(&to_receiver, s, n);
+    }
+}
+
+static void receiver_tick() {
+    if(!opt_async && now < flash_busy_t) return; // the main loop blocked, programming
+    if(fw_download_flush(&dl)) return;
+    receiver_read();
+}
+
+////// sender, as the deploy tool
+
+static sender_state_t sender_state = sender_CONNECT;
+static uint32_t sent; // offset of the next chunk
+static uint32_t acked;
+static uint32_t chunks_sent = 0;
+static uint32_t chunks_corrupted = 0;
+static uint32_t resumes = 0;
+static uint32_t go_backs = 0;
+static uint8_t reply[FW_DOWNLOAD_REPLY_MAX];
+static uint8_t reply_len = 0;
+
+#define CHUNK_HEAD 11
+
+static void send_command(uint8_t cmd) {
+    uint8_t b[FW_DOWNLOAD_HEAD_MAX] = {cmd};
+    uint32_t len = 1;
+    if(cmd == FW_DOWNLOAD_CMD_BEGIN || cmd == FW_DOWNLOAD_CMD_BEGIN_PACKED) {
+        write_u32(b + 1, stream_size);
+        write_u32(b + 5, crc32_update(0, stream, stream_size));
+        len = 9;
+    }
+    if(cmd == FW_DOWNLOAD_CMD_BEGIN_PACKED) {
+        write_u32(b + 9, image_size);
+        write_u32(b + 13, crc32_update(0, image, image_size));
+        len = 17;
+    }
+    pipe_write(&to_receiver, b, len);
+}
+
+static void send_chunk() {
+    // not across a sector of the stream
+    uint8_t b[CHUNK_HEAD + FW_DOWNLOAD_CHUNK_MAX];
+    uint32_t n = stream_size - sent < FW_DOWNLOAD_CHUNK_MAX ? stream_size - sent : FW_DOWNLOAD_CHUNK_MAX;
+    uint32_t in_sector = FW_DOWNLOAD_SECTOR_SIZE - sent % FW_DOWNLOAD_SECTOR_SIZE;
+    if(n > in_sector) n = in_sector;
+    b[0] = FW_DOWNLOAD_CMD_CHUNK;
+    write_u32(b + 1, sent);
+    b[5] = n & 0xFF;
+    b[6] = n >> 8;
+    write_u32(b + 7, crc32_update(0, stream + sent, n));
+    memcpy(b + CHUNK_HEAD, stream + sent, n);
+    if(next_rand(1000) < opt_corrupt) {
+        b[CHUNK_HEAD + next_rand(n)] ^= 0x5A;
+        chunks_corrupted++;
+    }
+    pipe_write(&to_receiver, b, CHUNK_HEAD + n);
+    sent += n;
+    chunks_sent++;
+}
+
+static bool next_reply() {
+    // a reply in full, from the stream
+    segment_t* s;
+    while((s = pipe_arrived(&to_sender))) {
+        if(reply_len == 0 && s->read < s->len) reply[reply_len++] = s->data[s->read++];
+        uint8_t size = reply[0] == FW_DOWNLOAD_CMD_QUERY ? 14 : 6;
+        while(reply_len < size && s->read < s->len) reply[reply_len++] = s->data[s->read++];
+        if(s->read == s->len) to_sender.head++;
+        if(reply_len == size) {
+            reply_len = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sender_tick() {
+    if(sender_state == sender_CONNECT) {
+        send_command(FW_DOWNLOAD_CMD_QUERY);
+        sender_state = sender_QUERY;
+    }
+    while(next_reply()) {
+        uint8_t cmd = reply[0], status = reply[1];
+        uint32_t offset = read_u32(reply + 2);
+        if(sender_state == sender_QUERY && cmd == FW_DOWNLOAD_CMD_QUERY) {
+            if(status == fw_download_status_OK && read_u32(reply + 6) == stream_size &&
+               read_u32(reply + 10) == crc32_update(0, stream, stream_size)) {
+                sent = acked = offset; // the same image, resume
+                sender_state = sender_CHUNKS;
+                if(offset > 0) resumes++;
+            } else {
+                send_command(opt_packed ? FW_DOWNLOAD_CMD_BEGIN_PACKED : FW_DOWNLOAD_CMD_BEGIN);
+                sender_state = sender_BEGIN;
+            }
+        } else if(sender_state == sender_BEGIN && (cmd == FW_DOWNLOAD_CMD_BEGIN || cmd == FW_DOWNLOAD_CMD_BEGIN_PACKED)) {
+            sent = acked = 0;
+            sender_state = status == fw_download_status_OK ? sender_CHUNKS : sender_CONNECT;
+        } else if(sender_state == sender_CHUNKS && cmd == FW_DOWNLOAD_CMD_CHUNK) {
+            if(status == fw_download_status_OK) {
+                if(offset > acked) acked = offset;
+            } else {
+                sent = acked = offset; // go back
+                go_backs++;
+            }
+        } else if(sender_state == sender_END && cmd == FW_DOWNLOAD_CMD_END) {
+            sender_state = status == fw_download_status_OK ? sender_DONE : sender_CONNECT;
+        }
+    }
+    if(sender_state == sender_CHUNKS) {
+        while(sent < stream_size && sent - acked < FW_DOWNLOAD_WINDOW)
+            send_chunk();
+        if(acked == stream_size) {
+            send_command(FW_DOWNLOAD_CMD_END);
+            sender_state = sender_END;
+        }
+    }
+}
+
+////// run
+
+static uint64_t stop_and_wait_ms() {
+    // the protocol before: a 1 KB chunk (+4 header) each, flashed as received, a 1 byte ack,
+    // and the tool sleeping 2 ms before reading it
+    uint32_t chunks = (image_size + 1023) / 1024;
+    uint64_t per_chunk = 1028 / opt_bw + opt_rtt + opt_flash_ms / 4 + 2;
+    return chunks * per_chunk;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "k:b:r:f:c:d:s:za")) != -1) {
+        switch(opt) {
+            case 'k': opt_kb = atoi(optarg); break;
+            case 'b': opt_bw = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'r': opt_rtt = atoi(optarg); break;
+            case 'f': opt_flash_ms = atoi(optarg); break;
+            case 'c': opt_corrupt = atoi(optarg); break;
+            case 'd': opt_drops = atoi(optarg); break;
+            case 's': rand_state = atoi(optarg); break;
+            case 'z': opt_packed = true; break;
+            case 'a': opt_async = true; break;
+            default:
+                printf("usage: %s [-k image-kb] [-b bytes-per-ms] [-r rtt-ms] [-f flash-ms-per-sector]"
+                       " [-c corrupt-per-1000-chunks] [-d drops-per-1000-s] [-s seed] [-z] [-a] [image.bin]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("\nTest fw_download\n");
+
+    if(optind < argc) {
+        if(!read_image(argv[optind])) {
+            printf("\nCan not read %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        image_size = opt_kb * 1024 - next_rand(1000); // not a whole sector
+        if(image_size > SLOT_MAX) image_size = SLOT_MAX;
+        make_image();
+    }
+    stream = image;
+    stream_size = image_size;
+    if(opt_packed) {
+        pack_image();
+        stream = packed;
+        stream_size = packed_size;
+    }
+    printf("\nImage %u bytes, %u bytes/ms, rtt %u ms, flash %u ms/sector, corrupt %u/1000 chunks, drops %u/1000 s\n",
+           image_size, opt_bw, opt_rtt, opt_flash_ms, opt_corrupt, opt_drops);
+    if(opt_packed)
+        printf("packed %u bytes (%u%%), into %u blocks\n", stream_size, stream_size * 100 / image_size,
+               (image_size + FW_DOWNLOAD_SECTOR_SIZE - 1) / FW_DOWNLOAD_SECTOR_SIZE);
+
+    fw_download_init(&dl, opt_async ? &flash_async : &flash);
+    uint32_t drops = 0;
+    uint32_t max_queued = 0;
+    for(now = 0; now < TIME_MAX_MS && sender_state != sender_DONE; now++) {
+        if(opt_drops && next_rand(1000000) < opt_drops) {
+            // the connection lost, with all in flight, then reconnected
+            pipe_clear(&to_receiver);
+            pipe_clear(&to_sender);
+            fw_download_restart_stream(&dl);
+            reply_len = 0;
+            sender_state = sender_CONNECT;
+            drops++;
+        }
+        sender_tick();
+        receiver_tick();
+        uint32_t queued = pipe_queued(&to_receiver);
+        if(queued > max_queued) max_queued = queued;
+    }
+
+    bool ok = sender_state == sender_DONE && slot_valid && !marked_early && memcmp(slot, image, image_size) == 0;
+    printf("\n%s in %llu ms (%u KB/s), stop and wait %llu ms\n", ok ? "Downloaded" : "FAILED",
+           (unsigned long long) now, (uint32_t) (now ? (uint64_t) image_size / now : 0),
+           (unsigned long long) stop_and_wait_ms());
+    printf("chunks sent %u, corrupted %u, go backs %u, drops %u, resumes %u, sectors flashed %u\n",
+           chunks_sent, chunks_corrupted, go_backs, drops, resumes, sectors_flashed);
+    printf("max queued to the receiver %u bytes (tcp window %u)\n", max_queued, 8 * SEGMENT_MAX);
+
+    printf("\nEnd of Test fw_download\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,378 @@
+/*
+ * Test util/fw_relay: relay a firmware from AP to a node, as comm does, the pieces over the bulk
+ * transfer in the room the live records leave in the frames, and the node reading them into its
+ * fw_download, a flash which blocks the node while a sector is programmed. AP reads the staged
+ * a piece at a time, asked on a call and ready a millisecond after, as from the W25Q32 through
+ * core1, and a piece may be asked again meanwhile, by the node restarted. The node restarts
+ * part way, and the other node is relayed meanwhile, so that the commit waits for it. Checks the
+ * slot against the image, that it is committed only once verified, and that a stream corrupted
+ * on its way to AP (staged as is) fails on the node, and is not committed.
+ *
+ * Build & run (host):
+ *   gcc -O2 -o /tmp/test_fw_relay test_fw_relay.c ../util/fw_relay.c ../util/fw_download.c \
+ *       ../util/bulk_transfer.c ../util/crc32.c ../util/lz4_block.c
+ *   /tmp/test_fw_relay [-k image-kb] [-i interval-ms] [-n frames-per-interval] [-f flash-ms-per-sector] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../util/crc32.h"
+#include "../util/fw_relay.h"
+
+#define SLOT_MAX (1024 * 1024)
+#define STREAM_MAX (SLOT_MAX + SLOT_MAX / 64)
+#define PIECE_MAX 4096 // KBD_BULK_SIZE_MAX
+#define PAYLOAD 61     // BLE_PAYLOAD_SIZE
+#define LIVE 14        // room taken by the live records, key events and so on
+#define FRAMES_MAX 1024
+#define POLL_MS 4      // of the node, KBD_POLL_ACTIVE_MS
+#define REFRESH_MS 250 // KBD_COMM_REFRESH_MS
+#define TIME_MAX_MS 3600000
+#define CHUNK_HEAD 11 // cmd, offset, n, crc
+
+// records, as the comm types
+enum { rec_bulk_begin = 1, rec_bulk_chunk, rec_bulk_ack, rec_relay_status, rec_relay_commit };
+
+typedef struct {
+    uint64_t t; // arrives at, ms
+    uint8_t len;
+    uint8_t data[PAYLOAD];
+} frame_t;
+
+typedef struct {
+    frame_t frames[FRAMES_MAX];
+    uint32_t head;
+    uint32_t tail;
+} link_t;
+
+// options
+static uint32_t opt_kb = 300;
+static uint32_t opt_interval = 8; // ms, of the connection
+static uint32_t opt_frames = 3;   // per interval, as the window allows
+static uint32_t opt_flash_ms = 45;
+
+static uint64_t now = 0;
+
+static uint8_t image[SLOT_MAX];
+static uint32_t image_size;
+static uint8_t stream[STREAM_MAX]; // the fw_download commands, as staged on AP
+static uint32_t stream_size;
+static uint8_t slot[SLOT_MAX];
+static bool slot_valid = false;
+static uint64_t flash_busy_t = 0;
+static uint32_t sectors_flashed = 0;
+
+static link_t to_node;
+static link_t to_ap;
+
+// AP
+static fw_relay_sender_t relay[2]; // 0: the node, 1: the other one, its state only
+static uint8_t piece[PIECE_MAX];
+static bulk_sender_t tx;
+static bool staged_asked = false;
+static uint32_t staged_offset;
+static uint32_t staged_len;
+static uint64_t staged_ready_t;
+
+// node
+static fw_relay_receiver_t rr;
+static uint8_t rx_data[PIECE_MAX];
+static bulk_receiver_t rx;
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+static inline void write_u32(uint8_t* buff, uint32_t v) {
+    for(int i=0; i<4; i++) buff[i] = (v >> (8 * i)) & 0xFF;
+}
+
+////// flash of the node
+
+static void flash_init_slot(void) {
+    slot_valid = false; // the sectors erased as written
+}
+
+static bool flash_write(const uint8_t* data, uint32_t offset, uint32_t size) {
+    if(offset % FW_DOWNLOAD_PAGE_SIZE || size % FW_DOWNLOAD_PAGE_SIZE || offset + size > SLOT_MAX) return false;
+    if(offset % FW_DOWNLOAD_SECTOR_SIZE == 0) memset(slot + offset, 0xFF, FW_DOWNLOAD_SECTOR_SIZE);
+    memcpy(slot + offset, data, size);
+    flash_busy_t = now + opt_flash_ms;
+    sectors_flashed++;
+    return true;
+}
+
+static void flash_mark_valid(void) { slot_valid = true; }
+
+static const fw_download_flash_t flash = {
+    .init_slot = flash_init_slot,
+    .write = flash_write,
+    .mark_valid = flash_mark_valid,
+};
+
+////// the staged on AP, read as through core1
+
+static bool staged_read(uint32_t offset, uint8_t* buf, uint32_t len) {
+    if(staged_asked && staged_offset == offset && staged_len == len) {
+        if(now < staged_ready_t) return false;
+        memcpy(buf, stream + offset, len);
+        staged_asked = false;
+        return true;
+    }
+    staged_asked = true;
+    staged_offset = offset;
+    staged_len = len;
+    staged_ready_t = now + 1;
+    return false;
+}
+
+////// the image, and its stream as the deploy tool makes it
+
+static void make_image() {
+    for(uint32_t i=0; i<image_size; i++) image[i] = next_rand(4) ? next_rand(256) : 0;
+}
+
+static void make_stream() {
+    uint8_t* b = stream;
+    b[0] = FW_DOWNLOAD_CMD_BEGIN;
+    write_u32(b + 1, image_size);
+    write_u32(b + 5, crc32_update(0, image, image_size));
+    b += 9;
+    for(uint32_t at = 0; at < image_size;) {
+        // not across a sector
+        uint32_t n = image_size - at < FW_DOWNLOAD_CHUNK_MAX ? image_size - at : FW_DOWNLOAD_CHUNK_MAX;
+        uint32_t in_sector = FW_DOWNLOAD_SECTOR_SIZE - at % FW_DOWNLOAD_SECTOR_SIZE;
+        if(n > in_sector) n = in_sector;
+        b[0] = FW_DOWNLOAD_CMD_CHUNK;
+        write_u32(b + 1, at);
+        b[5] = n & 0xFF;
+        b[6] = n >> 8;
+        write_u32(b + 7, crc32_update(0, image + at, n));
+        memcpy(b + CHUNK_HEAD, image + at, n);
+        b += CHUNK_HEAD + n;
+        at += n;
+    }
+    *b++ = FW_DOWNLOAD_CMD_END;
+    stream_size = b - stream;
+}
+
+////// link, in order, a frame arrives an interval later
+
+static void link_clear(link_t* l) {
+    l->head = l->tail = 0;
+}
+
+static void link_write(link_t* l, const uint8_t* data, uint8_t len) {
+    if(l->tail - l->head >= FRAMES_MAX) {
+        fprintf(stderr, "link overflow\n");
+        exit(2);
+    }
+    frame_t* f = l->frames + l->tail++ % FRAMES_MAX;
+    f->t = now + opt_interval;
+    f->len = len;
+    memcpy(f->data, data, len);
+}
+
+static frame_t* link_read(link_t* l) {
+    if(l->head == l->tail || l->frames[l->head % FRAMES_MAX].t > now) return NULL;
+    return l->frames + l->head++ % FRAMES_MAX;
+}
+
+////// AP
+
+static uint64_t commit_t = 0;
+
+static uint8_t ap_produce(uint8_t* buff) {
+    uint8_t len = 0;
+    if(fw_relay_sender_commit_due(relay, relay, 2)) {
+        relay[0].state = fw_relay_state_COMMITTED;
+        buff[len++] = rec_relay_commit;
+        commit_t = now;
+    }
+    fw_relay_sender_task(relay, &tx, (uint32_t) now);
+    bool is_begin;
+    uint8_t n = bulk_sender_write(&tx, buff + len + 1, PAYLOAD - LIVE - len - 1, &is_begin, (uint32_t) now);
+    if(n > 0) {
+        buff[len] = is_begin ? rec_bulk_begin : rec_bulk_chunk;
+        len += 1 + n;
+    }
+    return len;
+}
+
+static void ap_consume(const uint8_t* buff, uint8_t len) {
+    while(len > 1) {
+        uint8_t n = 0;
+        if(buff[0] == rec_bulk_ack) n = bulk_sender_read_ack(&tx, buff + 1, len - 1, (uint32_t) now);
+        else if(buff[0] == rec_relay_status) n = fw_relay_sender_read_status(relay, buff + 1, len - 1, (uint32_t) now);
+        if(n == 0) break;
+        len -= 1 + n;
+        buff += 1 + n;
+    }
+}
+
+////// node
+
+static void node_start() {
+    // as on boot, the slot as it is
+    if(rr.dl.sector[0]) free(rr.dl.sector[0]);
+    if(rr.dl.packed_buff) free(rr.dl.packed_buff);
+    bulk_receiver_init(&rx, rx_data, PIECE_MAX);
+    fw_relay_receiver_init(&rr, &flash);
+}
+
+static void node_consume(const uint8_t* buff, uint8_t len) {
+    while(len > 0) {
+        uint8_t n = 0;
+        if(buff[0] == rec_relay_commit) {
+            fw_relay_receiver_commit(&rr);
+        } else if(buff[0] == rec_bulk_begin && len > 1) {
+            n = bulk_receiver_read_begin(&rx, buff + 1, len - 1, (uint32_t) now);
+            if(n == 0) break;
+        } else if(buff[0] == rec_bulk_chunk && len > 1) {
+            n = bulk_receiver_read_chunk(&rx, buff + 1, len - 1, (uint32_t) now);
+            if(n == 0) break;
+        } else {
+            break;
+        }
+        len -= 1 + n;
+        buff += 1 + n;
+    }
+}
+
+static uint8_t node_produce(uint8_t* buff, bool refresh) {
+    uint8_t len = 0;
+    if(rx.ack_due || (refresh && rx.state != bulk_state_IDLE)) {
+        buff[len] = rec_bulk_ack;
+        len += 1 + bulk_receiver_write_ack(&rx, buff + len + 1);
+    }
+    if(rr.status_due || (refresh && rx.state != bulk_state_IDLE)) {
+        buff[len] = rec_relay_status;
+        len += 1 + fw_relay_receiver_write_status(&rr, buff + len + 1);
+    }
+    return len;
+}
+
+////// run
+
+typedef struct {
+    uint64_t verified_t; // by AP, as reported
+    uint64_t other_done_t;
+    uint32_t restarts;
+    bool committed;
+} result_t;
+
+static result_t run(bool restart, uint64_t other_ms) {
+    result_t res = {0};
+    now = 0;
+    flash_busy_t = 0;
+    sectors_flashed = 0;
+    commit_t = 0;
+    memset(slot, 0xFF, sizeof(slot));
+    slot_valid = false;
+    link_clear(&to_node);
+    link_clear(&to_ap);
+    bulk_sender_init(&tx);
+    fw_relay_sender_init(relay, piece, PIECE_MAX);
+    fw_relay_sender_init(relay + 1, NULL, 0);
+    node_start();
+
+    staged_asked = false;
+    fw_relay_sender_start(relay, staged_read, stream_size);
+    relay[1].state = fw_relay_state_RELAYING; // the other node, done later
+    uint64_t refresh_t = 0;
+    for(; now < TIME_MAX_MS; now++) {
+        if(relay[1].state == fw_relay_state_RELAYING && res.verified_t && now >= res.verified_t + other_ms) {
+            relay[1].state = fw_relay_state_IDLE;
+            res.other_done_t = now;
+        }
+        if(now % opt_interval == 0) {
+            uint8_t buff[PAYLOAD];
+            for(uint32_t i=0; i<opt_frames; i++) {
+                uint8_t len = ap_produce(buff);
+                if(len == 0) break;
+                link_write(&to_node, buff, len);
+            }
+        }
+        frame_t* f;
+        while((f = link_read(&to_ap))) ap_consume(f->data, f->len);
+        if(relay[0].state == fw_relay_state_VERIFIED && !res.verified_t) res.verified_t = now;
+        if(relay[0].state == fw_relay_state_FAILED || rr.commit_due) break;
+
+        // the node, off while a sector is programmed
+        if(now < flash_busy_t) continue;
+        while((f = link_read(&to_node))) node_consume(f->data, f->len);
+        if(now % POLL_MS == 0) fw_relay_receiver_task(&rr, &rx);
+        if(restart && res.restarts == 0 && rr.read > stream_size / 2) {
+            node_start();
+            res.restarts++;
+            continue;
+        }
+        if(now % opt_interval == opt_interval / 2) {
+            bool refresh = now - refresh_t >= REFRESH_MS;
+            if(refresh) refresh_t = now;
+            uint8_t buff[PAYLOAD];
+            uint8_t len = node_produce(buff, refresh);
+            if(len > 0) link_write(&to_ap, buff, len);
+        }
+    }
+    res.committed = rr.commit_due;
+    return res;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "k:i:n:f:s:")) != -1) {
+        switch(opt) {
+        case 'k': opt_kb = atoi(optarg); break;
+        case 'i': opt_interval = atoi(optarg); break;
+        case 'n': opt_frames = atoi(optarg); break;
+        case 'f': opt_flash_ms = atoi(optarg); break;
+        case 's': rand_state = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-k image-kb] [-i interval-ms] [-n frames-per-interval] [-f flash-ms] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    image_size = opt_kb * 1024 - 100; // the last sector in part
+    if(image_size > SLOT_MAX) image_size = SLOT_MAX;
+    if(opt_interval < 2) opt_interval = 2;
+    make_image();
+    make_stream();
+    printf("image %u bytes, stream %u bytes, interval %u ms x %u frames, flash %u ms per sector\n",
+           image_size, stream_size, opt_interval, opt_frames, opt_flash_ms);
+
+    int failures = 0;
+
+    // relayed, the node restarted half way, the other node done 2 s after
+    result_t r = run(true, 2000);
+    bool same = memcmp(slot, image, image_size) == 0;
+    printf("relayed   : %s, %.1f s, %.1f KB/s, %u sectors flashed, %u restart(s), slot %s, %s\n",
+           r.committed ? "committed" : "NOT committed", now / 1000.0,
+           r.verified_t ? stream_size / (double) r.verified_t : 0.0, sectors_flashed, r.restarts,
+           same && slot_valid ? "as the image" : "NOT as the image",
+           commit_t >= r.other_done_t && r.other_done_t > 0 ? "after the other node" : "BEFORE the other node");
+    if(!r.committed || !same || !slot_valid || r.restarts != 1 || r.other_done_t == 0 || commit_t < r.other_done_t)
+        failures++;
+
+    // corrupted on its way to AP, in a chunk of the middle, as staged
+    uint32_t at = 9 + (image_size / FW_DOWNLOAD_CHUNK_MAX / 2) * (CHUNK_HEAD + FW_DOWNLOAD_CHUNK_MAX) + CHUNK_HEAD + 7;
+    stream[at] ^= 0x5A;
+    r = run(false, 0);
+    stream[at] ^= 0x5A;
+    printf("corrupted : %s, %s, status %u, read %u of %u, slot %s\n",
+           relay[0].state == fw_relay_state_FAILED ? "failed" : "NOT failed",
+           r.committed ? "COMMITTED" : "not committed", relay[0].status, relay[0].read, stream_size,
+           slot_valid ? "VALID" : "not valid");
+    if(relay[0].state != fw_relay_state_FAILED || r.committed || slot_valid ||
+       relay[0].status != fw_download_status_BAD_CHUNK)
+        failures++;
+
+    printf(failures ? "FAILED\n" : "OK\n");
+    return failures ? 1 : 0;
+}
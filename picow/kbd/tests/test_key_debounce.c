@@ -0,0 +1,250 @@
+/*
+ * Replay key bounce traces through util/key_debounce and report, per algorithm,
+ * the added latency of the debounced edges and any spurious or missed transitions.
+ *
+ * Build & run (host):
+ *   gcc -O2 -o /tmp/test_key_debounce test_key_debounce.c ../util/key_debounce.c
+ *   /tmp/test_key_debounce [trace-file|"" [scan-period-us]]
+ *
+ * The scan period defaults to 1000 us, the period of the frames which core0 debounces one by one
+ * (hw_key_scan_rate_hz), so that the latencies and counter_max are as on the nodes.
+ *
+ * Trace file: one raw level change per line "t_us row col level", '#' for comments.
+ * Without a trace file a synthetic trace of bouncy keystrokes is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/key_debounce.h"
+
+#define ROWS 6
+#define COLS 7
+#define KEYS (ROWS*COLS)
+#define MAX_EVENTS 100000
+#define MAX_EDGES 4096
+#define SETTLE_US 10000 // a level which holds this long is intended
+
+typedef struct {
+    uint64_t t;
+    uint8_t row;
+    uint8_t col;
+    uint8_t level;
+} trace_event_t;
+
+typedef struct {
+    uint64_t t;
+    uint8_t level;
+} edge_t;
+
+static trace_event_t trace[MAX_EVENTS];
+static int trace_count = 0;
+
+static edge_t intended[KEYS][MAX_EDGES];
+static int intended_count[KEYS];
+static edge_t debounced[KEYS][MAX_EDGES];
+static int debounced_count[KEYS];
+
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(uint32_t max) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) % max);
+}
+
+static void add_event(uint64_t t, uint8_t row, uint8_t col, uint8_t level) {
+    if(trace_count >= MAX_EVENTS) return;
+    trace[trace_count++] = (trace_event_t) {t, row, col, level};
+}
+
+static uint64_t add_bounce(uint64_t t, uint8_t row, uint8_t col, uint8_t level) {
+    // contact chatter for upto 4 ms, then settle on level
+    uint32_t bounces = next_rand(6);
+    for(uint32_t i=0; i<bounces; i++) {
+        add_event(t, row, col, (i%2) ? !level : level);
+        t += 100 + next_rand(600);
+    }
+    add_event(t, row, col, level);
+    return t;
+}
+
+static void make_synthetic_trace() {
+    static uint64_t busy[KEYS]; // key is in use until
+    uint64_t t = 10000;
+    for(int i=0; i<400; i++) {
+        uint8_t row, col;
+        do { // rolls overlap, but not on the same key
+            row = next_rand(ROWS);
+            col = next_rand(COLS);
+        } while(busy[row*COLS+col] + SETTLE_US > t);
+        // mostly normal keystrokes, some quick taps
+        uint32_t hold = (i%10==0) ? 15000 + next_rand(5000) : 30000 + next_rand(90000);
+        uint64_t tr = add_bounce(t, row, col, 1);
+        busy[row*COLS+col] = add_bounce(tr + hold, row, col, 0);
+        t += 20000 + next_rand(150000);
+    }
+    // order by time, rolls can overlap
+    for(int i=1; i<trace_count; i++) {
+        trace_event_t e = trace[i];
+        int j = i-1;
+        while(j>=0 && trace[j].t > e.t) { trace[j+1] = trace[j]; j--; }
+        trace[j+1] = e;
+    }
+}
+
+static int read_trace(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(!f) return -1;
+    char line[128];
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long long t;
+        unsigned row, col, level;
+        if(line[0]=='#') continue;
+        if(sscanf(line, "%llu %u %u %u", &t, &row, &col, &level) != 4) continue;
+        if(row>=ROWS || col>=COLS) continue;
+        add_event(t, row, col, level ? 1 : 0);
+    }
+    fclose(f);
+    return 0;
+}
+
+// intended transition: 1st edge of a burst of raw edges, which settles to a new level
+static void find_intended() {
+    static uint64_t burst_t[KEYS];
+    static uint8_t burst_level[KEYS];
+    static uint8_t level[KEYS];
+    static uint64_t last_t[KEYS];
+    memset(intended_count, 0, sizeof(intended_count));
+    memset(level, 0, sizeof(level));
+    memset(burst_level, 0, sizeof(burst_level));
+    for(int k=0; k<KEYS; k++) last_t[k] = burst_t[k] = 0;
+
+    for(int i=0; i<=trace_count; i++) {
+        for(int k=0; k<KEYS; k++) {
+            // close the bursts which settled
+            uint64_t t = i<trace_count ? trace[i].t : (uint64_t)-1;
+            if(burst_t[k] && t - last_t[k] >= SETTLE_US) {
+                if(level[k] != burst_level[k] && intended_count[k] < MAX_EDGES)
+                    intended[k][intended_count[k]++] = (edge_t) {burst_t[k], level[k]};
+                burst_level[k] = level[k];
+                burst_t[k] = 0;
+            }
+        }
+        if(i==trace_count) break;
+        trace_event_t* e = trace + i;
+        int k = e->row*COLS + e->col;
+        if(e->level == level[k]) continue;
+        if(!burst_t[k]) burst_t[k] = e->t;
+        level[k] = e->level;
+        last_t[k] = e->t;
+    }
+}
+
+static void replay(key_debounce_t* kd, uint32_t period_us) {
+    uint8_t raw[ROWS] = {0};
+    uint8_t prev[ROWS] = {0};
+    memset(debounced_count, 0, sizeof(debounced_count));
+
+    uint64_t end = trace[trace_count-1].t + 2*SETTLE_US;
+    int i = 0;
+    for(uint64_t t=0; t<end; t+=period_us) {
+        for(; i<trace_count && trace[i].t <= t; i++) {
+            uint8_t mask = 1 << (COLS-1-trace[i].col);
+            if(trace[i].level) raw[trace[i].row] |= mask;
+            else raw[trace[i].row] &= ~mask;
+        }
+        if(!key_debounce_update(kd, raw, t)) continue;
+        for(int row=0; row<ROWS; row++) {
+            uint8_t dv = prev[row] ^ kd->keys[row];
+            for(int col=0; col<COLS && dv; col++) {
+                uint8_t mask = 1 << (COLS-1-col);
+                if(!(dv & mask)) continue;
+                int k = row*COLS + col;
+                if(debounced_count[k] < MAX_EDGES)
+                    debounced[k][debounced_count[k]++] = (edge_t) {t, (kd->keys[row] & mask) ? 1 : 0};
+            }
+            prev[row] = kd->keys[row];
+        }
+    }
+}
+
+static void report(const char* name) {
+    uint64_t sum[2] = {0, 0}, max[2] = {0, 0};
+    int n[2] = {0, 0}, spurious = 0, missed = 0;
+    for(int k=0; k<KEYS; k++) {
+        int a = 0, b = 0;
+        while(b < debounced_count[k]) {
+            edge_t* d = &debounced[k][b];
+            edge_t* e = a < intended_count[k] ? &intended[k][a] : NULL;
+            if(e && d->level == e->level && d->t >= e->t) {
+                uint64_t dt = d->t - e->t;
+                sum[e->level] += dt;
+                if(dt > max[e->level]) max[e->level] = dt;
+                n[e->level]++;
+                a++;
+            } else if(e && d->level != e->level) {
+                missed++; // this intended edge was skipped over
+                a++;
+                continue;
+            } else {
+                spurious++;
+            }
+            b++;
+        }
+        missed += intended_count[k] - a;
+    }
+    printf("\n%-8s press: avg %5llu us, max %5llu us | release: avg %5llu us, max %5llu us"
+           " | spurious: %d, missed: %d",
+           name,
+           (unsigned long long) (n[1] ? sum[1]/n[1] : 0), (unsigned long long) max[1],
+           (unsigned long long) (n[0] ? sum[0]/n[0] : 0), (unsigned long long) max[0],
+           spurious, missed);
+}
+
+void test(uint32_t period_us) {
+    const char* names[key_debounce_COUNT] = {"none", "eager", "defer", "counter"};
+
+    find_intended();
+    int total = 0;
+    for(int k=0; k<KEYS; k++) total += intended_count[k];
+    printf("\nTrace: %d raw edges, %d intended transitions, scan period %u us\n",
+           trace_count, total, period_us);
+
+    for(uint8_t algo=0; algo<key_debounce_COUNT; algo++) {
+        key_debounce_config_t config = {
+            .algorithm = algo,
+            .press_ms = 5,
+            .release_ms = 5,
+            .counter_max = 5000 / period_us > 0 ? 5000 / period_us : 1
+        };
+        key_debounce_t* kd = key_debounce_create(ROWS, COLS, &config);
+        replay(kd, period_us);
+        report(names[algo]);
+        key_debounce_free(kd);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    printf("\nTest key_debounce\n");
+
+    uint32_t period_us = argc > 2 ? (uint32_t) atoi(argv[2]) : 1000;
+    if(argc > 1 && argv[1][0]) {
+        if(read_trace(argv[1])) {
+            printf("\nCan not read trace %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        make_synthetic_trace();
+    }
+    if(trace_count == 0) {
+        printf("\nEmpty trace\n");
+        return 1;
+    }
+
+    test(period_us);
+
+    printf("\nEnd of Test key_debounce\n");
+    return 0;
+}
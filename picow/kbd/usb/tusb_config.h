@@ -91,7 +91,7 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID               2
+#define CFG_TUD_HID               4
 #define CFG_TUD_CDC               0
 #define CFG_TUD_MSC               0
 #define CFG_TUD_MIDI              0
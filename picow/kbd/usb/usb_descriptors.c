@@ -76,8 +76,6 @@ uint8_t const * tud_descriptor_device_cb(void)
 //--------------------------------------------------------------------+
 
 uint8_t const desc_hid_report1[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(REPORT_ID_KEYBOARD         )),
-    KBD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(REPORT_ID_MOUSE            )),
     TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(REPORT_ID_CONSUMER_CONTROL )),
     TUD_HID_REPORT_DESC_GAMEPAD ( HID_REPORT_ID(REPORT_ID_GAMEPAD          ))
 };
@@ -86,6 +84,14 @@ uint8_t const desc_hid_report2[] = {
     TUD_HID_REPORT_DESC_GENERIC_INOUT( CFG_TUD_HID_EP_BUFSIZE )
 };
 
+uint8_t const desc_hid_report3[] = {
+    KBD_HID_REPORT_DESC_MOUSE()
+};
+
+uint8_t const desc_hid_report4[] = {
+    KBD_HID_REPORT_DESC_NKRO()
+};
+
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
@@ -95,6 +101,10 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
         return desc_hid_report1;
     } else if(instance==1) {
         return desc_hid_report2;
+    } else if(instance==2) {
+        return desc_hid_report3;
+    } else if(instance==3) {
+        return desc_hid_report4;
     }
 
     return NULL;
@@ -104,10 +114,12 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
 // Configuration Descriptor
 //--------------------------------------------------------------------+
 
-#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN)
+#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN + TUD_HID_DESC_LEN)
 
 #define EPNUM_HID1   0x81 // IN for HID1
 #define EPNUM_HID2   0x82 // IN for HID2
+#define EPNUM_HID3   0x83 // IN for HID3
+#define EPNUM_HID4   0x84 // IN for HID4
 
 uint8_t const desc_configuration[] =
 {
@@ -115,10 +127,18 @@ uint8_t const desc_configuration[] =
     TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
     // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
+    // consumer control and gamepad are not used, not worth polling at 1 ms
     TUD_HID_DESCRIPTOR(ITF_NUM_HID1, 4, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report1), EPNUM_HID1, CFG_TUD_HID_EP_BUFSIZE, 10),
 
     // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
-    TUD_HID_DESCRIPTOR(ITF_NUM_HID2, 5, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report2), EPNUM_HID2, CFG_TUD_HID_EP_BUFSIZE, 10)
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID2, 5, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report2), EPNUM_HID2, CFG_TUD_HID_EP_BUFSIZE, 10),
+
+    // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID3, 6, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report3), EPNUM_HID3, CFG_TUD_HID_EP_BUFSIZE, 1),
+
+    // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
+    // boot keyboard, so that hosts without NKRO support can switch it to boot protocol
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID4, 7, HID_ITF_PROTOCOL_KEYBOARD, sizeof(desc_hid_report4), EPNUM_HID4, CFG_TUD_HID_EP_BUFSIZE, 1)
 
 };
 
@@ -152,8 +172,10 @@ char const *string_desc_arr[] =
     "TinyUSB",                     // 1: Manufacturer
     "TinyUSB Device",              // 2: Product
     NULL,                          // 3: Serials will use unique ID if possible
-    "Keyboard/Mouse Interface",    // 4: Interface 1 string
-    "Generic IO Interface"         // 5: Interface 2 string
+    "Consumer/Gamepad Interface",  // 4: Interface 1 string
+    "Generic IO Interface",        // 5: Interface 2 string
+    "Mouse Interface",             // 6: Interface 3 string
+    "Keyboard Interface"           // 7: Interface 4 string
 };
 
 static uint16_t _desc_str[32 + 1];
@@ -27,22 +27,75 @@
 
 #include "tusb.h"
 
+#include "key_layout.h"
+
+// report ids of HID1, sent as a chain in this order
+// mouse and keyboard have their own interfaces HID3 and HID4, without report id
 enum
 {
-    REPORT_ID_KEYBOARD = 1,
-    REPORT_ID_MOUSE,
-    REPORT_ID_CONSUMER_CONTROL,
+    REPORT_ID_CONSUMER_CONTROL = 1,
     REPORT_ID_GAMEPAD,
     REPORT_ID_COUNT
 };
 
 enum
 {
-    ITF_NUM_HID1,
-    ITF_NUM_HID2,
+    ITF_NUM_HID1, // consumer control, gamepad
+    ITF_NUM_HID2, // generic in/out
+    ITF_NUM_HID3, // mouse
+    ITF_NUM_HID4, // keyboard, NKRO (report protocol) or 6KRO (boot protocol)
     ITF_NUM_TOTAL
 };
 
+/*
+ * NKRO keyboard, a bit per key code 0x00 - 0xDF
+ * The first 2 bytes are the same as the boot keyboard report, modifiers and reserved.
+ * Hosts which only talk boot protocol (BIOS) ignore this and get the 8 bytes boot report instead.
+ */
+
+// NKRO Keyboard Report Descriptor Template
+#define KBD_HID_REPORT_DESC_NKRO(...) \
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP      )                   ,\
+  HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD  )                   ,\
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION  )                   ,\
+    /* Report ID if any */\
+    __VA_ARGS__ \
+    /* 8 bits Modifier Keys (Shift, Control, Alt) */ \
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD )                     ,\
+      HID_USAGE_MIN    ( 224                                    )  ,\
+      HID_USAGE_MAX    ( 231                                    )  ,\
+      HID_LOGICAL_MIN  ( 0                                      )  ,\
+      HID_LOGICAL_MAX  ( 1                                      )  ,\
+      HID_REPORT_COUNT ( 8                                      )  ,\
+      HID_REPORT_SIZE  ( 1                                      )  ,\
+      HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE )  ,\
+      /* 8 bit reserved */ \
+      HID_REPORT_COUNT ( 1                                      )  ,\
+      HID_REPORT_SIZE  ( 8                                      )  ,\
+      HID_INPUT        ( HID_CONSTANT                           )  ,\
+    /* Output 5-bit LED Indicator Kana | Compose | ScrollLock | CapsLock | NumLock */ \
+    HID_USAGE_PAGE  ( HID_USAGE_PAGE_LED                   )       ,\
+      HID_USAGE_MIN    ( 1                                       ) ,\
+      HID_USAGE_MAX    ( 5                                       ) ,\
+      HID_REPORT_COUNT ( 5                                       ) ,\
+      HID_REPORT_SIZE  ( 1                                       ) ,\
+      HID_OUTPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE  ) ,\
+      /* led padding */ \
+      HID_REPORT_COUNT ( 1                                       ) ,\
+      HID_REPORT_SIZE  ( 3                                       ) ,\
+      HID_OUTPUT       ( HID_CONSTANT                            ) ,\
+    /* a bit per key */ \
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD )                     ,\
+      HID_USAGE_MIN    ( 0                                      )  ,\
+      HID_USAGE_MAX_N  ( KEY_BITS_SIZE*8-1, 2                   )  ,\
+      HID_LOGICAL_MIN  ( 0                                      )  ,\
+      HID_LOGICAL_MAX  ( 1                                      )  ,\
+      HID_REPORT_COUNT_N ( KEY_BITS_SIZE*8, 2                   )  ,\
+      HID_REPORT_SIZE  ( 1                                      )  ,\
+      HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE )  ,\
+  HID_COLLECTION_END \
+
+
 /*
  * Modified version of TUD_HID_REPORT_DESC_MOUSE
  * It uses 16 bits for delta-X, delta-Y, scroll and pan
@@ -53,6 +53,7 @@ typedef struct TU_ATTR_PACKED {
 
 static bool send_hid_mouse_report() {
     hid_report_out_mouse_t* m = &(kbd_system.core1.hid_report_out.mouse);
+    static uint8_t last_buttons = 0;
 
     uint8_t buttons = 0 |
         (m->left     ? MOUSE_BUTTON_LEFT     : 0) |
@@ -69,18 +70,32 @@ static bool send_hid_mouse_report() {
         .pan     = m->scrollX
     };
 
+    // nothing to report, unless moved or buttons changed
+    if(buttons==last_buttons && !report.x && !report.y && !report.wheel && !report.pan)
+        return true;
+
+    if(!tud_hid_n_ready(ITF_NUM_HID3)) return false; // try again in next loop
+
     bool success = false;
-    if(tud_hid_n_report(ITF_NUM_HID1, REPORT_ID_MOUSE, &report, sizeof(report))) {
+    if(tud_hid_n_report(ITF_NUM_HID3, 0, &report, sizeof(report))) {
         m->deltaX = 0;
         m->deltaY = 0;
         m->scrollX = 0;
         m->scrollY = 0;
+        last_buttons = buttons;
         success = true;
     }
     if(!success) tud_fail_counter.mouse++;
     return success;
 }
 
+/// NKRO Keyboard Report, see KBD_HID_REPORT_DESC_NKRO
+typedef struct TU_ATTR_PACKED {
+    uint8_t modifiers;
+    uint8_t reserved;
+    uint8_t key_bits[KEY_BITS_SIZE];
+} kbd_nkro_report_t;
+
 static bool send_hid_keyboard_report() {
     hid_report_out_keyboard_t* k = &(kbd_system.core1.hid_report_out.keyboard);
 
@@ -94,7 +109,28 @@ static bool send_hid_keyboard_report() {
         (k->rightAlt   ? KEYBOARD_MODIFIER_RIGHTALT   : 0) |
         (k->rightGui   ? KEYBOARD_MODIFIER_RIGHTGUI   : 0);
 
-    bool success = tud_hid_n_keyboard_report(ITF_NUM_HID1, REPORT_ID_KEYBOARD, modifiers, k->key_codes);
+    bool success;
+    if(tud_hid_n_get_protocol(ITF_NUM_HID4) == HID_PROTOCOL_BOOT) {
+        // host does not support NKRO, fall back to the 6 keys of boot protocol
+        uint8_t key_codes[KEY_CODE_MAX] = {0};
+        uint8_t n = 0;
+        for(uint8_t i=0; i<KEY_BITS_SIZE; i++) {
+            for(uint8_t j=0, v=k->key_bits[i]; v; j++, v>>=1) {
+                if(!(v & 1)) continue;
+                if(n == KEY_CODE_MAX) { // too many keys, report phantom state
+                    memset(key_codes, 0x01, KEY_CODE_MAX); // ErrorRollOver
+                    i = KEY_BITS_SIZE;
+                    break;
+                }
+                key_codes[n++] = i*8 + j;
+            }
+        }
+        success = tud_hid_n_keyboard_report(ITF_NUM_HID4, 0, modifiers, key_codes);
+    } else {
+        kbd_nkro_report_t report = {.modifiers = modifiers, .reserved = 0};
+        memcpy(report.key_bits, k->key_bits, KEY_BITS_SIZE);
+        success = tud_hid_n_report(ITF_NUM_HID4, 0, &report, sizeof(report));
+    }
     if(!success) tud_fail_counter.keyboard++;
     return success;
 }
@@ -111,10 +147,6 @@ static bool send_hid_report(uint8_t report_id) {
     //       no completion callback to send the next report which is consumer control.
     switch (report_id)
     {
-    case REPORT_ID_KEYBOARD:
-        return send_hid_keyboard_report();
-    case REPORT_ID_MOUSE:
-        return send_hid_mouse_report();
     case REPORT_ID_CONSUMER_CONTROL:
         return send_hid_consumer_report();
     case REPORT_ID_GAMEPAD:
@@ -124,24 +156,37 @@ static bool send_hid_report(uint8_t report_id) {
     }
 }
 
+static bool send_keyboard_report() {
+    if(!tud_hid_n_ready(ITF_NUM_HID4)) {
+        tud_fail_counter.not_ready++;
+        return false;
+    }
+    return send_hid_keyboard_report();
+}
+
+static void mouse_task(void) {
+    // mouse is on its own interface, sent as soon as there is motion
+    // independent of the keyboard report chain
+    if(!tud_suspended()) send_hid_mouse_report();
+}
+
 static void hid_task(void) {
     if(tud_suspended() && kbd_system.core1.hid_report_out.has_events) {
         // Wake up host if we are in suspended mode
         // and REMOTE_WAKEUP feature is enabled by host
         tud_remote_wakeup();
     } else {
-        // Send the 1st of report chain, the rest will be sent by tud_hid_report_complete_cb()
-        // Send the report chain on
+        // Send the keyboard report on
         //  - new events (like keypress)
         //  - end of events (like release of keypress)
         static bool had_events = false;
         if(kbd_system.core1.hid_report_out.has_events) { // has some events
-            send_hid_report(REPORT_ID_KEYBOARD);
+            send_keyboard_report();
             had_events = true;
         } else {
             // report end of previous envents
             if(had_events)
-                if(send_hid_report(REPORT_ID_KEYBOARD))
+                if(send_keyboard_report())
                     had_events = false;
         }
     }
@@ -149,6 +194,7 @@ static void hid_task(void) {
 
 void usb_hid_idle_task(void) {
     tud_task();
+    mouse_task(); // flush any motion left over, as the endpoint frees up
 
     uint32_t dt = 10000; // 10 second interval
     tud_fail_counter.ms = board_millis();
@@ -164,6 +210,7 @@ void usb_hid_idle_task(void) {
 void usb_hid_task(void) {
     tud_task();
     hid_task();
+    mouse_task();
 }
 
 void usb_hid_init(void) {
@@ -249,7 +296,7 @@ void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_
 {
     if (report_type == HID_REPORT_TYPE_OUTPUT) {
         // Set keyboard LED e.g. Caps_Lock, Num_Lock etc..
-        if (instance == ITF_NUM_HID1 && report_id == REPORT_ID_KEYBOARD) {
+        if (instance == ITF_NUM_HID4) { // same in boot and report protocol, no report id
             // bufsize should be at least 1
             if (bufsize < 1)
                 return;
@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "bulk_transfer.h"
+#include "crc32.h"
+
+static inline void write_u16(uint8_t* buff, uint16_t v) {
+    buff[0] = v & 0xFF;
+    buff[1] = v >> 8;
+}
+
+static inline uint16_t read_u16(const uint8_t* buff) {
+    return buff[0] | (uint16_t) buff[1] << 8;
+}
+
+static inline uint32_t transfer_rate(uint16_t bytes, uint32_t ms) {
+    return ms > 0 ? (uint32_t) bytes * 1000 / ms : (uint32_t) bytes * 1000;
+}
+
+uint32_t bulk_crc32(const uint8_t* data, uint16_t size) {
+    return crc32_update(0, data, size);
+}
+
+void bulk_sender_init(bulk_sender_t* tx) {
+    memset(tx, 0, sizeof(bulk_sender_t));
+}
+
+void bulk_sender_start(bulk_sender_t* tx, const uint8_t* data, uint16_t size, uint32_t now_ms) {
+    tx->id++;
+    tx->data = data;
+    tx->size = size;
+    tx->crc = bulk_crc32(data, size);
+    tx->sent = 0;
+    tx->acked = 0;
+    tx->progress_ms = now_ms;
+    tx->start_ms = now_ms;
+    tx->state = bulk_state_BEGIN;
+}
+
+uint8_t bulk_sender_write(bulk_sender_t* tx, uint8_t* buff, uint8_t room, bool* is_begin, uint32_t now_ms) {
+    if(!bulk_sender_busy(tx)) return 0;
+
+    // go back to what is acknowledged, if stalled, the receiver may have lost the begin too
+    if(tx->state == bulk_state_TRANSFER && now_ms - tx->progress_ms >= BULK_STALL_MS) {
+        tx->sent = tx->acked;
+        tx->progress_ms = now_ms;
+        tx->state = bulk_state_BEGIN;
+    }
+
+    if(tx->state == bulk_state_BEGIN) {
+        if(room < BULK_BEGIN_SIZE) return 0;
+        buff[0] = tx->id;
+        write_u16(buff + 1, tx->size);
+        buff[3] = tx->crc & 0xFF;
+        buff[4] = (tx->crc >> 8) & 0xFF;
+        buff[5] = (tx->crc >> 16) & 0xFF;
+        buff[6] = tx->crc >> 24;
+        tx->state = bulk_state_TRANSFER;
+        *is_begin = true;
+        return BULK_BEGIN_SIZE;
+    }
+
+    // a chunk, as large as would fit in the room and the window
+    uint16_t n = tx->size - tx->sent;
+    uint16_t window = BULK_WINDOW - (tx->sent - tx->acked);
+    if(n > window) n = window;
+    if(room <= BULK_CHUNK_HEADER_SIZE || n == 0) return 0;
+    if(n > room - BULK_CHUNK_HEADER_SIZE) n = room - BULK_CHUNK_HEADER_SIZE;
+
+    buff[0] = tx->id;
+    write_u16(buff + 1, tx->sent);
+    buff[3] = n;
+    memcpy(buff + BULK_CHUNK_HEADER_SIZE, tx->data + tx->sent, n);
+    tx->sent += n;
+    tx->progress_ms = now_ms;
+    *is_begin = false;
+    return BULK_CHUNK_HEADER_SIZE + n;
+}
+
+uint8_t bulk_sender_read_ack(bulk_sender_t* tx, const uint8_t* buff, uint8_t len, uint32_t now_ms) {
+    if(len < BULK_ACK_SIZE) return 0;
+    if(buff[0] != tx->id || !bulk_sender_busy(tx)) return BULK_ACK_SIZE; // stale
+
+    uint16_t offset = read_u16(buff + 1);
+    bulk_state_t status = (bulk_state_t) buff[3];
+    if(status == bulk_state_DONE && offset == tx->size) {
+        tx->acked = tx->sent = offset;
+        tx->rate = transfer_rate(tx->size, now_ms - tx->start_ms);
+        tx->state = bulk_state_DONE;
+    } else if(status == bulk_state_FAILED) {
+        tx->state = bulk_state_FAILED;
+    } else if(offset > tx->acked && offset <= tx->sent) {
+        tx->acked = offset;
+        tx->progress_ms = now_ms;
+    } else if(offset < tx->acked) {
+        // the receiver restarted, from the begin
+        tx->acked = tx->sent = offset;
+        tx->progress_ms = now_ms;
+    }
+    return BULK_ACK_SIZE;
+}
+
+void bulk_receiver_init(bulk_receiver_t* rx, uint8_t* data, uint16_t capacity) {
+    memset(rx, 0, sizeof(bulk_receiver_t));
+    rx->data = data;
+    rx->capacity = capacity;
+}
+
+uint8_t bulk_receiver_read_begin(bulk_receiver_t* rx, const uint8_t* buff, uint8_t len, uint32_t now_ms) {
+    if(len < BULK_BEGIN_SIZE) return 0;
+    uint16_t size = read_u16(buff + 1);
+    uint32_t crc = buff[3] | (uint32_t) buff[4] << 8 | (uint32_t) buff[5] << 16 | (uint32_t) buff[6] << 24;
+    // a repeated begin, after a stall, leaves the transfer as is, the id alone may be of a
+    // sender restarted, from its first id again
+    if(buff[0] == rx->id && size == rx->size && crc == rx->crc && rx->state != bulk_state_IDLE) {
+        rx->ack_due = true;
+        return BULK_BEGIN_SIZE;
+    }
+    rx->id = buff[0];
+    rx->size = size;
+    rx->crc = crc;
+    rx->received = 0;
+    rx->start_ms = now_ms;
+    rx->state = rx->size > rx->capacity ? bulk_state_FAILED : bulk_state_TRANSFER;
+    rx->ack_due = true;
+    return BULK_BEGIN_SIZE;
+}
+
+uint8_t bulk_receiver_read_chunk(bulk_receiver_t* rx, const uint8_t* buff, uint8_t len, uint32_t now_ms) {
+    if(len < BULK_CHUNK_HEADER_SIZE || len < BULK_CHUNK_HEADER_SIZE + buff[3]) return 0;
+    uint8_t n = buff[3];
+    uint16_t offset = read_u16(buff + 1);
+    // only what follows in order, else the ack sends the sender back
+    if(buff[0] != rx->id || rx->state != bulk_state_TRANSFER || offset != rx->received ||
+       offset + n > rx->size) {
+        rx->ack_due = true;
+        return BULK_CHUNK_HEADER_SIZE + n;
+    }
+    memcpy(rx->data + offset, buff + BULK_CHUNK_HEADER_SIZE, n);
+    rx->received += n;
+    rx->rate = transfer_rate(rx->received, now_ms - rx->start_ms);
+    if(rx->received == rx->size)
+        rx->state = bulk_crc32(rx->data, rx->size) == rx->crc ? bulk_state_DONE : bulk_state_FAILED;
+    rx->ack_due = true;
+    return BULK_CHUNK_HEADER_SIZE + n;
+}
+
+uint8_t bulk_receiver_write_ack(bulk_receiver_t* rx, uint8_t* buff) {
+    buff[0] = rx->id;
+    write_u16(buff + 1, rx->received);
+    buff[3] = rx->state;
+    rx->ack_due = false;
+    return BULK_ACK_SIZE;
+}
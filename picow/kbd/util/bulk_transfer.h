@@ -0,0 +1,98 @@
+#ifndef _BULK_TRANSFER_H_
+#define _BULK_TRANSFER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bulk transfer - a payload larger than a frame, split into chunks which are
+ * multiplexed into the comm frames, in the room left by the other records.
+ *
+ * Sender                                   Receiver
+ *   begin: id, size(2), crc(4)        ==>    reset, unless the same id, size and crc
+ *   chunk: id, offset(2), n, data(n)  ==>    appended if at the offset received, else dropped
+ *          acked <= sent <= size
+ *   (acked, sent] in flight, at most
+ *   a window, so as not to hog the link
+ *                                     <==  ack: id, offset(2) received, status
+ *
+ * The link delivers in order, so a chunk is lost only if the link is reset or the
+ * receiver restarts. The sender goes back to what is acknowledged if there is no
+ * progress for a while, or if the receiver acknowledges less than before.
+ * The receiver checks the crc once all is received.
+ *
+ * Multi-byte values are little endian. The record bodies are written/read here,
+ * the record type is up to the comm.
+ */
+
+#define BULK_BEGIN_SIZE 7        // id, size, crc
+#define BULK_CHUNK_HEADER_SIZE 4 // id, offset, n
+#define BULK_ACK_SIZE 4          // id, offset, status
+
+#define BULK_WINDOW 256   // bytes in flight
+#define BULK_STALL_MS 200 // without progress, to go back
+
+typedef enum {
+    bulk_state_IDLE = 0,
+    bulk_state_BEGIN,     // sender: begin to be sent
+    bulk_state_TRANSFER,  // in progress
+    bulk_state_DONE,      // all received, crc matched
+    bulk_state_FAILED     // crc mismatch, or too large for the receiver
+} bulk_state_t;
+
+typedef struct {
+    volatile bulk_state_t state;
+    uint8_t id;
+    const uint8_t* data;
+    uint16_t size;
+    uint32_t crc;
+    uint16_t sent;  // offset of the next chunk
+    uint16_t acked; // offset received, as acknowledged
+
+    uint32_t progress_ms; // last sent or acknowledged
+    uint32_t start_ms;
+    uint32_t rate; // bytes per second of the last transfer done
+} bulk_sender_t;
+
+typedef struct {
+    volatile bulk_state_t state;
+    uint8_t id;
+    uint8_t* data;
+    uint16_t capacity;
+    uint16_t size;
+    uint32_t crc;
+    uint16_t received;
+    bool ack_due; // acknowledge the change
+
+    uint32_t start_ms;
+    uint32_t rate; // bytes per second, of the last transfer, or so far
+} bulk_receiver_t;
+
+uint32_t bulk_crc32(const uint8_t* data, uint16_t size);
+
+void bulk_sender_init(bulk_sender_t* tx);
+
+// data is held until done/failed, the previous transfer is dropped if still in progress
+void bulk_sender_start(bulk_sender_t* tx, const uint8_t* data, uint16_t size, uint32_t now_ms);
+
+static inline bool bulk_sender_busy(bulk_sender_t* tx) {
+    return tx->state == bulk_state_BEGIN || tx->state == bulk_state_TRANSFER;
+}
+
+// returns the bytes written to buff (begin or chunk record body), 0 if nothing to send within room
+// begin is written if is_begin is set
+uint8_t bulk_sender_write(bulk_sender_t* tx, uint8_t* buff, uint8_t room, bool* is_begin, uint32_t now_ms);
+
+// returns the bytes read, 0 if invalid
+uint8_t bulk_sender_read_ack(bulk_sender_t* tx, const uint8_t* buff, uint8_t len, uint32_t now_ms);
+
+void bulk_receiver_init(bulk_receiver_t* rx, uint8_t* data, uint16_t capacity);
+
+// return the bytes read, 0 if invalid
+uint8_t bulk_receiver_read_begin(bulk_receiver_t* rx, const uint8_t* buff, uint8_t len, uint32_t now_ms);
+uint8_t bulk_receiver_read_chunk(bulk_receiver_t* rx, const uint8_t* buff, uint8_t len, uint32_t now_ms);
+
+// returns the bytes written, BULK_ACK_SIZE
+uint8_t bulk_receiver_write_ack(bulk_receiver_t* rx, uint8_t* buff);
+
+#endif
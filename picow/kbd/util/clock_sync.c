@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "clock_sync.h"
+
+void clock_sync_init(clock_sync_t* cs) {
+    memset(cs, 0, sizeof(clock_sync_t));
+}
+
+int64_t clock_sync_offset(const clock_sync_t* cs, uint64_t t) {
+    int64_t dt = (int64_t) (t - cs->ref_t);
+    return cs->offset + dt * cs->drift_ppb / 1000000000;
+}
+
+static const clock_sync_sample_t* best_sample(const clock_sync_t* cs) {
+    const clock_sync_sample_t* best = cs->samples;
+    for(uint8_t i = 1; i < cs->count; i++)
+        if(cs->samples[i].delay < best->delay) best = cs->samples + i;
+    return best;
+}
+
+static void set_reference(clock_sync_t* cs, const clock_sync_sample_t* s) {
+    cs->ref_t = s->t;
+    cs->offset = s->offset;
+    cs->delay = s->delay;
+}
+
+bool clock_sync_add(clock_sync_t* cs, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+    if(t4 < t1 || t3 < t2 || t3 - t2 > t4 - t1) return false;
+
+    clock_sync_sample_t* s = cs->samples + cs->next;
+    s->delay = (uint32_t) ((t4 - t1) - (t3 - t2));
+    s->offset = ((int64_t) (t2 - t1) + (int64_t) (t3 - t4)) / 2;
+    s->t = t1 + (t4 - t1) / 2;
+    cs->next = (cs->next + 1) % CLOCK_SYNC_SAMPLES;
+    if(cs->count < CLOCK_SYNC_SAMPLES) cs->count++;
+
+    const clock_sync_sample_t* best = best_sample(cs);
+    if(!cs->synced) {
+        set_reference(cs, best);
+        cs->synced = true;
+    } else if(best->t >= cs->ref_t + CLOCK_SYNC_DRIFT_SPAN_US) {
+        // drift from the reference to the best of now, then that is the reference
+        int64_t drift = (best->offset - cs->offset) * 1000000000 / (int64_t) (best->t - cs->ref_t);
+        cs->drift_ppb = cs->drift_known ? (3 * (int64_t) cs->drift_ppb + drift) / 4 : drift;
+        cs->drift_known = true;
+        set_reference(cs, best);
+    } else if(best->delay < cs->delay && best->t > cs->ref_t) {
+        // a better one meanwhile, as extrapolated so far, the drift is measured from it later
+        set_reference(cs, best);
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef _CLOCK_SYNC_H_
+#define _CLOCK_SYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Clock sync - offset and drift of a remote clock (a node) to the local one (AP), NTP style.
+ *
+ * local                           remote
+ *   t1: ping                  ==>   t2: received
+ *                             <==   t3: pong, with t1, t2
+ *   t4: received
+ *
+ * delay  = (t4 - t1) - (t3 - t2)            round trip, less the time held by the remote
+ * offset = ((t2 - t1) + (t3 - t4)) / 2      remote - local, at the midpoint of the round trip
+ *
+ * The offset is off by at most delay/2, when the way there and back are not even, so of the
+ * recent samples the one with the least delay is taken (as the NTP clock filter). The drift is
+ * the change of that offset over at least CLOCK_SYNC_DRIFT_SPAN_US, smoothed, so that the offset
+ * is extrapolated between the samples.
+ *
+ * Times are us, of the local clock unless said remote.
+ */
+
+#define CLOCK_SYNC_SAMPLES 8
+#define CLOCK_SYNC_DRIFT_SPAN_US 16000000 // between the offsets the drift is measured from
+
+typedef struct {
+    uint64_t t;     // local, midpoint of the round trip
+    int64_t offset; // remote - local
+    uint32_t delay;
+} clock_sync_sample_t;
+
+typedef struct {
+    clock_sync_sample_t samples[CLOCK_SYNC_SAMPLES]; // the latest
+    uint8_t count;
+    uint8_t next;
+
+    // estimate, as per the sample with the least delay
+    bool synced;
+    uint64_t ref_t;     // local, of the offset
+    int64_t offset;     // remote - local, at ref_t
+    int32_t drift_ppb;  // remote rate - local rate, parts per billion
+    uint32_t delay;     // of the sample the offset is from
+    bool drift_known;
+} clock_sync_t;
+
+void clock_sync_init(clock_sync_t* cs);
+
+// a round trip, returns false if not valid (held longer than the round trip)
+bool clock_sync_add(clock_sync_t* cs, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+
+// remote - local, at local time t
+int64_t clock_sync_offset(const clock_sync_t* cs, uint64_t t);
+
+// only once synced
+static inline uint64_t clock_sync_to_local(const clock_sync_t* cs, uint64_t remote_t) {
+    int64_t offset = clock_sync_offset(cs, remote_t - cs->offset);
+    return remote_t - offset;
+}
+
+static inline uint64_t clock_sync_to_remote(const clock_sync_t* cs, uint64_t local_t) {
+    return local_t + clock_sync_offset(cs, local_t);
+}
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stdint.h>
+
+// crc-32 (as zlib, java.util.zip.CRC32), from 0, continued over pieces by passing the previous result
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t size);
+
+#endif
@@ -21,6 +21,12 @@
  * Since the id is only 8bits, it can support max 256 datasets, that is upto 16MB
  * In this project we are using a 4MB flash card and reserving the first block for other purposes,
  * it can handle only upto 63 datasets.
+ *
+ * A save is queued as its jobs, in the order they were done in before: erase if a sector is
+ * started, the id/tracking bits, then the data. The last one of a save sets fd->pos once done,
+ * the saves after compute from fd->queued_pos. Nothing is read while a job is in progress.
+ * The jobs of the other users (the firmware staged on AP, see hw_model.c) go in the same queue,
+ * after the saves, on the data of theirs, a read done as the flash is idle, one per iteration.
  */
 
 #define BASE_ADDR 65536 // reserved 1st 64K block
@@ -33,6 +39,24 @@
 void (*store_read)(uint32_t addr, uint8_t* buf, size_t len);
 void (*store_program)(uint32_t addr, const uint8_t* buf, size_t len);
 void (*store_erase)(uint32_t addr);
+bool (*store_busy)(void);
+
+typedef struct {
+    bool erase;  // else program
+    uint16_t len; // to program, or read
+    uint8_t buf[FLASH_DATASET_SIZE];
+    const uint8_t* data; // programmed from, of another user, else buf
+    uint8_t* into; // read into, of another user
+    uint32_t addr;
+    flash_dataset_t* fd; // the last job of a save, its pos set once done
+    uint16_t pos;
+    bool* done; // the last job of another user
+} flash_job_t;
+
+static flash_job_t jobs[FLASH_STORE_JOB_COUNT];
+static uint8_t job_head = 0;
+static uint8_t job_count = 0;
+static bool job_issued = false; // the one at head, the flash at it
 
 /*
  * Create specified number (count) of datasets
@@ -42,12 +66,14 @@ void (*store_erase)(uint32_t addr);
 void flash_create_store(uint8_t count, uint8_t* ids, flash_dataset_t** fds,
                         void (*read)(uint32_t addr, uint8_t* buf, size_t len),
                         void (*page_program)(uint32_t addr, const uint8_t* buf, size_t len),
-                        void (*sector_erase)(uint32_t addr)) {
+                        void (*sector_erase)(uint32_t addr),
+                        bool (*busy)(void)) {
     for(unsigned int i=0; i<count; i++) {
         flash_dataset_t* fd = (flash_dataset_t*) malloc(sizeof(flash_dataset_t));
         fd->id = ids[i];
         fd->addr = BASE_ADDR + BLOCK_SIZE * i;
         fd->pos = BASE_POS;
+        fd->queued_pos = BASE_POS;
         fd->need_flash_init = true;
         memset(fd->data, 0, FLASH_DATASET_SIZE);
         fds[i] = fd;
@@ -55,6 +81,7 @@ void flash_create_store(uint8_t count, uint8_t* ids, flash_dataset_t** fds,
     store_read = read;
     store_program = page_program;
     store_erase = sector_erase;
+    store_busy = busy;
 }
 
 void flash_free_dataset(flash_dataset_t* fd) {
@@ -62,6 +89,7 @@ void flash_free_dataset(flash_dataset_t* fd) {
 }
 
 void flash_store_load(flash_dataset_t* fd) {
+    flash_store_flush();
     uint8_t buf[PAGE_SIZE];
     store_read(fd->addr, buf, PAGE_SIZE);
     if(buf[0]!=fd->id) return; // flash data invalid, continue with init data
@@ -85,12 +113,33 @@ void flash_store_load(flash_dataset_t* fd) {
     for(i=byte_pos+1; i<PAGE_SIZE; i++) if(buf[i]!=0xFF) return;
     // read the data
     fd->pos = pos;
+    fd->queued_pos = pos;
     fd->need_flash_init = false;
     store_read(fd->addr+(pos*FLASH_DATASET_SIZE), fd->data, FLASH_DATASET_SIZE);
 }
 
-void flash_store_save(flash_dataset_t* fd) {
-    uint16_t pos = fd->pos;
+static flash_job_t* next_job(bool erase, uint32_t addr, uint16_t len) {
+    flash_job_t* job = jobs + (job_head + job_count) % FLASH_STORE_JOB_COUNT;
+    job_count++;
+    job->erase = erase;
+    job->addr = addr;
+    job->len = len;
+    job->data = NULL;
+    job->into = NULL;
+    job->fd = NULL;
+    job->done = NULL;
+    return job;
+}
+
+static flash_job_t* queue_job(bool erase, uint32_t addr, const uint8_t* buf, uint8_t len) {
+    if(job_count==FLASH_STORE_JOB_COUNT) flash_store_flush(); // saved faster than flashed, wait
+    flash_job_t* job = next_job(erase, addr, len);
+    if(len>0) memcpy(job->buf, buf, len);
+    return job;
+}
+
+uint16_t flash_store_save(flash_dataset_t* fd) {
+    uint16_t pos = fd->queued_pos;
     if(!fd->need_flash_init) {
         if(pos<MAX_POS) pos++;
         else pos=BASE_POS;
@@ -99,16 +148,93 @@ void flash_store_save(flash_dataset_t* fd) {
     }
     uint32_t addr = fd->addr + (pos * FLASH_DATASET_SIZE);
     if(pos==BASE_POS) {
-        store_erase(fd->addr);
+        queue_job(true, fd->addr, NULL, 0);
         uint8_t buf[2] = {fd->id, 0x7F};
-        store_program(fd->addr, buf, 2);
+        queue_job(false, fd->addr, buf, 2);
     } else {
         if(addr%SECTOR_SIZE == 0){
-            store_erase(addr);
+            queue_job(true, addr, NULL, 0);
         }
         uint8_t track = 0xFF>>((pos%8)+1);
-        store_program(fd->addr+(pos/8), &track, 1);
+        queue_job(false, fd->addr+(pos/8), &track, 1);
     }
-    store_program(addr, fd->data, FLASH_DATASET_SIZE);
-    fd->pos = pos;
+    flash_job_t* job = queue_job(false, addr, fd->data, FLASH_DATASET_SIZE);
+    job->fd = fd;
+    job->pos = pos;
+    fd->queued_pos = pos;
+    return pos;
+}
+
+static bool has_room(uint16_t count) {
+    return job_count + count + FLASH_STORE_JOB_RESERVE <= FLASH_STORE_JOB_COUNT;
+}
+
+bool flash_store_queue_write(uint32_t addr, const uint8_t* data, uint16_t len, bool* done) {
+    // the sectors started within, those before are as written already
+    uint32_t from = (addr + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    uint32_t to = (addr + len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    uint16_t pages = len==0 ? 0 : (addr + len - 1) / PAGE_SIZE - addr / PAGE_SIZE + 1;
+    if(!has_room((to - from) / SECTOR_SIZE + pages)) return false;
+    flash_job_t* job = NULL;
+    for(uint32_t a=from; a<to; a+=SECTOR_SIZE) job = next_job(true, a, 0);
+    for(uint32_t a=addr; a<addr+len;) {
+        uint16_t n = (a / PAGE_SIZE + 1) * PAGE_SIZE - a;
+        if(n > addr + len - a) n = addr + len - a;
+        job = next_job(false, a, n);
+        job->data = data + (a - addr);
+        a += n;
+    }
+    if(job) job->done = done;
+    else *done = true;
+    return true;
+}
+
+bool flash_store_queue_read(uint32_t addr, uint8_t* data, uint16_t len, bool* done) {
+    if(!has_room((len + FLASH_STORE_READ_MAX - 1) / FLASH_STORE_READ_MAX)) return false;
+    flash_job_t* job = NULL;
+    for(uint16_t k=0; k<len;) {
+        uint16_t n = len - k > FLASH_STORE_READ_MAX ? FLASH_STORE_READ_MAX : len - k;
+        job = next_job(false, addr + k, n);
+        job->into = data + k;
+        k += n;
+    }
+    if(job) job->done = done;
+    else *done = true;
+    return true;
+}
+
+static void job_done(flash_job_t* job) {
+    if(job->fd) job->fd->pos = job->pos;
+    if(job->done) *job->done = true;
+    job_issued = false;
+    job_head = (job_head + 1) % FLASH_STORE_JOB_COUNT;
+    job_count--;
+}
+
+bool flash_store_task(void) {
+    while(job_count>0) {
+        flash_job_t* job = jobs + job_head;
+        if(!job_issued) {
+            if(job->into) {
+                // the flash is idle, read at once, the one read of the iteration
+                store_read(job->addr, job->into, job->len);
+                job_done(job);
+                return job_count>0;
+            }
+            if(job->erase)
+                store_erase(job->addr);
+            else
+                store_program(job->addr, job->data ? job->data : job->buf, job->len);
+            job_issued = true;
+            return true;
+        }
+        if(store_busy()) return true;
+        // done, the next one right away
+        job_done(job);
+    }
+    return false;
+}
+
+void flash_store_flush(void) {
+    while(flash_store_task());
 }
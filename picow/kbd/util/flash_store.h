@@ -6,25 +6,54 @@
 #include <stdlib.h>
 
 #define FLASH_DATASET_SIZE 32
+#define FLASH_STORE_JOB_COUNT 48 // program/erase queued, a save takes upto 3, beyond it waits
+#define FLASH_STORE_JOB_RESERVE 12 // left for the saves by the other jobs, four back to back
+#define FLASH_STORE_READ_MAX 1024 // per job of a read, the loop held ~0.3 ms at 31.25 MHz
 
 typedef struct {
     uint8_t data[FLASH_DATASET_SIZE];
     uint8_t id;    // 1-255
 
     bool need_flash_init; // not present in flash
-    uint16_t pos; // current position in allocated block
+    uint16_t pos; // current position in allocated block, as flashed
+    uint16_t queued_pos; // of the last save queued, pos once it is flashed
     uint32_t addr; // address of allocated block in flash
 } flash_dataset_t;
 
+/*
+ * The saves are queued as jobs, each a page program or a sector erase, issued one at a time
+ * by flash_store_task, which polls the flash between the iterations of the main loop, so that
+ * an erase (tens of ms) does not hold it up. The page_program/sector_erase callbacks only issue
+ * the command, busy tells if the flash is still at it.
+ */
 void flash_create_store(uint8_t count, uint8_t* ids, flash_dataset_t** fds,
                         void (*read)(uint32_t addr, uint8_t* buf, size_t len),
                         void (*page_program)(uint32_t addr, const uint8_t* buf, size_t len),
-                        void (*sector_erase)(uint32_t addr));
+                        void (*sector_erase)(uint32_t addr),
+                        bool (*busy)(void));
 
 void flash_free_dataset(flash_dataset_t* fd);
 
+// once the saves queued are flashed
 void flash_store_load(flash_dataset_t* fd);
 
-void flash_store_save(flash_dataset_t* fd);
+// the data is copied, fd->pos is updated once flashed, returns that pos
+uint16_t flash_store_save(flash_dataset_t* fd);
+
+/*
+ * The jobs of another user of the flash (on the same core), queued after the saves: the pages of
+ * data programmed at addr, a sector started erased first, or data read, FLASH_STORE_READ_MAX a job.
+ * done is set once all of them are, the data is held till then. Returns false, it does not wait,
+ * if they would not leave FLASH_STORE_JOB_RESERVE free.
+ */
+bool flash_store_queue_write(uint32_t addr, const uint8_t* data, uint16_t len, bool* done);
+
+bool flash_store_queue_read(uint32_t addr, uint8_t* data, uint16_t len, bool* done);
+
+// issue the next job once the flash is done with the one before, returns true while any is queued
+bool flash_store_task(void);
+
+// wait till all the jobs queued are done
+void flash_store_flush(void);
 
 #endif
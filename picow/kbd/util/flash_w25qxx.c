@@ -49,16 +49,17 @@ static void __not_in_flash_func(flash_write_enable)(flash_t* f) {
     master_spi_release_slave(f->m_spi, f->spi_slave_id);
 }
 
+bool __not_in_flash_func(flash_is_busy)(flash_t* f) {
+    master_spi_set_baud(f->m_spi, f->spi_slave_id);
+    master_spi_select_slave(f->m_spi, f->spi_slave_id);
+    uint8_t buf[2] = {FLASH_CMD_STATUS, 0};
+    master_spi_write8_read8(f->m_spi, buf, buf, 2);
+    master_spi_release_slave(f->m_spi, f->spi_slave_id);
+    return buf[1] & FLASH_STATUS_BUSY_MASK;
+}
+
 static void __not_in_flash_func(flash_wait_done)(flash_t* f) {
-    uint8_t status;
-    do {
-        master_spi_select_slave(f->m_spi, f->spi_slave_id);
-        uint8_t buf[2] = {FLASH_CMD_STATUS, 0};
-        master_spi_write8_read8(f->m_spi, buf, buf, 2);
-        master_spi_release_slave(f->m_spi, f->spi_slave_id);
-        status = buf[1];
-        if(status & FLASH_STATUS_BUSY_MASK) sleep_us(100); else return;
-    } while(true);
+    while(flash_is_busy(f)) sleep_us(100);
 }
 
 void __not_in_flash_func(flash_read)(flash_t* f, uint32_t addr, uint8_t* buf, size_t len) {
@@ -75,7 +76,7 @@ void __not_in_flash_func(flash_read)(flash_t* f, uint32_t addr, uint8_t* buf, si
     master_spi_release_slave(f->m_spi, f->spi_slave_id);
 }
 
-void __not_in_flash_func(flash_page_program)(flash_t* f, uint32_t addr, const uint8_t* buf, size_t len) {
+void __not_in_flash_func(flash_page_program_start)(flash_t* f, uint32_t addr, const uint8_t* buf, size_t len) {
     master_spi_set_baud(f->m_spi, f->spi_slave_id);
     uint8_t cmd[4] = {
         FLASH_CMD_PAGE_PROGRAM,
@@ -88,10 +89,14 @@ void __not_in_flash_func(flash_page_program)(flash_t* f, uint32_t addr, const ui
     master_spi_write8(f->m_spi, cmd, 4);
     master_spi_write8(f->m_spi, buf, len);
     master_spi_release_slave(f->m_spi, f->spi_slave_id);
+}
+
+void __not_in_flash_func(flash_page_program)(flash_t* f, uint32_t addr, const uint8_t* buf, size_t len) {
+    flash_page_program_start(f, addr, buf, len);
     flash_wait_done(f);
 }
 
-void __not_in_flash_func(flash_sector_erase)(flash_t* f, uint32_t addr) {
+void __not_in_flash_func(flash_sector_erase_start)(flash_t* f, uint32_t addr) {
     master_spi_set_baud(f->m_spi, f->spi_slave_id);
     uint8_t cmd[4] = {
         FLASH_CMD_SECTOR_ERASE,
@@ -103,6 +108,10 @@ void __not_in_flash_func(flash_sector_erase)(flash_t* f, uint32_t addr) {
     master_spi_select_slave(f->m_spi, f->spi_slave_id);
     master_spi_write8(f->m_spi, cmd, 4);
     master_spi_release_slave(f->m_spi, f->spi_slave_id);
+}
+
+void __not_in_flash_func(flash_sector_erase)(flash_t* f, uint32_t addr) {
+    flash_sector_erase_start(f, addr);
     flash_wait_done(f);
 }
 
@@ -1,6 +1,7 @@
 #ifndef __FLASH_W25QXX_H
 #define __FLASH_W25QXX_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "master_spi.h"
@@ -28,10 +29,19 @@ void flash_free(flash_t* f);
 
 void flash_read(flash_t* f, uint32_t addr, uint8_t* buf, size_t len);
 
+// the program/erase wait till done, the _start ones only issue the command, to be polled by flash_is_busy,
+// and the flash is not to be read, programmed or erased meanwhile
+
 void flash_page_program(flash_t* f, uint32_t addr, const uint8_t* buf, size_t len);
 
+void flash_page_program_start(flash_t* f, uint32_t addr, const uint8_t* buf, size_t len);
+
 void flash_sector_erase(flash_t* f, uint32_t addr);
 
+void flash_sector_erase_start(flash_t* f, uint32_t addr);
+
+bool flash_is_busy(flash_t* f);
+
 void flash_block_erase_32K(flash_t* f, uint32_t addr);
 
 void flash_block_erase_64K(flash_t* f, uint32_t addr);
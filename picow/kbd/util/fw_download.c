@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "fw_download.h"
+#include "lz4_block.h"
+
+static inline void write_u32(uint8_t* buff, uint32_t v) {
+    buff[0] = v & 0xFF;
+    buff[1] = (v >> 8) & 0xFF;
+    buff[2] = (v >> 16) & 0xFF;
+    buff[3] = v >> 24;
+}
+
+static inline uint32_t read_u32(const uint8_t* buff) {
+    return buff[0] | (uint32_t) buff[1] << 8 | (uint32_t) buff[2] << 16 | (uint32_t) buff[3] << 24;
+}
+
+static inline uint16_t read_u16(const uint8_t* buff) {
+    return buff[0] | (uint16_t) buff[1] << 8;
+}
+
+static uint8_t head_size(uint8_t cmd) {
+    switch(cmd) {
+        case FW_DOWNLOAD_CMD_BEGIN: return 9;  // cmd, size, crc
+        case FW_DOWNLOAD_CMD_CHUNK: return 11; // cmd, offset, n, crc
+        case FW_DOWNLOAD_CMD_BEGIN_PACKED: return 17; // cmd, size, crc, image size, image crc
+        case FW_DOWNLOAD_CMD_BEGIN_DELTA: return 25;  // and base size, base crc
+        default: return 1;
+    }
+}
+
+void fw_download_init(fw_download_t* dl, const fw_download_flash_t* flash) {
+    memset(dl, 0, sizeof(fw_download_t));
+    dl->flash = flash;
+}
+
+void fw_download_restart_stream(fw_download_t* dl) {
+    dl->head_len = 0;
+    dl->data_len = 0;
+    dl->chunk_open = false;
+    dl->skip = false;
+    dl->nacked = false;
+    dl->reply_len = 0;
+}
+
+static void reply(fw_download_t* dl, fw_download_status_t status) {
+    dl->reply[0] = dl->head[0];
+    dl->reply[1] = status;
+    write_u32(dl->reply + 2, dl->received);
+    dl->reply_len = 6;
+}
+
+static void nack(fw_download_t* dl, fw_download_status_t status) {
+    // once, the chunks in flight behind are dropped quietly till the sender goes back
+    if(!dl->nacked) reply(dl, status);
+    dl->nacked = true;
+}
+
+static void query(fw_download_t* dl) {
+    reply(dl, dl->state == fw_download_state_ACTIVE ? fw_download_status_OK : fw_download_status_NOT_BEGUN);
+    write_u32(dl->reply + 6, dl->size);
+    write_u32(dl->reply + 10, dl->crc);
+    dl->reply_len = 14;
+}
+
+static bool running_base(fw_download_t* dl) {
+    // the image running is the one the delta is of
+    uint32_t size = read_u32(dl->head + 17);
+    uint32_t running_size = 0;
+    const uint8_t* running = dl->flash->running ? dl->flash->running(&running_size) : NULL;
+    if(!running || size == 0 || size > running_size || crc32_update(0, running, size) != read_u32(dl->head + 21))
+        return false;
+    dl->base = running;
+    dl->base_size = size;
+    return true;
+}
+
+static void begin(fw_download_t* dl) {
+    uint32_t size = read_u32(dl->head + 1);
+    bool delta = dl->head[0] == FW_DOWNLOAD_CMD_BEGIN_DELTA;
+    bool packed = delta || dl->head[0] == FW_DOWNLOAD_CMD_BEGIN_PACKED;
+    uint32_t image_size = packed ? read_u32(dl->head + 9) : size;
+    if(!dl->sector[0]) {
+        dl->sector[0] = (uint8_t*) malloc(2 * FW_DOWNLOAD_SECTOR_SIZE);
+        dl->sector[1] = dl->sector[0] ? dl->sector[0] + FW_DOWNLOAD_SECTOR_SIZE : NULL;
+    }
+    if(packed && !dl->packed_buff) dl->packed_buff = (uint8_t*) malloc(FW_DOWNLOAD_PACKED_MAX);
+    dl->state = fw_download_state_IDLE;
+    dl->received = 0;
+    if(size == 0 || image_size == 0 || !dl->sector[0] || (packed && !dl->packed_buff)) {
+        reply(dl, size == 0 || image_size == 0 ? fw_download_status_BAD_IMAGE : fw_download_status_FLASH_FAILED);
+        return;
+    }
+    dl->base = NULL;
+    if(delta && !running_base(dl)) {
+        reply(dl, fw_download_status_BAD_BASE); // the slot left as it is
+        return;
+    }
+    dl->flash->init_slot();
+    dl->state = fw_download_state_ACTIVE;
+    dl->size = size;
+    dl->crc = read_u32(dl->head + 5);
+    dl->received_crc = 0;
+    dl->flashed = 0;
+    dl->packed = packed;
+    dl->packed_len = 0;
+    dl->image_size = image_size;
+    dl->image_crc = packed ? read_u32(dl->head + 13) : dl->crc;
+    dl->unpacked = 0;
+    dl->unpacked_crc = 0;
+    dl->sector_size[0] = dl->sector_size[1] = 0;
+    dl->fill = 0;
+    dl->nacked = false;
+    reply(dl, fw_download_status_OK);
+}
+
+static void fail(fw_download_t* dl, fw_download_status_t status) {
+    dl->state = fw_download_state_FAILED;
+    dl->failure = status;
+}
+
+static fw_download_status_t not_active(fw_download_t* dl) {
+    return dl->state == fw_download_state_FAILED ? dl->failure : fw_download_status_NOT_BEGUN;
+}
+
+static bool block_received(fw_download_t* dl) {
+    // in full, to be unpacked
+    if(dl->packed_len < 2) return false;
+    uint16_t n = read_u16(dl->packed_buff) & FW_DOWNLOAD_BLOCK_SIZE;
+    return dl->packed_len >= 2 + n;
+}
+
+static bool end(fw_download_t* dl) {
+    // returns false to wait till all is unpacked and flashed
+    if(dl->state != fw_download_state_ACTIVE) {
+        reply(dl, not_active(dl));
+        return true;
+    }
+    if(dl->sector_size[0] || dl->sector_size[1] || (dl->packed && block_received(dl))) return false;
+    if(dl->flash->busy && dl->flash->busy()) return false;
+    if(dl->received != dl->size || dl->received_crc != dl->crc ||
+       (dl->packed && (dl->packed_len || dl->unpacked != dl->image_size || dl->unpacked_crc != dl->image_crc))) {
+        dl->state = fw_download_state_IDLE; // to begin again
+        reply(dl, fw_download_status_BAD_IMAGE);
+        return true;
+    }
+    dl->flash->mark_valid();
+    dl->state = fw_download_state_DONE;
+    reply(dl, fw_download_status_OK);
+    return true;
+}
+
+static uint8_t* chunk_data(fw_download_t* dl) {
+    // where the chunk is read into, as is or packed
+    if(dl->packed) return dl->packed_buff + dl->packed_len;
+    return dl->sector[dl->fill] + read_u32(dl->head + 1) % FW_DOWNLOAD_SECTOR_SIZE;
+}
+
+static bool open_chunk(fw_download_t* dl) {
+    // returns false to wait till the buffer to fill is flashed, or unpacked
+    uint32_t offset = read_u32(dl->head + 1);
+    uint16_t n = read_u16(dl->head + 5);
+    dl->skip = true;
+    if(dl->state != fw_download_state_ACTIVE)
+        nack(dl, not_active(dl));
+    else if(offset < dl->received)
+        ; // resent, already have it
+    else if(offset > dl->received)
+        nack(dl, fw_download_status_OUT_OF_ORDER);
+    else if(n == 0 || n > FW_DOWNLOAD_CHUNK_MAX || offset % FW_DOWNLOAD_SECTOR_SIZE + n > FW_DOWNLOAD_SECTOR_SIZE ||
+            offset + n > dl->size)
+        nack(dl, fw_download_status_BAD_CHUNK);
+    else if(dl->packed ? dl->packed_len + n > FW_DOWNLOAD_PACKED_MAX : dl->sector_size[dl->fill] != 0)
+        return false;
+    else
+        dl->skip = false;
+    dl->chunk_open = true;
+    return true;
+}
+
+static void close_chunk(fw_download_t* dl) {
+    uint16_t n = read_u16(dl->head + 5);
+    uint8_t* data = chunk_data(dl);
+    if(crc32_update(0, data, n) != read_u32(dl->head + 7)) {
+        nack(dl, fw_download_status_BAD_CHUNK);
+        return;
+    }
+    dl->received += n;
+    dl->received_crc = crc32_update(dl->received_crc, data, n);
+    dl->nacked = false;
+    // a sector filled, or the last one in part, to be flashed, packed acknowledged the same
+    uint16_t in_sector = dl->received % FW_DOWNLOAD_SECTOR_SIZE;
+    if(dl->packed) {
+        dl->packed_len += n;
+        if(in_sector == 0 || dl->received == dl->size) reply(dl, fw_download_status_OK);
+    } else if(in_sector == 0 || dl->received == dl->size) {
+        uint16_t size = in_sector ? in_sector : FW_DOWNLOAD_SECTOR_SIZE;
+        dl->sector_offset[dl->fill] = dl->received - size;
+        dl->sector_size[dl->fill] = size;
+        dl->fill ^= 1;
+        reply(dl, fw_download_status_OK);
+    }
+}
+
+uint16_t fw_download_read(fw_download_t* dl, const uint8_t* data, uint16_t len) {
+    uint16_t n = 0;
+    while(n < len && dl->reply_len == 0) {
+        if(dl->head_len == 0 && !fw_download_is_command(data[n])) break;
+        // the head, as much as there is
+        uint8_t cmd = dl->head_len ? dl->head[0] : data[n];
+        uint8_t size = head_size(cmd);
+        if(dl->head_len < size) {
+            uint16_t k = size - dl->head_len;
+            if(k > len - n) k = len - n;
+            memcpy(dl->head + dl->head_len, data + n, k);
+            dl->head_len += k;
+            n += k;
+            if(dl->head_len < size) break;
+        }
+        if(cmd != FW_DOWNLOAD_CMD_CHUNK) {
+            if(cmd == FW_DOWNLOAD_CMD_QUERY)
+                query(dl);
+            else if(cmd == FW_DOWNLOAD_CMD_BEGIN || cmd == FW_DOWNLOAD_CMD_BEGIN_PACKED ||
+                    cmd == FW_DOWNLOAD_CMD_BEGIN_DELTA)
+                begin(dl);
+            else if(!end(dl)) {
+                // left unread till all is flashed, as the stream is held back meanwhile
+                dl->head_len = 0;
+                n--;
+                break;
+            }
+            dl->head_len = 0;
+            continue;
+        }
+        // the chunk data, into the sector buffer
+        if(!dl->chunk_open && !open_chunk(dl)) break;
+        uint16_t chunk_n = read_u16(dl->head + 5);
+        uint16_t k = chunk_n - dl->data_len;
+        if(k > len - n) k = len - n;
+        if(!dl->skip) memcpy(chunk_data(dl) + dl->data_len, data + n, k);
+        dl->data_len += k;
+        n += k;
+        if(dl->data_len == chunk_n) {
+            if(!dl->skip) close_chunk(dl);
+            dl->head_len = 0;
+            dl->data_len = 0;
+            dl->chunk_open = false;
+        }
+    }
+    return n;
+}
+
+static bool apply_delta(fw_download_t* dl, const uint8_t* block, uint16_t n, uint8_t* sector, uint16_t size) {
+    // the difference into the sector, then the base added, as per the copies
+    if(!dl->base || n < 2) return false;
+    uint16_t count = read_u16(block);
+    uint32_t copies_len = 2 + 8 * (uint32_t) count;
+    if(copies_len > n || lz4_block_decode(block + copies_len, n - copies_len, sector, size) != size) return false;
+    uint32_t at = 0;
+    for(const uint8_t* copy = block + 2; copy < block + copies_len; copy += 8) {
+        uint16_t copy_n = read_u16(copy + 2);
+        uint32_t offset = read_u32(copy + 4);
+        at += read_u16(copy);
+        if(at + copy_n > size || offset > dl->base_size || copy_n > dl->base_size - offset) return false;
+        const uint8_t* base = dl->base + offset;
+        for(uint16_t i = 0; i < copy_n; i++) sector[at++] += base[i];
+    }
+    return true;
+}
+
+static bool unpack(fw_download_t* dl) {
+    // a block received into the sector buffer to fill, as if filled from the stream
+    if(dl->state != fw_download_state_ACTIVE || !dl->packed || dl->sector_size[dl->fill]) return false;
+    if(dl->packed_len < 2) return false;
+    uint16_t head = read_u16(dl->packed_buff);
+    uint16_t n = head & FW_DOWNLOAD_BLOCK_SIZE;
+    uint32_t size = dl->image_size - dl->unpacked;
+    if(size > FW_DOWNLOAD_SECTOR_SIZE) size = FW_DOWNLOAD_SECTOR_SIZE;
+    if(n == 0 || n > FW_DOWNLOAD_SECTOR_SIZE || size == 0) {
+        fail(dl, fw_download_status_BAD_IMAGE);
+        return true;
+    }
+    if(dl->packed_len < 2 + n) return false;
+    uint8_t* sector = dl->sector[dl->fill];
+    if(head & FW_DOWNLOAD_BLOCK_STORED) {
+        if(n != size) {
+            fail(dl, fw_download_status_BAD_IMAGE);
+            return true;
+        }
+        memcpy(sector, dl->packed_buff + 2, n);
+    } else if(head & FW_DOWNLOAD_BLOCK_DELTA) {
+        if(!apply_delta(dl, dl->packed_buff + 2, n, sector, size)) {
+            fail(dl, fw_download_status_BAD_IMAGE);
+            return true;
+        }
+    } else if(lz4_block_decode(dl->packed_buff + 2, n, sector, size) != (int32_t) size) {
+        fail(dl, fw_download_status_BAD_IMAGE);
+        return true;
+    }
+    dl->sector_offset[dl->fill] = dl->unpacked;
+    dl->sector_size[dl->fill] = size;
+    dl->fill ^= 1;
+    dl->unpacked += size;
+    dl->unpacked_crc = crc32_update(dl->unpacked_crc, sector, size);
+    // the rest, the next block in part, and the chunk being read if any
+    dl->packed_len -= 2 + n;
+    uint16_t reading = dl->chunk_open && !dl->skip ? dl->data_len : 0;
+    memmove(dl->packed_buff, dl->packed_buff + 2 + n, dl->packed_len + reading);
+    return true;
+}
+
+bool fw_download_flush(fw_download_t* dl) {
+    // the older one first, as filled
+    uint8_t i = dl->fill ^ 1;
+    if(!dl->sector_size[i]) i ^= 1;
+    bool busy = dl->flash->busy && dl->flash->busy();
+    if(dl->flashing && !busy) {
+        // the one before is flashed now, to read on
+        dl->flashing = false;
+        return true;
+    }
+    if(!dl->sector_size[i]) return unpack(dl);
+    if(busy) return false;
+    uint16_t size = dl->sector_size[i];
+    uint16_t padded = (size + FW_DOWNLOAD_PAGE_SIZE - 1) / FW_DOWNLOAD_PAGE_SIZE * FW_DOWNLOAD_PAGE_SIZE;
+    memset(dl->sector[i] + size, 0xFF, padded - size);
+    if(dl->state == fw_download_state_ACTIVE && !dl->flash->write(dl->sector[i], dl->sector_offset[i], padded))
+        fail(dl, fw_download_status_FLASH_FAILED);
+    dl->flashing = dl->flash->busy != NULL;
+    dl->flashed += size;
+    dl->sector_size[i] = 0;
+    return true;
+}
@@ -0,0 +1,155 @@
+#ifndef _FW_DOWNLOAD_H_
+#define _FW_DOWNLOAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Firmware download - a stream of commands (tcp) writing an image into the download slot,
+ * with several chunks in flight, the flash programming done a sector at a time off the stream,
+ * and a resume from where it stopped if the connection drops.
+ *
+ * Sender                                          Receiver
+ *   query                                    ==>
+ *                                            <==  query: status, received(4), size(4), crc(4)
+ *   begin: size(4), crc(4)                   ==>  slot initialised (erased)
+ *                                            <==  begin: status, received(4) = 0
+ *   chunk: offset(4), n(2), crc(4), data(n)  ==>  appended if at the offset received and the crc matches,
+ *     ...  upto FW_DOWNLOAD_WINDOW bytes            a sector buffered is flashed by the main loop, while
+ *          beyond what is acknowledged              the next one is filled from the stream
+ *                                            <==  chunk: status, received(4), on each sector filled,
+ *                                                   or once on an error, then the sender goes back
+ *   end                                      ==>  all flashed, the size and the crc of all matched
+ *                                            <==  end: status, received(4)
+ *
+ * Packed, begun by begin_packed: size(4), crc(4), image size(4), image crc(4), the size and crc
+ * are of the stream as sent, the image ones as unpacked. The stream is of blocks, each a sector
+ * of the image (the last one in part) packed on its own, as LZ4 (see lz4_block.h):
+ *   block: n(2) | FW_DOWNLOAD_BLOCK_STORED if as is, data(n)
+ * The blocks received are unpacked into the sector buffers by the main loop, so the RAM taken
+ * is the two sectors and FW_DOWNLOAD_PACKED_MAX, and the sender only sees fewer bytes to send.
+ *
+ * Delta, begun by begin_delta: as packed, and base size(4), base crc(4) of the image running,
+ * refused (BAD_BASE) before the slot is erased if that is not it. A block may then be a delta
+ * (bsdiff alike) of the sector against the image running, read as it is in flash:
+ *   block: n(2) | FW_DOWNLOAD_BLOCK_DELTA, count(2), count x (skip(2), n(2), base offset(4)),
+ *          the difference, as LZ4, of the sector
+ * The difference is unpacked into the sector, then to each n bytes after a skip, the base from
+ * its offset is added (bytewise), the bytes skipped are as they are, new. Code moved, or with
+ * addresses shifted, differs from the base in a few and regular bytes, which pack well.
+ *
+ * Every reply starts with the command replied to. A chunk must not cross a sector, nor be
+ * larger than FW_DOWNLOAD_CHUNK_MAX. The state is kept across connections, so the sender
+ * queries, and if it is the same image (size and crc) continues from received, else begins.
+ *
+ * Multi-byte values are little endian. The flash is behind the callbacks, so that this
+ * runs on the host as well.
+ */
+
+#define FW_DOWNLOAD_CMD_QUERY 0x05
+#define FW_DOWNLOAD_CMD_BEGIN 0x06
+#define FW_DOWNLOAD_CMD_CHUNK 0x07
+#define FW_DOWNLOAD_CMD_END 0x08
+#define FW_DOWNLOAD_CMD_BEGIN_PACKED 0x09
+#define FW_DOWNLOAD_CMD_BEGIN_DELTA 0x0A
+
+#define FW_DOWNLOAD_SECTOR_SIZE 4096
+#define FW_DOWNLOAD_PAGE_SIZE 256 // the flash is programmed in these, the last one padded
+#define FW_DOWNLOAD_CHUNK_MAX 1024
+#define FW_DOWNLOAD_WINDOW 8192 // bytes in flight, at most, as per the sender
+#define FW_DOWNLOAD_HEAD_MAX 25 // begin_delta: command, size, crc, image size, image crc, base size, base crc
+#define FW_DOWNLOAD_REPLY_MAX 14
+#define FW_DOWNLOAD_BLOCK_STORED 0x8000
+#define FW_DOWNLOAD_BLOCK_DELTA 0x4000
+#define FW_DOWNLOAD_BLOCK_SIZE 0x3FFF // mask
+#define FW_DOWNLOAD_PACKED_MAX (2 + FW_DOWNLOAD_SECTOR_SIZE + FW_DOWNLOAD_CHUNK_MAX) // a block and a chunk
+
+typedef enum {
+    fw_download_status_OK = 0,
+    fw_download_status_NOT_BEGUN, // or already ended
+    fw_download_status_BAD_CHUNK, // crc mismatch, too large, or across a sector
+    fw_download_status_OUT_OF_ORDER,
+    fw_download_status_BAD_IMAGE, // size or crc mismatch at the end, or a block not unpacked
+    fw_download_status_FLASH_FAILED,
+    fw_download_status_BAD_BASE // the image running is not the one the delta is of
+} fw_download_status_t;
+
+typedef enum {
+    fw_download_state_IDLE = 0,
+    fw_download_state_ACTIVE,
+    fw_download_state_DONE,  // verified and marked valid, to reboot into
+    fw_download_state_FAILED // flash failed, or a block not unpacked, to begin again
+} fw_download_state_t;
+
+typedef struct {
+    void (*init_slot)(void); // erase the download slot
+    bool (*write)(const uint8_t* data, uint32_t offset, uint32_t size); // pages, into the slot
+    void (*mark_valid)(void);
+    const uint8_t* (*running)(uint32_t* size); // the image running, readable, as the slot is
+    bool (*busy)(void); // optional, a write taken but not yet flashed, the next one waits, as the end
+} fw_download_flash_t;
+
+typedef struct {
+    fw_download_state_t state;
+    fw_download_status_t failure; // as per which it FAILED
+    uint32_t size; // of the stream
+    uint32_t crc;
+    uint32_t received;     // in order, the chunks checked
+    uint32_t received_crc; // of those
+    uint32_t flashed;
+
+    // packed, the blocks received not yet unpacked
+    bool packed;
+    uint8_t* packed_buff;
+    uint16_t packed_len;
+    uint32_t image_size; // as unpacked
+    uint32_t image_crc;
+    uint32_t unpacked;
+    uint32_t unpacked_crc;
+    const uint8_t* base; // of a delta, the image running
+    uint32_t base_size;
+
+    // double buffered: one filled from the stream, the other flashed
+    uint8_t* sector[2];
+    uint32_t sector_offset[2];
+    uint16_t sector_size[2]; // 0 if not to be flashed
+    uint8_t fill;
+    bool flashing; // the last written, in the background (busy)
+    bool nacked; // an error replied, not again till in order
+
+    // the command being read, across the pieces of the stream
+    uint8_t head[FW_DOWNLOAD_HEAD_MAX];
+    uint8_t head_len;
+    uint16_t data_len; // of the chunk, read so far
+    bool chunk_open;   // the head of the chunk checked, its data being read
+    bool skip;         // the chunk data is dropped
+
+    uint8_t reply[FW_DOWNLOAD_REPLY_MAX];
+    uint8_t reply_len; // to be sent, before reading on
+
+    const fw_download_flash_t* flash;
+} fw_download_t;
+
+void fw_download_init(fw_download_t* dl, const fw_download_flash_t* flash);
+
+// on a new connection, the command read in part, if any, is dropped, the download goes on
+void fw_download_restart_stream(fw_download_t* dl);
+
+static inline bool fw_download_is_command(uint8_t cmd) {
+    return cmd >= FW_DOWNLOAD_CMD_QUERY && cmd <= FW_DOWNLOAD_CMD_BEGIN_DELTA;
+}
+
+// while a command is read in part
+static inline bool fw_download_in_command(fw_download_t* dl) {
+    return dl->head_len > 0;
+}
+
+// read the stream, returns the bytes read, upto a reply to be sent or the next command not of
+// the download, 0 if it can not read on till a sector is flashed (fw_download_flush)
+uint16_t fw_download_read(fw_download_t* dl, const uint8_t* data, uint16_t len);
+
+// flash a sector filled, or else unpack a block received, by the main loop, returns false if none,
+// with a busy flash, true as well once the one before is flashed
+bool fw_download_flush(fw_download_t* dl);
+
+#endif
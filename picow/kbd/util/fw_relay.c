@@ -0,0 +1,160 @@
+#include <string.h>
+
+#include "fw_relay.h"
+
+static inline void write_u32(uint8_t* buff, uint32_t v) {
+    buff[0] = v & 0xFF;
+    buff[1] = (v >> 8) & 0xFF;
+    buff[2] = (v >> 16) & 0xFF;
+    buff[3] = v >> 24;
+}
+
+static inline uint32_t read_u32(const uint8_t* buff) {
+    return buff[0] | (uint32_t) buff[1] << 8 | (uint32_t) buff[2] << 16 | (uint32_t) buff[3] << 24;
+}
+
+////// AP
+
+void fw_relay_sender_init(fw_relay_sender_t* rs, uint8_t* piece, uint16_t piece_max) {
+    memset(rs, 0, sizeof(fw_relay_sender_t));
+    rs->piece = piece;
+    rs->piece_max = piece_max;
+}
+
+void fw_relay_sender_start(fw_relay_sender_t* rs, bool (*read)(uint32_t offset, uint8_t* buf, uint32_t len),
+                           uint32_t size) {
+    rs->read_staged = read;
+    rs->size = size;
+    rs->sent = 0;
+    rs->read = 0;
+    rs->status = fw_download_status_OK;
+    rs->progress_ms = 0;
+    rs->state = fw_relay_state_RELAYING;
+}
+
+void fw_relay_sender_stop(fw_relay_sender_t* rs) {
+    rs->state = fw_relay_state_IDLE;
+}
+
+bool fw_relay_sender_task(fw_relay_sender_t* rs, bulk_sender_t* tx, uint32_t now_ms) {
+    if(rs->state != fw_relay_state_RELAYING || !rs->piece || bulk_sender_busy(tx)) return false;
+    // not received as sent, or not read on for long, from what is read
+    if(tx->state == bulk_state_FAILED || (rs->read != rs->sent && now_ms - rs->progress_ms >= FW_RELAY_STALL_MS))
+        rs->sent = rs->read;
+    if(rs->read != rs->sent || rs->sent >= rs->size) return false;
+
+    uint32_t n = rs->size - rs->sent;
+    if(n > (uint32_t) rs->piece_max - FW_RELAY_PIECE_HEAD) n = rs->piece_max - FW_RELAY_PIECE_HEAD;
+    if(!rs->read_staged(rs->sent, rs->piece + FW_RELAY_PIECE_HEAD, n)) return false; // on a call after
+    rs->piece[0] = FW_RELAY_PIECE;
+    write_u32(rs->piece + 1, rs->sent);
+    bulk_sender_start(tx, rs->piece, FW_RELAY_PIECE_HEAD + n, now_ms);
+    rs->sent += n;
+    rs->progress_ms = now_ms;
+    return true;
+}
+
+uint8_t fw_relay_sender_read_status(fw_relay_sender_t* rs, const uint8_t* buff, uint8_t len, uint32_t now_ms) {
+    if(len < FW_RELAY_STATUS_SIZE) return 0;
+    uint32_t read = read_u32(buff);
+    fw_relay_state_t state = (fw_relay_state_t) buff[4];
+    if(rs->state != fw_relay_state_RELAYING) return FW_RELAY_STATUS_SIZE;
+
+    if(read < rs->read) {
+        // the node restarted, from what it reads
+        rs->sent = read;
+    } else if(read > rs->sent) {
+        return FW_RELAY_STATUS_SIZE; // stale, of a relay before
+    }
+    if(read != rs->read) rs->progress_ms = now_ms;
+    rs->read = read;
+    rs->status = buff[5];
+    if(state == fw_relay_state_VERIFIED && read == rs->size)
+        rs->state = fw_relay_state_VERIFIED;
+    else if(state == fw_relay_state_FAILED)
+        rs->state = fw_relay_state_FAILED;
+    return FW_RELAY_STATUS_SIZE;
+}
+
+bool fw_relay_sender_commit_due(const fw_relay_sender_t* rs, const fw_relay_sender_t* all, uint8_t count) {
+    if(rs->state != fw_relay_state_VERIFIED) return false;
+    for(uint8_t i = 0; i < count; i++)
+        if(all + i != rs && fw_relay_sender_active(all + i)) return false;
+    return true;
+}
+
+////// node
+
+void fw_relay_receiver_init(fw_relay_receiver_t* rr, const fw_download_flash_t* flash) {
+    memset(rr, 0, sizeof(fw_relay_receiver_t));
+    fw_download_init(&rr->dl, flash);
+}
+
+static void set_state(fw_relay_receiver_t* rr, fw_relay_state_t state, uint8_t status) {
+    rr->state = state;
+    rr->status = status;
+    rr->status_due = true;
+}
+
+static void read_reply(fw_relay_receiver_t* rr) {
+    // OK is as expected, but for the end, the image verified
+    uint8_t cmd = rr->dl.reply[0];
+    uint8_t status = rr->dl.reply[1];
+    rr->dl.reply_len = 0;
+    if(status != fw_download_status_OK)
+        set_state(rr, fw_relay_state_FAILED, status);
+    else if(cmd == FW_DOWNLOAD_CMD_END)
+        set_state(rr, fw_relay_state_VERIFIED, status);
+    else if(cmd != FW_DOWNLOAD_CMD_CHUNK)
+        set_state(rr, fw_relay_state_RELAYING, status); // begun
+}
+
+bool fw_relay_receiver_task(fw_relay_receiver_t* rr, bulk_receiver_t* rx) {
+    if(rr->dl.reply_len) {
+        read_reply(rr);
+        return true;
+    }
+    if(fw_download_flush(&rr->dl)) return true;
+
+    // the piece, from what is read so far, if it is of the relay
+    if(rx->state != bulk_state_DONE || rx->size <= FW_RELAY_PIECE_HEAD || rx->data[0] != FW_RELAY_PIECE)
+        return false;
+    uint32_t offset = read_u32(rx->data + 1);
+    uint32_t n = rx->size - FW_RELAY_PIECE_HEAD;
+    if(!rr->piece_seen || rx->id != rr->piece_id) {
+        rr->piece_seen = true;
+        rr->piece_id = rx->id;
+        if(offset == 0 && rr->read > 0) {
+            // relayed again from the begin, the one before restarted, verified or failed
+            rr->read = 0;
+            fw_download_restart_stream(&rr->dl);
+            set_state(rr, fw_relay_state_IDLE, fw_download_status_OK);
+        }
+    }
+    if(rr->state == fw_relay_state_FAILED || rr->read < offset || rr->read >= offset + n) return false;
+
+    uint32_t at = rr->read - offset;
+    uint32_t len = n - at;
+    if(len > 0xFFFF) len = 0xFFFF;
+    uint16_t k = fw_download_read(&rr->dl, rx->data + FW_RELAY_PIECE_HEAD + at, len);
+    if(k == 0 && rr->dl.reply_len == 0) {
+        // not a command of the download, the stream is not as expected
+        set_state(rr, fw_relay_state_FAILED, fw_download_status_BAD_CHUNK);
+        return false;
+    }
+    rr->read += k;
+    if(rr->read == offset + n) rr->status_due = true; // for the next one
+    return true;
+}
+
+uint8_t fw_relay_receiver_write_status(fw_relay_receiver_t* rr, uint8_t* buff) {
+    write_u32(buff, rr->read);
+    buff[4] = rr->state;
+    buff[5] = rr->status;
+    rr->status_due = false;
+    return FW_RELAY_STATUS_SIZE;
+}
+
+void fw_relay_receiver_commit(fw_relay_receiver_t* rr) {
+    if(rr->state == fw_relay_state_VERIFIED) rr->commit_due = true;
+}
@@ -0,0 +1,108 @@
+#ifndef _FW_RELAY_H_
+#define _FW_RELAY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bulk_transfer.h"
+#include "fw_download.h"
+
+/*
+ * Firmware relay - an update of left/right, staged on AP as received over tcp (see tcp_server.c),
+ * streamed to the node in pieces by the bulk transfer, alongside the live records, and read by
+ * the node into its own fw_download, as if from tcp, a sector flashed at a time. The staged is
+ * read a piece at a time through the read callback, which may take a few calls (see hw_model.h).
+ *
+ * The staged is the stream of fw_download commands as the deploy tool makes it for the node:
+ * begin (or begin_packed, begin_delta), the chunks, in order, then end. The replies are not sent
+ * back, the node only tells how far it read, and how it went.
+ *
+ * AP                                                    Node
+ *   piece: FW_RELAY_PIECE, offset(4), data       ==>    (bulk) read from the offset read so far
+ *                                                <==    status: read(4), state, status
+ *   the next piece, once all sent is read                 on a piece read, a change, and refresh
+ *   ...                                                   end replied OK: VERIFIED, the image crc
+ *                                                         matched, the slot marked valid
+ *   commit, once no other node is relayed still  ==>    reboots into it, on its next poll
+ *
+ * A node restarted reads from 0 again (the begin), the AP goes back to what it reads. If all
+ * sent is done with on the bulk, but not read, for FW_RELAY_STALL_MS, the AP sends again from
+ * what is read, so that a node restarted in between is heard of again.
+ * Multi-byte values are little endian. The record bodies are written/read here, the record
+ * type is up to the comm.
+ */
+
+#define FW_RELAY_PIECE 0xF7      // first byte of the bulk payload
+#define FW_RELAY_PIECE_HEAD 5    // FW_RELAY_PIECE, offset
+#define FW_RELAY_STATUS_SIZE 6   // read, state, status
+#define FW_RELAY_STALL_MS 1000   // without the node reading on, to send again
+
+typedef enum {
+    fw_relay_state_IDLE = 0,
+    fw_relay_state_RELAYING,
+    fw_relay_state_VERIFIED, // to be committed
+    fw_relay_state_COMMITTED,
+    fw_relay_state_FAILED    // as per the status, of the node fw_download
+} fw_relay_state_t;
+
+// AP, per node
+typedef struct {
+    volatile fw_relay_state_t state;
+    bool (*read_staged)(uint32_t offset, uint8_t* buf, uint32_t len); // false till read
+    uint32_t size;
+    uint32_t sent;  // upto, in pieces
+    uint32_t read;  // by the node, as reported
+    uint8_t status; // fw_download_status_t of the node, as reported
+    uint32_t progress_ms; // last sent, or read on
+
+    uint8_t* piece; // bulk payload, held till done
+    uint16_t piece_max;
+} fw_relay_sender_t;
+
+// node
+typedef struct {
+    fw_relay_state_t state;
+    uint8_t status;
+    uint32_t read;   // of the relayed stream, in order
+    uint8_t piece_id; // bulk id of the piece read last
+    bool piece_seen;
+    bool status_due;
+    bool commit_due; // by AP, once verified
+    fw_download_t dl;
+} fw_relay_receiver_t;
+
+void fw_relay_sender_init(fw_relay_sender_t* rs, uint8_t* piece, uint16_t piece_max);
+
+// the staged data is held till committed or stopped
+void fw_relay_sender_start(fw_relay_sender_t* rs, bool (*read)(uint32_t offset, uint8_t* buf, uint32_t len),
+                           uint32_t size);
+
+// while staged again
+void fw_relay_sender_stop(fw_relay_sender_t* rs);
+
+static inline bool fw_relay_sender_active(const fw_relay_sender_t* rs) {
+    return rs->state == fw_relay_state_RELAYING;
+}
+
+// start the next piece on the bulk transfer, once the node has read all sent and the piece is read
+// from the staged, returns true if started
+bool fw_relay_sender_task(fw_relay_sender_t* rs, bulk_sender_t* tx, uint32_t now_ms);
+
+// returns the bytes read, 0 if invalid
+uint8_t fw_relay_sender_read_status(fw_relay_sender_t* rs, const uint8_t* buff, uint8_t len, uint32_t now_ms);
+
+// verified, and none of the others is relayed still, then it is COMMITTED as the commit is sent
+bool fw_relay_sender_commit_due(const fw_relay_sender_t* rs, const fw_relay_sender_t* others, uint8_t count);
+
+void fw_relay_receiver_init(fw_relay_receiver_t* rr, const fw_download_flash_t* flash);
+
+// read the piece received, upto a reply, or else flash a sector, returns false if nothing to do
+bool fw_relay_receiver_task(fw_relay_receiver_t* rr, bulk_receiver_t* rx);
+
+// returns the bytes written, FW_RELAY_STATUS_SIZE
+uint8_t fw_relay_receiver_write_status(fw_relay_receiver_t* rr, uint8_t* buff);
+
+// commit received, due if verified, the node reboots into the image on its next poll
+void fw_relay_receiver_commit(fw_relay_receiver_t* rr);
+
+#endif
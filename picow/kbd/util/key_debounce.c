@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "key_debounce.h"
+
+key_debounce_t* key_debounce_create(uint8_t row_count, uint8_t col_count, const key_debounce_config_t* config) {
+    key_debounce_t* kd = (key_debounce_t*) malloc(sizeof(key_debounce_t));
+    uint16_t n = row_count * col_count;
+    kd->row_count = row_count;
+    kd->col_count = col_count;
+    kd->raw = (uint8_t*) malloc(row_count*sizeof(uint8_t));
+    kd->keys = (uint8_t*) malloc(row_count*sizeof(uint8_t));
+    kd->ts = (uint32_t*) malloc(n*sizeof(uint32_t));
+    kd->counter = (uint8_t*) malloc(n*sizeof(uint8_t));
+    memset(kd->raw, 0, row_count);
+    memset(kd->keys, 0, row_count);
+    memset(kd->ts, 0, n*sizeof(uint32_t));
+    memset(kd->counter, 0, n);
+
+    key_debounce_set_config(kd, config);
+    return kd;
+}
+
+void key_debounce_free(key_debounce_t* kd) {
+    free(kd->raw);
+    free(kd->keys);
+    free(kd->ts);
+    free(kd->counter);
+    free(kd);
+}
+
+void key_debounce_set_config(key_debounce_t* kd, const key_debounce_config_t* config) {
+    kd->config = *config;
+    if(kd->config.algorithm >= key_debounce_COUNT) kd->config.algorithm = key_debounce_NONE;
+    if(kd->config.counter_max == 0) kd->config.counter_max = 1;
+
+    // restart the integrators from the current state
+    for(uint8_t row=0; row<kd->row_count; row++) {
+        uint8_t v = kd->keys[row];
+        for(int8_t col=kd->col_count-1; col>=0; col--, v>>=1)
+            kd->counter[row*kd->col_count+col] = (v & 1) ? kd->config.counter_max : 0;
+    }
+}
+
+static inline bool debounce_key(key_debounce_t* kd, uint16_t k, bool raw, bool changed, bool out, uint32_t now) {
+    key_debounce_config_t* cfg = &kd->config;
+    uint32_t dt;
+    uint8_t* counter;
+
+    if(changed) kd->ts[k] = now;
+    dt = now - kd->ts[k];
+
+    switch(cfg->algorithm) {
+    case key_debounce_EAGER:
+        if(raw) return true;
+        return out && dt < 1000u * cfg->release_ms;
+    case key_debounce_DEFER:
+        if(raw == out) return out;
+        return dt >= 1000u * (raw ? cfg->press_ms : cfg->release_ms) ? raw : out;
+    case key_debounce_COUNTER:
+        counter = kd->counter + k;
+        if(raw) {
+            if(*counter < cfg->counter_max) (*counter)++;
+        } else {
+            if(*counter > 0) (*counter)--;
+        }
+        if(*counter >= cfg->counter_max) return true;
+        if(*counter == 0) return false;
+        return out;
+    default: // key_debounce_NONE
+        return raw;
+    }
+}
+
+bool key_debounce_update(key_debounce_t* kd, const uint8_t* raw, uint64_t ts) {
+    uint32_t now = (uint32_t) ts; // only differences are used, wrap around is fine
+    bool counter = kd->config.algorithm == key_debounce_COUNTER;
+    bool changed = false;
+
+    for(uint8_t row=0; row<kd->row_count; row++) {
+        uint8_t v = raw[row];
+        uint8_t dv = v ^ kd->raw[row];
+        uint8_t o = kd->keys[row];
+        // nothing to do if stable and settled
+        if(!dv && v==o && !counter) continue;
+
+        uint8_t keys = 0;
+        for(uint8_t col=0; col<kd->col_count; col++) {
+            uint8_t mask = 1 << (kd->col_count-1-col);
+            bool out = debounce_key(kd, row*kd->col_count+col, v & mask, dv & mask, o & mask, now);
+            if(out) keys |= mask;
+        }
+
+        kd->raw[row] = v;
+        if(keys != o) {
+            kd->keys[row] = keys;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
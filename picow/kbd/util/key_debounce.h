@@ -0,0 +1,59 @@
+#ifndef _KEY_DEBOUNCE_H
+#define _KEY_DEBOUNCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Per-key debouncing of the scanned key matrix.
+ * Each row is a byte, first column in the most significant bit (as in key_scan).
+ *
+ * Algorithms:
+ *   EAGER   : press is reported at once, release only after the key stays released for release_ms
+ *   DEFER   : any change is reported only after the key stays in the new state for press_ms/release_ms
+ *   COUNTER : an up/down counter per key integrates the samples, report press when it reaches
+ *             counter_max, and release when it gets back to 0
+ *   NONE    : raw samples are passed through
+ */
+
+typedef enum {
+    key_debounce_NONE = 0,
+    key_debounce_EAGER,
+    key_debounce_DEFER,
+    key_debounce_COUNTER,
+    key_debounce_COUNT
+} key_debounce_algorithm_t;
+
+typedef struct {
+    // be careful about the size, it is stored as flash dataset
+    uint8_t algorithm; // key_debounce_algorithm_t
+    uint8_t press_ms;
+    uint8_t release_ms;
+    uint8_t counter_max; // samples
+} key_debounce_config_t;
+
+typedef struct {
+    uint8_t row_count;
+    uint8_t col_count; // MAX 8
+    key_debounce_config_t config;
+
+    uint8_t* raw;      // last raw sample
+    uint8_t* keys;     // debounced keys
+    uint32_t* ts;      // per key, time (us) of last raw change
+    uint8_t* counter;  // per key, integrator for COUNTER
+} key_debounce_t;
+
+// the config is copied, as by key_debounce_set_config
+key_debounce_t* key_debounce_create(uint8_t row_count, uint8_t col_count, const key_debounce_config_t* config);
+
+void key_debounce_free(key_debounce_t* kd);
+
+void key_debounce_set_config(key_debounce_t* kd, const key_debounce_config_t* config);
+
+/*
+ * Feed a raw sample of the matrix taken at ts (us).
+ * Returns true if the debounced keys changed.
+ */
+bool key_debounce_update(key_debounce_t* kd, const uint8_t* raw, uint64_t ts);
+
+#endif
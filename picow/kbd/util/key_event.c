@@ -0,0 +1,35 @@
+#include <string.h>
+
+#include "key_event.h"
+
+uint8_t push_key_events_diff(key_event_queue_t* q, uint64_t ts,
+                             const uint8_t* old_keys, const uint8_t* new_keys,
+                             uint8_t row_count, uint8_t col_count) {
+    uint8_t n = 0;
+    for(uint8_t row=0; row<row_count; row++) {
+        uint8_t dv = old_keys[row] ^ new_keys[row];
+        for(uint8_t col=0; dv && col<col_count; col++) {
+            uint8_t mask = 1 << (col_count-1-col);
+            if(!(dv & mask)) continue;
+            dv &= ~mask;
+            uint8_t key = KEY_EVENT_KEY(row, col) | ((new_keys[row] & mask) ? KEY_EVENT_PRESS : 0);
+            if(push_key_event(q, ts, key)) n++;
+        }
+    }
+    return n;
+}
+
+void write_key_event_wire(uint8_t* buff, const key_event_t* event, uint64_t now) {
+    uint64_t age = now > event->ts ? now - event->ts : 0;
+    if(age > KEY_EVENT_WIRE_AGE_MAX) age = KEY_EVENT_WIRE_AGE_MAX;
+    buff[0] = event->key;
+    buff[1] = age & 0xFF;
+    buff[2] = (age >> 8) & 0xFF;
+    buff[3] = (age >> 16) & 0xFF;
+}
+
+void read_key_event_wire(const uint8_t* buff, key_event_t* event, uint64_t now) {
+    uint32_t age = buff[1] | (buff[2] << 8) | (buff[3] << 16);
+    event->key = buff[0];
+    event->ts = now > age ? now - age : 0;
+}
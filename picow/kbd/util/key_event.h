@@ -0,0 +1,77 @@
+#ifndef _KEY_EVENT_H
+#define _KEY_EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "spsc_queue.h"
+
+/*
+ * Key press/release events, as diffed from consecutive matrix scans.
+ *
+ * key: bit 7 press (else release), bit 6 right side (else left), bits 5-3 row, bits 2-0 col
+ * ts : time of the scan (us), in the local clock of the node which owns the queue
+ *
+ * The queue is a spsc_queue: bounded, lock free, one writer, one reader (can be on different cores).
+ */
+
+#define KEY_EVENT_PRESS 0x80
+#define KEY_EVENT_RIGHT 0x40
+
+#define KEY_EVENT_KEY(row, col) ((((row) & 0x07) << 3) | ((col) & 0x07))
+#define KEY_EVENT_ROW(key) (((key) >> 3) & 0x07)
+#define KEY_EVENT_COL(key) ((key) & 0x07)
+
+// over the wire: key + age (us) of the event when sent, 3 bytes little endian
+#define KEY_EVENT_WIRE_SIZE 4
+#define KEY_EVENT_WIRE_AGE_MAX 0xFFFFFF
+
+typedef struct {
+    uint64_t ts;
+    uint8_t key;
+} key_event_t;
+
+typedef spsc_queue_t key_event_queue_t;
+
+static inline key_event_queue_t* new_key_event_queue(uint16_t size) {
+    return new_spsc_queue(sizeof(key_event_t), size);
+}
+
+static inline void free_key_event_queue(key_event_queue_t* q) {
+    free_spsc_queue(q);
+}
+
+static inline void clear_key_event_queue(key_event_queue_t* q) {
+    clear_spsc_queue(q);
+}
+
+// returns false if the queue is full
+static inline bool push_key_event(key_event_queue_t* q, uint64_t ts, uint8_t key) {
+    key_event_t e = {.ts = ts, .key = key};
+    return push_spsc_queue(q, &e);
+}
+
+// returns false if the queue is empty
+static inline bool pop_key_event(key_event_queue_t* q, key_event_t* event) {
+    return pop_spsc_queue(q, event);
+}
+
+static inline uint16_t key_event_count(key_event_queue_t* q) {
+    return spsc_queue_count(q);
+}
+
+/*
+ * Push an event for every key which differs between old_keys and new_keys.
+ * Each row is a byte, first column in the most significant bit (as in key_scan).
+ * Returns the number of events pushed.
+ */
+uint8_t push_key_events_diff(key_event_queue_t* q, uint64_t ts,
+                             const uint8_t* old_keys, const uint8_t* new_keys,
+                             uint8_t row_count, uint8_t col_count);
+
+void write_key_event_wire(uint8_t* buff, const key_event_t* event, uint64_t now);
+
+void read_key_event_wire(const uint8_t* buff, key_event_t* event, uint64_t now);
+
+#endif
@@ -4,23 +4,101 @@
 
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
 
+#include "key_scan.pio.h"
 #include "key_scan.h"
 
-key_scan_t* key_scan_create(uint8_t row_count, uint8_t col_count,
-                            uint8_t* gpio_rows, uint8_t* gpio_cols) {
+#define FRAME_WORDS KEY_SCAN_FRAME_SLOTS
+#define RING_WORDS (KEY_SCAN_FRAME_SLOTS * KEY_SCAN_FRAME_COUNT)
+#define TX_RING_BITS 5 // 8 words x 4 bytes = 32 bytes
+#define RX_RING_BITS 12 // 1024 words x 4 bytes = 4096 bytes
+
+static uint8_t pio_offset[2] = {0xFF, 0xFF}; // program offset per pio, if loaded
+
+static key_scan_t* wake_ks = NULL; // armed
+static void (*wake_callback)(void) = NULL;
+
+static uint8_t min_gpio(uint8_t* gpios, uint8_t count) {
+    uint8_t m = 0xFF;
+    for(uint i=0; i<count; i++) if(gpios[i]<m) m = gpios[i];
+    return m;
+}
+
+static uint8_t max_gpio(uint8_t* gpios, uint8_t count) {
+    uint8_t m = 0;
+    for(uint i=0; i<count; i++) if(gpios[i]>m) m = gpios[i];
+    return m;
+}
+
+static void key_scan_start(key_scan_t* ks) {
+    uint8_t offset = pio_offset[pio_get_index(ks->pio)];
+
+    dma_channel_abort(ks->tx_chan);
+    dma_channel_abort(ks->rx_chan);
+
+    pio_sm_set_enabled(ks->pio, ks->sm, false);
+    pio_sm_clear_fifos(ks->pio, ks->sm);
+    pio_sm_restart(ks->pio, ks->sm);
+    pio_sm_exec(ks->pio, ks->sm, pio_encode_jmp(offset));
+
+    // max transfer count, runs for days, restarted by key_scan_update when done
+    dma_channel_transfer_to_buffer_now(ks->rx_chan, ks->rx_buff, 0xFFFFFFFF);
+    dma_channel_transfer_from_buffer_now(ks->tx_chan, ks->tx_buff, 0xFFFFFFFF);
+
+    pio_sm_set_enabled(ks->pio, ks->sm, true);
+    ks->frame_read = 0;
+}
+
+static bool can_load(pio_hw_t* pio) {
+    return pio_offset[pio_get_index(pio)]!=0xFF || pio_can_add_program(pio, &key_scan_program);
+}
+
+static int claim_sm(pio_hw_t** pio) {
+    // on the pio given, else on the other one, neither taking a state machine in use (e.g. cyw43 spi)
+    int sm = can_load(*pio) ? pio_claim_unused_sm(*pio, false) : -1;
+    if(sm < 0) {
+        *pio = *pio == pio0 ? pio1 : pio0;
+        sm = pio_claim_unused_sm(*pio, true);
+    }
+    return sm;
+}
+
+key_scan_t* key_scan_create(pio_hw_t* pio,
+                            uint8_t row_count, uint8_t col_count,
+                            uint8_t* gpio_rows, uint8_t* gpio_cols,
+                            uint32_t rate_hz) {
     key_scan_t* ks = (key_scan_t*) malloc(sizeof(key_scan_t));
     ks->row_count = row_count;
     ks->col_count = col_count;
     ks->gpio_rows = (uint8_t*) malloc(row_count*sizeof(uint8_t));
     ks->gpio_cols = (uint8_t*) malloc(col_count*sizeof(uint8_t));
     ks->keys = (uint8_t*)malloc(row_count*sizeof(uint8_t));
+    memset(ks->keys, 0, row_count);
+    ks->ts = 0;
+    ks->frames_lost = 0;
+
+    uint sm = claim_sm(&pio);
+    ks->pio = pio;
+    ks->sm = sm;
+    ks->row_base = min_gpio(gpio_rows, row_count);
+    ks->col_base = min_gpio(gpio_cols, col_count);
+
+    // dma rings must be aligned to their size
+    ks->tx_buff = (uint32_t*) aligned_alloc(1u<<TX_RING_BITS, FRAME_WORDS*4);
+    ks->rx_buff = (uint32_t*) aligned_alloc(1u<<RX_RING_BITS, RING_WORDS*4);
+    memset(ks->tx_buff, 0, FRAME_WORDS*4); // idle slots drive no row
+    memset(ks->rx_buff, 0, RING_WORDS*4);
+
+    ks->slot_us = 1000000u / (rate_hz * KEY_SCAN_FRAME_SLOTS);
+    ks->frame_us = ks->slot_us * KEY_SCAN_FRAME_SLOTS;
 
     uint i, gpio;
 
     for(i=0; i<row_count; i++) {
         gpio = gpio_rows[i];
         ks->gpio_rows[i] = gpio;
+        ks->tx_buff[i] = 1u << (gpio - ks->row_base);
         gpio_init(gpio);
         gpio_set_dir(gpio, GPIO_OUT);
     }
@@ -32,38 +110,158 @@ key_scan_t* key_scan_create(uint8_t row_count, uint8_t col_count,
         gpio_set_dir(gpio, GPIO_IN);
     }
 
+    uint8_t pio_index = pio_get_index(pio);
+    if(pio_offset[pio_index]==0xFF)
+        pio_offset[pio_index] = pio_add_program(pio, &key_scan_program);
+    uint8_t row_span = max_gpio(gpio_rows, row_count) - ks->row_base + 1;
+    key_scan_program_init(pio, sm, pio_offset[pio_index], ks->row_base, row_span,
+                          ks->col_base, rate_hz * KEY_SCAN_FRAME_SLOTS);
+
+    dma_channel_config c;
+
+    ks->tx_chan = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(ks->tx_chan);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_ring(&c, false, TX_RING_BITS); // wrap the read on row patterns
+    dma_channel_configure(ks->tx_chan, &c, &pio->txf[sm], ks->tx_buff, 0, false);
+
+    ks->rx_chan = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(ks->rx_chan);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, RX_RING_BITS); // wrap the write on frames ring
+    dma_channel_configure(ks->rx_chan, &c, ks->rx_buff, &pio->rxf[sm], 0, false);
+
+    key_scan_start(ks);
+
+    // let a couple of frames complete so that keys are valid right away
+    sleep_us(2 * ks->frame_us);
+    key_scan_update(ks);
+
     return ks;
 }
 
 void key_scan_free(key_scan_t* ks) {
+    pio_sm_set_enabled(ks->pio, ks->sm, false);
+    dma_channel_abort(ks->tx_chan);
+    dma_channel_abort(ks->rx_chan);
+    dma_channel_unclaim(ks->tx_chan);
+    dma_channel_unclaim(ks->rx_chan);
+    pio_sm_unclaim(ks->pio, ks->sm);
+    free(ks->tx_buff);
+    free(ks->rx_buff);
     free(ks->gpio_rows);
     free(ks->gpio_cols);
     free(ks->keys);
     free(ks);
 }
 
-void key_scan_update(key_scan_t* ks) {
-    memset(ks->keys, 0, ks->row_count);
+static void restart_if_done(key_scan_t* ks) {
+    // the dma stops once its transfer count is exhausted, just restart it
+    if(!dma_channel_is_busy(ks->tx_chan)) {
+        key_scan_start(ks);
+        sleep_us(2 * ks->frame_us);
+    }
+}
+
+static uint32_t current_frame(key_scan_t* ks, uint64_t* start) {
+    // the frame being written, counted since the dma started, and when it started
+    uint64_t now = time_us_64();
+    uint32_t written = 0xFFFFFFFF - dma_hw->ch[ks->rx_chan].transfer_count;
+    *start = now - (written % KEY_SCAN_FRAME_SLOTS) * ks->slot_us;
+    return written / KEY_SCAN_FRAME_SLOTS;
+}
+
+static void read_frame(key_scan_t* ks, uint32_t frame) {
+    uint32_t* samples = ks->rx_buff + (frame % KEY_SCAN_FRAME_COUNT) * KEY_SCAN_FRAME_SLOTS;
 
     for(uint row=0; row<ks->row_count; row++) {
-        uint row_gpio = ks->gpio_rows[row];
-        gpio_put(row_gpio, true);
-        sleep_us(1);
+        uint32_t sample = samples[row];
 
+        // first column goes to the most significant bit
         uint8_t keys = 0;
         for(uint col=0; col<ks->col_count; col++) {
-            uint col_gpio = ks->gpio_cols[col];
-            keys = (keys<<1) | (gpio_get(col_gpio) ? 1 : 0);
+            uint8_t bit = ks->gpio_cols[col] - ks->col_base;
+            keys = (keys<<1) | ((sample >> bit) & 1);
         }
 
-        // for(uint col=ks->col_count-1; ; col--) {
-        //     uint col_gpio = ks->gpio_cols[col];
-        //     keys = (keys>>1) | (gpio_get(col_gpio) ? 1<<(ks->col_count-1) : 0);
-        //     if(col==0) break;
-        // }
+        ks->keys[row] = keys;
+    }
+}
 
-        gpio_put(row_gpio, false);
+void key_scan_update(key_scan_t* ks) {
+    restart_if_done(ks);
 
-        ks->keys[row] = keys;
+    // the one before the frame being written is the latest complete frame
+    uint64_t start;
+    uint32_t frame = current_frame(ks, &start);
+    read_frame(ks, frame - 1);
+
+    // the frame completed when the current one started
+    ks->ts = start;
+    ks->frame_read = frame;
+}
+
+bool key_scan_next(key_scan_t* ks) {
+    restart_if_done(ks);
+
+    uint64_t start;
+    uint32_t frame = current_frame(ks, &start);
+    if(ks->frame_read >= frame) return false;
+    // the frame being written takes the place of the oldest
+    if(frame - ks->frame_read > KEY_SCAN_FRAME_COUNT - 1) {
+        ks->frames_lost += frame - ks->frame_read - (KEY_SCAN_FRAME_COUNT - 1);
+        ks->frame_read = frame - (KEY_SCAN_FRAME_COUNT - 1);
     }
+    read_frame(ks, ks->frame_read);
+
+    // completed when the next one started
+    ks->ts = start - (uint64_t) (frame - 1 - ks->frame_read) * ks->frame_us;
+    ks->frame_read++;
+    return true;
+}
+
+static void key_scan_wake_irq() {
+    // a pressed key's column follows its row as scanned, so it rises
+    key_scan_t* ks = wake_ks;
+    if(!ks) return;
+    bool woken = false;
+    for(uint col=0; col<ks->col_count; col++) {
+        uint32_t events = gpio_get_irq_event_mask(ks->gpio_cols[col]);
+        if(events) {
+            gpio_acknowledge_irq(ks->gpio_cols[col], events);
+            woken = true;
+        }
+    }
+    if(!woken) return;
+    key_scan_disarm_wake(ks);
+    if(wake_callback) wake_callback();
+}
+
+void key_scan_arm_wake(key_scan_t* ks, void (*wake)(void)) {
+    static bool handler_added = false;
+    if(!handler_added) {
+        uint32_t mask = 0;
+        for(uint col=0; col<ks->col_count; col++) mask |= 1u << ks->gpio_cols[col];
+        gpio_add_raw_irq_handler_masked(mask, key_scan_wake_irq);
+        irq_set_enabled(IO_IRQ_BANK0, true);
+        handler_added = true;
+    }
+    wake_callback = wake;
+    wake_ks = ks;
+    // enabling acknowledges the edges latched before, so a key pressed since the last poll
+    // wakes up only as the scan goes on, its column rises again as its row is driven (each frame)
+    for(uint col=0; col<ks->col_count; col++)
+        gpio_set_irq_enabled(ks->gpio_cols[col], GPIO_IRQ_EDGE_RISE, true);
+}
+
+void key_scan_disarm_wake(key_scan_t* ks) {
+    for(uint col=0; col<ks->col_count; col++)
+        gpio_set_irq_enabled(ks->gpio_cols[col], GPIO_IRQ_EDGE_RISE, false);
+    wake_ks = NULL;
 }
@@ -4,20 +4,76 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+
+/*
+ * The matrix is scanned by a PIO state machine, row by row, without CPU.
+ * Two DMA channels feed it the row patterns and collect the column samples
+ * into a ring of frames. A frame has KEY_SCAN_FRAME_SLOTS slots, the first
+ * row_count slots are the rows, the rest are idle (no row driven).
+ *
+ * key_scan_update() only picks up the most recent complete frame, key_scan_next() picks up
+ * each frame in turn, as debouncing needs every sample, upto the frames the ring holds.
+ */
+
+#define KEY_SCAN_FRAME_SLOTS 8 // MAX rows, power of 2 for the dma ring
+// frames in ring, power of 2 for the dma ring, 128 ms at 1 kHz, to outlast a sector of the
+// internal flash erased and programmed with the interrupts off (fw_flash.h), ~56 ms
+#define KEY_SCAN_FRAME_COUNT 128
+
 typedef struct {
-    uint8_t row_count;
+    uint8_t row_count; // MAX 8
     uint8_t col_count; // MAX 8
     uint8_t* gpio_rows;
     uint8_t* gpio_cols;
 
+    pio_hw_t* pio;
+    uint8_t sm;
+    uint8_t row_base; // rows and cols must be within a window of 8 gpio each
+    uint8_t col_base;
+
+    int tx_chan;
+    int rx_chan;
+    uint32_t* tx_buff; // row patterns, one frame
+    uint32_t* rx_buff; // column samples, ring of frames
+    uint32_t slot_us;  // duration of a slot
+    uint32_t frame_us; // duration of a frame (scan period)
+
     uint8_t* keys;
+    uint64_t ts; // capture time of keys
+    uint32_t frame_read; // next frame for key_scan_next, counted since the dma started
+    uint32_t frames_lost; // overwritten before read by key_scan_next
 } key_scan_t;
 
-key_scan_t* key_scan_create(uint8_t row_count, uint8_t col_count,
-                            uint8_t* gpio_rows, uint8_t* gpio_cols);
+/*
+ * typically pio = pio0, rate_hz = 1000
+ * The state machine is claimed, an unused one of pio, else of the other pio if pio has none or
+ * no room for the program. cyw43_arch_init claims its own (pio1 preferred), so is to come first.
+ */
+key_scan_t* key_scan_create(pio_hw_t* pio,
+                            uint8_t row_count, uint8_t col_count,
+                            uint8_t* gpio_rows, uint8_t* gpio_cols,
+                            uint32_t rate_hz);
 
 void key_scan_free(key_scan_t* ks);
 
 void key_scan_update(key_scan_t* ks);
 
+/*
+ * The next frame completed since read last, into keys and ts, false if there is none yet.
+ * Frames overwritten meanwhile are skipped, it goes on from the oldest in the ring.
+ */
+bool key_scan_next(key_scan_t* ks);
+
+/*
+ * Wake on a key press, while polled slowly: an edge interrupt on the columns,
+ * the first edge disarms it and calls wake, in the irq context. It relies on the scan going on,
+ * a held key rises on its column each frame, as the edges before arming are not kept.
+ * Only one key_scan can be armed, the irq is handled on the core which armed it first.
+ */
+void key_scan_arm_wake(key_scan_t* ks, void (*wake)(void));
+
+void key_scan_disarm_wake(key_scan_t* ks);
+
 #endif
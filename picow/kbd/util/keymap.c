@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "keymap.h"
+
+#define BIT_IS_SET(bits, i) ((bits)[(i) >> 3] & (1 << ((i) & 7)))
+#define BIT_SET(bits, i) ((bits)[(i) >> 3] |= (1 << ((i) & 7)))
+
+static inline int64_t elapsed(uint64_t ts, uint64_t since) {
+    return (int64_t) (ts - since);
+}
+
+static void compile_entry(keymap_t* km, keymap_entry_t* e, uint8_t code, uint8_t modifiers,
+                          uint8_t action, uint8_t arg, uint8_t hold_modifiers) {
+    e->code = code;
+    e->modifiers = modifiers;
+    e->flags = KEYMAP_FLAG_DEFINED;
+    e->track = 0;
+    e->action = action;
+    e->arg = arg < KEYMAP_LAYER_COUNT ? arg : 0;
+    e->hold_modifiers = hold_modifiers;
+    if(modifiers) e->flags |= KEYMAP_FLAG_MODIFIER;
+    if(code > 0 && code < KEYMAP_CODE_COUNT) e->flags |= KEYMAP_FLAG_KEY;
+    if(code >= KEYMAP_SPECIAL_BASE) e->flags |= KEYMAP_FLAG_SPECIAL;
+    for(uint8_t i=0; i<km->track_code_count; i++) {
+        if(km->track_codes[i] == code) {
+            e->flags |= KEYMAP_FLAG_TRACKED;
+            e->track = i;
+            break;
+        }
+    }
+}
+
+static uint8_t key_index(keymap_t* km, uint8_t row, uint8_t col) {
+    uint8_t side = col / km->col_count;
+    return KEYMAP_KEY_INDEX(row, side, col % km->col_count);
+}
+
+keymap_t* keymap_create(const uint8_t* layout, uint8_t row_count, uint8_t col_count,
+                        const uint8_t* track_codes, uint8_t track_count, uint16_t layer_specials) {
+    keymap_t* km = (keymap_t*) malloc(sizeof(keymap_t));
+    memset(km->entries, 0, sizeof(km->entries)); // all transparent
+    km->row_count = row_count;
+    km->col_count = col_count;
+    km->tapping_term_us = KEYMAP_TAPPING_TERM_US;
+    km->combo_term_us = KEYMAP_COMBO_TERM_US;
+    km->track_code_count = track_count < KEYMAP_TRACK_MAX ? track_count : KEYMAP_TRACK_MAX;
+    memcpy(km->track_codes, track_codes, km->track_code_count);
+    km->combo_count = 0;
+    memset(km->combo_members, 0, sizeof(km->combo_members));
+
+    for(uint8_t row=0; row<row_count; row++)
+        for(uint8_t col=0; col<2*col_count; col++) {
+            const uint8_t* key = layout + (row * 2 * col_count + col) * 3;
+            uint8_t index = key_index(km, row, col);
+            bool layer_key = key[1] >= KEYMAP_SPECIAL_BASE
+                             && (layer_specials & (1u << (key[1] - KEYMAP_SPECIAL_BASE)));
+            compile_entry(km, &km->entries[0][index], key[1], key[0],
+                          layer_key ? keymap_action_MOMENTARY : keymap_action_KEY, layer_key ? 1 : 0, 0);
+            // layer keys stay as is, on the layer 1
+            if(key[2] && !layer_key)
+                compile_entry(km, &km->entries[1][index], key[2], key[0], keymap_action_KEY, 0, 0);
+        }
+
+    keymap_reset(km);
+    return km;
+}
+
+void keymap_free(keymap_t* km) {
+    free(km);
+}
+
+void keymap_add_actions(keymap_t* km, const keymap_action_def_t* defs, uint8_t count) {
+    for(uint8_t i=0; i<count; i++) {
+        const keymap_action_def_t* d = defs + i;
+        if(d->row >= km->row_count || d->col >= 2*km->col_count || d->layer >= KEYMAP_LAYER_COUNT) continue;
+        compile_entry(km, &km->entries[d->layer][key_index(km, d->row, d->col)],
+                      d->code, d->modifiers, d->action, d->arg, d->hold_modifiers);
+    }
+}
+
+void keymap_add_combos(keymap_t* km, const keymap_combo_def_t* defs, uint8_t count) {
+    for(uint8_t i=0; i<count && km->combo_count<KEYMAP_COMBO_MAX; i++) {
+        const keymap_combo_def_t* d = defs + i;
+        uint8_t c = km->combo_count;
+        uint8_t n = 0;
+        for(uint8_t k=0; k<d->key_count && k<KEYMAP_COMBO_KEY_MAX; k++) {
+            if(d->keys[k][0] >= km->row_count || d->keys[k][1] >= 2*km->col_count) continue;
+            km->combo_keys[c][n++] = key_index(km, d->keys[k][0], d->keys[k][1]);
+        }
+        if(n < 2) continue; // not a combo
+        km->combo_key_count[c] = n;
+        for(uint8_t k=0; k<n; k++) BIT_SET(km->combo_members, km->combo_keys[c][k]);
+        compile_entry(km, &km->combo_entries[c], d->code, d->modifiers,
+                      d->action == keymap_action_TAP_HOLD ? keymap_action_KEY : d->action, d->arg, 0);
+        km->combo_count++;
+    }
+}
+
+void keymap_reset(keymap_t* km) {
+    memset(km->keys, 0, sizeof(km->keys));
+    km->queue_count = 0;
+    km->dropped = 0;
+    memset(km->pressed, 0, sizeof(km->pressed));
+    memset(km->pass_pressed, 0, sizeof(km->pass_pressed));
+    km->steps = 0;
+    memset(km->combo_held, 0, sizeof(km->combo_held));
+    memset(km->combo_pressed, 0, sizeof(km->combo_pressed));
+    memset(km->layer_count, 0, sizeof(km->layer_count));
+    km->layer_toggled = 0;
+    km->oneshot_layer = 0;
+    km->oneshot_modifiers = 0;
+    memset(km->code_count, 0, sizeof(km->code_count));
+    memset(km->modifier_count, 0, sizeof(km->modifier_count));
+    memset(km->special_count, 0, sizeof(km->special_count));
+    memset(km->track_count, 0, sizeof(km->track_count));
+    km->modifiers = 0;
+    memset(km->key_bits, 0, sizeof(km->key_bits));
+    km->special_bits = 0;
+    km->track_bits = 0;
+    km->key_count = 0;
+}
+
+/*
+ * Report
+ */
+
+static inline void apply_modifiers(keymap_t* km, uint8_t modifiers, bool press) {
+    uint8_t i, bit;
+    for(i=0, bit=1; modifiers && i<8; i++, bit<<=1) {
+        if(!(modifiers & bit)) continue;
+        if(press) {
+            if(km->modifier_count[i]++ == 0) km->modifiers |= bit;
+        } else if(km->modifier_count[i] > 0 && --km->modifier_count[i] == 0) {
+            km->modifiers &= ~bit;
+        }
+    }
+}
+
+static inline void apply_entry(keymap_t* km, const keymap_entry_t* e, bool press) {
+    uint8_t i;
+    if(e->flags & KEYMAP_FLAG_KEY) {
+        uint8_t c = e->code;
+        if(press) {
+            if(km->code_count[c]++ == 0) {
+                km->key_bits[c >> 3] |= 1 << (c & 7);
+                km->key_count++;
+            }
+        } else if(km->code_count[c] > 0 && --km->code_count[c] == 0) {
+            km->key_bits[c >> 3] &= ~(1 << (c & 7));
+            km->key_count--;
+        }
+    }
+    if(e->flags & KEYMAP_FLAG_MODIFIER) apply_modifiers(km, e->modifiers, press);
+    if(e->flags & KEYMAP_FLAG_SPECIAL) {
+        i = e->code - KEYMAP_SPECIAL_BASE;
+        if(press) {
+            if(km->special_count[i]++ == 0) km->special_bits |= (1u << i);
+        } else if(km->special_count[i] > 0 && --km->special_count[i] == 0) {
+            km->special_bits &= ~(1u << i);
+        }
+    }
+    if(e->flags & KEYMAP_FLAG_TRACKED) {
+        i = e->track;
+        if(press) {
+            if(km->track_count[i]++ == 0) km->track_bits |= (1u << i);
+        } else if(km->track_count[i] > 0 && --km->track_count[i] == 0) {
+            km->track_bits &= ~(1u << i);
+        }
+    }
+}
+
+/*
+ * Press and release
+ */
+
+static const keymap_entry_t* lookup(keymap_t* km, uint8_t index) {
+    uint8_t layers = keymap_layers(km);
+    for(uint8_t layer=KEYMAP_LAYER_COUNT-1; layer>0; layer--) {
+        km->steps++;
+        const keymap_entry_t* e = &km->entries[layer][index];
+        if((layers & (1 << layer)) && (e->flags & KEYMAP_FLAG_DEFINED)) return e;
+    }
+    return &km->entries[0][index];
+}
+
+static void press_entry(keymap_t* km, keymap_press_t* p, const keymap_entry_t* e, uint8_t kind) {
+    p->entry = e;
+    p->kind = kind;
+    p->modifiers = 0;
+
+    if(kind == keymap_press_HOLD) {
+        if(e->arg) km->layer_count[e->arg]++;
+        else apply_modifiers(km, e->hold_modifiers, true);
+        return;
+    }
+
+    switch(e->action) {
+    case keymap_action_MOMENTARY:
+        km->layer_count[e->arg]++;
+        break;
+    case keymap_action_TOGGLE:
+        if(e->arg) km->layer_toggled ^= 1 << e->arg;
+        break;
+    case keymap_action_ONE_SHOT:
+        km->oneshot_modifiers |= e->modifiers;
+        if(e->arg) km->oneshot_layer = e->arg;
+        return; // nothing to report by itself
+    default: // key or tap, takes the one-shot
+        p->modifiers = km->oneshot_modifiers;
+        apply_modifiers(km, p->modifiers, true);
+        km->oneshot_modifiers = 0;
+        km->oneshot_layer = 0;
+        break;
+    }
+    apply_entry(km, e, true);
+}
+
+static void release_entry(keymap_t* km, keymap_press_t* p) {
+    const keymap_entry_t* e = p->entry;
+    uint8_t kind = p->kind;
+    p->kind = keymap_press_NONE;
+
+    switch(kind) {
+    case keymap_press_NONE:
+        return;
+    case keymap_press_HOLD:
+        if(e->arg) {
+            if(km->layer_count[e->arg]) km->layer_count[e->arg]--;
+        } else {
+            apply_modifiers(km, e->hold_modifiers, false);
+        }
+        return;
+    case keymap_press_COMBO:
+        // the combo is released with its first key
+        if(km->combo_held[p->arg] > 0) km->combo_held[p->arg]--;
+        release_entry(km, &km->combo_pressed[p->arg]);
+        return;
+    }
+
+    switch(e->action) {
+    case keymap_action_MOMENTARY:
+        if(km->layer_count[e->arg]) km->layer_count[e->arg]--;
+        break;
+    case keymap_action_ONE_SHOT:
+        return;
+    default:
+        break;
+    }
+    apply_modifiers(km, p->modifiers, false);
+    apply_entry(km, e, false);
+}
+
+/*
+ * Queue
+ */
+
+bool keymap_push_event(keymap_t* km, uint8_t row, uint8_t side, uint8_t col, bool press, uint64_t ts) {
+    if(row >= km->row_count || col >= km->col_count) return true; // invalid, ignore
+    if(km->queue_count >= KEYMAP_QUEUE_SIZE) {
+        km->dropped++;
+        return false;
+    }
+    uint8_t mask = 1 << (km->col_count - 1 - col);
+    if(press) km->keys[side][row] |= mask;
+    else km->keys[side][row] &= ~mask;
+    km->queue[km->queue_count++] = (keymap_event_t) {ts, KEYMAP_KEY_INDEX(row, side, col), press};
+    return true;
+}
+
+void keymap_sync(keymap_t* km, const uint8_t* left_keys, const uint8_t* right_keys, uint64_t ts) {
+    const uint8_t* keys[2] = {left_keys, right_keys};
+    for(uint8_t row=0; row<km->row_count; row++)
+        for(uint8_t side=0; side<2; side++) {
+            uint8_t v = keys[side][row];
+            uint8_t dv = v ^ km->keys[side][row];
+            for(int8_t col=km->col_count-1; dv && col>=0; col--, dv>>=1, v>>=1)
+                if((dv & 1) && !keymap_push_event(km, row, side, col, v & 1, ts)) return; // rest next time
+        }
+}
+
+static void remove_event(keymap_t* km, uint8_t i) {
+    km->queue_count--;
+    memmove(km->queue + i, km->queue + i + 1, (km->queue_count - i) * sizeof(keymap_event_t));
+}
+
+/*
+ * Resolve the press of queue[0]
+ */
+
+#define RESOLVE_WAIT -1
+#define RESOLVE_NONE -2
+
+// returns the combo, or RESOLVE_WAIT/RESOLVE_NONE
+static int8_t resolve_combo(keymap_t* km, uint64_t now) {
+    keymap_event_t* e0 = km->queue;
+    bool wait = false;
+    for(uint8_t c=0; c<km->combo_count; c++) {
+        uint8_t need = km->combo_key_count[c];
+        uint8_t* keys = km->combo_keys[c];
+        uint8_t got = 0; // bit per member
+        uint8_t pos[KEYMAP_COMBO_KEY_MAX];
+        uint8_t found = 0;
+        uint8_t k;
+        for(k=0; k<need && keys[k]!=e0->index; k++);
+        if(k == need) continue; // not a member
+        got = 1 << k;
+        found = 1;
+
+        bool failed = false;
+        for(uint8_t i=1; i<km->queue_count && found<need; i++) {
+            keymap_event_t* e = km->queue + i;
+            km->steps++;
+            if(elapsed(e->ts, e0->ts) >= km->combo_term_us) {
+                failed = true;
+                break;
+            }
+            for(k=0; k<need && keys[k]!=e->index; k++);
+            if(k == need) {
+                // an other key pressed in between, a release is fine (roll)
+                if(e->press) {
+                    failed = true;
+                    break;
+                }
+                continue;
+            }
+            if(!e->press) { // a member released
+                failed = true;
+                break;
+            }
+            if(!(got & (1 << k))) {
+                got |= 1 << k;
+                pos[found++] = i;
+            }
+        }
+        if(failed) continue;
+
+        if(found == need) {
+            // the members are pressed as the combo, queue[0] is taken out by the caller
+            for(k=need-1; k>0; k--) remove_event(km, pos[k]);
+            for(k=0; k<need; k++) {
+                uint8_t index = keys[k];
+                km->pressed[index] = (keymap_press_t) {NULL, keymap_press_COMBO, 0, c};
+                BIT_SET(km->pass_pressed, index);
+            }
+            km->combo_held[c] = need;
+            return c;
+        }
+        if(elapsed(now, e0->ts) < km->combo_term_us) wait = true;
+    }
+    return wait ? RESOLVE_WAIT : RESOLVE_NONE;
+}
+
+// returns keymap_press_KEY for tap, keymap_press_HOLD, or RESOLVE_WAIT
+static int8_t resolve_tap_hold(keymap_t* km, uint64_t now) {
+    keymap_event_t* e0 = km->queue;
+    uint8_t pressed[KEYMAP_KEY_MAX / 8] = {0}; // pressed after e0
+    for(uint8_t i=1; i<km->queue_count; i++) {
+        keymap_event_t* e = km->queue + i;
+        km->steps++;
+        if(elapsed(e->ts, e0->ts) >= km->tapping_term_us) return keymap_press_HOLD;
+        if(e->index == e0->index) return keymap_press_KEY;
+        if(e->press) BIT_SET(pressed, e->index);
+        else if(BIT_IS_SET(pressed, e->index)) return keymap_press_HOLD; // permissive hold
+    }
+    if(elapsed(now, e0->ts) >= km->tapping_term_us) return keymap_press_HOLD;
+    return RESOLVE_WAIT;
+}
+
+static bool resolve_press(keymap_t* km, uint64_t now) {
+    uint8_t index = km->queue[0].index;
+    keymap_press_t* p = &km->pressed[index];
+    if(p->kind != keymap_press_NONE) return true; // already pressed, as a combo
+
+    if(BIT_IS_SET(km->combo_members, index)) {
+        int8_t c = resolve_combo(km, now);
+        if(c == RESOLVE_WAIT) return false;
+        if(c >= 0) {
+            press_entry(km, &km->combo_pressed[c], &km->combo_entries[c], keymap_press_KEY);
+            return true;
+        }
+    }
+
+    const keymap_entry_t* e = lookup(km, index);
+    uint8_t kind = keymap_press_KEY;
+    if(e->action == keymap_action_TAP_HOLD) {
+        int8_t r = resolve_tap_hold(km, now);
+        if(r == RESOLVE_WAIT) return false;
+        kind = r;
+    }
+    press_entry(km, p, e, kind);
+    BIT_SET(km->pass_pressed, index);
+    return true;
+}
+
+bool keymap_process(keymap_t* km, uint64_t now) {
+    uint8_t n = 0;
+    km->steps = 0;
+    memset(km->pass_pressed, 0, sizeof(km->pass_pressed));
+
+    while(km->queue_count > 0 && n < KEYMAP_PASS_EVENT_MAX
+          && km->steps + KEYMAP_EVENT_STEP_MAX <= KEYMAP_PASS_STEP_MAX) {
+        keymap_event_t* e = km->queue;
+        km->steps++;
+        if(e->press) {
+            if(!resolve_press(km, now)) break; // undecided, wait for more events or time
+        } else {
+            if(BIT_IS_SET(km->pass_pressed, e->index)) break; // next pass, to report the press
+            release_entry(km, &km->pressed[e->index]);
+        }
+        remove_event(km, 0);
+        n++;
+    }
+
+    return n > 0;
+}
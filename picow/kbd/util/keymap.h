@@ -0,0 +1,223 @@
+#ifndef _KEYMAP_H
+#define _KEYMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Keymap compiled from a key layout into flat lookup tables, one per layer,
+ * and a layer engine driven by timestamped key press/release events.
+ *
+ * Layout: [row_count][2*col_count][3] entries of [modifier_mask, key_code, layer_key_code],
+ * left half cols first, then right half. layer_key_code==0 => same as key_code.
+ * The key_code makes the layer 0, the layer_key_code the layer 1.
+ * Matrix: a byte per row per side, first column in the most significant bit (as in key_scan).
+ *
+ * Key codes
+ *   0x00-0xDF : normal keys, reported as key_bits
+ *   0xE0-0xE7 : modifier keys, reported via the modifier_mask only
+ *   0xF0-0xFF : special keys, reported as special_bits (bit n => code 0xF0+n)
+ * The special keys in layer_specials switch to the layer 1 while held (momentary).
+ *
+ * Layers
+ *   The layer 0 is always active, over it momentary, toggled and one-shot layers.
+ *   A key is looked up on the highest active layer which defines it (else transparent),
+ *   at the time of press, and is released as such, whatever the layers then.
+ *
+ * Actions, added over the layout with keymap_add_actions
+ *   KEY       : code and modifiers, as the layout keys
+ *   MOMENTARY : layer (arg) while held
+ *   TOGGLE    : layer (arg) toggled on press
+ *   TAP_HOLD  : code and modifiers on tap, on hold the layer (arg) if any, else hold_modifiers.
+ *               Hold if held for tapping_term, or if another key is pressed and released
+ *               meanwhile (permissive hold), else tap on release.
+ *   ONE_SHOT  : modifiers and/or layer (arg), for the next key pressed only
+ *
+ * Combos, added with keymap_add_combos, are keys (of any side) pressed together
+ * within combo_term, which act as an other key. The combo is released with its first key.
+ *
+ * Events are queued with keymap_push_event, and resolved with keymap_process, in order.
+ * Undecided tap-holds and combos hold back the events behind them, until decided by
+ * later events or by the time (now). A pass stops before a release of a key pressed
+ * in the same pass, so that the report has the press. A pass is bounded in work
+ * (KEYMAP_PASS_STEP_MAX steps), the rest is left for the next pass.
+ */
+
+#define KEYMAP_ROW_MAX 8
+#define KEYMAP_COL_MAX 8 // per side
+#define KEYMAP_KEY_MAX (KEYMAP_ROW_MAX * 2 * KEYMAP_COL_MAX)
+#define KEYMAP_LAYER_COUNT 4
+#define KEYMAP_CODE_COUNT 0xE0 // normal key codes
+#define KEYMAP_SPECIAL_BASE 0xF0
+#define KEYMAP_TRACK_MAX 16
+#define KEYMAP_COMBO_MAX 8
+#define KEYMAP_COMBO_KEY_MAX 4
+#define KEYMAP_QUEUE_SIZE 32
+
+#define KEYMAP_TAPPING_TERM_US 200000
+#define KEYMAP_COMBO_TERM_US 30000
+
+// work per pass, a step is a layer lookup or an event looked at in the queue
+#define KEYMAP_EVENT_STEP_MAX (KEYMAP_LAYER_COUNT + KEYMAP_QUEUE_SIZE * (1 + KEYMAP_COMBO_MAX))
+#define KEYMAP_PASS_STEP_MAX (4 * KEYMAP_EVENT_STEP_MAX)
+#define KEYMAP_PASS_EVENT_MAX 16
+
+#define KEYMAP_KEY_INDEX(row, side, col) ((((row) * 2) + (side)) * KEYMAP_COL_MAX + (col))
+
+#define KEYMAP_FLAG_KEY 0x01      // normal key
+#define KEYMAP_FLAG_MODIFIER 0x02 // has modifiers
+#define KEYMAP_FLAG_SPECIAL 0x04  // special key
+#define KEYMAP_FLAG_TRACKED 0x08  // tracked key, track is the index in track_codes
+#define KEYMAP_FLAG_DEFINED 0x10  // not transparent
+
+typedef enum {
+    keymap_action_KEY = 0,
+    keymap_action_MOMENTARY,
+    keymap_action_TOGGLE,
+    keymap_action_TAP_HOLD,
+    keymap_action_ONE_SHOT,
+} keymap_action_t;
+
+typedef struct {
+    uint8_t code;
+    uint8_t modifiers;
+    uint8_t flags;
+    uint8_t track;
+    uint8_t action; // keymap_action_t
+    uint8_t arg;    // layer, 0 => none
+    uint8_t hold_modifiers;
+} keymap_entry_t;
+
+// col: 0 to 2*col_count-1, as in the layout
+typedef struct {
+    uint8_t row;
+    uint8_t col;
+    uint8_t layer;
+    uint8_t action; // keymap_action_t
+    uint8_t code;
+    uint8_t modifiers;
+    uint8_t arg;
+    uint8_t hold_modifiers;
+} keymap_action_def_t;
+
+typedef struct {
+    uint8_t key_count; // MAX KEYMAP_COMBO_KEY_MAX
+    uint8_t keys[KEYMAP_COMBO_KEY_MAX][2]; // row, col as in the layout
+    uint8_t action; // keymap_action_t, KEY, MOMENTARY, TOGGLE or ONE_SHOT
+    uint8_t code;
+    uint8_t modifiers;
+    uint8_t arg;
+} keymap_combo_def_t;
+
+typedef struct {
+    uint64_t ts;
+    uint8_t index; // KEYMAP_KEY_INDEX
+    bool press;
+} keymap_event_t;
+
+typedef enum {
+    keymap_press_NONE = 0,
+    keymap_press_KEY,   // entry pressed, or tap of a tap-hold
+    keymap_press_HOLD,  // hold of a tap-hold
+    keymap_press_COMBO, // member of the combo arg
+} keymap_press_kind_t;
+
+typedef struct {
+    const keymap_entry_t* entry;
+    uint8_t kind;      // keymap_press_kind_t
+    uint8_t modifiers; // one-shot modifiers added
+    uint8_t arg;       // combo
+} keymap_press_t;
+
+typedef struct {
+    uint8_t row_count;
+    uint8_t col_count; // MAX 8, per side
+    uint32_t tapping_term_us;
+    uint32_t combo_term_us;
+    uint8_t track_codes[KEYMAP_TRACK_MAX];
+    uint8_t track_code_count;
+    keymap_entry_t entries[KEYMAP_LAYER_COUNT][KEYMAP_KEY_MAX];
+
+    uint8_t combo_count;
+    uint8_t combo_key_count[KEYMAP_COMBO_MAX];
+    uint8_t combo_keys[KEYMAP_COMBO_MAX][KEYMAP_COMBO_KEY_MAX];
+    keymap_entry_t combo_entries[KEYMAP_COMBO_MAX];
+    uint8_t combo_members[KEYMAP_KEY_MAX / 8]; // bit per key index
+    uint8_t combo_held[KEYMAP_COMBO_MAX];      // members still held of an active combo
+    keymap_press_t combo_pressed[KEYMAP_COMBO_MAX];
+
+    // matrix as per the events pushed
+    uint8_t keys[2][KEYMAP_ROW_MAX];
+
+    keymap_event_t queue[KEYMAP_QUEUE_SIZE];
+    uint8_t queue_count;
+    uint32_t dropped; // events lost as the queue was full
+
+    keymap_press_t pressed[KEYMAP_KEY_MAX];
+    uint8_t pass_pressed[KEYMAP_KEY_MAX / 8]; // pressed in the current pass
+    uint16_t steps; // of the current pass
+
+    // layers
+    uint8_t layer_count[KEYMAP_LAYER_COUNT]; // momentary, held
+    uint8_t layer_toggled;                   // bit per layer
+    uint8_t oneshot_layer;                   // 0 => none
+    uint8_t oneshot_modifiers;
+
+    // pressed keys count per report item
+    uint8_t code_count[KEYMAP_CODE_COUNT];
+    uint8_t modifier_count[8];
+    uint8_t special_count[16];
+    uint8_t track_count[KEYMAP_TRACK_MAX];
+
+    // report
+    uint8_t modifiers;
+    uint8_t key_bits[KEYMAP_CODE_COUNT / 8]; // bit per key code, LSB first
+    uint16_t special_bits;
+    uint16_t track_bits;
+    uint8_t key_count; // normal keys pressed
+} keymap_t;
+
+/*
+ * Compile the layout into the lookup tables, layer_specials are bits as in special_bits
+ */
+keymap_t* keymap_create(const uint8_t* layout, uint8_t row_count, uint8_t col_count,
+                        const uint8_t* track_codes, uint8_t track_count, uint16_t layer_specials);
+
+void keymap_free(keymap_t* km);
+
+void keymap_add_actions(keymap_t* km, const keymap_action_def_t* defs, uint8_t count);
+
+void keymap_add_combos(keymap_t* km, const keymap_combo_def_t* defs, uint8_t count);
+
+// release all, clear the queue and layers
+void keymap_reset(keymap_t* km);
+
+// returns false if the queue is full
+bool keymap_push_event(keymap_t* km, uint8_t row, uint8_t side, uint8_t col, bool press, uint64_t ts);
+
+/*
+ * Push an event at ts for every key which differs from the matrix as per the events pushed,
+ * to make up for lost events.
+ */
+void keymap_sync(keymap_t* km, const uint8_t* left_keys, const uint8_t* right_keys, uint64_t ts);
+
+/*
+ * Resolve the queued events, upto a pass worth, now is the time (us) of the event clock.
+ * Returns true if any event was resolved.
+ */
+bool keymap_process(keymap_t* km, uint64_t now);
+
+static inline bool keymap_update(keymap_t* km, const uint8_t* left_keys, const uint8_t* right_keys, uint64_t now) {
+    keymap_sync(km, left_keys, right_keys, now);
+    return keymap_process(km, now);
+}
+
+static inline uint8_t keymap_layers(keymap_t* km) {
+    uint8_t layers = 1 | km->layer_toggled;
+    for(uint8_t i=1; i<KEYMAP_LAYER_COUNT; i++)
+        if(km->layer_count[i]) layers |= 1 << i;
+    if(km->oneshot_layer) layers |= 1 << km->oneshot_layer;
+    return layers;
+}
+
+#endif
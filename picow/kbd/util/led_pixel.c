@@ -9,8 +9,20 @@
 
 #define LED_FREQ 800000 // 800kHz
 
-led_pixel_t* led_pixel_create(pio_hw_t* pio, uint8_t sm, uint8_t gpio_DI, uint8_t count) {
+static int claim_sm(pio_hw_t** pio) {
+    // on the pio given, else on the other one, as key_scan (core0) does meanwhile, neither taking
+    // a state machine in use
+    int sm = pio_can_add_program(*pio, &led_pixel_program) ? pio_claim_unused_sm(*pio, false) : -1;
+    if(sm < 0) {
+        *pio = *pio == pio0 ? pio1 : pio0;
+        sm = pio_claim_unused_sm(*pio, true);
+    }
+    return sm;
+}
+
+led_pixel_t* led_pixel_create(pio_hw_t* pio, uint8_t gpio_DI, uint8_t count) {
     led_pixel_t* led = (led_pixel_t*) malloc(sizeof(led_pixel_t));
+    uint8_t sm = claim_sm(&pio);
     led->pio = pio;
     led->sm = sm;
     led->gpio_DI = gpio_DI;
@@ -43,6 +55,7 @@ led_pixel_t* led_pixel_create(pio_hw_t* pio, uint8_t sm, uint8_t gpio_DI, uint8_
 }
 
 void led_pixel_free(led_pixel_t* led) {
+    pio_sm_unclaim(led->pio, led->sm);
     free(led->buff);
     free(led);
 }
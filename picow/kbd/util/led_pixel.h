@@ -22,9 +22,9 @@ typedef struct {
 } led_pixel_t;
 
 /*
- * typically pio = pio0, sm = 0
+ * typically pio = pio0, an unused state machine is claimed, on pio1 if none is left on it
  */
-led_pixel_t* led_pixel_create(pio_hw_t* pio, uint8_t sm, uint8_t gpio_DI, uint8_t count);
+led_pixel_t* led_pixel_create(pio_hw_t* pio, uint8_t gpio_DI, uint8_t count);
 
 void led_pixel_free(led_pixel_t* led);
 
@@ -0,0 +1,39 @@
+#include <string.h>
+
+#include "lz4_block.h"
+
+static inline bool read_length(const uint8_t** src, const uint8_t* end, uint32_t* len) {
+    // continued in bytes of 255, as long as there are
+    uint8_t b;
+    do {
+        if(*src >= end) return false;
+        b = *(*src)++;
+        *len += b;
+    } while(b == 255);
+    return true;
+}
+
+int32_t lz4_block_decode(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len) {
+    const uint8_t* end = src + src_len;
+    uint32_t out = 0;
+    while(src < end) {
+        uint8_t token = *src++;
+        uint32_t len = token >> 4;
+        if(len == 15 && !read_length(&src, end, &len)) return -1;
+        if(len > (uint32_t) (end - src) || len > dst_len - out) return -1;
+        memcpy(dst + out, src, len);
+        src += len;
+        out += len;
+        if(src == end) break; // the last sequence, literals only
+        if(end - src < 2) return -1;
+        uint16_t offset = src[0] | (uint16_t) src[1] << 8;
+        src += 2;
+        len = (token & 0x0F);
+        if(len == 15 && !read_length(&src, end, &len)) return -1;
+        len += 4;
+        if(offset == 0 || offset > out || len > dst_len - out) return -1;
+        // byte by byte, as the match may overlap what it copies
+        for(uint8_t* d = dst + out; len > 0; len--, d++, out++) *d = *(d - offset);
+    }
+    return out;
+}
@@ -0,0 +1,19 @@
+#ifndef _LZ4_BLOCK_H_
+#define _LZ4_BLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * LZ4 block format (lz4 LZ4_compress_default, lz4-java LZ4Compressor), decoding only:
+ * sequences of a token (literal length << 4 | match length - 4), the literal length beyond 15
+ * in bytes of 255 + the rest, the literals, the match offset (2, little endian) back into the
+ * output, the match length beyond 19 the same way. The last sequence has literals only.
+ *
+ * A block is decoded on its own, so the output buffer is the whole of the window.
+ */
+
+// returns the bytes decoded, -1 if malformed or not fitting dst
+int32_t lz4_block_decode(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len);
+
+#endif
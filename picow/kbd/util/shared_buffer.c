@@ -2,17 +2,24 @@
 
 #include "shared_buffer.h"
 
+// write k (from 1) goes to slot k%2, seq is 2k-1 while at it, and 2k when done
+#define LATEST_SLOT(seq) (((seq) >> 1) & 1)
+
 void clear_shared_buffer(shared_buffer_t* sb) {
     uint32_t saved_irq = spin_lock_blocking(sb->spin_lock);
-    memset(sb->buff, 0, sb->size);
+    memset(sb->buff, 0, 2 * sb->size);
+    sb->slot_ts[0] = sb->slot_ts[1] = 0;
+    sb->seq = 0;
     sb->ts = 0;
+    sb->reads = 0;
+    sb->retries = 0;
     spin_unlock(sb->spin_lock, saved_irq);
 }
 
 shared_buffer_t* new_shared_buffer(size_t size, spin_lock_t* spin_lock) {
     shared_buffer_t* sb = (shared_buffer_t*) malloc(sizeof(shared_buffer_t));
     sb->size = size;
-    sb->buff = (uint8_t*) malloc(sizeof(uint8_t) * size);
+    sb->buff = (uint8_t*) malloc(sizeof(uint8_t) * size * 2);
     sb->spin_lock = spin_lock;
     clear_shared_buffer(sb);
     return sb;
@@ -24,15 +31,29 @@ void free_shared_buffer(shared_buffer_t* sb) {
 }
 
 void read_shared_buffer(shared_buffer_t* sb, uint64_t* ts, void* dst) {
-    uint32_t saved_irq = spin_lock_blocking(sb->spin_lock);
-    memcpy(dst, sb->buff, sb->size);
-    *ts = sb->ts;
-    spin_unlock(sb->spin_lock, saved_irq);
+    uint32_t seq, slot;
+    sb->reads++;
+    while(true) {
+        seq = sb->seq;
+        __dmb();
+        slot = LATEST_SLOT(seq);
+        memcpy(dst, sb->buff + slot * sb->size, sb->size);
+        *ts = sb->slot_ts[slot];
+        __dmb();
+        // the slot is written over again from seq (even) + 3
+        if(sb->seq - (seq & ~1u) <= 2) return;
+        sb->retries++;
+    }
 }
 
 void write_shared_buffer(shared_buffer_t* sb, const uint64_t ts, const void* src) {
-    uint32_t saved_irq = spin_lock_blocking(sb->spin_lock);
+    uint32_t seq = sb->seq + 1; // odd, writing
+    uint32_t slot = LATEST_SLOT(seq + 1);
+    sb->seq = seq;
+    __dmb();
+    memcpy(sb->buff + slot * sb->size, src, sb->size);
+    sb->slot_ts[slot] = ts;
+    __dmb();
+    sb->seq = seq + 1;
     sb->ts = ts;
-    memcpy(sb->buff, src, sb->size);
-    spin_unlock(sb->spin_lock, saved_irq);
 }
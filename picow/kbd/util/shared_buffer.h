@@ -10,14 +10,25 @@
 /*
  * Shared buffer for concurrent operation - one writer, one reader.
  * Use timestamp to track change.
+ *
+ * Lock free, a seqlock over two slots: the writer never waits, it writes the
+ * slot not holding the latest data, and bumps seq before (odd) and after (even).
+ * The reader copies the latest complete slot, and retries only if the writer has
+ * meanwhile started over that very slot (two writes during one read).
  */
 
 typedef struct {
     size_t size;
-    uint8_t* buff;
-    volatile uint64_t ts;
+    uint8_t* buff;         // 2 slots of size
+    uint64_t slot_ts[2];
+    volatile uint32_t seq; // 2 per write, odd while writing
+    volatile uint64_t ts;  // of the latest write
 
-    spin_lock_t* spin_lock;
+    // stats
+    volatile uint32_t reads;
+    volatile uint32_t retries; // torn reads, retried
+
+    spin_lock_t* spin_lock; // only to clear
 } shared_buffer_t;
 
 void clear_shared_buffer(shared_buffer_t* sb);
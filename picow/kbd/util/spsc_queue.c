@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "spsc_queue.h"
+
+spsc_queue_t* new_spsc_queue(uint16_t elem_size, uint16_t capacity) {
+    uint16_t c = 1;
+    while(c < capacity) c <<= 1;
+    spsc_queue_t* q = (spsc_queue_t*) malloc(sizeof(spsc_queue_t));
+    q->elem_size = elem_size;
+    q->capacity = c;
+    q->buff = (uint8_t*) malloc(elem_size * c);
+    q->head = 0;
+    q->tail = 0;
+    q->pushed = 0;
+    q->overflows = 0;
+    q->max_count = 0;
+    return q;
+}
+
+void free_spsc_queue(spsc_queue_t* q) {
+    free(q->buff);
+    free(q);
+}
+
+void clear_spsc_queue(spsc_queue_t* q) {
+    q->head = q->tail;
+}
+
+bool push_spsc_queue(spsc_queue_t* q, const void* elem) {
+    uint32_t tail = q->tail;
+    uint16_t count = (uint16_t) (tail - q->head);
+    if(count >= q->capacity) {
+        q->overflows++;
+        return false;
+    }
+    memcpy(q->buff + (tail & (q->capacity - 1)) * q->elem_size, elem, q->elem_size);
+    __dmb(); // element written before it is published
+    q->tail = tail + 1;
+    q->pushed++;
+    if(count + 1 > q->max_count) q->max_count = count + 1;
+    return true;
+}
+
+bool peek_spsc_queue(spsc_queue_t* q, void* elem) {
+    uint32_t head = q->head;
+    if(q->tail == head) return false;
+    __dmb(); // tail read before the element
+    memcpy(elem, q->buff + (head & (q->capacity - 1)) * q->elem_size, q->elem_size);
+    return true;
+}
+
+bool pop_spsc_queue(spsc_queue_t* q, void* elem) {
+    if(!peek_spsc_queue(q, elem)) return false;
+    __dmb(); // element read before the slot is released
+    q->head = q->head + 1;
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <hardware/sync.h>
+
+/*
+ * Lock free ring queue - one writer, one reader (can be on different cores).
+ * Fixed size elements, fixed capacity (power of 2), allocated once.
+ *
+ * head is only written by the reader, tail only by the writer, both run free
+ * (wrap around at 2^32) and are masked into the ring. The element is copied
+ * before tail is published, and copied out before head is released.
+ * Push on a full queue is dropped and counted, the queue never blocks.
+ */
+
+typedef struct {
+    uint16_t elem_size;
+    uint16_t capacity; // power of 2
+    uint8_t* buff;
+    volatile uint32_t head; // next to read
+    volatile uint32_t tail; // next to write
+
+    // stats
+    volatile uint32_t pushed;
+    volatile uint32_t overflows; // pushes dropped, the queue being full
+    volatile uint16_t max_count; // high water mark
+} spsc_queue_t;
+
+/*
+ * Allocate memory, capacity is rounded up to a power of 2
+ */
+spsc_queue_t* new_spsc_queue(uint16_t elem_size, uint16_t capacity);
+
+void free_spsc_queue(spsc_queue_t* q);
+
+// by the reader, drops all
+void clear_spsc_queue(spsc_queue_t* q);
+
+// by the writer, returns false if the queue is full
+bool push_spsc_queue(spsc_queue_t* q, const void* elem);
+
+// by the reader, returns false if the queue is empty
+bool pop_spsc_queue(spsc_queue_t* q, void* elem);
+
+// by the reader, returns false if the queue is empty
+bool peek_spsc_queue(spsc_queue_t* q, void* elem);
+
+static inline uint16_t spsc_queue_count(spsc_queue_t* q) {
+    return (uint16_t) (q->tail - q->head);
+}
+
+#endif